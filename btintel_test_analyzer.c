@@ -0,0 +1,1347 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * Intel Bluetooth Test Generic Driver - HCI Capture Analyzer
+ *
+ * Copyright (C) 2026  Your Company/Name
+ *
+ * Offline analysis of btsnoop captures (H4, un-encapsulated HCI and the
+ * btmon monitor format): command latency per opcode, ACL throughput over
+ * time, command and ACL credit stalls, and error events.
+ *
+ * The capture is memory-mapped and split into one chunk per thread. Each
+ * thread parses its chunk independently and keeps only the few events that
+ * carry cross-record state (commands, their completions and ACL flow
+ * control) in capture order; those are replayed sequentially afterwards.
+ *
+ * Build: gcc -O2 -o btintel_test_analyzer btintel_test_analyzer.c -pthread
+ * Usage: ./btintel_test_analyzer [options] CAPTURE
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* ============================================================================
+ * CAPTURE FORMAT
+ * ============================================================================ */
+
+#define SNOOP_MAGIC		"btsnoop\0"
+#define SNOOP_HDR_LEN		16
+#define SNOOP_REC_LEN		24
+#define SNOOP_MAX_PKT		(65536 + 16)
+#define SNOOP_EPOCH_US		0x00dcddb30f2f8000ULL	/* 0 AD to 1970, in us */
+
+#define SNOOP_DL_HCI		1001	/* Un-encapsulated HCI */
+#define SNOOP_DL_H4		1002	/* HCI UART (H4) */
+#define SNOOP_DL_MONITOR	2001	/* btmon */
+
+/* H4 packet types */
+#define H4_CMD			0x01
+#define H4_ACL			0x02
+#define H4_SCO			0x03
+#define H4_EVT			0x04
+#define H4_ISO			0x05
+
+/* Monitor opcodes, in the low 16 bits of the record flags */
+#define MON_COMMAND		2
+#define MON_EVENT		3
+#define MON_ACL_TX		4
+#define MON_ACL_RX		5
+#define MON_SCO_TX		6
+#define MON_SCO_RX		7
+#define MON_ISO_TX		18
+#define MON_ISO_RX		19
+#define MON_MAX_OPCODE		64
+
+/* HCI events and commands the analysis looks into */
+#define EVT_DISCONN_COMPLETE	0x05
+#define EVT_CMD_COMPLETE	0x0e
+#define EVT_CMD_STATUS		0x0f
+#define EVT_HW_ERROR		0x10
+#define EVT_NUM_COMP_PKTS	0x13
+#define EVT_DATA_OVERFLOW	0x1a
+#define OP_READ_BUFFER_SIZE	0x1005
+#define OP_LE_READ_BUFFER_SIZE	0x2002
+
+/* Records checked to accept a resynchronisation point inside a chunk */
+#define SYNC_CHAIN		16
+/* Timestamps further than this from the first record are not plausible */
+#define SYNC_MAX_SPAN_US	(31ULL * 24 * 3600 * 1000000)
+
+#define MAX_INDEX		16	/* Controllers tracked in monitor captures */
+#define MAX_PENDING		64	/* Outstanding commands per controller */
+#define MAX_ERRORS		256	/* Distinct error kinds */
+#define MAX_BINS		(1 << 22)	/* ACL throughput bins, 64 MiB */
+
+/* ============================================================================
+ * DATA STRUCTURES
+ * ============================================================================ */
+
+/**
+ * struct snoop - Mapped capture
+ * @data: File contents
+ * @len: File length
+ * @datalink: SNOOP_DL_*
+ * @first_ts: Timestamp of the first record, in us since 0 AD
+ * @bin_us: Width of an ACL throughput bin
+ */
+struct snoop {
+	const uint8_t *data;
+	uint64_t len;
+	uint32_t datalink;
+	uint64_t first_ts;
+	uint64_t bin_us;
+};
+
+enum flow_kind {
+	FLOW_CMD,		/* Command sent */
+	FLOW_CMD_DONE,		/* Command Complete or Command Status */
+	FLOW_ACL_TX,		/* ACL packet sent to the controller */
+	FLOW_ACL_DONE,		/* Number Of Completed Packets */
+	FLOW_ACL_BUFFERS,	/* Read Buffer Size (BR/EDR) response */
+	FLOW_LE_BUFFERS,	/* LE Read Buffer Size response */
+};
+
+/**
+ * struct flow_event - Record that carries state across records
+ * @ts: Timestamp in us since 0 AD
+ * @opcode: Command opcode for FLOW_CMD and FLOW_CMD_DONE
+ * @value: Packets completed, or controller buffers
+ * @kind: enum flow_kind
+ * @index: Controller index
+ * @status: Status of FLOW_CMD_DONE
+ * @ncmd: Command credits granted by FLOW_CMD_DONE
+ */
+struct flow_event {
+	uint64_t ts;
+	uint16_t opcode;
+	uint16_t value;
+	uint8_t kind;
+	uint8_t index;
+	uint8_t status;
+	uint8_t ncmd;
+};
+
+/**
+ * struct error_entry - One kind of error event and how often it occurred
+ * @event: HCI event code
+ * @opcode: Failed command, for Command Complete and Command Status
+ * @status: Status, error or disconnection reason code
+ * @count: Occurrences
+ */
+struct error_entry {
+	uint8_t event;
+	uint16_t opcode;
+	uint8_t status;
+	uint64_t count;
+};
+
+/**
+ * struct acl_bin - ACL payload bytes in one throughput bin
+ */
+struct acl_bin {
+	uint64_t tx;
+	uint64_t rx;
+};
+
+/**
+ * struct snoop_counts - Stateless per-record counters
+ */
+struct snoop_counts {
+	uint64_t records;
+	uint64_t cmds;
+	uint64_t evts;
+	uint64_t acl_tx;
+	uint64_t acl_rx;
+	uint64_t acl_tx_bytes;
+	uint64_t acl_rx_bytes;
+	uint64_t sco;
+	uint64_t iso;
+	uint64_t other;
+	uint64_t truncated;
+	uint64_t bad_ts;
+	uint64_t drops;
+	uint64_t last_ts;
+};
+
+/**
+ * struct snoop_worker - One parsing thread and its chunk
+ * @s: Capture
+ * @start: Offset of the first record of the chunk
+ * @end: Offset of the first record of the next chunk
+ * @stop: Offset parsing stopped at; equal to @end when the chunk was sound
+ * @counts: Record counters
+ * @flow: Stateful events, in capture order
+ * @nr_flow: Entries in @flow
+ * @max_flow: Allocated entries of @flow
+ * @bins: ACL throughput bins
+ * @nr_bins: Allocated entries of @bins
+ * @errors: Error kinds
+ * @nr_errors: Entries in @errors
+ * @errors_lost: Error events of kinds that did not fit in @errors
+ * @nomem: An allocation failed
+ * @too_long: The capture needs more than MAX_BINS throughput bins
+ */
+struct snoop_worker {
+	pthread_t thread;
+	const struct snoop *s;
+	uint64_t start;
+	uint64_t end;
+	uint64_t stop;
+	struct snoop_counts counts;
+	struct flow_event *flow;
+	size_t nr_flow;
+	size_t max_flow;
+	struct acl_bin *bins;
+	size_t nr_bins;
+	struct error_entry errors[MAX_ERRORS];
+	int nr_errors;
+	uint64_t errors_lost;
+	int nomem;
+	int too_long;
+};
+
+/**
+ * struct opcode_stats - Latency of one command opcode
+ * @sent: Commands sent
+ * @failed: Completions with a non-zero status
+ * @lat: Latency of every answered command, in us
+ * @nr: Entries in @lat
+ * @max: Allocated entries of @lat
+ */
+struct opcode_stats {
+	uint64_t sent;
+	uint64_t failed;
+	uint32_t *lat;
+	size_t nr;
+	size_t max;
+};
+
+/**
+ * struct stall_stats - Time spent without credits
+ */
+struct stall_stats {
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+};
+
+/**
+ * struct index_state - Flow control state of one controller during replay
+ * @pending: Commands waiting for their completion, oldest first
+ * @nr_pending: Entries in @pending
+ * @cmd_stalled: No command credits since @cmd_stall_start
+ * @cmd_stall_start: Start of the current command stall
+ * @acl_out: ACL packets sent and not yet completed
+ * @acl_bufs: BR/EDR ACL buffers of the controller, 0 when unknown
+ * @le_bufs: LE ACL buffers of the controller, 0 when shared or unknown
+ * @acl_stalled: All ACL buffers in use since @acl_stall_start
+ * @acl_stall_start: Start of the current ACL stall
+ */
+struct index_state {
+	struct {
+		uint64_t ts;
+		uint16_t opcode;
+	} pending[MAX_PENDING];
+	int nr_pending;
+	int cmd_stalled;
+	uint64_t cmd_stall_start;
+	uint32_t acl_out;
+	uint32_t acl_bufs;
+	uint32_t le_bufs;
+	int acl_stalled;
+	uint64_t acl_stall_start;
+};
+
+/**
+ * struct analysis - Results of the sequential replay
+ */
+struct analysis {
+	struct opcode_stats *ops[65536];
+	struct index_state idx[MAX_INDEX];
+	uint64_t unanswered;
+	uint64_t unmatched;
+	uint32_t acl_max_out;
+	uint32_t acl_bufs;
+	struct stall_stats cmd_stall;
+	struct stall_stats acl_stall;
+};
+
+/* ============================================================================
+ * HELPER FUNCTIONS
+ * ============================================================================ */
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint64_t get_be64(const uint8_t *p)
+{
+	return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+/**
+ * now_ns - CLOCK_MONOTONIC time in nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * stall_add - Account one finished credit stall
+ */
+static void stall_add(struct stall_stats *st, uint64_t start, uint64_t end)
+{
+	uint64_t us = end > start ? end - start : 0;
+
+	st->count++;
+	st->total_us += us;
+	if (us > st->max_us)
+		st->max_us = us;
+}
+
+/* ============================================================================
+ * RECORD PARSING
+ * ============================================================================ */
+
+/**
+ * snoop_plausible - Check that a record header can start at @off
+ * @s: Capture
+ * @off: Candidate record offset
+ * @next: Set to the offset of the following record
+ */
+static int snoop_plausible(const struct snoop *s, uint64_t off, uint64_t *next)
+{
+	const uint8_t *p = s->data + off;
+	uint32_t orig, incl, flags;
+	uint64_t ts;
+
+	if (off + SNOOP_REC_LEN > s->len)
+		return 0;
+
+	orig = get_be32(p);
+	incl = get_be32(p + 4);
+	flags = get_be32(p + 8);
+	ts = get_be64(p + 16);
+
+	if (!incl || incl > orig || incl > SNOOP_MAX_PKT)
+		return 0;
+	*next = off + SNOOP_REC_LEN + incl;
+	if (*next > s->len)
+		return 0;
+	if (ts + SYNC_MAX_SPAN_US < s->first_ts ||
+	    ts > s->first_ts + SYNC_MAX_SPAN_US)
+		return 0;
+
+	switch (s->datalink) {
+	case SNOOP_DL_HCI:
+		if (flags > 3)
+			return 0;
+		break;
+	case SNOOP_DL_H4:
+		if (flags > 3 || p[SNOOP_REC_LEN] < H4_CMD ||
+		    p[SNOOP_REC_LEN] > H4_ISO)
+			return 0;
+		break;
+	case SNOOP_DL_MONITOR:
+		if ((flags & 0xffff) >= MON_MAX_OPCODE)
+			return 0;
+		break;
+	}
+
+	return 1;
+}
+
+/**
+ * snoop_sync - Find the first record boundary at or after @off
+ * @s: Capture
+ * @off: Arbitrary offset inside the record area
+ * @limit: Give up at this offset
+ *
+ * Records carry no sync marker, so a boundary is accepted only when
+ * SYNC_CHAIN consecutive plausible headers chain from it, or the chain
+ * ends exactly at the end of the file.
+ *
+ * Return: Record offset, or @limit when none was found before it
+ */
+static uint64_t snoop_sync(const struct snoop *s, uint64_t off, uint64_t limit)
+{
+	uint64_t cur, next;
+	int i;
+
+	for (; off < limit; off++) {
+		cur = off;
+		for (i = 0; i < SYNC_CHAIN && cur < s->len; i++) {
+			if (!snoop_plausible(s, cur, &next))
+				break;
+			cur = next;
+		}
+		if (i == SYNC_CHAIN || cur == s->len)
+			return off;
+	}
+	return limit;
+}
+
+/**
+ * worker_flow - Append a stateful event
+ */
+static void worker_flow(struct snoop_worker *w, uint64_t ts, uint8_t kind,
+			uint8_t index, uint16_t opcode, uint16_t value,
+			uint8_t status, uint8_t ncmd)
+{
+	struct flow_event *ev;
+
+	if (w->nr_flow == w->max_flow) {
+		size_t max = w->max_flow ? 2 * w->max_flow : 4096;
+
+		ev = realloc(w->flow, max * sizeof(*ev));
+		if (!ev) {
+			w->nomem = 1;
+			return;
+		}
+		w->flow = ev;
+		w->max_flow = max;
+	}
+
+	ev = &w->flow[w->nr_flow++];
+	ev->ts = ts;
+	ev->kind = kind;
+	ev->index = index;
+	ev->opcode = opcode;
+	ev->value = value;
+	ev->status = status;
+	ev->ncmd = ncmd;
+}
+
+/**
+ * worker_error - Count one error event
+ */
+static void worker_error(struct snoop_worker *w, uint8_t event,
+			 uint16_t opcode, uint8_t status)
+{
+	int i;
+
+	for (i = 0; i < w->nr_errors; i++) {
+		if (w->errors[i].event == event &&
+		    w->errors[i].opcode == opcode &&
+		    w->errors[i].status == status) {
+			w->errors[i].count++;
+			return;
+		}
+	}
+
+	if (w->nr_errors == MAX_ERRORS) {
+		w->errors_lost++;
+		return;
+	}
+
+	w->errors[w->nr_errors].event = event;
+	w->errors[w->nr_errors].opcode = opcode;
+	w->errors[w->nr_errors].status = status;
+	w->errors[w->nr_errors].count = 1;
+	w->nr_errors++;
+}
+
+/**
+ * worker_acl - Account ACL payload in its throughput bin
+ */
+static void worker_acl(struct snoop_worker *w, uint64_t ts, const uint8_t *p,
+		       uint32_t len, int tx)
+{
+	uint64_t bytes, bin;
+
+	if (len < 4)
+		return;
+
+	bytes = get_le16(p + 2);
+	if (tx) {
+		w->counts.acl_tx++;
+		w->counts.acl_tx_bytes += bytes;
+	} else {
+		w->counts.acl_rx++;
+		w->counts.acl_rx_bytes += bytes;
+	}
+
+	bin = ts > w->s->first_ts ? (ts - w->s->first_ts) / w->s->bin_us : 0;
+	if (bin >= MAX_BINS) {
+		w->too_long = 1;
+		return;
+	}
+	if (bin >= w->nr_bins) {
+		size_t nr = w->nr_bins ? w->nr_bins : 64;
+		struct acl_bin *bins;
+
+		while (nr <= bin)
+			nr *= 2;
+		if (nr > MAX_BINS)
+			nr = MAX_BINS;
+		bins = realloc(w->bins, nr * sizeof(*bins));
+		if (!bins) {
+			w->nomem = 1;
+			return;
+		}
+		memset(bins + w->nr_bins, 0,
+		       (nr - w->nr_bins) * sizeof(*bins));
+		w->bins = bins;
+		w->nr_bins = nr;
+	}
+
+	if (tx)
+		w->bins[bin].tx += bytes;
+	else
+		w->bins[bin].rx += bytes;
+}
+
+/**
+ * worker_event - Parse one HCI event
+ */
+static void worker_event(struct snoop_worker *w, uint64_t ts, uint8_t index,
+			 const uint8_t *p, uint32_t len)
+{
+	uint32_t i, n, total = 0;
+	uint16_t opcode;
+	uint8_t status;
+
+	w->counts.evts++;
+	if (len < 2)
+		return;
+
+	switch (p[0]) {
+	case EVT_CMD_COMPLETE:
+		if (len < 5)
+			break;
+		opcode = get_le16(p + 3);
+		status = len > 5 ? p[5] : 0;
+		worker_flow(w, ts, FLOW_CMD_DONE, index, opcode, 0, status,
+			    p[2]);
+		if (status) {
+			worker_error(w, p[0], opcode, status);
+			break;
+		}
+		if (opcode == OP_READ_BUFFER_SIZE && len >= 11)
+			worker_flow(w, ts, FLOW_ACL_BUFFERS, index, 0,
+				    get_le16(p + 9), 0, 0);
+		else if (opcode == OP_LE_READ_BUFFER_SIZE && len >= 9)
+			worker_flow(w, ts, FLOW_LE_BUFFERS, index, 0, p[8],
+				    0, 0);
+		break;
+	case EVT_CMD_STATUS:
+		if (len < 6)
+			break;
+		opcode = get_le16(p + 4);
+		worker_flow(w, ts, FLOW_CMD_DONE, index, opcode, 0, p[2], p[3]);
+		if (p[2])
+			worker_error(w, p[0], opcode, p[2]);
+		break;
+	case EVT_NUM_COMP_PKTS:
+		if (len < 3)
+			break;
+		n = p[2];
+		for (i = 0; i < n && 3 + 4 * i + 4 <= len; i++)
+			total += get_le16(p + 3 + 4 * i + 2);
+		if (total)
+			worker_flow(w, ts, FLOW_ACL_DONE, index, 0,
+				    total > UINT16_MAX ? UINT16_MAX : total, 0, 0);
+		break;
+	case EVT_HW_ERROR:
+		worker_error(w, p[0], 0, len > 2 ? p[2] : 0);
+		break;
+	case EVT_DATA_OVERFLOW:
+		worker_error(w, p[0], 0, len > 2 ? p[2] : 0);
+		break;
+	case EVT_DISCONN_COMPLETE:
+		/* Counted by reason, the status is almost always success */
+		if (len >= 6)
+			worker_error(w, p[0], 0, p[2] ? p[2] : p[5]);
+		break;
+	}
+}
+
+/**
+ * worker_record - Classify and parse one record
+ */
+static void worker_record(struct snoop_worker *w, uint32_t flags, uint64_t ts,
+			  const uint8_t *p, uint32_t len)
+{
+	uint8_t index = 0;
+	int type = 0, rx = flags & 1;
+
+	switch (w->s->datalink) {
+	case SNOOP_DL_H4:
+		if (!len)
+			return;
+		type = p[0];
+		p++;
+		len--;
+		break;
+	case SNOOP_DL_HCI:
+		if (flags & 2)
+			type = rx ? H4_EVT : H4_CMD;
+		else
+			type = H4_ACL;
+		break;
+	case SNOOP_DL_MONITOR:
+		index = flags >> 16 < MAX_INDEX ? flags >> 16 : MAX_INDEX;
+		switch (flags & 0xffff) {
+		case MON_COMMAND:
+			type = H4_CMD;
+			break;
+		case MON_EVENT:
+			type = H4_EVT;
+			break;
+		case MON_ACL_TX:
+		case MON_ACL_RX:
+			type = H4_ACL;
+			rx = (flags & 0xffff) == MON_ACL_RX;
+			break;
+		case MON_SCO_TX:
+		case MON_SCO_RX:
+			type = H4_SCO;
+			break;
+		case MON_ISO_TX:
+		case MON_ISO_RX:
+			type = H4_ISO;
+			break;
+		}
+		break;
+	}
+
+	switch (type) {
+	case H4_CMD:
+		w->counts.cmds++;
+		if (len >= 3)
+			worker_flow(w, ts, FLOW_CMD, index, get_le16(p), 0, 0, 0);
+		break;
+	case H4_EVT:
+		worker_event(w, ts, index, p, len);
+		break;
+	case H4_ACL:
+		worker_acl(w, ts, p, len, !rx);
+		if (!rx)
+			worker_flow(w, ts, FLOW_ACL_TX, index, 0, 1, 0, 0);
+		break;
+	case H4_SCO:
+		w->counts.sco++;
+		break;
+	case H4_ISO:
+		w->counts.iso++;
+		break;
+	default:
+		w->counts.other++;
+		break;
+	}
+}
+
+/**
+ * worker_run - Parse the records of one chunk
+ */
+static void *worker_run(void *arg)
+{
+	struct snoop_worker *w = arg;
+	const struct snoop *s = w->s;
+	uint64_t off = w->start, ts;
+	uint32_t incl, flags, drops;
+	const uint8_t *p;
+
+	while (off < w->end && !w->nomem && !w->too_long) {
+		if (off + SNOOP_REC_LEN > s->len) {
+			w->counts.truncated++;
+			off = s->len;
+			break;
+		}
+
+		p = s->data + off;
+		incl = get_be32(p + 4);
+		flags = get_be32(p + 8);
+		drops = get_be32(p + 12);
+		ts = get_be64(p + 16);
+
+		if (off + SNOOP_REC_LEN + incl > s->len) {
+			w->counts.truncated++;
+			off = s->len;
+			break;
+		}
+
+		w->counts.records++;
+		if (drops > w->counts.drops)
+			w->counts.drops = drops;
+
+		/* A corrupt timestamp would send the ACL bins into the future */
+		if (ts < s->first_ts || ts - s->first_ts > SYNC_MAX_SPAN_US) {
+			w->counts.bad_ts++;
+			off += SNOOP_REC_LEN + incl;
+			continue;
+		}
+		if (ts > w->counts.last_ts)
+			w->counts.last_ts = ts;
+
+		worker_record(w, flags, ts, p + SNOOP_REC_LEN, incl);
+		off += SNOOP_REC_LEN + incl;
+	}
+
+	w->stop = off;
+	return NULL;
+}
+
+/* ============================================================================
+ * SEQUENTIAL REPLAY
+ * ============================================================================ */
+
+/**
+ * opcode_add - Record the latency of one answered command
+ */
+static int opcode_add(struct opcode_stats *op, uint64_t us)
+{
+	if (op->nr == op->max) {
+		size_t max = op->max ? 2 * op->max : 64;
+		uint32_t *lat = realloc(op->lat, max * sizeof(*lat));
+
+		if (!lat)
+			return -1;
+		op->lat = lat;
+		op->max = max;
+	}
+	op->lat[op->nr++] = us > UINT32_MAX ? UINT32_MAX : us;
+	return 0;
+}
+
+/**
+ * replay_cmd_done - Match a completion with the oldest pending command
+ *
+ * Also tracks command credits: a completion granting none starts a stall
+ * that the next completion granting some ends.
+ */
+static int replay_cmd_done(struct analysis *a, struct index_state *st,
+			   const struct flow_event *ev)
+{
+	struct opcode_stats *op;
+	int i;
+
+	if (!ev->ncmd && !st->cmd_stalled) {
+		st->cmd_stalled = 1;
+		st->cmd_stall_start = ev->ts;
+	} else if (ev->ncmd && st->cmd_stalled) {
+		st->cmd_stalled = 0;
+		stall_add(&a->cmd_stall, st->cmd_stall_start, ev->ts);
+	}
+
+	/* Opcode 0x0000 only returns credits */
+	if (!ev->opcode)
+		return 0;
+
+	for (i = 0; i < st->nr_pending; i++)
+		if (st->pending[i].opcode == ev->opcode)
+			break;
+	if (i == st->nr_pending) {
+		/* Sent before the capture started */
+		a->unmatched++;
+		return 0;
+	}
+
+	op = a->ops[ev->opcode];
+	if (ev->status)
+		op->failed++;
+	if (opcode_add(op, ev->ts - st->pending[i].ts) < 0)
+		return -1;
+
+	st->nr_pending--;
+	memmove(&st->pending[i], &st->pending[i + 1],
+		(st->nr_pending - i) * sizeof(st->pending[0]));
+	return 0;
+}
+
+/**
+ * replay_acl - Track ACL buffer occupancy
+ *
+ * The controller's buffers are treated as one pool, LE buffers when the
+ * controller reported a separate LE pool. A stall lasts from the packet
+ * that fills the pool until the completion that frees a buffer.
+ */
+static void replay_acl(struct analysis *a, struct index_state *st,
+		       const struct flow_event *ev)
+{
+	uint32_t bufs = st->le_bufs ? st->le_bufs : st->acl_bufs;
+
+	switch (ev->kind) {
+	case FLOW_ACL_BUFFERS:
+		st->acl_bufs = ev->value;
+		return;
+	case FLOW_LE_BUFFERS:
+		st->le_bufs = ev->value;
+		return;
+	case FLOW_ACL_TX:
+		st->acl_out++;
+		if (st->acl_out > a->acl_max_out)
+			a->acl_max_out = st->acl_out;
+		if (bufs && st->acl_out >= bufs && !st->acl_stalled) {
+			st->acl_stalled = 1;
+			st->acl_stall_start = ev->ts;
+		}
+		return;
+	case FLOW_ACL_DONE:
+		/* Packets sent before the capture started are completed too */
+		st->acl_out = st->acl_out > ev->value ? st->acl_out - ev->value : 0;
+		if (st->acl_stalled && st->acl_out < bufs) {
+			st->acl_stalled = 0;
+			stall_add(&a->acl_stall, st->acl_stall_start, ev->ts);
+		}
+		return;
+	}
+}
+
+/**
+ * replay_flow - Replay the stateful events of every chunk in order
+ */
+static int replay_flow(struct analysis *a, struct snoop_worker *w, int nr)
+{
+	const struct flow_event *ev;
+	struct index_state *st;
+	struct opcode_stats *op;
+	size_t j;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < w[i].nr_flow; j++) {
+			ev = &w[i].flow[j];
+			if (ev->index >= MAX_INDEX)
+				continue;
+			st = &a->idx[ev->index];
+
+			switch (ev->kind) {
+			case FLOW_CMD:
+				op = a->ops[ev->opcode];
+				if (!op) {
+					op = calloc(1, sizeof(*op));
+					if (!op)
+						return -1;
+					a->ops[ev->opcode] = op;
+				}
+				op->sent++;
+				if (st->nr_pending == MAX_PENDING) {
+					/* Never answered, make room */
+					a->unanswered++;
+					st->nr_pending--;
+					memmove(&st->pending[0], &st->pending[1],
+						st->nr_pending *
+						sizeof(st->pending[0]));
+				}
+				st->pending[st->nr_pending].ts = ev->ts;
+				st->pending[st->nr_pending].opcode = ev->opcode;
+				st->nr_pending++;
+				break;
+			case FLOW_CMD_DONE:
+				if (replay_cmd_done(a, st, ev) < 0)
+					return -1;
+				break;
+			default:
+				replay_acl(a, st, ev);
+				if (st->acl_bufs > a->acl_bufs)
+					a->acl_bufs = st->acl_bufs;
+				if (st->le_bufs > a->acl_bufs)
+					a->acl_bufs = st->le_bufs;
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < MAX_INDEX; i++)
+		a->unanswered += a->idx[i].nr_pending;
+	return 0;
+}
+
+/* ============================================================================
+ * REPORT
+ * ============================================================================ */
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * print_opcodes - Print the latency distribution of the busiest opcodes
+ */
+static void print_opcodes(struct analysis *a, int top)
+{
+	uint16_t order[65536];
+	int i, j, n = 0;
+	uint64_t sum;
+
+	for (i = 0; i < 65536; i++)
+		if (a->ops[i])
+			order[n++] = i;
+
+	/* Most frequent first; the table is small enough for a plain sort */
+	for (i = 1; i < n; i++) {
+		uint16_t v = order[i];
+
+		for (j = i; j > 0 && a->ops[order[j - 1]]->sent <
+				     a->ops[v]->sent; j--)
+			order[j] = order[j - 1];
+		order[j] = v;
+	}
+
+	printf("\nCommand latency (us):\n");
+	printf("  %-8s %10s %8s %8s %8s %8s %8s %8s %8s\n", "Opcode", "Sent",
+	       "Failed", "Min", "Mean", "P50", "P90", "P99", "Max");
+	for (i = 0; i < n && i < top; i++) {
+		struct opcode_stats *op = a->ops[order[i]];
+
+		if (!op->nr) {
+			printf("  0x%04x   %10llu %8llu %8s\n", order[i],
+			       (unsigned long long)op->sent,
+			       (unsigned long long)op->failed, "-");
+			continue;
+		}
+
+		qsort(op->lat, op->nr, sizeof(*op->lat), cmp_u32);
+		for (sum = 0, j = 0; j < (int)op->nr; j++)
+			sum += op->lat[j];
+		printf("  0x%04x   %10llu %8llu %8u %8llu %8u %8u %8u %8u\n",
+		       order[i], (unsigned long long)op->sent,
+		       (unsigned long long)op->failed, op->lat[0],
+		       (unsigned long long)(sum / op->nr),
+		       op->lat[op->nr / 2], op->lat[op->nr * 9 / 10],
+		       op->lat[op->nr * 99 / 100], op->lat[op->nr - 1]);
+	}
+	if (n > top)
+		printf("  ... %d more opcodes (--top)\n", n - top);
+	printf("  Unanswered: %llu, completions without a command: %llu\n",
+	       (unsigned long long)a->unanswered,
+	       (unsigned long long)a->unmatched);
+}
+
+/**
+ * print_stalls - Print one credit stall summary
+ */
+static void print_stalls(const char *name, const struct stall_stats *st)
+{
+	printf("  %-8s %llu stalls, %.3f ms total, %.3f ms longest\n", name,
+	       (unsigned long long)st->count, st->total_us / 1e3,
+	       st->max_us / 1e3);
+}
+
+/**
+ * print_throughput - Summarise ACL throughput and optionally write the bins
+ */
+static int print_throughput(const struct snoop *s, const struct acl_bin *bins,
+			    size_t nr, const char *csv)
+{
+	double secs = s->bin_us / 1e6, tx, rx, peak_tx = 0, peak_rx = 0;
+	FILE *f = NULL;
+	size_t i;
+
+	if (csv) {
+		f = fopen(csv, "w");
+		if (!f) {
+			fprintf(stderr, "ERROR: %s: %s\n", csv, strerror(errno));
+			return -1;
+		}
+		fprintf(f, "time_s,tx_bytes_per_s,rx_bytes_per_s\n");
+	}
+
+	for (i = 0; i < nr; i++) {
+		tx = bins[i].tx / secs;
+		rx = bins[i].rx / secs;
+		if (tx > peak_tx)
+			peak_tx = tx;
+		if (rx > peak_rx)
+			peak_rx = rx;
+		if (f)
+			fprintf(f, "%.3f,%.0f,%.0f\n", i * secs, tx, rx);
+	}
+
+	printf("  Peak:    %.1f KB/s TX, %.1f KB/s RX (%.3f s bins)\n",
+	       peak_tx / 1e3, peak_rx / 1e3, secs);
+
+	if (f && fclose(f)) {
+		fprintf(stderr, "ERROR: %s: %s\n", csv, strerror(errno));
+		return -1;
+	}
+	if (f)
+		printf("  Series:  %s\n", csv);
+	return 0;
+}
+
+/**
+ * print_errors - Print the error events, merged over all chunks
+ */
+static void print_errors(struct snoop_worker *w, int nr)
+{
+	struct error_entry all[MAX_ERRORS];
+	uint64_t lost = 0;
+	int i, j, k, n = 0;
+
+	for (i = 0; i < nr; i++) {
+		lost += w[i].errors_lost;
+		for (j = 0; j < w[i].nr_errors; j++) {
+			const struct error_entry *e = &w[i].errors[j];
+
+			for (k = 0; k < n; k++)
+				if (all[k].event == e->event &&
+				    all[k].opcode == e->opcode &&
+				    all[k].status == e->status)
+					break;
+			if (k < n) {
+				all[k].count += e->count;
+			} else if (n < MAX_ERRORS) {
+				all[n++] = *e;
+			} else {
+				lost += e->count;
+			}
+		}
+	}
+
+	printf("\nError events:\n");
+	if (!n)
+		printf("  None\n");
+	for (i = 0; i < n; i++) {
+		switch (all[i].event) {
+		case EVT_CMD_COMPLETE:
+		case EVT_CMD_STATUS:
+			printf("  %-22s opcode 0x%04x status 0x%02x: %llu\n",
+			       all[i].event == EVT_CMD_STATUS ?
+			       "Command Status" : "Command Complete",
+			       all[i].opcode, all[i].status,
+			       (unsigned long long)all[i].count);
+			break;
+		case EVT_HW_ERROR:
+			printf("  %-22s code 0x%02x: %llu\n", "Hardware Error",
+			       all[i].status, (unsigned long long)all[i].count);
+			break;
+		case EVT_DATA_OVERFLOW:
+			printf("  %-22s link type %u: %llu\n",
+			       "Data Buffer Overflow", all[i].status,
+			       (unsigned long long)all[i].count);
+			break;
+		case EVT_DISCONN_COMPLETE:
+			printf("  %-22s reason 0x%02x: %llu\n", "Disconnection",
+			       all[i].status, (unsigned long long)all[i].count);
+			break;
+		}
+	}
+	if (lost)
+		printf("  %llu events of further kinds not listed\n",
+		       (unsigned long long)lost);
+}
+
+/* ============================================================================
+ * MAIN PROGRAM
+ * ============================================================================ */
+
+/**
+ * split - Cut the record area into one chunk per worker
+ *
+ * Return: Number of chunks, fewer than @nr when no boundary was found
+ * inside some of them
+ */
+static int split(const struct snoop *s, struct snoop_worker *w, int nr)
+{
+	uint64_t area = s->len - SNOOP_HDR_LEN, off;
+	int i, n = 1;
+
+	w[0].start = SNOOP_HDR_LEN;
+	for (i = 1; i < nr; i++) {
+		off = SNOOP_HDR_LEN + area * i / nr;
+		if (off <= w[n - 1].start)
+			continue;
+		off = snoop_sync(s, off, SNOOP_HDR_LEN + area * (i + 1) / nr);
+		if (off >= s->len || off <= w[n - 1].start)
+			continue;
+		w[n - 1].end = off;
+		w[n++].start = off;
+	}
+	w[n - 1].end = s->len;
+	return n;
+}
+
+/**
+ * run_workers - Parse the chunks in parallel
+ *
+ * Return: 0, 1 when a chunk boundary turned out to be wrong, or -1
+ */
+static int run_workers(const struct snoop *s, struct snoop_worker *w, int nr)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < nr; i++) {
+		w[i].s = s;
+		if (pthread_create(&w[i].thread, NULL, worker_run, &w[i])) {
+			fprintf(stderr, "ERROR: Cannot create thread\n");
+			while (i--)
+				pthread_join(w[i].thread, NULL);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < nr; i++)
+		pthread_join(w[i].thread, NULL);
+
+	for (i = 0; i < nr; i++) {
+		if (w[i].nomem) {
+			fprintf(stderr, "ERROR: Out of memory\n");
+			ret = -1;
+		} else if (w[i].too_long) {
+			fprintf(stderr, "ERROR: Capture needs more than %d throughput bins of %llu ms, use a larger --bin-ms\n",
+				MAX_BINS,
+				(unsigned long long)s->bin_us / 1000);
+			ret = -1;
+		} else if (!ret && w[i].stop != w[i].end && w[i].stop != s->len) {
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
+static void free_workers(struct snoop_worker *w, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		free(w[i].flow);
+		free(w[i].bins);
+	}
+	memset(w, 0, nr * sizeof(*w));
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [--threads N] [--bin-ms MS] [--csv FILE] [--top N] CAPTURE\n",
+	       prog);
+	printf("  CAPTURE is a btsnoop file: H4, un-encapsulated HCI or btmon\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "threads", required_argument, NULL, 't' },
+		{ "bin-ms",  required_argument, NULL, 'b' },
+		{ "csv",     required_argument, NULL, 'c' },
+		{ "top",     required_argument, NULL, 'T' },
+		{ "help",    no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct snoop_worker *w = NULL;
+	struct snoop_counts total;
+	struct analysis *a = NULL;
+	struct acl_bin *bins = NULL;
+	struct snoop s;
+	struct stat st;
+	const char *csv = NULL;
+	uint64_t start, elapsed, bin_ms = 1000;
+	size_t nr_bins = 0, k;
+	int opt, fd, i, nr, threads, top = 20, ret = EXIT_FAILURE;
+	time_t t;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'b':
+			bin_ms = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			csv = optarg;
+			break;
+		case 'T':
+			top = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (optind + 1 != argc || threads < 1 || threads > 256 || !bin_ms) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "ERROR: %s: %s\n", argv[optind], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.len = st.st_size;
+	if (s.len < SNOOP_HDR_LEN + SNOOP_REC_LEN) {
+		fprintf(stderr, "ERROR: %s: Too short for a btsnoop capture\n",
+			argv[optind]);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	s.data = mmap(NULL, s.len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (s.data == MAP_FAILED) {
+		fprintf(stderr, "ERROR: mmap: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	madvise((void *)s.data, s.len, MADV_SEQUENTIAL);
+
+	if (memcmp(s.data, SNOOP_MAGIC, 8) || get_be32(s.data + 8) != 1) {
+		fprintf(stderr, "ERROR: Not a version 1 btsnoop capture\n");
+		goto out;
+	}
+	s.datalink = get_be32(s.data + 12);
+	if (s.datalink != SNOOP_DL_HCI && s.datalink != SNOOP_DL_H4 &&
+	    s.datalink != SNOOP_DL_MONITOR) {
+		fprintf(stderr, "ERROR: Unsupported datalink %u\n", s.datalink);
+		goto out;
+	}
+	s.first_ts = get_be64(s.data + SNOOP_HDR_LEN + 16);
+	s.bin_us = bin_ms * 1000;
+
+	w = calloc(threads, sizeof(*w));
+	a = calloc(1, sizeof(*a));
+	if (!w || !a) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		goto out;
+	}
+
+	start = now_ns();
+	nr = split(&s, w, threads);
+	i = run_workers(&s, w, nr);
+	if (i > 0) {
+		/* A chunk started inside a record: fall back to one thread */
+		fprintf(stderr, "[INFO] Chunk boundaries inconsistent, reparsing with one thread\n");
+		free_workers(w, nr);
+		nr = split(&s, w, 1);
+		i = run_workers(&s, w, nr);
+	}
+	if (i < 0 || replay_flow(a, w, nr) < 0)
+		goto out;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < nr; i++) {
+		const struct snoop_counts *c = &w[i].counts;
+
+		total.records += c->records;
+		total.cmds += c->cmds;
+		total.evts += c->evts;
+		total.acl_tx += c->acl_tx;
+		total.acl_rx += c->acl_rx;
+		total.acl_tx_bytes += c->acl_tx_bytes;
+		total.acl_rx_bytes += c->acl_rx_bytes;
+		total.sco += c->sco;
+		total.iso += c->iso;
+		total.other += c->other;
+		total.truncated += c->truncated;
+		total.bad_ts += c->bad_ts;
+		if (c->drops > total.drops)
+			total.drops = c->drops;
+		if (c->last_ts > total.last_ts)
+			total.last_ts = c->last_ts;
+
+		if (w[i].nr_bins > nr_bins) {
+			struct acl_bin *b = realloc(bins,
+						    w[i].nr_bins * sizeof(*b));
+
+			if (!b) {
+				fprintf(stderr, "ERROR: Out of memory\n");
+				goto out;
+			}
+			memset(b + nr_bins, 0,
+			       (w[i].nr_bins - nr_bins) * sizeof(*b));
+			bins = b;
+			nr_bins = w[i].nr_bins;
+		}
+		for (k = 0; k < w[i].nr_bins; k++) {
+			bins[k].tx += w[i].bins[k].tx;
+			bins[k].rx += w[i].bins[k].rx;
+		}
+	}
+	/* The bin arrays grow in powers of two, trim to the capture span */
+	if (total.last_ts > s.first_ts &&
+	    (total.last_ts - s.first_ts) / s.bin_us + 1 < nr_bins)
+		nr_bins = (total.last_ts - s.first_ts) / s.bin_us + 1;
+	elapsed = now_ns() - start;
+
+	t = (s.first_ts - SNOOP_EPOCH_US) / 1000000;
+	printf("Capture:   %s (%s)\n", argv[optind],
+	       s.datalink == SNOOP_DL_H4 ? "H4" :
+	       s.datalink == SNOOP_DL_HCI ? "HCI" : "monitor");
+	printf("  Start:   %s", asctime(gmtime(&t)));
+	printf("  Span:    %.3f s\n", total.last_ts > s.first_ts ?
+	       (total.last_ts - s.first_ts) / 1e6 : 0.0);
+	printf("  Records: %llu (%llu truncated, %llu dropped by the capturer)\n",
+	       (unsigned long long)total.records,
+	       (unsigned long long)total.truncated,
+	       (unsigned long long)total.drops);
+	if (total.bad_ts)
+		printf("  Skipped: %llu records timestamped outside the capture\n",
+		       (unsigned long long)total.bad_ts);
+	printf("  Packets: %llu commands, %llu events, %llu SCO, %llu ISO, %llu other\n",
+	       (unsigned long long)total.cmds, (unsigned long long)total.evts,
+	       (unsigned long long)total.sco, (unsigned long long)total.iso,
+	       (unsigned long long)total.other);
+
+	print_opcodes(a, top);
+
+	printf("\nACL throughput:\n");
+	printf("  TX:      %llu packets, %llu bytes\n",
+	       (unsigned long long)total.acl_tx,
+	       (unsigned long long)total.acl_tx_bytes);
+	printf("  RX:      %llu packets, %llu bytes\n",
+	       (unsigned long long)total.acl_rx,
+	       (unsigned long long)total.acl_rx_bytes);
+	if (print_throughput(&s, bins, nr_bins, csv) < 0)
+		goto out;
+
+	printf("\nCredit stalls:\n");
+	print_stalls("Command", &a->cmd_stall);
+	if (a->acl_bufs)
+		print_stalls("ACL", &a->acl_stall);
+	else
+		printf("  ACL      buffer count not in capture\n");
+	printf("  ACL packets in flight: %u max of %u buffers\n",
+	       a->acl_max_out, a->acl_bufs);
+
+	print_errors(w, nr);
+
+	printf("\nParsed %.1f MB in %.3f s (%.1f MB/s, %d thread%s)\n",
+	       s.len / 1e6, elapsed / 1e9, elapsed ? s.len * 1e3 / elapsed : 0,
+	       nr, nr > 1 ? "s" : "");
+	ret = EXIT_SUCCESS;
+out:
+	if (a) {
+		for (i = 0; i < 65536; i++) {
+			if (a->ops[i])
+				free(a->ops[i]->lat);
+			free(a->ops[i]);
+		}
+	}
+	if (w)
+		free_workers(w, threads);
+	free(a);
+	free(w);
+	free(bins);
+	munmap((void *)s.data, s.len);
+	return ret;
+}
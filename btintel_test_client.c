@@ -0,0 +1,421 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * Intel Bluetooth Test Generic Driver - Client Library
+ *
+ * Copyright (C) 2026  Your Company/Name
+ *
+ * The io_uring interface is driven through the raw system calls and the
+ * UAPI header, so the library has no dependency beyond libc.
+ *
+ * Build: gcc -shared -fPIC -o libbtintel_test_client.so btintel_test_client.c
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <glob.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "btintel_test_client.h"
+
+/* ============================================================================
+ * DATA STRUCTURES
+ * ============================================================================ */
+
+/**
+ * struct btintel_test_client_ring - Userspace view of one io_uring
+ * @fd: Ring file descriptor, -1 without a ring
+ * @sq_map: Submission ring mapping
+ * @sq_map_len: Length of @sq_map
+ * @cq_map: Completion ring mapping, @sq_map with IORING_FEAT_SINGLE_MMAP
+ * @cq_map_len: Length of @cq_map
+ * @sqes: Submission queue entries
+ * @sqes_len: Length of @sqes
+ * @sq_head: Kernel-owned consumer index of the submission ring
+ * @sq_tail: Our producer index of the submission ring
+ * @sq_mask: Index mask of the submission ring
+ * @sq_array: Indirection array of the submission ring
+ * @sq_entries: Size of the submission ring
+ * @sq_local_tail: Entries queued but not yet published to @sq_tail
+ * @cq_head: Our consumer index of the completion ring
+ * @cq_tail: Kernel-owned producer index of the completion ring
+ * @cq_mask: Index mask of the completion ring
+ * @cqes: Completion queue entries
+ */
+struct btintel_test_client_ring {
+	int fd;
+	void *sq_map;
+	size_t sq_map_len;
+	void *cq_map;
+	size_t cq_map_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/**
+ * struct btintel_test_client - One open device node
+ * @fd: Device file descriptor
+ * @ring: io_uring, set up by btintel_test_client_ring_init()
+ */
+struct btintel_test_client {
+	int fd;
+	struct btintel_test_client_ring ring;
+};
+
+/* ============================================================================
+ * DEVICE DISCOVERY & LIFETIME
+ * ============================================================================ */
+
+int btintel_test_client_discover(char paths[][BTINTEL_TEST_CLIENT_PATH_MAX],
+				 int max)
+{
+	glob_t g;
+	size_t i;
+	int ret;
+
+	/* The first instance is the bare name, further ones carry a suffix */
+	ret = glob(BTINTEL_TEST_CLIENT_DEV_PREFIX "*", 0, NULL, &g);
+	if (ret == GLOB_NOMATCH)
+		return 0;
+	if (ret)
+		return -ENOMEM;
+
+	for (i = 0; i < g.gl_pathc && (int)i < max; i++)
+		snprintf(paths[i], BTINTEL_TEST_CLIENT_PATH_MAX, "%s",
+			 g.gl_pathv[i]);
+
+	ret = g.gl_pathc;
+	globfree(&g);
+	return ret;
+}
+
+struct btintel_test_client *btintel_test_client_open(const char *path)
+{
+	char first[1][BTINTEL_TEST_CLIENT_PATH_MAX];
+	struct btintel_test_client *c;
+
+	if (!path) {
+		if (btintel_test_client_discover(first, 1) < 1) {
+			errno = ENODEV;
+			return NULL;
+		}
+		path = first[0];
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	c->ring.fd = -1;
+	c->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (c->fd < 0) {
+		free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+/**
+ * btintel_test_client_ring_free - Unmap and close a ring
+ * @ring: Ring, possibly only partly set up
+ */
+static void btintel_test_client_ring_free(struct btintel_test_client_ring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_map && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_len);
+	if (ring->sq_map)
+		munmap(ring->sq_map, ring->sq_map_len);
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+void btintel_test_client_close(struct btintel_test_client *c)
+{
+	if (!c)
+		return;
+
+	btintel_test_client_ring_free(&c->ring);
+	close(c->fd);
+	free(c);
+}
+
+int btintel_test_client_fd(const struct btintel_test_client *c)
+{
+	return c->fd;
+}
+
+/* ============================================================================
+ * SYNCHRONOUS OPERATIONS
+ * ============================================================================ */
+
+ssize_t btintel_test_client_read(struct btintel_test_client *c, void *buf,
+				 size_t len, uint64_t offset)
+{
+	ssize_t ret = pread(c->fd, buf, len, offset);
+
+	return ret < 0 ? -errno : ret;
+}
+
+ssize_t btintel_test_client_write(struct btintel_test_client *c,
+				  const void *buf, size_t len, uint64_t offset)
+{
+	ssize_t ret = pwrite(c->fd, buf, len, offset);
+
+	return ret < 0 ? -errno : ret;
+}
+
+int btintel_test_client_ioctl(struct btintel_test_client *c,
+			      unsigned long cmd, void *arg)
+{
+	return ioctl(c->fd, cmd, arg) < 0 ? -errno : 0;
+}
+
+int btintel_test_client_get_info(struct btintel_test_client *c,
+				 struct btintel_test_dev_info *info)
+{
+	return btintel_test_client_ioctl(c, BTINTEL_TEST_IOC_GET_INFO, info);
+}
+
+int btintel_test_client_get_stats(struct btintel_test_client *c,
+				  struct btintel_test_stats *stats)
+{
+	return btintel_test_client_ioctl(c, BTINTEL_TEST_IOC_GET_STATS, stats);
+}
+
+int btintel_test_client_reset_stats(struct btintel_test_client *c)
+{
+	return btintel_test_client_ioctl(c, BTINTEL_TEST_IOC_RESET_STATS, NULL);
+}
+
+int btintel_test_client_clear_buffer(struct btintel_test_client *c)
+{
+	return btintel_test_client_ioctl(c, BTINTEL_TEST_IOC_CLEAR_BUFFER, NULL);
+}
+
+int btintel_test_client_set_buffer_size(struct btintel_test_client *c,
+					size_t size, uint32_t flags)
+{
+	struct btintel_test_buffer_data data;
+
+	memset(&data, 0, sizeof(data));
+	data.size = size;
+	data.flags = flags;
+
+	return btintel_test_client_ioctl(c, BTINTEL_TEST_IOC_SET_BUFFER_SIZE,
+					 &data);
+}
+
+/* ============================================================================
+ * ASYNCHRONOUS OPERATIONS (io_uring)
+ * ============================================================================ */
+
+int btintel_test_client_ring_init(struct btintel_test_client *c,
+				  unsigned int entries)
+{
+	struct btintel_test_client_ring *ring = &c->ring;
+	struct io_uring_params p;
+	int fd, ret;
+
+	if (ring->fd >= 0)
+		return -EBUSY;
+	if (!entries || entries > BTINTEL_TEST_CLIENT_MAX_ENTRIES)
+		return -EINVAL;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return -errno;
+	ring->fd = fd;
+
+	ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_map_len = p.cq_off.cqes +
+			   p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_map_len > ring->sq_map_len)
+			ring->sq_map_len = ring->cq_map_len;
+		ring->cq_map_len = ring->sq_map_len;
+	}
+
+	ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED) {
+		ring->sq_map = NULL;
+		goto err;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap(NULL, ring->cq_map_len,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, fd,
+				    IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED) {
+			ring->cq_map = NULL;
+			goto err;
+		}
+	}
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err;
+	}
+
+	ring->sq_head = (unsigned int *)((char *)ring->sq_map + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_map + p.sq_off.tail);
+	ring->sq_mask = *(unsigned int *)((char *)ring->sq_map +
+					  p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_map +
+					  p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+
+	ring->cq_head = (unsigned int *)((char *)ring->cq_map + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_map + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)((char *)ring->cq_map +
+					  p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map +
+					     p.cq_off.cqes);
+
+	return 0;
+
+err:
+	ret = -errno;
+	btintel_test_client_ring_free(ring);
+	return ret;
+}
+
+int btintel_test_client_register_buffers(struct btintel_test_client *c,
+					 const struct iovec *iov,
+					 unsigned int nr)
+{
+	if (c->ring.fd < 0)
+		return -EINVAL;
+
+	if (syscall(__NR_io_uring_register, c->ring.fd,
+		    IORING_REGISTER_BUFFERS, iov, nr) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int btintel_test_client_queue(struct btintel_test_client *c,
+			      const struct btintel_test_client_op *op)
+{
+	struct btintel_test_client_ring *ring = &c->ring;
+	struct io_uring_sqe *sqe;
+	unsigned int idx, head;
+
+	if (ring->fd < 0 || op->opcode > BTINTEL_TEST_CLIENT_OP_WRITE)
+		return -EINVAL;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head >= ring->sq_entries)
+		return -EBUSY;
+
+	idx = ring->sq_local_tail & ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+
+	if (op->buf_index >= 0) {
+		sqe->opcode = op->opcode == BTINTEL_TEST_CLIENT_OP_READ ?
+			      IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+		sqe->buf_index = op->buf_index;
+	} else {
+		sqe->opcode = op->opcode == BTINTEL_TEST_CLIENT_OP_READ ?
+			      IORING_OP_READ : IORING_OP_WRITE;
+	}
+	sqe->fd = c->fd;
+	sqe->addr = (uintptr_t)op->buf;
+	sqe->len = op->len;
+	sqe->off = op->offset;
+	sqe->user_data = op->user_data;
+
+	ring->sq_array[idx] = idx;
+	ring->sq_local_tail++;
+	return 0;
+}
+
+int btintel_test_client_submit(struct btintel_test_client *c,
+			       unsigned int wait_nr)
+{
+	struct btintel_test_client_ring *ring = &c->ring;
+	unsigned int to_submit;
+	int ret;
+
+	if (ring->fd < 0)
+		return -EINVAL;
+
+	to_submit = ring->sq_local_tail - *ring->sq_tail;
+	if (!to_submit && !wait_nr)
+		return 0;
+
+	/* Publish the entries before the kernel can see the new tail */
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+		      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	return ret < 0 ? -errno : ret;
+}
+
+int btintel_test_client_reap(struct btintel_test_client *c,
+			     struct btintel_test_client_cqe *cqes,
+			     unsigned int max, unsigned int min)
+{
+	struct btintel_test_client_ring *ring = &c->ring;
+	unsigned int head, tail, n = 0;
+
+	if (ring->fd < 0)
+		return -EINVAL;
+
+	for (;;) {
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		while (head != tail && n < max) {
+			const struct io_uring_cqe *cqe =
+				&ring->cqes[head & ring->cq_mask];
+
+			cqes[n].user_data = cqe->user_data;
+			cqes[n].res = cqe->res;
+			n++;
+			head++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		if (n >= min || n >= max)
+			return n;
+
+		if (syscall(__NR_io_uring_enter, ring->fd, 0, min - n,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+		    errno != EINTR)
+			return n ? (int)n : -errno;
+	}
+}
@@ -0,0 +1,203 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * Intel Bluetooth Test Generic Driver - Client Library
+ *
+ * Copyright (C) 2026  Your Company/Name
+ *
+ * Small C API around the driver's device nodes: discovery, buffer I/O,
+ * statistics and the ioctl set, plus an asynchronous submission/completion
+ * interface built on io_uring with batching and registered buffers.
+ *
+ * Build: make lib (produces libbtintel_test_client.so)
+ */
+
+#ifndef __BTINTEL_TEST_CLIENT_H
+#define __BTINTEL_TEST_CLIENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "btintel_test_userspace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ============================================================================
+ * CONSTANTS
+ * ============================================================================ */
+
+#define BTINTEL_TEST_CLIENT_DEV_PREFIX	"/dev/btintel_test_generic_driver"
+#define BTINTEL_TEST_CLIENT_PATH_MAX	64
+#define BTINTEL_TEST_CLIENT_MAX_ENTRIES	4096	/* io_uring queue depth */
+
+/* Asynchronous operations */
+#define BTINTEL_TEST_CLIENT_OP_READ	0
+#define BTINTEL_TEST_CLIENT_OP_WRITE	1
+
+/* ============================================================================
+ * DATA STRUCTURES
+ * ============================================================================ */
+
+/* Opaque handle of one open device node */
+struct btintel_test_client;
+
+/**
+ * struct btintel_test_client_op - One asynchronous buffer transfer
+ * @opcode: BTINTEL_TEST_CLIENT_OP_READ or BTINTEL_TEST_CLIENT_OP_WRITE
+ * @buf_index: Registered buffer @buf lies in, or -1 for plain memory
+ * @len: Bytes to transfer
+ * @buf: Data, inside registered buffer @buf_index when it is not -1
+ * @offset: Offset in the device buffer
+ * @user_data: Returned unchanged with the completion
+ */
+struct btintel_test_client_op {
+	uint32_t opcode;
+	int32_t buf_index;
+	uint32_t len;
+	void *buf;
+	uint64_t offset;
+	uint64_t user_data;
+};
+
+/**
+ * struct btintel_test_client_cqe - Completion of an asynchronous transfer
+ * @user_data: From the submitted struct btintel_test_client_op
+ * @res: Bytes transferred, or a negative errno
+ */
+struct btintel_test_client_cqe {
+	uint64_t user_data;
+	int32_t res;
+};
+
+/* ============================================================================
+ * DEVICE DISCOVERY & LIFETIME
+ * ============================================================================ */
+
+/**
+ * btintel_test_client_discover - List the driver's device nodes
+ * @paths: Filled with up to @max node paths, sorted
+ * @max: Entries in @paths
+ *
+ * Return: Number of nodes found (may exceed @max), or a negative errno
+ */
+int btintel_test_client_discover(char paths[][BTINTEL_TEST_CLIENT_PATH_MAX],
+				 int max);
+
+/**
+ * btintel_test_client_open - Open a device node
+ * @path: Node path, or NULL for the first one discovered
+ *
+ * Return: Handle, or NULL with errno set
+ */
+struct btintel_test_client *btintel_test_client_open(const char *path);
+
+/**
+ * btintel_test_client_close - Tear down the ring, if any, and close the node
+ * @c: Handle
+ */
+void btintel_test_client_close(struct btintel_test_client *c);
+
+/**
+ * btintel_test_client_fd - File descriptor of the node, for raw access
+ * @c: Handle
+ */
+int btintel_test_client_fd(const struct btintel_test_client *c);
+
+/* ============================================================================
+ * SYNCHRONOUS OPERATIONS
+ *
+ * All return 0 (or a byte count) on success and a negative errno on failure.
+ * ============================================================================ */
+
+ssize_t btintel_test_client_read(struct btintel_test_client *c, void *buf,
+				 size_t len, uint64_t offset);
+ssize_t btintel_test_client_write(struct btintel_test_client *c,
+				  const void *buf, size_t len, uint64_t offset);
+
+/**
+ * btintel_test_client_ioctl - Issue any BTINTEL_TEST_IOC_* command
+ * @c: Handle
+ * @cmd: Command
+ * @arg: Argument structure, or NULL for commands without one
+ */
+int btintel_test_client_ioctl(struct btintel_test_client *c,
+			      unsigned long cmd, void *arg);
+
+int btintel_test_client_get_info(struct btintel_test_client *c,
+				 struct btintel_test_dev_info *info);
+int btintel_test_client_get_stats(struct btintel_test_client *c,
+				  struct btintel_test_stats *stats);
+int btintel_test_client_reset_stats(struct btintel_test_client *c);
+int btintel_test_client_clear_buffer(struct btintel_test_client *c);
+int btintel_test_client_set_buffer_size(struct btintel_test_client *c,
+					size_t size, uint32_t flags);
+
+/* ============================================================================
+ * ASYNCHRONOUS OPERATIONS (io_uring)
+ *
+ * Transfers are queued locally and handed to the kernel in one system call
+ * by btintel_test_client_submit(), so a batch of any size costs a single
+ * io_uring_enter(). Registered buffers skip the per-transfer page pinning.
+ * The handle is not thread-safe; use one handle per thread.
+ * ============================================================================ */
+
+/**
+ * btintel_test_client_ring_init - Set up the io_uring of a handle
+ * @c: Handle
+ * @entries: Queue depth, up to BTINTEL_TEST_CLIENT_MAX_ENTRIES
+ */
+int btintel_test_client_ring_init(struct btintel_test_client *c,
+				  unsigned int entries);
+
+/**
+ * btintel_test_client_register_buffers - Register buffers for fixed transfers
+ * @c: Handle with a ring
+ * @iov: Buffers, referred to by index in struct btintel_test_client_op
+ * @nr: Entries in @iov
+ */
+int btintel_test_client_register_buffers(struct btintel_test_client *c,
+					 const struct iovec *iov,
+					 unsigned int nr);
+
+/**
+ * btintel_test_client_queue - Queue one transfer without submitting it
+ * @c: Handle with a ring
+ * @op: Transfer
+ *
+ * Return: 0, or -EBUSY when the submission queue is full
+ */
+int btintel_test_client_queue(struct btintel_test_client *c,
+			      const struct btintel_test_client_op *op);
+
+/**
+ * btintel_test_client_submit - Submit every queued transfer
+ * @c: Handle with a ring
+ * @wait_nr: Completions to wait for in the same system call
+ *
+ * Return: Number of transfers submitted, or a negative errno
+ */
+int btintel_test_client_submit(struct btintel_test_client *c,
+			       unsigned int wait_nr);
+
+/**
+ * btintel_test_client_reap - Collect completions
+ * @c: Handle with a ring
+ * @cqes: Filled with up to @max completions
+ * @max: Entries in @cqes
+ * @min: Completions to wait for before returning
+ *
+ * Return: Number of completions returned, or a negative errno
+ */
+int btintel_test_client_reap(struct btintel_test_client *c,
+			     struct btintel_test_client_cqe *cqes,
+			     unsigned int max, unsigned int min);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BTINTEL_TEST_CLIENT_H */
@@ -28,16 +28,51 @@
 #include <linux/device.h>
 #include <linux/miscdevice.h>
 #include <linux/fs.h>
+#include <linux/file.h>
 #include <linux/ioctl.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
 #include <linux/uaccess.h>
 #include <linux/pci.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/vmalloc.h>
+#include <linux/kref.h>
+#include <linux/wait.h>
+#include <linux/random.h>
+#include <linux/sched/signal.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/completion.h>
+#include <linux/delay.h>
+#include <linux/firmware.h>
+#include <linux/pm_runtime.h>
+#include <linux/interrupt.h>
+#include <linux/irq_work.h>
+#include <linux/anon_inodes.h>
+#include <linux/lz4.h>
+#include <linux/nospec.h>
+#include <linux/jump_label.h>
+#include <linux/moduleparam.h>
+#include <linux/perf_event.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/net.h>
+#include <linux/dma-mapping.h>
+#include <linux/log2.h>
+#include <net/sock.h>
 
 #include <net/bluetooth/bluetooth.h>
 #include <net/bluetooth/hci.h>
 #include <net/bluetooth/hci_sync.h>
+#include <net/bluetooth/hci_sock.h>
+
+#if defined(BTINTEL_TEST_KUNIT) && IS_ENABLED(CONFIG_KUNIT)
+#include <linux/mman.h>
+#include <kunit/test.h>
+#endif
 
 #include "btintel_test_generic_driver.h"
 
@@ -76,41 +111,661 @@ static const u16 intel_bt_device_ids[] = {
 	0      /* Terminator */
 };
 
-/* Debug logging macro */
-#ifdef DEBUG
+/* How long a benchmark waits for in-flight packets after its last send */
+#define BTINTEL_TEST_DRAIN_MS		1000
+
+/* Intel Read Version, as btintel uses it to tell bootloader from firmware */
+#define BTINTEL_TEST_OP_READ_VERSION	0xfc05
+#define BTINTEL_TEST_VER_TLV		0xff	/* Parameter: TLV reply */
+#define BTINTEL_TEST_VER_LEGACY_LEN	10	/* Status + struct intel_version */
+#define BTINTEL_TEST_VER_LEGACY_PLATFORM 0x37
+#define BTINTEL_TEST_VER_LEGACY_BOOTLOADER 0x06	/* fw_variant */
+#define BTINTEL_TEST_VER_TLV_IMAGE_TYPE	0x1c
+#define BTINTEL_TEST_VER_IMAGE_BOOTLOADER 0x01
+
+/* btintel_test_hci_cmd() flag beside the uAPI ones: skip the response cache */
+#define BTINTEL_TEST_HCI_NOCACHE	BIT(31)
+
+/* Upper bound of the emul_instances module parameter */
+#define BTINTEL_TEST_MAX_INSTANCES	64
+
+/*
+ * Debug logging macro. Compiled in with DEBUG (CONFIG_PCIE_TEST_DRIVER_DEBUG),
+ * or left to dynamic debug, which keeps each call site a patched-out branch
+ * until enabled through <debugfs>/dynamic_debug/control.
+ */
+#if defined(DEBUG) || defined(CONFIG_DYNAMIC_DEBUG)
 #define pr_debug_dev(fmt, ...) \
 	pr_debug("%s: " fmt, __func__, ##__VA_ARGS__)
 #else
 #define pr_debug_dev(fmt, ...) ((void)0)
 #endif
 
+/* ============================================================================
+ * MODULE PARAMETERS
+ * ============================================================================ */
+
+static bool emulate;
+module_param(emulate, bool, 0444);
+MODULE_PARM_DESC(emulate,
+		 "Load without an Intel Bluetooth controller and run the benchmarks against emulated backends");
+
+static unsigned int emul_instances;
+module_param(emul_instances, uint, 0444);
+MODULE_PARM_DESC(emul_instances,
+		 "Additional emulated devices, registered as /dev/" DRIVER_NAME "1 to N");
+
+static unsigned int fw_cache_kb = 8192;
+module_param(fw_cache_kb, uint, 0644);
+MODULE_PARM_DESC(fw_cache_kb,
+		 "Memory the firmware image cache may hold, in KiB");
+
 /* ============================================================================
  * DATA STRUCTURES
  * ============================================================================ */
 
+/**
+ * struct btintel_test_emul_hci - Virtual HCI controller stand-in
+ * @lock: Protects @pending, @last_due and @link_free
+ * @pending: Frames waiting for their simulated completion, oldest first
+ * @timer: Fires when the head of @pending is due
+ * @latency_ns: Fixed completion latency added to every frame
+ * @jitter_ns: Upper bound of the random latency added on top
+ * @credits: Frames the controller buffers, reported back as ncmd
+ * @bytes_per_sec: Bandwidth of the link to the controller, 0 for unlimited
+ * @last_due: Completion time of the newest pending frame
+ * @link_free: Time the link finishes carrying the newest pending frame
+ *
+ * Frames complete in submission order, like on a real controller, after
+ * crossing the link and the configured latency. A frame submitted with a
+ * completion callback is handed to it; otherwise completing a frame frees
+ * it, so owners observe the completion through the skb destructor.
+ */
+struct btintel_test_emul_hci {
+	spinlock_t lock;
+	struct sk_buff_head pending;
+	struct hrtimer timer;
+	u64 latency_ns;
+	u32 jitter_ns;
+	u32 credits;
+	u64 bytes_per_sec;
+	ktime_t last_due;
+	ktime_t link_free;
+};
+
+/**
+ * struct btintel_test_emul_cb - Per-frame state while on the virtual HCI
+ * @complete: Called with the frame and the credits left, or NULL to free it
+ * @arg: Owner data for @complete
+ *
+ * Lives in skb->cb, which the virtual HCI owns while the frame is pending.
+ */
+struct btintel_test_emul_cb {
+	void (*complete)(struct sk_buff *skb, u8 ncmd);
+	void *arg;
+};
+
+#define BTINTEL_TEST_EMUL_CB(skb) ((struct btintel_test_emul_cb *)(skb)->cb)
+
+/**
+ * struct btintel_test_emul_cfg - Virtual HCI settings of one engine run
+ * @latency_ns: See struct btintel_test_emul_hci
+ * @jitter_ns: See struct btintel_test_emul_hci
+ * @credits: See struct btintel_test_emul_hci, 0 for 1
+ * @bytes_per_sec: See struct btintel_test_emul_hci
+ */
+struct btintel_test_emul_cfg {
+	u64 latency_ns;
+	u32 jitter_ns;
+	u32 credits;
+	u64 bytes_per_sec;
+};
+
+/**
+ * struct btintel_test_emul_cmd - Command in flight on the virtual HCI
+ * @done: Completed once the virtual HCI answered
+ * @rsp: Command Complete return parameters, NULL on allocation failure
+ */
+struct btintel_test_emul_cmd {
+	struct completion done;
+	struct sk_buff *rsp;
+};
+
+/**
+ * struct btintel_test_pipe_evt - Command completion seen by the pipeline
+ * @time_ns: Time the completion reached the engine
+ * @opcode: Opcode the completion is for
+ * @status: HCI status
+ * @ncmd: Command credits the controller reported
+ */
+struct btintel_test_pipe_evt {
+	u64 time_ns;
+	u16 opcode;
+	u8 status;
+	u8 ncmd;
+};
+
+/**
+ * struct btintel_test_pipe_cmd - Command the pipeline has in flight
+ * @send_ns: Time the command was submitted
+ * @opcode: Opcode its completion will carry
+ */
+struct btintel_test_pipe_cmd {
+	u64 send_ns;
+	u16 opcode;
+};
+
+/**
+ * struct btintel_test_pipe - State of one pipelined command run
+ * @lock: Protects @evts, @head and @tail
+ * @wait: Woken when the virtual HCI queues a completion
+ * @evts: Completions from the virtual HCI not processed yet
+ * @head: Producer index into @evts
+ * @tail: Consumer index into @evts
+ * @sock: Raw HCI socket receiving events of a real controller
+ * @inflight: Commands in flight, oldest first
+ * @outstanding: Entries in @inflight
+ * @last_ns: Time @area was last updated
+ * @area: Integral of @outstanding over time, in ns
+ * @poll_ns: Busy-poll budget of each wait for a completion, 0 to sleep
+ * @polled: Waits that found their completion while busy-polling
+ * @poll_fallbacks: Waits that ran out of budget and slept
+ */
+struct btintel_test_pipe {
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	struct btintel_test_pipe_evt evts[BTINTEL_TEST_PIPE_MAX_DEPTH];
+	u32 head;
+	u32 tail;
+	struct socket *sock;
+	struct btintel_test_pipe_cmd inflight[BTINTEL_TEST_PIPE_MAX_DEPTH];
+	u32 outstanding;
+	u64 last_ns;
+	u64 area;
+	u32 poll_ns;
+	u32 polled;
+	u32 poll_fallbacks;
+};
+
+struct btintel_test_exec;
+
+/**
+ * struct btintel_test_exec_job - Job queued on or finished by the executor
+ * @node: Entry in a worker queue or in the done list
+ * @job: Job as submitted by userspace
+ * @res: Result, valid once on the done list
+ * @owner: Index of the worker the job was queued on
+ * @submit_ns: Submission time
+ */
+struct btintel_test_exec_job {
+	struct list_head node;
+	struct btintel_test_job job;
+	struct btintel_test_job_result res;
+	unsigned int owner;
+	u64 submit_ns;
+};
+
+/**
+ * struct btintel_test_exec_worker - Executor worker thread bound to a CPU
+ * @exec: Executor the worker belongs to
+ * @task: Worker thread
+ * @lock: Protects @queue
+ * @queue: Jobs queued on this worker, oldest first
+ * @index: Position in @exec->workers
+ * @cpu: CPU the thread is bound to
+ */
+struct btintel_test_exec_worker {
+	struct btintel_test_exec *exec;
+	struct task_struct *task;
+	spinlock_t lock;
+	struct list_head queue;
+	unsigned int index;
+	unsigned int cpu;
+};
+
+/**
+ * struct btintel_test_exec - Parallel test executor
+ * @dev: Device the jobs run against
+ * @lock: Serializes configuration and submission
+ * @workers: Worker threads, NULL until first configured or used
+ * @nr_workers: Number of entries in @workers
+ * @next_worker: Round-robin cursor for submissions
+ * @queued: Jobs sitting in a worker queue
+ * @pending: Jobs queued, running or awaiting collection
+ * @work_wq: Idle workers wait here for @queued
+ * @done_lock: Protects @done
+ * @done: Finished jobs, in completion order
+ * @done_wq: Collectors wait here for @done
+ */
+struct btintel_test_exec {
+	struct btintel_test_device *dev;
+	struct mutex lock;
+	struct btintel_test_exec_worker *workers;
+	unsigned int nr_workers;
+	unsigned int next_worker;
+	atomic_t queued;
+	atomic_t pending;
+	wait_queue_head_t work_wq;
+	spinlock_t done_lock;
+	struct list_head done;
+	wait_queue_head_t done_wq;
+};
+
+/**
+ * struct btintel_test_lat_acc - Accumulator for struct btintel_test_latency
+ * @sum_ns: Running sum of the samples, for the mean
+ * @lat: Summary being built
+ */
+struct btintel_test_lat_acc {
+	u64 sum_ns;
+	struct btintel_test_latency lat;
+};
+
+/**
+ * struct btintel_test_irq_vec - Instrumentation state of one vector
+ * @lock: Protects the counters against the handler
+ * @kind: BTINTEL_TEST_IRQ_VEC_*
+ * @irq: Linux interrupt number of an MSI-X vector
+ * @index: MSI-X table index
+ * @count: Interrupts seen
+ * @read_count: @count at the previous snapshot, for the rate
+ * @last_ns: Time of the previous interrupt
+ * @inject_ns: Time of the injection not yet handled, 0 if none
+ * @injected: Completed by the handler when it consumes an injection
+ * @work: Raises the software vector
+ * @latency: Injection to handler latency
+ * @interval: Interrupt inter-arrival time
+ */
+struct btintel_test_irq_vec {
+	spinlock_t lock;
+	u32 kind;
+	int irq;
+	u32 index;
+	u64 count;
+	u64 read_count;
+	u64 last_ns;
+	u64 inject_ns;
+	struct completion injected;
+	struct irq_work work;
+	struct btintel_test_lat_acc latency;
+	struct btintel_test_lat_acc interval;
+};
+
+/**
+ * struct btintel_test_irq_mon - Interrupt instrumentation
+ * @lock: Serializes monitor control, injection and snapshots
+ * @active: Monitor started
+ * @flags: BTINTEL_TEST_IRQ_* it was started with
+ * @pdev: Function whose MSI-X vectors are instrumented, referenced
+ * @nr_vecs: Valid entries in @vecs, the software vector first
+ * @read_ns: Time of the previous snapshot
+ * @vecs: Instrumented vectors
+ */
+struct btintel_test_irq_mon {
+	struct mutex lock;
+	bool active;
+	u32 flags;
+	struct pci_dev *pdev;
+	unsigned int nr_vecs;
+	u64 read_ns;
+	struct btintel_test_irq_vec vecs[BTINTEL_TEST_IRQ_MAX_VECTORS];
+};
+
+/**
+ * struct btintel_test_hugebuf - Huge page backing of the device buffer
+ * @nr: Number of entries in @chunks
+ * @chunks: PMD-sized compound pages, in buffer order
+ *
+ * The buffer is also vmap()ed so that it has a single address, but that
+ * mapping uses base pages. Nothing reads or writes through it: every
+ * access goes through btintel_test_buf_at(), which returns the linear map
+ * address of the chunk, and the linear map covers it with huge TLB
+ * entries.
+ */
+struct btintel_test_hugebuf {
+	unsigned int nr;
+	struct page *chunks[];
+};
+
+/**
+ * struct btintel_test_ioctl_acct - Cost of one ioctl command on one CPU
+ * @calls: Times the command ran
+ * @errors: Times it returned an error
+ * @total_ns: Time spent in it
+ * @max_ns: Longest single call
+ */
+struct btintel_test_ioctl_acct {
+	u64 calls;
+	u64 errors;
+	u64 total_ns;
+	u64 max_ns;
+};
+
+/**
+ * struct btintel_test_sampler_snap - Cumulative counters at one instant
+ * @ns: CLOCK_MONOTONIC time of the snapshot
+ * @reads: Read operations
+ * @writes: Write operations
+ * @ioctls: Ioctl operations
+ * @errors: Errors
+ * @read_bytes: Bytes read
+ * @write_bytes: Bytes written
+ * @hci_cmds: HCI commands completed
+ * @hci_ns: Time spent in those commands
+ */
+struct btintel_test_sampler_snap {
+	u64 ns;
+	u64 reads;
+	u64 writes;
+	u64 ioctls;
+	u64 errors;
+	u64 read_bytes;
+	u64 write_bytes;
+	u64 hci_cmds;
+	u64 hci_ns;
+};
+
+/**
+ * struct btintel_test_stats_sampler - Time-series stats sampler
+ * @lock: Serializes starting, stopping and resetting the sampler
+ * @ring_lock: Protects @ring, @seq and @prev against the timer
+ * @timer: Period timer, runs in softirq context
+ * @period: Sampling period
+ * @running: @timer armed
+ * @ring: History of BTINTEL_TEST_SAMPLER_RING samples, allocated on first
+ *        start
+ * @seq: Sequence number of the next sample
+ * @prev: Counters at the previous sample, the base of the next one
+ */
+struct btintel_test_stats_sampler {
+	struct mutex lock;
+	spinlock_t ring_lock;
+	struct hrtimer timer;
+	ktime_t period;
+	bool running;
+	struct btintel_test_sample *ring;
+	u64 seq;
+	struct btintel_test_sampler_snap prev;
+};
+
+/**
+ * struct btintel_test_rsp_entry - One cached HCI command response
+ * @list: Entry in btintel_test_rsp_store.lru
+ * @hdev: Controller the response came from, NULL for the virtual HCI.
+ *        Only compared, never dereferenced
+ * @opcode: HCI opcode
+ * @plen: Parameter length
+ * @rlen: Response length
+ * @param: Parameters, the response is only valid for these
+ * @rsp: Command Complete return parameters, status first
+ */
+struct btintel_test_rsp_entry {
+	struct list_head list;
+	const struct hci_dev *hdev;
+	u16 opcode;
+	u8 plen;
+	u8 rlen;
+	u8 param[BTINTEL_TEST_RSP_CACHE_MAX_PARAM];
+	u8 rsp[];
+};
+
+/**
+ * struct btintel_test_rsp_store - HCI command response cache of one device
+ * @lock: Protects every other member
+ * @opcodes: Opcodes whose responses are cached, none by default
+ * @nr_opcodes: Entries in @opcodes
+ * @lru: Cached responses, most recently used first
+ * @entries: Responses on @lru
+ * @gen: Bumped on every invalidation, so that a response requested
+ *       before one is not cached after it
+ * @hci_gen: Controller lifecycle generation @lru was filled in, see
+ *           struct btintel_test_hci_watch
+ * @hits: Commands answered from @lru
+ * @misses: Commands of a cached opcode sent to the controller
+ * @invalidations: Times @lru was emptied
+ * @evictions: Responses dropped to stay within
+ *             BTINTEL_TEST_RSP_CACHE_MAX_ENTRIES
+ * @hit_lat: Time to answer a hit
+ * @miss_lat: Round trip of a miss
+ */
+struct btintel_test_rsp_store {
+	struct mutex lock;
+	u16 opcodes[BTINTEL_TEST_RSP_CACHE_MAX_OPCODES];
+	u32 nr_opcodes;
+	struct list_head lru;
+	u32 entries;
+	u64 gen;
+	s64 hci_gen;
+	u64 hits;
+	u64 misses;
+	u64 invalidations;
+	u64 evictions;
+	struct btintel_test_lat_acc hit_lat;
+	struct btintel_test_lat_acc miss_lat;
+};
+
 /**
  * struct btintel_test_device - Main device structure
  * @misc: Miscdevice structure
- * @pdev: PCIe device pointer
+ * @pdev: PCIe device pointer, NULL when loaded with emulate=1 and no device
  * @refcount: Open file descriptor reference count
  * @active: Device state (active/inactive)
- * @buffer: Internal device buffer (example)
+ * @buffer: Internal device buffer (example), on btintel_test_alloc_node()
  * @buffer_size: Size of internal buffer
+ * @huge: Huge page backing of @buffer, NULL for other backings
+ * @buffer_huge: Huge pages requested through BTINTEL_TEST_BUF_HUGE
+ * @buffer_backing: BTINTEL_TEST_BUF_BACKING_* of @buffer
  * @stats: Device statistics
+ * @lock: Serializes the long-running test engines
+ * @emul: Virtual HCI used by BTINTEL_TEST_BACKEND_EMUL
+ * @exec: Parallel test executor
+ * @emul_mem: Emulated controller memory for BTINTEL_TEST_DUMP_SRC_EMUL,
+ *            allocated on first use
+ * @emul_mem_users: Dumps reading @emul_mem outside @lock
+ * @irq_mon: Interrupt instrumentation
+ * @numa_node: Node set by BTINTEL_TEST_IOC_SET_NUMA_NODE, NUMA_NO_NODE to
+ *             follow @pdev
+ * @ioctl_acct: Per-CPU arrays of BTINTEL_TEST_IOC_MAX_NR command costs,
+ *              indexed by ioctl number
+ * @hci: Cumulative HCI command count and latency; @hci.max_ns is the worst
+ *       latency since the sampler last looked
+ * @sampler: Time-series stats sampler
+ * @debugfs: Directory of the metrics exporter
+ * @name: Device node name
+ * @rsp_cache: HCI command response cache
  */
 struct btintel_test_device {
 	struct miscdevice misc;
+	char name[32];
 	struct pci_dev *pdev;
 	int refcount;
 	bool active;
 	void *buffer;
 	size_t buffer_size;
+	struct btintel_test_hugebuf *huge;
+	bool buffer_huge;
+	u32 buffer_backing;
 	struct {
 		unsigned long read_count;
 		unsigned long write_count;
 		unsigned long ioctl_count;
 		unsigned long errors;
+		u64 read_bytes;
+		u64 write_bytes;
+		int last_error;
 	} stats;
+	struct mutex lock;
+	struct btintel_test_emul_hci emul;
+	struct btintel_test_exec exec;
+	u32 *emul_mem;
+	unsigned int emul_mem_users;
+	struct btintel_test_irq_mon irq_mon;
+	int numa_node;
+	struct btintel_test_ioctl_acct __percpu *ioctl_acct;
+	struct {
+		atomic64_t cmds;
+		atomic64_t total_ns;
+		atomic64_t max_ns;
+	} hci;
+	struct btintel_test_stats_sampler sampler;
+	struct dentry *debugfs;
+	struct btintel_test_rsp_store rsp_cache;
+};
+
+/**
+ * struct btintel_test_perf - Performance counters of one BTINTEL_TEST_IOC_PERF_RUN
+ * @ev: Counters, NULL where the machine cannot provide one
+ */
+struct btintel_test_perf {
+	struct perf_event *ev[BTINTEL_TEST_PERF_COUNTERS];
+};
+
+/**
+ * struct btintel_test_ioctl_desc - Ioctl dispatch table entry
+ * @cmd: Full command, so that direction and size must match too
+ * @name: Name reported by BTINTEL_TEST_IOC_IOCTL_STATS
+ * @handler: Handler, called with the user argument
+ */
+struct btintel_test_ioctl_desc {
+	unsigned int cmd;
+	const char *name;
+	int (*handler)(struct btintel_test_device *dev, void __user *argp);
+};
+
+struct btintel_test_iso_run;
+
+/**
+ * struct btintel_test_iso_slot - Kernel-side state of one injected packet
+ * @run: Run the packet belongs to
+ * @rec: Timeline reported to userspace
+ */
+struct btintel_test_iso_slot {
+	struct btintel_test_iso_run *run;
+	struct btintel_test_iso_record rec;
+};
+
+/**
+ * struct btintel_test_iso_run - One periodic injection run
+ * @kref: Held by the engine and by every packet still in flight
+ * @outstanding: Packets whose destructor has not run yet
+ * @wait: Woken when @outstanding drops to zero
+ * @slots: Per-packet state, one per requested packet
+ */
+struct btintel_test_iso_run {
+	struct kref kref;
+	atomic_t outstanding;
+	wait_queue_head_t wait;
+	struct btintel_test_iso_slot slots[];
+};
+
+/**
+ * struct btintel_test_dump - Captured memory dump behind a dump file
+ * @pages: Backing pages, individually allocated
+ * @nr_pages: Number of entries in @pages
+ * @size: Bytes of stream written so far
+ */
+struct btintel_test_dump {
+	struct page **pages;
+	unsigned int nr_pages;
+	size_t size;
+};
+
+/**
+ * struct btintel_test_reset_run - State of one reset cycle stress run
+ * @req: Parameters and results
+ * @hci_id: hciN index the HW controller had before the first reset
+ * @t0: Time the current cycle's reset was issued
+ * @due: Absolute time each emulated stage is reached in this cycle
+ * @acc: Per-stage accumulators
+ * @total: Reset to READY accumulator
+ */
+struct btintel_test_reset_run {
+	struct btintel_test_reset_cycle *req;
+	u16 hci_id;
+	u64 t0;
+	u64 due[BTINTEL_TEST_RESET_STAGES];
+	struct btintel_test_lat_acc acc[BTINTEL_TEST_RESET_STAGES];
+	struct btintel_test_lat_acc total;
+};
+
+#define BTINTEL_TEST_RESET_BOOT_STAGES \
+	(BIT(BTINTEL_TEST_RESET_STAGE_ROM) | BIT(BTINTEL_TEST_RESET_STAGE_IML) | \
+	 BIT(BTINTEL_TEST_RESET_STAGE_OPFW) | BIT(BTINTEL_TEST_RESET_STAGE_ALIVE))
+
+/**
+ * struct btintel_test_fw_rec - One secure send record of a parsed image
+ * @type: Secure send fragment type (0x00 header, 0x01 data, 0x02
+ *        signature, 0x03 public key)
+ * @offset: Start of the record in the image
+ * @len: Record length, sent in BTINTEL_TEST_FW_FRAG_MAX byte commands
+ */
+struct btintel_test_fw_rec {
+	u8 type;
+	u32 offset;
+	u32 len;
+};
+
+/**
+ * struct btintel_test_fw_image - Cached, pre-parsed firmware image
+ * @kref: Held by the cache while listed and by every user
+ * @list: Entry in the cache LRU list, empty when not cached
+ * @name: Firmware file name
+ * @fw: Image as loaded by request_firmware()
+ * @format: BTINTEL_TEST_FW_FMT_*
+ * @nr_recs: Number of entries in @recs
+ * @fragments: Secure send commands across all of @recs
+ * @recs: Records to download, in order
+ */
+struct btintel_test_fw_image {
+	struct kref kref;
+	struct list_head list;
+	char name[BTINTEL_TEST_FW_NAME_MAX];
+	const struct firmware *fw;
+	u32 format;
+	u32 nr_recs;
+	u32 fragments;
+	struct btintel_test_fw_rec *recs;
+};
+
+/**
+ * struct btintel_test_fw_cache - Firmware images shared by all controllers
+ * @lock: Protects every other member
+ * @lru: Cached images, most recently used first
+ * @bytes: Memory held by the cached images
+ * @hits: Loads served from @lru
+ * @misses: Loads that went to the filesystem
+ * @evictions: Images dropped to stay within fw_cache_kb
+ * @hit_lat: Load time of hits
+ * @miss_lat: Load time of misses
+ */
+struct btintel_test_fw_cache {
+	struct mutex lock;
+	struct list_head lru;
+	size_t bytes;
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+	struct btintel_test_lat_acc hit_lat;
+	struct btintel_test_lat_acc miss_lat;
+};
+
+/**
+ * struct btintel_test_hci_watch - Listener for controller lifecycle events
+ * @sock: Raw HCI socket bound to no controller, which the HCI core sends
+ *        its stack internal device events to
+ * @work: Drains @sock
+ * @gen: Bumped whenever a controller is registered, unregistered, brought
+ *       up or brought down
+ *
+ * The HCI core offers no notifier for these, so this socket stands in for
+ * one. @gen moves before the core carries on with the change, so a
+ * response cached for an hci_dev never outlives it, even if a new
+ * controller later gets the same memory or index.
+ */
+struct btintel_test_hci_watch {
+	struct socket *sock;
+	struct work_struct work;
+	atomic64_t gen;
 };
 
 /* ============================================================================
@@ -118,6 +773,10 @@ struct btintel_test_device {
  * ============================================================================ */
 
 static struct btintel_test_device *btintel_test_dev;
+static struct btintel_test_device *btintel_test_instances[BTINTEL_TEST_MAX_INSTANCES];
+static unsigned int btintel_test_nr_instances;
+static struct btintel_test_fw_cache btintel_test_fw_cache;
+static struct btintel_test_hci_watch btintel_test_hci_watch;
 
 /* ============================================================================
  * FUNCTION PROTOTYPES
@@ -125,12 +784,211 @@ static struct btintel_test_device *btintel_test_dev;
 
 static int btintel_test_open(struct inode *inode, struct file *filp);
 static int btintel_test_release(struct inode *inode, struct file *filp);
-static ssize_t btintel_test_read(struct file *filp, char __user *buf,
-				  size_t count, loff_t *f_pos);
-static ssize_t btintel_test_write(struct file *filp, const char __user *buf,
-				   size_t count, loff_t *f_pos);
+static ssize_t btintel_test_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t btintel_test_write_iter(struct kiocb *iocb,
+				       struct iov_iter *from);
 static long btintel_test_ioctl(struct file *filp, unsigned int cmd,
 			       unsigned long arg);
+static int btintel_test_ioctl_iso_jitter(struct btintel_test_device *dev,
+					 void __user *argp);
+static int btintel_test_ioctl_exec_config(struct btintel_test_device *dev,
+					  void __user *argp);
+static int btintel_test_ioctl_exec_submit(struct btintel_test_device *dev,
+					  void __user *argp);
+static int btintel_test_ioctl_exec_collect(struct btintel_test_device *dev,
+					   void __user *argp);
+static int btintel_test_ioctl_hci_pipeline(struct btintel_test_device *dev,
+					   void __user *argp);
+static int btintel_test_ioctl_mem_dump(struct btintel_test_device *dev,
+				       void __user *argp);
+static int btintel_test_ioctl_reset_cycle(struct btintel_test_device *dev,
+					  void __user *argp);
+static int btintel_test_ioctl_reset_cycle_v2(struct btintel_test_device *dev,
+					     void __user *argp);
+static int btintel_test_ioctl_fw_load(struct btintel_test_device *dev,
+				      void __user *argp);
+static int btintel_test_ioctl_fw_cache_stats(struct btintel_test_device *dev,
+					     void __user *argp);
+static void btintel_test_fw_cache_flush(void);
+static int btintel_test_ioctl_pm_cycle(struct btintel_test_device *dev,
+				       void __user *argp);
+static int btintel_test_ioctl_irq_monitor(struct btintel_test_device *dev,
+					  void __user *argp);
+static int btintel_test_ioctl_irq_inject(struct btintel_test_device *dev,
+					 void __user *argp);
+static int btintel_test_ioctl_irq_stats(struct btintel_test_device *dev,
+					void __user *argp);
+static void btintel_test_irq_stop(struct btintel_test_irq_mon *mon);
+static int btintel_test_irq_start(struct btintel_test_device *dev, u32 flags);
+static int btintel_test_ioctl_hci_poll(struct btintel_test_device *dev,
+				       void __user *argp);
+static int btintel_test_alloc_node(struct btintel_test_device *dev);
+static int btintel_test_mem_node(const void *addr);
+static int btintel_test_ioctl_set_numa_node(struct btintel_test_device *dev,
+					    void __user *argp);
+static int btintel_test_ioctl_numa_bench(struct btintel_test_device *dev,
+					 void __user *argp);
+static void *btintel_test_buffer_alloc(size_t size, bool huge, int node,
+				       struct btintel_test_hugebuf **hbp,
+				       u32 *backing);
+static void btintel_test_buffer_free(void *buf, struct btintel_test_hugebuf *hb);
+static void *btintel_test_buf_at(void *buf, struct btintel_test_hugebuf *hb,
+				 size_t off, size_t *len);
+static void *btintel_test_buffer_at(struct btintel_test_device *dev,
+				    size_t off, size_t *len);
+static int btintel_test_ioctl_buf_bench(struct btintel_test_device *dev,
+					void __user *argp);
+static int btintel_test_ioctl_cost_stats(struct btintel_test_device *dev,
+					 void __user *argp);
+static void btintel_test_trace_record(unsigned int point, u64 ns);
+static void btintel_test_trace_set(u32 flags);
+static int btintel_test_ioctl_trace(struct btintel_test_device *dev,
+				    void __user *argp);
+static int btintel_test_ioctl_trace_bench(struct btintel_test_device *dev,
+					  void __user *argp);
+static long btintel_test_ioctl_dispatch(struct btintel_test_device *dev,
+					unsigned int cmd, void __user *argp);
+static int btintel_test_ioctl_perf_run(struct btintel_test_device *dev,
+				       void __user *argp);
+static void btintel_test_sampler_init(struct btintel_test_stats_sampler *sampler);
+static void btintel_test_sampler_stop(struct btintel_test_stats_sampler *sampler);
+static int btintel_test_ioctl_sampler(struct btintel_test_device *dev,
+				      void __user *argp);
+static int btintel_test_ioctl_sampler_read(struct btintel_test_device *dev,
+					   void __user *argp);
+static void btintel_test_metrics_register(struct btintel_test_device *dev);
+static int btintel_test_ioctl_hci_replay(struct btintel_test_device *dev,
+					 void __user *argp);
+static int btintel_test_ioctl_dma_bench(struct btintel_test_device *dev,
+					void __user *argp);
+static struct sk_buff *btintel_test_rsp_cache_get(struct btintel_test_device *dev,
+						  struct hci_dev *hdev,
+						  u16 opcode, u32 plen,
+						  const void *param, u32 flags,
+						  u64 *gen);
+static void btintel_test_rsp_cache_put(struct btintel_test_device *dev,
+				       struct hci_dev *hdev, u16 opcode,
+				       u32 plen, const void *param,
+				       const struct sk_buff *skb, u64 ns,
+				       u64 gen);
+static void btintel_test_rsp_cache_invalidate(struct btintel_test_device *dev);
+static int btintel_test_ioctl_rsp_cache(struct btintel_test_device *dev,
+					void __user *argp);
+static int btintel_test_ioctl_rsp_cache_flush(struct btintel_test_device *dev,
+					      void __user *argp);
+static int btintel_test_ioctl_fw_sweep(struct btintel_test_device *dev,
+				       void __user *argp);
+
+/* ============================================================================
+ * RUNTIME INSTRUMENTATION
+ * ============================================================================ */
+
+/*
+ * Timing points on the read, write, ioctl and HCI command paths. They sit
+ * behind a static branch, so while disabled each point is a single no-op
+ * instruction. They start enabled in DEBUG builds.
+ */
+#ifdef DEBUG
+static DEFINE_STATIC_KEY_TRUE(btintel_test_trace_key);
+#else
+static DEFINE_STATIC_KEY_FALSE(btintel_test_trace_key);
+#endif
+
+/* Serializes toggling, resetting and benchmarking the points */
+static DEFINE_MUTEX(btintel_test_trace_lock);
+
+/**
+ * struct btintel_test_trace_cpu - Samples of every point on one CPU
+ * @points: Accumulators, indexed by BTINTEL_TEST_TRACE_*
+ */
+struct btintel_test_trace_cpu {
+	struct btintel_test_lat_acc points[BTINTEL_TEST_TRACE_POINTS];
+};
+
+static DEFINE_PER_CPU(struct btintel_test_trace_cpu, btintel_test_trace_cpu);
+
+/**
+ * btintel_test_trace_start - Open an instrumented section
+ *
+ * Return: Start time to pass to btintel_test_trace_end(), 0 when disabled
+ */
+static __always_inline u64 btintel_test_trace_start(void)
+{
+	if (static_branch_unlikely(&btintel_test_trace_key))
+		return ktime_get_ns();
+
+	return 0;
+}
+
+/**
+ * btintel_test_trace_end - Close an instrumented section
+ * @point: BTINTEL_TEST_TRACE_* the section belongs to
+ * @start: Value returned by btintel_test_trace_start()
+ *
+ * Sections opened while the points were disabled are not recorded.
+ */
+static __always_inline void btintel_test_trace_end(unsigned int point,
+						   u64 start)
+{
+	if (static_branch_unlikely(&btintel_test_trace_key) && start)
+		btintel_test_trace_record(point, ktime_get_ns() - start);
+}
+
+/**
+ * btintel_test_trace_add - Record a duration the caller measured anyway
+ * @point: BTINTEL_TEST_TRACE_* the duration belongs to
+ * @ns: Duration
+ */
+static __always_inline void btintel_test_trace_add(unsigned int point, u64 ns)
+{
+	if (static_branch_unlikely(&btintel_test_trace_key))
+		btintel_test_trace_record(point, ns);
+}
+
+/**
+ * btintel_test_trace_param_set - Toggle the points through the trace parameter
+ * @val: Boolean string
+ * @kp: Parameter
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_trace_param_set(const char *val,
+					const struct kernel_param *kp)
+{
+	bool on;
+	int ret;
+
+	ret = kstrtobool(val, &on);
+	if (ret)
+		return ret;
+
+	btintel_test_trace_set(on ? BTINTEL_TEST_TRACE_ENABLE :
+				    BTINTEL_TEST_TRACE_DISABLE);
+	return 0;
+}
+
+/**
+ * btintel_test_trace_param_get - Report whether the points are enabled
+ * @buf: Output buffer
+ * @kp: Parameter
+ *
+ * Return: Length written
+ */
+static int btintel_test_trace_param_get(char *buf,
+					const struct kernel_param *kp)
+{
+	return sysfs_emit(buf, "%c\n",
+			  static_key_enabled(&btintel_test_trace_key) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops btintel_test_trace_param_ops = {
+	.set = btintel_test_trace_param_set,
+	.get = btintel_test_trace_param_get,
+};
+
+module_param_cb(trace, &btintel_test_trace_param_ops, NULL, 0644);
+MODULE_PARM_DESC(trace,
+		 "Time the read, write, ioctl and HCI command paths (toggle at runtime)");
 
 /* ============================================================================
  * FILE OPERATIONS
@@ -140,8 +998,8 @@ static const struct file_operations btintel_test_fops = {
 	.owner = THIS_MODULE,
 	.open = btintel_test_open,
 	.release = btintel_test_release,
-	.read = btintel_test_read,
-	.write = btintel_test_write,
+	.read_iter = btintel_test_read_iter,
+	.write_iter = btintel_test_write_iter,
 	.unlocked_ioctl = btintel_test_ioctl,
 };
 
@@ -158,10 +1016,11 @@ static const struct file_operations btintel_test_fops = {
  */
 static int btintel_test_open(struct inode *inode, struct file *filp)
 {
-	struct btintel_test_device *dev = btintel_test_dev;
+	struct btintel_test_device *dev;
 
-	if (!dev)
-		return -ENODEV;
+	/* misc_open() points private_data at the miscdevice that was opened */
+	dev = container_of(filp->private_data, struct btintel_test_device,
+			   misc);
 
 	if (!dev->active) {
 		pr_warn("Device not active\n");
@@ -170,6 +1029,8 @@ static int btintel_test_open(struct inode *inode, struct file *filp)
 
 	dev->refcount++;
 	filp->private_data = dev;
+	/* Transfers never block, so io_uring may issue them inline */
+	filp->f_mode |= FMODE_NOWAIT;
 
 	return 0;
 }
@@ -194,193 +1055,7922 @@ static int btintel_test_release(struct inode *inode, struct file *filp)
 }
 
 /**
- * btintel_test_read - Called when user reads from device
- * @filp: File structure
- * @buf: User-space buffer
- * @count: Number of bytes to read
- * @f_pos: File position
+ * btintel_test_buffer_lock - Take @dev->lock for a buffer access
+ * @dev: Device structure
+ * @iocb: I/O control block of the access
+ *
+ * Keeps the buffer from being swapped by BTINTEL_TEST_IOC_SET_BUFFER_SIZE
+ * or BTINTEL_TEST_IOC_SET_NUMA_NODE under the copy. IOCB_NOWAIT callers
+ * get -EAGAIN instead of waiting for a test engine to finish.
+ *
+ * Return: 0 with @dev->lock held, or negative error code
+ */
+static int btintel_test_buffer_lock(struct btintel_test_device *dev,
+				    struct kiocb *iocb)
+{
+	if (!(iocb->ki_flags & IOCB_NOWAIT))
+		return mutex_lock_interruptible(&dev->lock);
+
+	return mutex_trylock(&dev->lock) ? 0 : -EAGAIN;
+}
+
+/**
+ * btintel_test_read_iter - Called when user reads from device
+ * @iocb: I/O control block, @iocb->ki_pos is the file position
+ * @to: Destination, user memory or pages registered with io_uring
  *
  * Return: Number of bytes read, or negative error code
  */
-static ssize_t btintel_test_read(struct file *filp, char __user *buf,
-				  size_t count, loff_t *f_pos)
+static ssize_t btintel_test_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct btintel_test_device *dev = filp->private_data;
+	struct btintel_test_device *dev = iocb->ki_filp->private_data;
+	u64 start = btintel_test_trace_start();
+	size_t count = iov_iter_count(to);
+	ssize_t ret;
+	size_t done, len;
+	void *src;
 
-	if (!dev || !dev->buffer)
+	if (!dev)
 		return -ENODEV;
 
-	if (*f_pos >= dev->buffer_size)
-		return 0;
+	ret = btintel_test_buffer_lock(dev, iocb);
+	if (ret)
+		return ret;
 
-	count = min(count, dev->buffer_size - (size_t)*f_pos);
+	if (!dev->buffer) {
+		ret = -ENODEV;
+		goto out_unlock;
+	}
 
-	if (copy_to_user(buf, dev->buffer + *f_pos, count)) {
-		dev->stats.errors++;
-		return -EFAULT;
+	if (iocb->ki_pos >= dev->buffer_size)
+		goto out_unlock;
+
+	count = min(count, dev->buffer_size - (size_t)iocb->ki_pos);
+
+	for (done = 0; done < count; done += len) {
+		len = count - done;
+		src = btintel_test_buffer_at(dev, iocb->ki_pos + done, &len);
+		if (copy_to_iter(src, len, to) != len) {
+			dev->stats.errors++;
+			dev->stats.last_error = EFAULT;
+			ret = -EFAULT;
+			goto out_unlock;
+		}
 	}
 
-	*f_pos += count;
+	iocb->ki_pos += count;
+	ret = count;
 	dev->stats.read_count++;
+	dev->stats.read_bytes += count;
+	btintel_test_trace_end(BTINTEL_TEST_TRACE_READ, start);
 
 	pr_debug_dev("Read %zd bytes\n", count);
 
-	return count;
+out_unlock:
+	mutex_unlock(&dev->lock);
+	return ret;
 }
 
 /**
- * btintel_test_write - Called when user writes to device
- * @filp: File structure
- * @buf: User-space buffer
- * @count: Number of bytes to write
- * @f_pos: File position
+ * btintel_test_write_iter - Called when user writes to device
+ * @iocb: I/O control block, @iocb->ki_pos is the file position
+ * @from: Source, user memory or pages registered with io_uring
  *
  * Return: Number of bytes written, or negative error code
  */
-static ssize_t btintel_test_write(struct file *filp, const char __user *buf,
-				   size_t count, loff_t *f_pos)
+static ssize_t btintel_test_write_iter(struct kiocb *iocb,
+				       struct iov_iter *from)
 {
-	struct btintel_test_device *dev = filp->private_data;
-	ssize_t ret = 0;
+	struct btintel_test_device *dev = iocb->ki_filp->private_data;
+	u64 start = btintel_test_trace_start();
+	size_t count = iov_iter_count(from);
+	ssize_t ret;
+	size_t done, len;
+	void *dst;
 
-	if (!dev || !dev->buffer)
+	if (!dev)
 		return -ENODEV;
 
-	if (*f_pos >= dev->buffer_size) {
+	ret = btintel_test_buffer_lock(dev, iocb);
+	if (ret)
+		return ret;
+
+	if (!dev->buffer) {
+		ret = -ENODEV;
+		goto out_unlock;
+	}
+
+	if (iocb->ki_pos >= dev->buffer_size) {
 		dev->stats.errors++;
-		return -ENOSPC;
+		dev->stats.last_error = ENOSPC;
+		ret = -ENOSPC;
+		goto out_unlock;
 	}
 
-	count = min(count, dev->buffer_size - (size_t)*f_pos);
+	count = min(count, dev->buffer_size - (size_t)iocb->ki_pos);
 
-	if (copy_from_user(dev->buffer + *f_pos, buf, count)) {
-		dev->stats.errors++;
-		return -EFAULT;
+	for (done = 0; done < count; done += len) {
+		len = count - done;
+		dst = btintel_test_buffer_at(dev, iocb->ki_pos + done, &len);
+		if (copy_from_iter(dst, len, from) != len) {
+			dev->stats.errors++;
+			dev->stats.last_error = EFAULT;
+			ret = -EFAULT;
+			goto out_unlock;
+		}
 	}
 
-	*f_pos += count;
+	iocb->ki_pos += count;
 	ret = count;
 	dev->stats.write_count++;
+	dev->stats.write_bytes += count;
+	btintel_test_trace_end(BTINTEL_TEST_TRACE_WRITE, start);
 
 	pr_debug_dev("Wrote %zd bytes\n", count);
 
+out_unlock:
+	mutex_unlock(&dev->lock);
 	return ret;
 }
 
 /**
- * btintel_test_ioctl - Handle IOCTL commands
- * @filp: File structure
- * @cmd: IOCTL command
- * @arg: Argument (user-space pointer or data)
+ * btintel_test_ioctl_get_info - Handle BTINTEL_TEST_IOC_GET_INFO
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_dev_info
  *
  * Return: 0 on success, negative error code on failure
  */
-static long btintel_test_ioctl(struct file *filp, unsigned int cmd,
-			       unsigned long arg)
+static int btintel_test_ioctl_get_info(struct btintel_test_device *dev,
+				       void __user *argp)
 {
-	struct btintel_test_device *dev = filp->private_data;
 	struct btintel_test_dev_info info;
-	struct btintel_test_stats stats;
-	struct btintel_test_buffer_data buf_data;
-	int ret = 0;
 
-	if (!dev)
-		return -ENODEV;
+	info.version = BTINTEL_TEST_VERSION_CODE;
+	info.buffer_size = dev->buffer_size;
+	info.active = dev->active;
+	info.refcount = dev->refcount;
+	info.numa_node = dev->pdev ? dev_to_node(&dev->pdev->dev) :
+				     NUMA_NO_NODE;
+	info.buffer_node = btintel_test_mem_node(dev->buffer);
+	info.buffer_backing = dev->buffer_backing;
 
-	switch (cmd) {
-	case BTINTEL_TEST_IOC_GET_INFO:
-		info.version = BTINTEL_TEST_VERSION_CODE;
-		info.buffer_size = dev->buffer_size;
-		info.active = dev->active;
-		info.refcount = dev->refcount;
+	if (copy_to_user(argp, &info, sizeof(info)))
+		return -EFAULT;
 
-		if (copy_to_user((void __user *)arg, &info, sizeof(info))) {
-			ret = -EFAULT;
-			dev->stats.errors++;
-		}
-		pr_debug_dev("GET_INFO ioctl\n");
-		break;
+	return 0;
+}
+
+/**
+ * btintel_test_ioctl_get_stats - Handle BTINTEL_TEST_IOC_GET_STATS
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_stats
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_get_stats(struct btintel_test_device *dev,
+					void __user *argp)
+{
+	struct btintel_test_stats stats;
+
+	stats.read_count = dev->stats.read_count;
+	stats.write_count = dev->stats.write_count;
+	stats.ioctl_count = dev->stats.ioctl_count;
+	stats.errors = dev->stats.errors;
+
+	if (copy_to_user(argp, &stats, sizeof(stats)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/**
+ * btintel_test_ioctl_reset_stats - Handle BTINTEL_TEST_IOC_RESET_STATS
+ * @dev: Device structure
+ * @argp: Unused
+ *
+ * Return: 0
+ */
+static int btintel_test_ioctl_reset_stats(struct btintel_test_device *dev,
+					  void __user *argp)
+{
+	dev->stats.read_count = 0;
+	dev->stats.write_count = 0;
+	dev->stats.ioctl_count = 0;
+	dev->stats.errors = 0;
+	dev->stats.read_bytes = 0;
+	dev->stats.write_bytes = 0;
+	dev->stats.last_error = 0;
+
+	return 0;
+}
+
+/**
+ * btintel_test_ioctl_clear_buffer - Handle BTINTEL_TEST_IOC_CLEAR_BUFFER
+ * @dev: Device structure
+ * @argp: Unused
+ *
+ * Return: 0, or -EINTR if interrupted waiting for the device lock
+ */
+static int btintel_test_ioctl_clear_buffer(struct btintel_test_device *dev,
+					   void __user *argp)
+{
+	size_t off, len;
+	int ret;
+
+	ret = mutex_lock_interruptible(&dev->lock);
+	if (ret)
+		return ret;
+
+	for (off = 0; dev->buffer && off < dev->buffer_size; off += len) {
+		len = dev->buffer_size - off;
+		memset(btintel_test_buffer_at(dev, off, &len), 0, len);
+	}
+
+	mutex_unlock(&dev->lock);
+	return 0;
+}
+
+/**
+ * btintel_test_ioctl_set_buffer_size - Handle BTINTEL_TEST_IOC_SET_BUFFER_SIZE
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_buffer_data
+ *
+ * The new buffer is allocated before the old one is let go, so a failed
+ * call leaves the device as it was.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_set_buffer_size(struct btintel_test_device *dev,
+					      void __user *argp)
+{
+	struct btintel_test_buffer_data buf_data;
+	struct btintel_test_hugebuf *hb, *old_hb;
+	bool huge;
+	u32 backing;
+	void *buf, *old;
+	int ret;
+
+	if (copy_from_user(&buf_data, argp, sizeof(buf_data)))
+		return -EFAULT;
+
+	if (buf_data.size > BTINTEL_TEST_MAX_BUFFER_SIZE ||
+	    buf_data.flags & ~BTINTEL_TEST_BUF_HUGE)
+		return -EINVAL;
+
+	ret = mutex_lock_interruptible(&dev->lock);
+	if (ret)
+		return ret;
+
+	huge = buf_data.flags & BTINTEL_TEST_BUF_HUGE;
+	buf = btintel_test_buffer_alloc(buf_data.size, huge,
+					btintel_test_alloc_node(dev), &hb,
+					&backing);
+	if (!buf) {
+		mutex_unlock(&dev->lock);
+		return -ENOMEM;
+	}
+
+	old = dev->buffer;
+	old_hb = dev->huge;
+	dev->buffer = buf;
+	dev->huge = hb;
+	dev->buffer_huge = huge;
+	dev->buffer_backing = backing;
+	dev->buffer_size = buf_data.size;
+	mutex_unlock(&dev->lock);
+
+	btintel_test_buffer_free(old, old_hb);
+	pr_debug_dev("Buffer size %zu\n", buf_data.size);
+
+	return 0;
+}
+
+/**
+ * btintel_test_ioctl_get_status - Handle BTINTEL_TEST_IOC_GET_STATUS
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_status
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_get_status(struct btintel_test_device *dev,
+					 void __user *argp)
+{
+	struct btintel_test_status status = {};
+
+	if (dev->active)
+		status.state |= BTINTEL_TEST_STATE_ACTIVE;
+	if (dev->pdev)
+		status.state |= BTINTEL_TEST_STATE_HW;
+	if (dev->buffer)
+		status.state |= BTINTEL_TEST_STATE_BUFFER;
+	status.error_code = dev->stats.last_error;
+
+	if (copy_to_user(argp, &status, sizeof(status)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/**
+ * btintel_test_ioctl_enable - Handle BTINTEL_TEST_IOC_ENABLE
+ * @dev: Device structure
+ * @argp: Unused
+ *
+ * Return: 0
+ */
+static int btintel_test_ioctl_enable(struct btintel_test_device *dev,
+				     void __user *argp)
+{
+	dev->active = true;
+	return 0;
+}
+
+/**
+ * btintel_test_ioctl_disable - Handle BTINTEL_TEST_IOC_DISABLE
+ * @dev: Device structure
+ * @argp: Unused
+ *
+ * Return: 0
+ */
+static int btintel_test_ioctl_disable(struct btintel_test_device *dev,
+				      void __user *argp)
+{
+	dev->active = false;
+	return 0;
+}
+
+/**
+ * btintel_test_ioctl_fw_cache_flush - Handle BTINTEL_TEST_IOC_FW_CACHE_FLUSH
+ * @dev: Device structure
+ * @argp: Unused
+ *
+ * Return: 0
+ */
+static int btintel_test_ioctl_fw_cache_flush(struct btintel_test_device *dev,
+					     void __user *argp)
+{
+	btintel_test_fw_cache_flush();
+	return 0;
+}
+
+#define BTINTEL_TEST_IOCTL(_cmd, _handler)				\
+	[_IOC_NR(BTINTEL_TEST_IOC_##_cmd)] = {				\
+		.cmd = BTINTEL_TEST_IOC_##_cmd,				\
+		.name = #_cmd,						\
+		.handler = btintel_test_ioctl_##_handler,		\
+	}
+
+/* Indexed by ioctl number; holes are unknown commands */
+static const struct btintel_test_ioctl_desc btintel_test_ioctls[] = {
+	BTINTEL_TEST_IOCTL(GET_INFO, get_info),
+	BTINTEL_TEST_IOCTL(GET_STATS, get_stats),
+	BTINTEL_TEST_IOCTL(RESET_STATS, reset_stats),
+	BTINTEL_TEST_IOCTL(CLEAR_BUFFER, clear_buffer),
+	BTINTEL_TEST_IOCTL(SET_BUFFER_SIZE, set_buffer_size),
+	BTINTEL_TEST_IOCTL(GET_STATUS, get_status),
+	BTINTEL_TEST_IOCTL(ENABLE, enable),
+	BTINTEL_TEST_IOCTL(DISABLE, disable),
+	BTINTEL_TEST_IOCTL(ISO_JITTER, iso_jitter),
+	BTINTEL_TEST_IOCTL(EXEC_CONFIG, exec_config),
+	BTINTEL_TEST_IOCTL(EXEC_SUBMIT, exec_submit),
+	BTINTEL_TEST_IOCTL(EXEC_COLLECT, exec_collect),
+	BTINTEL_TEST_IOCTL(HCI_PIPELINE, hci_pipeline),
+	BTINTEL_TEST_IOCTL(MEM_DUMP, mem_dump),
+	BTINTEL_TEST_IOCTL(RESET_CYCLE, reset_cycle),
+	BTINTEL_TEST_IOCTL(FW_LOAD, fw_load),
+	BTINTEL_TEST_IOCTL(FW_CACHE_STATS, fw_cache_stats),
+	BTINTEL_TEST_IOCTL(FW_CACHE_FLUSH, fw_cache_flush),
+	BTINTEL_TEST_IOCTL(PM_CYCLE, pm_cycle),
+	BTINTEL_TEST_IOCTL(IRQ_MONITOR, irq_monitor),
+	BTINTEL_TEST_IOCTL(IRQ_INJECT, irq_inject),
+	BTINTEL_TEST_IOCTL(IRQ_STATS, irq_stats),
+	BTINTEL_TEST_IOCTL(HCI_POLL, hci_poll),
+	BTINTEL_TEST_IOCTL(SET_NUMA_NODE, set_numa_node),
+	BTINTEL_TEST_IOCTL(NUMA_BENCH, numa_bench),
+	BTINTEL_TEST_IOCTL(BUF_BENCH, buf_bench),
+	BTINTEL_TEST_IOCTL(IOCTL_STATS, cost_stats),
+	BTINTEL_TEST_IOCTL(TRACE, trace),
+	BTINTEL_TEST_IOCTL(TRACE_BENCH, trace_bench),
+	BTINTEL_TEST_IOCTL(PERF_RUN, perf_run),
+	BTINTEL_TEST_IOCTL(SAMPLER, sampler),
+	BTINTEL_TEST_IOCTL(SAMPLER_READ, sampler_read),
+	BTINTEL_TEST_IOCTL(HCI_REPLAY, hci_replay),
+	BTINTEL_TEST_IOCTL(DMA_BENCH, dma_bench),
+	BTINTEL_TEST_IOCTL(RSP_CACHE, rsp_cache),
+	BTINTEL_TEST_IOCTL(RSP_CACHE_FLUSH, rsp_cache_flush),
+	BTINTEL_TEST_IOCTL(FW_SWEEP, fw_sweep),
+	BTINTEL_TEST_IOCTL(RESET_CYCLE_V2, reset_cycle_v2),
+};
+
+static_assert(ARRAY_SIZE(btintel_test_ioctls) <= BTINTEL_TEST_IOC_MAX_NR);
+
+/**
+ * btintel_test_ioctl_cost_stats - Handle BTINTEL_TEST_IOC_IOCTL_STATS
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_ioctl_stats
+ *
+ * Sums the per-CPU counters. A reset races with calls finishing on other
+ * CPUs, which may lose their update.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_cost_stats(struct btintel_test_device *dev,
+					 void __user *argp)
+{
+	struct btintel_test_ioctl_stats *st;
+	struct btintel_test_ioctl_acct *acct;
+	struct btintel_test_ioctl_cost *cost;
+	unsigned int nr;
+	u32 flags;
+	int cpu, ret = 0;
+
+	if (get_user(flags, (u32 __user *)argp))
+		return -EFAULT;
+
+	if (flags & ~BTINTEL_TEST_IOCTL_STATS_RESET)
+		return -EINVAL;
+
+	st = kzalloc(sizeof(*st), GFP_KERNEL);
+	if (!st)
+		return -ENOMEM;
+
+	st->flags = flags;
+	st->nr_cmds = ARRAY_SIZE(btintel_test_ioctls);
+	for (nr = 0; nr < ARRAY_SIZE(btintel_test_ioctls); nr++)
+		if (btintel_test_ioctls[nr].name)
+			strscpy(st->cmds[nr].name, btintel_test_ioctls[nr].name,
+				sizeof(st->cmds[nr].name));
+
+	for_each_possible_cpu(cpu) {
+		acct = per_cpu_ptr(dev->ioctl_acct, cpu);
+		for (nr = 0; nr < ARRAY_SIZE(btintel_test_ioctls); nr++) {
+			cost = &st->cmds[nr];
+			cost->calls += acct[nr].calls;
+			cost->errors += acct[nr].errors;
+			cost->total_ns += acct[nr].total_ns;
+			cost->max_ns = max(cost->max_ns, acct[nr].max_ns);
+		}
+		if (flags & BTINTEL_TEST_IOCTL_STATS_RESET)
+			memset(acct, 0, sizeof(*acct) * BTINTEL_TEST_IOC_MAX_NR);
+	}
+
+	if (copy_to_user(argp, st, sizeof(*st)))
+		ret = -EFAULT;
+
+	kfree(st);
+	return ret;
+}
+
+/**
+ * btintel_test_ioctl_dispatch - Run one ioctl command
+ * @dev: Device structure
+ * @cmd: IOCTL command
+ * @argp: User argument
+ *
+ * Looks the command up in btintel_test_ioctls[] and accounts the call,
+ * its outcome and its duration to the command, per CPU so that concurrent
+ * callers do not share cache lines.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static long btintel_test_ioctl_dispatch(struct btintel_test_device *dev,
+					unsigned int cmd, void __user *argp)
+{
+	const struct btintel_test_ioctl_desc *desc;
+	struct btintel_test_ioctl_acct *acct;
+	unsigned int nr = _IOC_NR(cmd);
+	u64 start, ns;
+	int ret;
+
+	if (_IOC_TYPE(cmd) != BTINTEL_TEST_IOC_MAGIC ||
+	    nr >= ARRAY_SIZE(btintel_test_ioctls) ||
+	    btintel_test_ioctls[nr].cmd != cmd ||
+	    !btintel_test_ioctls[nr].handler) {
+		pr_warn("Unknown ioctl command: 0x%x\n", cmd);
+		dev->stats.errors++;
+		dev->stats.last_error = ENOTTY;
+		dev->stats.ioctl_count++;
+		return -ENOTTY;
+	}
+
+	nr = array_index_nospec(nr, ARRAY_SIZE(btintel_test_ioctls));
+	desc = &btintel_test_ioctls[nr];
+
+	start = ktime_get_ns();
+	ret = desc->handler(dev, argp);
+	ns = ktime_get_ns() - start;
+	btintel_test_trace_add(BTINTEL_TEST_TRACE_IOCTL, ns);
+
+	acct = &get_cpu_ptr(dev->ioctl_acct)[nr];
+	acct->calls++;
+	acct->total_ns += ns;
+	acct->max_ns = max(acct->max_ns, ns);
+	if (ret)
+		acct->errors++;
+	put_cpu_ptr(dev->ioctl_acct);
+
+	if (ret) {
+		dev->stats.errors++;
+		dev->stats.last_error = -ret;
+	}
+	dev->stats.ioctl_count++;
+
+	pr_debug_dev("%s ioctl\n", desc->name);
+
+	return ret;
+}
+
+/**
+ * btintel_test_ioctl - Handle IOCTL commands
+ * @filp: File structure
+ * @cmd: IOCTL command
+ * @arg: Argument (user-space pointer or data)
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static long btintel_test_ioctl(struct file *filp, unsigned int cmd,
+			       unsigned long arg)
+{
+	struct btintel_test_device *dev = filp->private_data;
+
+	if (!dev)
+		return -ENODEV;
+
+	return btintel_test_ioctl_dispatch(dev, cmd, (void __user *)arg);
+}
+
+/* ============================================================================
+ * LATENCY SUMMARIES
+ * ============================================================================ */
+
+/**
+ * btintel_test_lat_init - Reset a latency accumulator
+ * @acc: Accumulator
+ */
+static void btintel_test_lat_init(struct btintel_test_lat_acc *acc)
+{
+	memset(acc, 0, sizeof(*acc));
+	acc->lat.min_ns = U64_MAX;
+}
+
+/**
+ * btintel_test_lat_add - Account one latency sample
+ * @acc: Accumulator
+ * @ns: Sample in nanoseconds
+ */
+static void btintel_test_lat_add(struct btintel_test_lat_acc *acc, u64 ns)
+{
+	struct btintel_test_latency *lat = &acc->lat;
+
+	lat->samples++;
+	lat->min_ns = min(lat->min_ns, ns);
+	lat->max_ns = max(lat->max_ns, ns);
+	lat->hist[min_t(unsigned int, fls64(ns),
+			BTINTEL_TEST_HIST_BUCKETS - 1)]++;
+	acc->sum_ns += ns;
+}
+
+/**
+ * btintel_test_lat_finish - Derive mean and p99 from the accumulated samples
+ * @acc: Accumulator
+ * @out: Summary to fill in
+ */
+static void btintel_test_lat_finish(struct btintel_test_lat_acc *acc,
+				    struct btintel_test_latency *out)
+{
+	struct btintel_test_latency *lat = &acc->lat;
+	u64 rank, seen = 0;
+	unsigned int i;
+
+	if (!lat->samples) {
+		memset(out, 0, sizeof(*out));
+		return;
+	}
+
+	lat->mean_ns = div64_u64(acc->sum_ns, lat->samples);
+
+	/* Smallest bucket holding the 99th percentile sample */
+	rank = lat->samples - div64_u64(lat->samples, 100);
+	for (i = 0; i < BTINTEL_TEST_HIST_BUCKETS; i++) {
+		seen += lat->hist[i];
+		if (seen >= rank)
+			break;
+	}
+	lat->p99_ns = min(i ? 1ULL << i : 0ULL, lat->max_ns);
+	lat->p99_ns = max(lat->p99_ns, lat->min_ns);
+
+	*out = *lat;
+}
+
+/* ============================================================================
+ * HCI BACKENDS
+ * ============================================================================ */
+
+/**
+ * btintel_test_hdev_get - Resolve the hci_dev a test engine should target
+ * @dev: Device structure
+ * @backend: BTINTEL_TEST_BACKEND_HW or BTINTEL_TEST_BACKEND_HCI_INDEX
+ * @index: hciN index for BTINTEL_TEST_BACKEND_HCI_INDEX
+ *
+ * BTINTEL_TEST_BACKEND_HW follows the same path as test_function(): the
+ * btintel_pcie driver data of @dev->pdev. BTINTEL_TEST_BACKEND_HCI_INDEX
+ * picks any registered controller, typically one created by hci_vhci.
+ *
+ * Return: Referenced hci_dev (drop with hci_dev_put()), or NULL
+ */
+static struct hci_dev *btintel_test_hdev_get(struct btintel_test_device *dev,
+					     u32 backend, u32 index)
+{
+	struct btintel_pcie_data *btintel_data;
+
+	if (backend == BTINTEL_TEST_BACKEND_HCI_INDEX)
+		return hci_dev_get(index);
+
+	if (backend != BTINTEL_TEST_BACKEND_HW || !dev->pdev)
+		return NULL;
+
+	btintel_data = pci_get_drvdata(dev->pdev);
+	if (!btintel_data || !btintel_data->hdev)
+		return NULL;
+
+	return hci_dev_hold(btintel_data->hdev);
+}
+
+/**
+ * btintel_test_pdev_get - Look up the current PCI function of the controller
+ * @dev: Device structure
+ *
+ * The btintel_pcie recovery path removes and rescans the function, which
+ * leaves @dev->pdev pointing at a detached pci_dev. Look the slot up again
+ * so that engines always act on the live one.
+ *
+ * Return: Referenced pci_dev (drop with pci_dev_put()), or NULL
+ */
+static struct pci_dev *btintel_test_pdev_get(struct btintel_test_device *dev)
+{
+	if (!dev->pdev)
+		return NULL;
+
+	return pci_get_domain_bus_and_slot(pci_domain_nr(dev->pdev->bus),
+					   dev->pdev->bus->number,
+					   dev->pdev->devfn);
+}
+
+/**
+ * btintel_test_hdev_is_own - Check whether a controller belongs to this device
+ * @dev: Device structure
+ * @hdev: Controller to check
+ *
+ * Return: true if @hdev is the controller btintel_pcie runs on @dev->pdev
+ */
+static bool btintel_test_hdev_is_own(struct btintel_test_device *dev,
+				     struct hci_dev *hdev)
+{
+	struct btintel_pcie_data *btintel_data;
+	struct pci_dev *pdev;
+	bool own;
+
+	pdev = btintel_test_pdev_get(dev);
+	if (!pdev)
+		return false;
+
+	/* The driver data is gone while recovery rebinds the function */
+	btintel_data = pci_get_drvdata(pdev);
+	own = hdev->dev.parent == &pdev->dev ||
+	      (btintel_data && btintel_data->hdev == hdev);
+	pci_dev_put(pdev);
+
+	return own;
+}
+
+/**
+ * btintel_test_emul_hci_complete - Hand a completed frame back to its owner
+ * @skb: Frame the virtual HCI is done with
+ * @ncmd: Credits the virtual HCI reports with the completion
+ */
+static void btintel_test_emul_hci_complete(struct sk_buff *skb, u8 ncmd)
+{
+	struct btintel_test_emul_cb *cb = BTINTEL_TEST_EMUL_CB(skb);
+
+	if (cb->complete)
+		cb->complete(skb, ncmd);
+	else
+		consume_skb(skb);
+}
+
+/**
+ * btintel_test_emul_hci_timer - Complete every due frame of the virtual HCI
+ * @timer: Timer embedded in struct btintel_test_emul_hci
+ *
+ * Return: HRTIMER_RESTART while frames are still pending
+ */
+static enum hrtimer_restart btintel_test_emul_hci_timer(struct hrtimer *timer)
+{
+	struct btintel_test_emul_hci *emul =
+		container_of(timer, struct btintel_test_emul_hci, timer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	struct sk_buff_head done;
+	struct sk_buff *skb;
+	ktime_t now = ktime_get();
+	u32 left;
+
+	__skb_queue_head_init(&done);
+
+	spin_lock(&emul->lock);
+	while ((skb = skb_peek(&emul->pending)) &&
+	       ktime_compare(skb->tstamp, now) <= 0) {
+		__skb_unlink(skb, &emul->pending);
+		__skb_queue_tail(&done, skb);
+	}
+	if (skb) {
+		hrtimer_set_expires(timer, skb->tstamp);
+		ret = HRTIMER_RESTART;
+	}
+	left = skb_queue_len(&emul->pending);
+	spin_unlock(&emul->lock);
+
+	while ((skb = __skb_dequeue(&done)))
+		btintel_test_emul_hci_complete(skb, emul->credits > left ?
+					       min(emul->credits - left, 255U) : 0);
+
+	return ret;
+}
+
+/**
+ * btintel_test_emul_hci_init - Initialize the virtual HCI
+ * @emul: Virtual HCI
+ */
+static void btintel_test_emul_hci_init(struct btintel_test_emul_hci *emul)
+{
+	spin_lock_init(&emul->lock);
+	__skb_queue_head_init(&emul->pending);
+	hrtimer_init(&emul->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	emul->timer.function = btintel_test_emul_hci_timer;
+	emul->credits = 1;
+}
+
+/**
+ * btintel_test_emul_hci_send - Submit a frame to the virtual HCI
+ * @emul: Virtual HCI
+ * @skb: Frame, ownership passes to @emul
+ * @complete: Completion callback, NULL to free the frame on completion
+ * @arg: Owner data for @complete
+ */
+static void btintel_test_emul_hci_send(struct btintel_test_emul_hci *emul,
+				       struct sk_buff *skb,
+				       void (*complete)(struct sk_buff *skb, u8 ncmd),
+				       void *arg)
+{
+	ktime_t due = ktime_get();
+	u64 delay = emul->latency_ns;
+	bool arm;
+
+	memset(skb->cb, 0, sizeof(skb->cb));
+	BTINTEL_TEST_EMUL_CB(skb)->complete = complete;
+	BTINTEL_TEST_EMUL_CB(skb)->arg = arg;
+
+	if (emul->jitter_ns)
+		delay += get_random_u32() % emul->jitter_ns;
+
+	spin_lock_bh(&emul->lock);
+	/* The link carries one frame at a time */
+	if (emul->bytes_per_sec) {
+		if (ktime_before(due, emul->link_free))
+			due = emul->link_free;
+		due = ktime_add_ns(due, div64_u64((u64)skb->len * NSEC_PER_SEC,
+						  emul->bytes_per_sec));
+		emul->link_free = due;
+	}
+	due = ktime_add_ns(due, delay);
+	/* Never complete ahead of an earlier frame */
+	if (ktime_before(due, emul->last_due))
+		due = emul->last_due;
+	emul->last_due = due;
+	skb->tstamp = due;
+
+	arm = skb_queue_empty(&emul->pending);
+	__skb_queue_tail(&emul->pending, skb);
+	if (arm)
+		hrtimer_start(&emul->timer, due, HRTIMER_MODE_ABS_SOFT);
+	spin_unlock_bh(&emul->lock);
+}
+
+/**
+ * btintel_test_emul_hci_flush - Complete every pending frame immediately
+ * @emul: Virtual HCI
+ */
+static void btintel_test_emul_hci_flush(struct btintel_test_emul_hci *emul)
+{
+	struct sk_buff_head done;
+	struct sk_buff *skb;
+
+	__skb_queue_head_init(&done);
+
+	hrtimer_cancel(&emul->timer);
+
+	spin_lock_bh(&emul->lock);
+	skb_queue_splice_init(&emul->pending, &done);
+	emul->last_due = 0;
+	emul->link_free = 0;
+	spin_unlock_bh(&emul->lock);
+
+	while ((skb = __skb_dequeue(&done)))
+		btintel_test_emul_hci_complete(skb, emul->credits);
+}
+
+/**
+ * btintel_test_emul_hci_cancel - Withdraw a pending command
+ * @emul: Virtual HCI
+ * @cmd: Command given as @arg to btintel_test_emul_hci_send()
+ *
+ * Return: true if the command was still pending and is now freed, false if
+ * the virtual HCI is already completing it
+ */
+static bool btintel_test_emul_hci_cancel(struct btintel_test_emul_hci *emul,
+					 struct btintel_test_emul_cmd *cmd)
+{
+	struct sk_buff *skb, *tmp;
+	bool found = false;
+
+	spin_lock_bh(&emul->lock);
+	skb_queue_walk_safe(&emul->pending, skb, tmp) {
+		if (BTINTEL_TEST_EMUL_CB(skb)->arg == cmd) {
+			__skb_unlink(skb, &emul->pending);
+			found = true;
+			break;
+		}
+	}
+	spin_unlock_bh(&emul->lock);
+
+	if (found)
+		kfree_skb(skb);
+
+	return found;
+}
+
+/**
+ * btintel_test_emul_hci_config - Apply an engine run's virtual HCI settings
+ * @emul: Virtual HCI
+ * @cfg: Settings for the run
+ * @saved: Filled with the settings to restore once the run is over
+ *
+ * Every delay is bounded by BTINTEL_TEST_EMUL_MAX_DELAY_NS, so a pending
+ * frame never outlives a synchronous command's timeout by much.
+ *
+ * Return: 0 on success, -EINVAL if a setting is out of range
+ */
+static int btintel_test_emul_hci_config(struct btintel_test_emul_hci *emul,
+					const struct btintel_test_emul_cfg *cfg,
+					struct btintel_test_emul_cfg *saved)
+{
+	if (cfg->latency_ns > BTINTEL_TEST_EMUL_MAX_DELAY_NS ||
+	    cfg->jitter_ns > BTINTEL_TEST_EMUL_MAX_DELAY_NS ||
+	    cfg->credits > BTINTEL_TEST_EMUL_MAX_CREDITS ||
+	    (cfg->bytes_per_sec &&
+	     cfg->bytes_per_sec < BTINTEL_TEST_EMUL_MIN_BYTES_PER_SEC))
+		return -EINVAL;
+
+	saved->latency_ns = READ_ONCE(emul->latency_ns);
+	saved->jitter_ns = READ_ONCE(emul->jitter_ns);
+	saved->credits = READ_ONCE(emul->credits);
+	saved->bytes_per_sec = READ_ONCE(emul->bytes_per_sec);
+
+	WRITE_ONCE(emul->latency_ns, cfg->latency_ns);
+	WRITE_ONCE(emul->jitter_ns, cfg->jitter_ns);
+	WRITE_ONCE(emul->credits, cfg->credits ? cfg->credits : 1);
+	WRITE_ONCE(emul->bytes_per_sec, cfg->bytes_per_sec);
+
+	return 0;
+}
+
+/**
+ * btintel_test_emul_hci_restore - Undo btintel_test_emul_hci_config()
+ * @emul: Virtual HCI
+ * @saved: Settings returned by btintel_test_emul_hci_config()
+ */
+static void btintel_test_emul_hci_restore(struct btintel_test_emul_hci *emul,
+					  const struct btintel_test_emul_cfg *saved)
+{
+	WRITE_ONCE(emul->latency_ns, saved->latency_ns);
+	WRITE_ONCE(emul->jitter_ns, saved->jitter_ns);
+	WRITE_ONCE(emul->credits, saved->credits);
+	WRITE_ONCE(emul->bytes_per_sec, saved->bytes_per_sec);
+}
+
+/**
+ * btintel_test_emul_cmd_complete - Answer a command sent to the virtual HCI
+ * @skb: Command being completed by the virtual HCI
+ * @ncmd: Credits left, unused for synchronous commands
+ */
+static void btintel_test_emul_cmd_complete(struct sk_buff *skb, u8 ncmd)
+{
+	struct btintel_test_emul_cmd *cmd = BTINTEL_TEST_EMUL_CB(skb)->arg;
+
+	consume_skb(skb);
+
+	/* Command Complete return parameters: success status only */
+	cmd->rsp = alloc_skb(1, GFP_ATOMIC);
+	if (cmd->rsp)
+		skb_put_u8(cmd->rsp, 0x00);
+
+	complete(&cmd->done);
+}
+
+/**
+ * btintel_test_emul_hci_cmd - Send one command to the virtual HCI and wait
+ * @emul: Virtual HCI
+ * @opcode: HCI opcode
+ * @plen: Parameter length
+ * @param: Parameters
+ * @poll_ns: Time to spin for the completion before sleeping, 0 to sleep
+ *
+ * Return: Command Complete return parameters, or ERR_PTR
+ */
+static struct sk_buff *btintel_test_emul_hci_cmd(struct btintel_test_emul_hci *emul,
+						 u16 opcode, u32 plen,
+						 const void *param, u64 poll_ns)
+{
+	struct btintel_test_emul_cmd cmd;
+	struct hci_command_hdr *hdr;
+	struct sk_buff *skb;
+	long left;
+
+	skb = bt_skb_alloc(HCI_COMMAND_HDR_SIZE + plen, GFP_KERNEL);
+	if (!skb)
+		return ERR_PTR(-ENOMEM);
+
+	hdr = skb_put(skb, HCI_COMMAND_HDR_SIZE);
+	hdr->opcode = cpu_to_le16(opcode);
+	hdr->plen = plen;
+	if (plen)
+		skb_put_data(skb, param, plen);
+	hci_skb_pkt_type(skb) = HCI_COMMAND_PKT;
+
+	init_completion(&cmd.done);
+	cmd.rsp = NULL;
+
+	btintel_test_emul_hci_send(emul, skb, btintel_test_emul_cmd_complete,
+				   &cmd);
+
+	if (poll_ns) {
+		u64 deadline = ktime_get_ns() + poll_ns;
+
+		while (!completion_done(&cmd.done) &&
+		       ktime_get_ns() < deadline && !need_resched())
+			cpu_relax();
+	}
+
+	left = wait_for_completion_interruptible_timeout(&cmd.done,
+							 HCI_CMD_TIMEOUT);
+	if (left <= 0) {
+		/* @cmd lives on this stack: take the command back or wait */
+		if (btintel_test_emul_hci_cancel(emul, &cmd))
+			return ERR_PTR(left ? left : -ETIMEDOUT);
+		wait_for_completion(&cmd.done);
+	}
+
+	return cmd.rsp ? cmd.rsp : ERR_PTR(-ENOMEM);
+}
+
+/**
+ * btintel_test_hci_cmd - Send one HCI command and wait for its completion
+ * @dev: Device structure
+ * @hdev: Controller, or NULL for the virtual HCI
+ * @opcode: HCI opcode
+ * @plen: Parameter length
+ * @param: Parameters
+ * @flags: BTINTEL_TEST_HCI_POLL to busy-poll for the completion,
+ *         BTINTEL_TEST_HCI_NOCACHE to always reach the controller
+ *
+ * Opcodes selected with BTINTEL_TEST_IOC_RSP_CACHE may be answered from
+ * the response cache without reaching the controller.
+ *
+ * A real controller is waited for inside hci_cmd_sync(), which only
+ * sleeps; there BTINTEL_TEST_HCI_POLL has no effect. Polling a real
+ * controller takes the raw socket path of BTINTEL_TEST_IOC_HCI_PIPELINE.
+ *
+ * Return: Command Complete return parameters (status first), or ERR_PTR
+ */
+static struct sk_buff *btintel_test_hci_cmd(struct btintel_test_device *dev,
+					    struct hci_dev *hdev, u16 opcode,
+					    u32 plen, const void *param,
+					    u32 flags)
+{
+	struct sk_buff *skb;
+	u64 start, gen;
+	s64 max;
+	u64 ns;
+
+	skb = btintel_test_rsp_cache_get(dev, hdev, opcode, plen, param, flags,
+					 &gen);
+	if (skb)
+		return skb;
+
+	start = ktime_get_ns();
+	if (hdev)
+		skb = hci_cmd_sync(hdev, opcode, plen, param, HCI_CMD_TIMEOUT);
+	else
+		skb = btintel_test_emul_hci_cmd(&dev->emul, opcode, plen, param,
+						flags & BTINTEL_TEST_HCI_POLL ?
+						BTINTEL_TEST_POLL_DEFAULT_BUDGET_NS : 0);
+
+	/* Always timed: a clock read is noise next to a command round trip */
+	ns = ktime_get_ns() - start;
+	btintel_test_trace_add(BTINTEL_TEST_TRACE_HCI_CMD, ns);
+
+	atomic64_inc(&dev->hci.cmds);
+	atomic64_add(ns, &dev->hci.total_ns);
+	max = atomic64_read(&dev->hci.max_ns);
+	while ((s64)ns > max && !atomic64_try_cmpxchg(&dev->hci.max_ns, &max, ns))
+		;
+
+	if (gen)
+		btintel_test_rsp_cache_put(dev, hdev, opcode, plen, param, skb,
+					   ns, gen);
+
+	return skb;
+}
+
+/* ============================================================================
+ * ISOCHRONOUS TIMING-JITTER BENCHMARK
+ * ============================================================================ */
+
+/**
+ * btintel_test_iso_run_release - Free a run once nothing references it
+ * @kref: Reference counter of struct btintel_test_iso_run
+ */
+static void btintel_test_iso_run_release(struct kref *kref)
+{
+	vfree(container_of(kref, struct btintel_test_iso_run, kref));
+}
+
+/**
+ * btintel_test_iso_destructor - Record the completion of an injected packet
+ * @skb: Packet being released by the backend
+ *
+ * On the virtual HCI this runs when the simulated controller completes the
+ * packet. On a real hci_dev it runs when the HCI core hands the packet to
+ * the transport driver, which is as far as the stack lets us follow it.
+ */
+static void btintel_test_iso_destructor(struct sk_buff *skb)
+{
+	struct btintel_test_iso_slot *slot = skb_shinfo(skb)->destructor_arg;
+	struct btintel_test_iso_run *run = slot->run;
+
+	WRITE_ONCE(slot->rec.complete_ns, ktime_get_ns());
+
+	if (atomic_dec_and_test(&run->outstanding))
+		wake_up(&run->wait);
+
+	kref_put(&run->kref, btintel_test_iso_run_release);
+}
+
+/**
+ * btintel_test_iso_alloc - Build one SCO or ISO data packet
+ * @req: Benchmark parameters
+ * @seq: Sequence number of the packet
+ *
+ * Return: Packet with its HCI packet type set, or NULL
+ */
+static struct sk_buff *btintel_test_iso_alloc(struct btintel_test_iso_jitter *req,
+					      u32 seq)
+{
+	struct sk_buff *skb;
+
+	skb = bt_skb_alloc(HCI_ISO_HDR_SIZE + HCI_ISO_DATA_HDR_SIZE +
+			   req->payload_len, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	if (req->pkt_type == BTINTEL_TEST_ISO_PKT_SCO) {
+		struct hci_sco_hdr *hdr = skb_put(skb, HCI_SCO_HDR_SIZE);
+
+		hdr->handle = cpu_to_le16(req->handle);
+		hdr->dlen = req->payload_len;
+		hci_skb_pkt_type(skb) = HCI_SCODATA_PKT;
+	} else {
+		struct hci_iso_hdr *hdr = skb_put(skb, HCI_ISO_HDR_SIZE);
+		struct hci_iso_data_hdr *data = skb_put(skb,
+							HCI_ISO_DATA_HDR_SIZE);
+
+		hdr->handle = cpu_to_le16(hci_handle_pack(req->handle,
+				hci_iso_flags_pack(ISO_SINGLE, 0x00)));
+		hdr->dlen = cpu_to_le16(HCI_ISO_DATA_HDR_SIZE +
+					req->payload_len);
+		data->sn = cpu_to_le16(seq);
+		data->slen = cpu_to_le16(req->payload_len);
+		hci_skb_pkt_type(skb) = HCI_ISODATA_PKT;
+	}
+
+	memset(skb_put(skb, req->payload_len), seq & 0xff, req->payload_len);
+
+	return skb;
+}
+
+/**
+ * btintel_test_iso_sleep_until - Sleep on an hrtimer until an absolute time
+ * @deadline: CLOCK_MONOTONIC time to wake up at
+ *
+ * Return: 0 once @deadline has passed, -EINTR if a signal is pending
+ */
+static int btintel_test_iso_sleep_until(ktime_t deadline)
+{
+	while (ktime_before(ktime_get(), deadline)) {
+		if (signal_pending(current))
+			return -EINTR;
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout_range(&deadline, 0, HRTIMER_MODE_ABS);
+	}
+
+	return 0;
+}
+
+/**
+ * btintel_test_iso_purge_raw_q - Drop our packets still queued on an hci_dev
+ * @hdev: Controller the packets were queued on
+ *
+ * Used when a controller stops draining its queue, so that no packet keeps
+ * a destructor pointing into this module.
+ */
+static void btintel_test_iso_purge_raw_q(struct hci_dev *hdev)
+{
+	struct sk_buff_head drop;
+	struct sk_buff *skb, *tmp;
+	unsigned long flags;
+
+	__skb_queue_head_init(&drop);
+
+	spin_lock_irqsave(&hdev->raw_q.lock, flags);
+	skb_queue_walk_safe(&hdev->raw_q, skb, tmp) {
+		if (skb->destructor != btintel_test_iso_destructor)
+			continue;
+		__skb_unlink(skb, &hdev->raw_q);
+		__skb_queue_tail(&drop, skb);
+	}
+	spin_unlock_irqrestore(&hdev->raw_q.lock, flags);
+
+	__skb_queue_purge(&drop);
+}
+
+/**
+ * btintel_test_iso_jitter - Inject SCO/ISO packets on a fixed period
+ * @dev: Device structure
+ * @req: Parameters in, results out
+ *
+ * Packets are sent from the calling thread, which sleeps on an hrtimer
+ * until each slot of an absolute schedule. A late slot does not shift the
+ * following ones, so the schedule never drifts.
+ *
+ * Return: 0 on success, -ETIMEDOUT if packets were still in flight after
+ * the drain, or another negative error code
+ */
+static int btintel_test_iso_jitter(struct btintel_test_device *dev,
+				   struct btintel_test_iso_jitter *req)
+{
+	struct btintel_test_lat_acc jitter, latency;
+	struct btintel_test_iso_record __user *urec;
+	struct btintel_test_emul_cfg saved;
+	struct btintel_test_iso_run *run;
+	struct hci_dev *hdev = NULL;
+	u64 start, deadline;
+	u32 max_payload, i;
+	int ret = 0;
+
+	max_payload = req->pkt_type == BTINTEL_TEST_ISO_PKT_SCO ?
+		      U8_MAX : BTINTEL_TEST_ISO_MAX_PAYLOAD;
+
+	if (req->pkt_type > BTINTEL_TEST_ISO_PKT_ISO ||
+	    req->payload_len > max_payload ||
+	    !req->count || req->count > BTINTEL_TEST_ISO_MAX_PACKETS ||
+	    req->interval_ns < BTINTEL_TEST_ISO_MIN_INTERVAL_NS ||
+	    req->interval_ns > BTINTEL_TEST_ISO_MAX_INTERVAL_NS ||
+	    req->handle > HCI_CONN_HANDLE_MAX)
+		return -EINVAL;
+
+	if (req->backend == BTINTEL_TEST_BACKEND_EMUL) {
+		struct btintel_test_emul_cfg cfg = {
+			.latency_ns = req->emul_latency_ns,
+			.jitter_ns = req->emul_jitter_ns,
+		};
+
+		ret = btintel_test_emul_hci_config(&dev->emul, &cfg, &saved);
+		if (ret)
+			return ret;
+	} else {
+		hdev = btintel_test_hdev_get(dev, req->backend, req->hci_index);
+		if (!hdev)
+			return -ENODEV;
+
+		if (!test_bit(HCI_UP, &hdev->flags)) {
+			ret = -ENETDOWN;
+			goto out_put;
+		}
+	}
+
+	run = vzalloc(struct_size(run, slots, req->count));
+	if (!run) {
+		ret = -ENOMEM;
+		goto out_put;
+	}
+	kref_init(&run->kref);
+	atomic_set(&run->outstanding, 0);
+	init_waitqueue_head(&run->wait);
+
+	deadline = req->deadline_ns ? req->deadline_ns : req->interval_ns;
+	req->sent = 0;
+	req->completed = 0;
+	req->missed_deadlines = 0;
+
+	start = ktime_get_ns() + req->interval_ns;
+
+	for (i = 0; i < req->count; i++) {
+		struct btintel_test_iso_slot *slot = &run->slots[i];
+		struct sk_buff *skb;
+
+		slot->run = run;
+		slot->rec.scheduled_ns = start + (u64)i * req->interval_ns;
+
+		skb = btintel_test_iso_alloc(req, i);
+		if (!skb) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		ret = btintel_test_iso_sleep_until(ns_to_ktime(slot->rec.scheduled_ns));
+		if (ret) {
+			kfree_skb(skb);
+			break;
+		}
+
+		kref_get(&run->kref);
+		atomic_inc(&run->outstanding);
+		skb->destructor = btintel_test_iso_destructor;
+		skb_shinfo(skb)->destructor_arg = slot;
+
+		slot->rec.send_ns = ktime_get_ns();
+		if (hdev) {
+			skb_queue_tail(&hdev->raw_q, skb);
+			queue_work(hdev->workqueue, &hdev->tx_work);
+		} else {
+			btintel_test_emul_hci_send(&dev->emul, skb, NULL, NULL);
+		}
+
+		req->sent++;
+		if (slot->rec.send_ns - slot->rec.scheduled_ns > deadline)
+			req->missed_deadlines++;
+	}
+
+	if (!wait_event_timeout(run->wait, !atomic_read(&run->outstanding),
+				msecs_to_jiffies(BTINTEL_TEST_DRAIN_MS))) {
+		pr_warn("ISO jitter: %d packets still in flight, dropping them\n",
+			atomic_read(&run->outstanding));
+		if (hdev)
+			btintel_test_iso_purge_raw_q(hdev);
+		else
+			btintel_test_emul_hci_flush(&dev->emul);
+
+		/*
+		 * Packets the driver already took may never come back if the
+		 * controller went away. @run stays alive until their
+		 * destructors have run, so give up on them rather than hang.
+		 */
+		if (!wait_event_timeout(run->wait,
+					!atomic_read(&run->outstanding),
+					msecs_to_jiffies(BTINTEL_TEST_DRAIN_MS)) &&
+		    !ret)
+			ret = -ETIMEDOUT;
+	}
+
+	btintel_test_lat_init(&jitter);
+	btintel_test_lat_init(&latency);
+	urec = u64_to_user_ptr(req->records);
+
+	for (i = 0; i < req->sent; i++) {
+		struct btintel_test_iso_record *rec = &run->slots[i].rec;
+		u64 complete_ns = READ_ONCE(rec->complete_ns);
+
+		btintel_test_lat_add(&jitter, rec->send_ns - rec->scheduled_ns);
+		if (complete_ns >= rec->send_ns) {
+			btintel_test_lat_add(&latency, complete_ns - rec->send_ns);
+			req->completed++;
+		}
+
+		if (urec && !ret && copy_to_user(&urec[i], rec, sizeof(*rec)))
+			ret = -EFAULT;
+	}
+
+	btintel_test_lat_finish(&jitter, &req->jitter);
+	btintel_test_lat_finish(&latency, &req->latency);
+
+	pr_debug_dev("ISO jitter: sent %u, completed %u, missed %u\n",
+		     req->sent, req->completed, req->missed_deadlines);
+
+	kref_put(&run->kref, btintel_test_iso_run_release);
+out_put:
+	if (hdev)
+		hci_dev_put(hdev);
+	else
+		btintel_test_emul_hci_restore(&dev->emul, &saved);
+	return ret;
+}
+
+/**
+ * btintel_test_ioctl_iso_jitter - Handle BTINTEL_TEST_IOC_ISO_JITTER
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_iso_jitter
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_iso_jitter(struct btintel_test_device *dev,
+					 void __user *argp)
+{
+	struct btintel_test_iso_jitter *req;
+	int ret;
+
+	req = memdup_user(argp, sizeof(*req));
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	ret = mutex_lock_interruptible(&dev->lock);
+	if (ret)
+		goto out_free;
+
+	ret = btintel_test_iso_jitter(dev, req);
+	mutex_unlock(&dev->lock);
+
+	if (!ret && copy_to_user(argp, req, sizeof(*req)))
+		ret = -EFAULT;
+
+out_free:
+	kfree(req);
+	return ret;
+}
+
+/* ============================================================================
+ * HCI COMMAND PIPELINING BENCHMARK
+ * ============================================================================ */
+
+/**
+ * btintel_test_pipe_emul_complete - Queue a virtual HCI command completion
+ * @skb: Command completed by the virtual HCI
+ * @ncmd: Credits the virtual HCI reports
+ */
+static void btintel_test_pipe_emul_complete(struct sk_buff *skb, u8 ncmd)
+{
+	struct btintel_test_pipe *p = BTINTEL_TEST_EMUL_CB(skb)->arg;
+	struct hci_command_hdr *hdr = (void *)skb->data;
+	struct btintel_test_pipe_evt *evt;
+
+	spin_lock_bh(&p->lock);
+	evt = &p->evts[p->head++ % BTINTEL_TEST_PIPE_MAX_DEPTH];
+	evt->time_ns = ktime_get_ns();
+	evt->opcode = le16_to_cpu(hdr->opcode);
+	evt->status = 0x00;
+	evt->ncmd = ncmd;
+	spin_unlock_bh(&p->lock);
+
+	consume_skb(skb);
+	wake_up(&p->wait);
+}
+
+/**
+ * btintel_test_pipe_tap_open - Open a raw HCI socket for command events
+ * @p: Pipeline state
+ * @hdev: Controller to listen on
+ *
+ * Command Complete and Command Status events still go through the HCI core
+ * as well, which is why the controller should carry no other traffic while
+ * a pipelined run is in progress.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_pipe_tap_open(struct btintel_test_pipe *p,
+				      struct hci_dev *hdev)
+{
+	struct sockaddr_hci addr = {
+		.hci_family = AF_BLUETOOTH,
+		.hci_dev = hdev->id,
+		.hci_channel = HCI_CHANNEL_RAW,
+	};
+	struct hci_ufilter flt = {
+		.type_mask = BIT(HCI_EVENT_PKT),
+		.event_mask = { BIT(HCI_EV_CMD_COMPLETE) | BIT(HCI_EV_CMD_STATUS) },
+	};
+	int ret;
+
+	ret = sock_create_kern(&init_net, PF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI,
+			       &p->sock);
+	if (ret)
+		return ret;
+
+	ret = kernel_bind(p->sock, (struct sockaddr *)&addr, sizeof(addr));
+	if (!ret)
+		ret = p->sock->ops->setsockopt(p->sock, SOL_HCI, HCI_FILTER,
+					       KERNEL_SOCKPTR(&flt),
+					       sizeof(flt));
+	if (ret) {
+		sock_release(p->sock);
+		p->sock = NULL;
+		return ret;
+	}
+
+	p->sock->sk->sk_rcvtimeo = HCI_CMD_TIMEOUT;
+	return 0;
+}
+
+/**
+ * btintel_test_pipe_attach_hdev - Connect pipeline state to a known backend
+ * @p: Zeroed pipeline state
+ * @hdev: Controller already resolved by the caller, NULL for the virtual HCI
+ *
+ * On success the pipeline holds its own reference to @hdev, which
+ * btintel_test_pipe_detach() drops.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_pipe_attach_hdev(struct btintel_test_pipe *p,
+					 struct hci_dev *hdev)
+{
+	int ret;
+
+	spin_lock_init(&p->lock);
+	init_waitqueue_head(&p->wait);
+
+	if (!hdev)
+		return 0;
+
+	ret = test_bit(HCI_UP, &hdev->flags) ?
+	      btintel_test_pipe_tap_open(p, hdev) : -ENETDOWN;
+	if (ret)
+		return ret;
+
+	hci_dev_hold(hdev);
+	return 0;
+}
+
+/**
+ * btintel_test_pipe_attach - Connect pipeline state to its backend
+ * @dev: Device structure
+ * @p: Zeroed pipeline state
+ * @backend: BTINTEL_TEST_BACKEND_*
+ * @index: hciN index for BTINTEL_TEST_BACKEND_HCI_INDEX
+ * @hdevp: Set to the referenced controller, NULL for the virtual HCI
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_pipe_attach(struct btintel_test_device *dev,
+				    struct btintel_test_pipe *p, u32 backend,
+				    u32 index, struct hci_dev **hdevp)
+{
+	struct hci_dev *hdev = NULL;
+	int ret;
+
+	*hdevp = NULL;
+
+	if (backend != BTINTEL_TEST_BACKEND_EMUL) {
+		hdev = btintel_test_hdev_get(dev, backend, index);
+		if (!hdev)
+			return -ENODEV;
+	}
+
+	ret = btintel_test_pipe_attach_hdev(p, hdev);
+	if (!ret)
+		*hdevp = hdev;
+	if (hdev)
+		hci_dev_put(hdev);
+	return ret;
+}
+
+/**
+ * btintel_test_pipe_detach - Disconnect pipeline state from its backend
+ * @dev: Device structure
+ * @hdev: Controller the pipeline was attached to, or NULL
+ * @hdev: Controller from btintel_test_pipe_attach(), or NULL
+ * @err: Run ended in error, possibly with commands still in flight
+ */
+static void btintel_test_pipe_detach(struct btintel_test_device *dev,
+				     struct btintel_test_pipe *p,
+				     struct hci_dev *hdev, int err)
+{
+	/* Callbacks of the virtual HCI must not outlive @p */
+	if (err && !hdev)
+		btintel_test_emul_hci_flush(&dev->emul);
+	if (p->sock)
+		sock_release(p->sock);
+	if (hdev)
+		hci_dev_put(hdev);
+}
+
+/**
+ * btintel_test_pipe_recv_evt - Receive the next command event from the tap
+ * @p: Pipeline state with a raw socket
+ * @evt: Completion out
+ * @flags: MSG_DONTWAIT to return at once if nothing is queued
+ *
+ * Return: 0 on success, -EAGAIN if nothing arrived, -EINTR or another
+ * negative error code
+ */
+static int btintel_test_pipe_recv_evt(struct btintel_test_pipe *p,
+				      struct btintel_test_pipe_evt *evt,
+				      int flags)
+{
+	u8 buf[1 + HCI_EVENT_HDR_SIZE + sizeof(struct hci_ev_cmd_status) + 1];
+	struct kvec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+	struct msghdr msg = {};
+	struct hci_event_hdr *hdr = (void *)&buf[1];
+	int len;
+
+	for (;;) {
+		len = kernel_recvmsg(p->sock, &msg, &iov, 1, sizeof(buf), flags);
+		if (len < 0)
+			return len == -ERESTARTSYS ? -EINTR : len;
+
+		evt->time_ns = ktime_get_ns();
+
+		if (len < 1 + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT)
+			continue;
+
+		if (hdr->evt == HCI_EV_CMD_COMPLETE &&
+		    len >= 1 + HCI_EVENT_HDR_SIZE + sizeof(struct hci_ev_cmd_complete)) {
+			struct hci_ev_cmd_complete *ev = (void *)(hdr + 1);
+
+			evt->ncmd = ev->ncmd;
+			evt->opcode = __le16_to_cpu(ev->opcode);
+			/* Status is the first return parameter */
+			evt->status = len > 1 + HCI_EVENT_HDR_SIZE + sizeof(*ev) ?
+				      buf[1 + HCI_EVENT_HDR_SIZE + sizeof(*ev)] : 0;
+			return 0;
+		}
+
+		if (hdr->evt == HCI_EV_CMD_STATUS &&
+		    len >= 1 + HCI_EVENT_HDR_SIZE + sizeof(struct hci_ev_cmd_status)) {
+			struct hci_ev_cmd_status *ev = (void *)(hdr + 1);
+
+			evt->ncmd = ev->ncmd;
+			evt->opcode = __le16_to_cpu(ev->opcode);
+			evt->status = ev->status;
+			return 0;
+		}
+	}
+}
+
+/**
+ * btintel_test_pipe_poll_evt - Busy-poll for the next command completion
+ * @p: Pipeline state
+ * @evt: Completion out
+ *
+ * Spins for at most @p->poll_ns, and gives up early if the scheduler wants
+ * the CPU back, since the completion may depend on the task we displace.
+ *
+ * Return: 0 on success, -EAGAIN if the budget ran out, or another negative
+ * error code
+ */
+static int btintel_test_pipe_poll_evt(struct btintel_test_pipe *p,
+				      struct btintel_test_pipe_evt *evt)
+{
+	u64 deadline = ktime_get_ns() + p->poll_ns;
+	int ret;
+
+	do {
+		if (!p->sock) {
+			if (READ_ONCE(p->head) != p->tail) {
+				spin_lock_bh(&p->lock);
+				*evt = p->evts[p->tail++ % BTINTEL_TEST_PIPE_MAX_DEPTH];
+				spin_unlock_bh(&p->lock);
+				return 0;
+			}
+		} else {
+			ret = btintel_test_pipe_recv_evt(p, evt, MSG_DONTWAIT);
+			if (ret != -EAGAIN)
+				return ret;
+		}
+		cpu_relax();
+	} while (ktime_get_ns() < deadline && !need_resched());
+
+	return -EAGAIN;
+}
+
+/**
+ * btintel_test_pipe_next_evt - Wait for the next command completion
+ * @p: Pipeline state
+ * @evt: Completion out
+ *
+ * Return: 0 on success, -ETIMEDOUT, -EINTR or another negative error code
+ */
+static int btintel_test_pipe_next_evt(struct btintel_test_pipe *p,
+				      struct btintel_test_pipe_evt *evt)
+{
+	long left;
+	int ret;
+
+	if (p->poll_ns) {
+		ret = btintel_test_pipe_poll_evt(p, evt);
+		if (!ret)
+			p->polled++;
+		if (ret != -EAGAIN)
+			return ret;
+		p->poll_fallbacks++;
+	}
+
+	if (!p->sock) {
+		left = wait_event_interruptible_timeout(p->wait,
+							READ_ONCE(p->head) != p->tail,
+							HCI_CMD_TIMEOUT);
+		if (left < 0)
+			return -EINTR;
+		if (!left)
+			return -ETIMEDOUT;
+
+		spin_lock_bh(&p->lock);
+		*evt = p->evts[p->tail++ % BTINTEL_TEST_PIPE_MAX_DEPTH];
+		spin_unlock_bh(&p->lock);
+		return 0;
+	}
+
+	ret = btintel_test_pipe_recv_evt(p, evt, 0);
+
+	return ret == -EAGAIN ? -ETIMEDOUT : ret;
+}
+
+/**
+ * btintel_test_pipe_cmd_alloc - Build an HCI command for raw submission
+ * @opcode: HCI opcode
+ * @plen: Parameter length
+ * @param: Parameters
+ *
+ * Return: Command, or NULL
+ */
+static struct sk_buff *btintel_test_pipe_cmd_alloc(u16 opcode, u8 plen,
+						   const void *param)
+{
+	struct hci_command_hdr *hdr;
+	struct sk_buff *skb;
+
+	skb = bt_skb_alloc(HCI_COMMAND_HDR_SIZE + plen, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	hdr = skb_put(skb, HCI_COMMAND_HDR_SIZE);
+	hdr->opcode = cpu_to_le16(opcode);
+	hdr->plen = plen;
+	skb_put_data(skb, param, plen);
+	hci_skb_pkt_type(skb) = HCI_COMMAND_PKT;
+	hci_skb_opcode(skb) = opcode;
+
+	return skb;
+}
+
+/**
+ * btintel_test_pipe_core_busy - Check whether the HCI core uses the controller
+ * @hdev: Controller, or NULL for the virtual HCI
+ *
+ * Commands sent around the HCI core's queue don't count against its
+ * cmd_cnt, and the core's commands don't count against the credits an
+ * engine tracks. Engines therefore submit nothing while the core has a
+ * command in flight or queued; its completion reaches the tap as well and
+ * brings the credits up to date.
+ *
+ * Return: true if the engine should hold back its next command
+ */
+static bool btintel_test_pipe_core_busy(struct hci_dev *hdev)
+{
+	return hdev && (!atomic_read(&hdev->cmd_cnt) ||
+			!skb_queue_empty(&hdev->cmd_q));
+}
+
+/**
+ * btintel_test_pipe_send - Submit a command around the HCI core's queue
+ * @dev: Device structure
+ * @p: Pipeline state the completion is reported to, with fewer than
+ *     BTINTEL_TEST_PIPE_MAX_DEPTH commands in flight
+ * @hdev: Controller, or NULL for the virtual HCI
+ * @skb: Command from btintel_test_pipe_cmd_alloc()
+ */
+static void btintel_test_pipe_send(struct btintel_test_device *dev,
+				   struct btintel_test_pipe *p,
+				   struct hci_dev *hdev, struct sk_buff *skb)
+{
+	struct btintel_test_pipe_cmd *cmd = &p->inflight[p->outstanding++];
+
+	cmd->opcode = hci_skb_opcode(skb);
+	cmd->send_ns = ktime_get_ns();
+
+	if (hdev) {
+		skb_queue_tail(&hdev->raw_q, skb);
+		queue_work(hdev->workqueue, &hdev->tx_work);
+	} else {
+		btintel_test_emul_hci_send(&dev->emul, skb,
+					   btintel_test_pipe_emul_complete, p);
+	}
+}
+
+/**
+ * btintel_test_pipe_complete - Match a completion to a command in flight
+ * @p: Pipeline state
+ * @evt: Completion from btintel_test_pipe_next_evt()
+ * @send_ns: Set to the submission time of the completed command
+ *
+ * A controller may complete commands with different opcodes out of order,
+ * so a completion goes to the oldest command in flight with its opcode.
+ *
+ * Return: true if @evt completed one of the pipeline's commands, false if
+ * it is for a command the HCI core sent itself
+ */
+static bool btintel_test_pipe_complete(struct btintel_test_pipe *p,
+				       const struct btintel_test_pipe_evt *evt,
+				       u64 *send_ns)
+{
+	u32 i;
+
+	for (i = 0; i < p->outstanding; i++) {
+		if (p->inflight[i].opcode != evt->opcode)
+			continue;
+
+		*send_ns = p->inflight[i].send_ns;
+		p->outstanding--;
+		memmove(&p->inflight[i], &p->inflight[i + 1],
+			(p->outstanding - i) * sizeof(p->inflight[0]));
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * btintel_test_pipe_account - Integrate commands in flight over time
+ * @p: Pipeline state
+ * @now: Current time
+ */
+static void btintel_test_pipe_account(struct btintel_test_pipe *p, u64 now)
+{
+	p->area += (u64)p->outstanding * (now - p->last_ns);
+	p->last_ns = now;
+}
+
+/**
+ * btintel_test_hci_pipeline - Keep up to N HCI commands in flight
+ * @dev: Device structure
+ * @req: Parameters in, results out
+ *
+ * hci_cmd_sync() and the HCI core's command queue allow one command in
+ * flight. This engine instead queues commands straight to the transport
+ * and does its own flow control from the Num_HCI_Command_Packets value of
+ * every Command Complete/Status event, so the controller's real credit
+ * limit is what bounds the pipeline. It yields to commands of the HCI
+ * core, see btintel_test_pipe_core_busy().
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_hci_pipeline(struct btintel_test_device *dev,
+				     struct btintel_test_hci_pipeline *req)
+{
+	struct btintel_test_lat_acc latency;
+	struct btintel_test_emul_cfg saved;
+	struct btintel_test_pipe_evt evt;
+	struct btintel_test_pipe *p;
+	struct hci_dev *hdev = NULL;
+	u32 submitted = 0, credits;
+	u64 start, wait_ns, send_ns;
+	bool starving;
+	int ret = 0;
+
+	if (!req->depth || req->depth > BTINTEL_TEST_PIPE_MAX_DEPTH ||
+	    !req->count || req->count > BTINTEL_TEST_PIPE_MAX_COMMANDS ||
+	    req->plen > BTINTEL_TEST_JOB_HCI_MAX_PARAM ||
+	    req->flags & ~BTINTEL_TEST_HCI_POLL)
+		return -EINVAL;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+
+	if (req->flags & BTINTEL_TEST_HCI_POLL)
+		p->poll_ns = BTINTEL_TEST_POLL_DEFAULT_BUDGET_NS;
+
+	if (req->backend == BTINTEL_TEST_BACKEND_EMUL) {
+		struct btintel_test_emul_cfg cfg = {
+			.latency_ns = req->emul_latency_ns,
+			.jitter_ns = req->emul_jitter_ns,
+			.credits = req->emul_credits,
+		};
+
+		ret = btintel_test_emul_hci_config(&dev->emul, &cfg, &saved);
+		if (ret)
+			goto out_free;
+	}
+
+	ret = btintel_test_pipe_attach(dev, p, req->backend, req->hci_index,
+				       &hdev);
+	if (ret)
+		goto out_restore;
+
+	/* Every controller accepts one command until it says otherwise */
+	credits = hdev ? 1 : dev->emul.credits;
+
+	btintel_test_lat_init(&latency);
+	req->completed = 0;
+	req->errors = 0;
+	req->max_outstanding = 0;
+	req->max_credits = credits;
+	req->elapsed_ns = 0;
+	req->cmds_per_sec = 0;
+	req->starved_ns = 0;
+	req->avg_outstanding_milli = 0;
+	req->polled = 0;
+	req->poll_fallbacks = 0;
+	memset(&req->latency, 0, sizeof(req->latency));
+
+	start = ktime_get_ns();
+	p->last_ns = start;
+
+	while (req->completed < req->count) {
+		while (submitted < req->count && p->outstanding < req->depth &&
+		       credits && !btintel_test_pipe_core_busy(hdev)) {
+			struct sk_buff *skb;
+
+			skb = btintel_test_pipe_cmd_alloc(req->opcode, req->plen,
+							  req->param);
+			if (!skb) {
+				ret = -ENOMEM;
+				goto out_drain;
+			}
+
+			btintel_test_pipe_account(p, ktime_get_ns());
+			btintel_test_pipe_send(dev, p, hdev, skb);
+
+			credits--;
+			submitted++;
+			req->max_outstanding = max(req->max_outstanding,
+						   p->outstanding);
+		}
+
+		starving = submitted < req->count &&
+			   p->outstanding < req->depth && !credits;
+		wait_ns = ktime_get_ns();
+
+		ret = btintel_test_pipe_next_evt(p, &evt);
+		if (ret)
+			goto out_drain;
+
+		btintel_test_pipe_account(p, evt.time_ns);
+		if (starving)
+			req->starved_ns += evt.time_ns - wait_ns;
+
+		credits = evt.ncmd;
+		req->max_credits = max_t(u32, req->max_credits, credits);
+
+		/* Credit updates for commands the HCI core sent itself */
+		if (!btintel_test_pipe_complete(p, &evt, &send_ns))
+			continue;
+
+		btintel_test_lat_add(&latency, evt.time_ns - send_ns);
+		req->completed++;
+		if (evt.status)
+			req->errors++;
+	}
+
+	req->elapsed_ns = p->last_ns - start;
+	if (req->elapsed_ns) {
+		req->cmds_per_sec = div64_u64((u64)req->completed * NSEC_PER_SEC,
+					      req->elapsed_ns);
+		req->avg_outstanding_milli = div64_u64(p->area * 1000,
+						       req->elapsed_ns);
+	}
+	req->polled = p->polled;
+	req->poll_fallbacks = p->poll_fallbacks;
+	btintel_test_lat_finish(&latency, &req->latency);
+
+	pr_debug_dev("HCI pipeline: %u commands, %llu/s, starved %llu ns\n",
+		     req->completed, req->cmds_per_sec, req->starved_ns);
+
+out_drain:
+	btintel_test_pipe_detach(dev, p, hdev, ret);
+out_restore:
+	if (req->backend == BTINTEL_TEST_BACKEND_EMUL)
+		btintel_test_emul_hci_restore(&dev->emul, &saved);
+out_free:
+	kfree(p);
+	return ret;
+}
+
+/**
+ * btintel_test_ioctl_hci_pipeline - Handle BTINTEL_TEST_IOC_HCI_PIPELINE
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_hci_pipeline
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_hci_pipeline(struct btintel_test_device *dev,
+					   void __user *argp)
+{
+	struct btintel_test_hci_pipeline *req;
+	int ret;
+
+	req = memdup_user(argp, sizeof(*req));
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	ret = mutex_lock_interruptible(&dev->lock);
+	if (ret)
+		goto out_free;
+
+	ret = btintel_test_hci_pipeline(dev, req);
+	mutex_unlock(&dev->lock);
+
+	if (!ret && copy_to_user(argp, req, sizeof(*req)))
+		ret = -EFAULT;
+
+out_free:
+	kfree(req);
+	return ret;
+}
+
+/* ============================================================================
+ * PARALLEL TEST EXECUTOR
+ * ============================================================================ */
+
+/**
+ * btintel_test_exec_pending - Jobs queued, running or awaiting collection
+ * @exec: Executor
+ *
+ * Return: Number of jobs not collected yet
+ */
+static u32 btintel_test_exec_pending(struct btintel_test_exec *exec)
+{
+	return atomic_read(&exec->pending);
+}
+
+/**
+ * btintel_test_exec_pop - Take the oldest job from a worker's own queue
+ * @w: Worker
+ *
+ * Return: Job, or NULL if the queue is empty
+ */
+static struct btintel_test_exec_job *btintel_test_exec_pop(struct btintel_test_exec_worker *w)
+{
+	struct btintel_test_exec_job *job;
+
+	spin_lock(&w->lock);
+	job = list_first_entry_or_null(&w->queue, struct btintel_test_exec_job,
+				       node);
+	if (job)
+		list_del(&job->node);
+	spin_unlock(&w->lock);
+
+	return job;
+}
+
+/**
+ * btintel_test_exec_steal - Take the newest job from another worker's queue
+ * @w: Idle worker looking for work
+ *
+ * Victims are scanned starting with the next worker so that idle workers
+ * spread out instead of all hitting the same queue.
+ *
+ * Return: Job, or NULL if every queue is empty
+ */
+static struct btintel_test_exec_job *btintel_test_exec_steal(struct btintel_test_exec_worker *w)
+{
+	struct btintel_test_exec *exec = w->exec;
+	struct btintel_test_exec_job *job = NULL;
+	unsigned int i;
+
+	for (i = 1; i < exec->nr_workers && !job; i++) {
+		struct btintel_test_exec_worker *victim =
+			&exec->workers[(w->index + i) % exec->nr_workers];
+
+		spin_lock(&victim->lock);
+		if (!list_empty(&victim->queue)) {
+			job = list_last_entry(&victim->queue,
+					      struct btintel_test_exec_job, node);
+			list_del(&job->node);
+		}
+		spin_unlock(&victim->lock);
+	}
+
+	return job;
+}
+
+/**
+ * btintel_test_exec_reg_sweep - Read a range of controller registers
+ * @dev: Device structure
+ * @job: Job description
+ * @res: Result to fill in
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_exec_reg_sweep(struct btintel_test_device *dev,
+				       struct btintel_test_job *job,
+				       struct btintel_test_job_result *res)
+{
+	struct btintel_pcie_data *btintel_data;
+	u32 stride = job->reg.stride ? job->reg.stride : 4;
+	u64 end;
+	u32 i;
+
+	if (job->backend != BTINTEL_TEST_BACKEND_HW || !dev->pdev)
+		return -ENODEV;
+
+	btintel_data = pci_get_drvdata(dev->pdev);
+	if (!btintel_data || !btintel_data->base_addr)
+		return -ENODEV;
+
+	end = job->reg.offset + (u64)job->reg.count * stride;
+	if (!IS_ALIGNED(job->reg.offset, 4) || !IS_ALIGNED(stride, 4) ||
+	    end > pci_resource_len(dev->pdev, 0))
+		return -EINVAL;
+
+	for (i = 0; i < job->reg.count; i++) {
+		res->value ^= BTINTEL_TEST_READ_REG(btintel_data->base_addr,
+						    job->reg.offset + i * stride);
+		res->ops++;
+	}
+
+	return 0;
+}
+
+/**
+ * btintel_test_exec_buf_pattern - Fill a scratch buffer and verify it
+ * @job: Job description
+ * @res: Result to fill in
+ *
+ * Return: 0 on success, -ECANCELED if the executor was stopped part way,
+ * or another negative error code
+ */
+static int btintel_test_exec_buf_pattern(struct btintel_test_job *job,
+					 struct btintel_test_job_result *res)
+{
+	u32 words = job->buf.size / sizeof(u32);
+	u32 iter, i, x;
+	u32 *buf;
+	int ret = 0;
+
+	if (!words || job->buf.size > BTINTEL_TEST_JOB_BUF_MAX_SIZE ||
+	    job->buf.iterations > BTINTEL_TEST_JOB_BUF_MAX_ITERATIONS)
+		return -EINVAL;
+
+	buf = kvmalloc_array(words, sizeof(u32), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	for (iter = 0; iter < max(job->buf.iterations, 1U); iter++) {
+		/* Executor teardown waits for us; don't make it wait long */
+		if (kthread_should_stop()) {
+			ret = -ECANCELED;
+			break;
+		}
+
+		/* xorshift32, never seeded with 0 */
+		x = (job->buf.seed + iter) | 1;
+		for (i = 0; i < words; i++) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			buf[i] = x;
+		}
+
+		x = (job->buf.seed + iter) | 1;
+		for (i = 0; i < words; i++) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			if (buf[i] != x)
+				res->value++;
+		}
+
+		res->ops += words * sizeof(u32);
+		cond_resched();
+	}
+
+	kvfree(buf);
+	return ret;
+}
+
+/**
+ * btintel_test_exec_hci_batch - Send the same HCI command repeatedly
+ * @dev: Device structure
+ * @job: Job description
+ * @res: Result to fill in
+ *
+ * Return: 0 on success, -ECANCELED if the executor was stopped part way,
+ * or another negative error code
+ */
+static int btintel_test_exec_hci_batch(struct btintel_test_device *dev,
+				       struct btintel_test_job *job,
+				       struct btintel_test_job_result *res)
+{
+	struct hci_dev *hdev = NULL;
+	struct sk_buff *skb;
+	int ret = 0;
+	u32 i;
+
+	if (job->hci.plen > BTINTEL_TEST_JOB_HCI_MAX_PARAM ||
+	    job->hci.count > BTINTEL_TEST_JOB_HCI_MAX_COUNT ||
+	    job->hci.flags & ~BTINTEL_TEST_HCI_POLL)
+		return -EINVAL;
+
+	if (job->backend != BTINTEL_TEST_BACKEND_EMUL) {
+		hdev = btintel_test_hdev_get(dev, job->backend, job->hci_index);
+		if (!hdev)
+			return -ENODEV;
+	}
+
+	for (i = 0; i < job->hci.count; i++) {
+		/* Executor teardown waits for us; don't make it wait long */
+		if (kthread_should_stop()) {
+			ret = -ECANCELED;
+			break;
+		}
+
+		skb = btintel_test_hci_cmd(dev, hdev, job->hci.opcode,
+					   job->hci.plen, job->hci.param,
+					   job->hci.flags);
+		res->ops++;
+		if (IS_ERR(skb)) {
+			res->value++;
+			continue;
+		}
+		if (!skb->len || skb->data[0])
+			res->value++;
+		kfree_skb(skb);
+	}
+
+	if (hdev)
+		hci_dev_put(hdev);
+	return ret;
+}
+
+/**
+ * btintel_test_exec_run - Execute one job and queue its result
+ * @w: Worker running the job
+ * @job: Job to run
+ */
+static void btintel_test_exec_run(struct btintel_test_exec_worker *w,
+				  struct btintel_test_exec_job *job)
+{
+	struct btintel_test_exec *exec = w->exec;
+	struct btintel_test_job_result *res = &job->res;
+	u64 start = ktime_get_ns();
+	int ret;
+
+	res->cpu = raw_smp_processor_id();
+	res->stolen = job->owner != w->index;
+	res->queue_ns = start - job->submit_ns;
+
+	switch (job->job.type) {
+	case BTINTEL_TEST_JOB_REG_SWEEP:
+		ret = btintel_test_exec_reg_sweep(exec->dev, &job->job, res);
+		break;
+	case BTINTEL_TEST_JOB_BUF_PATTERN:
+		ret = btintel_test_exec_buf_pattern(&job->job, res);
+		break;
+	case BTINTEL_TEST_JOB_HCI_BATCH:
+		ret = btintel_test_exec_hci_batch(exec->dev, &job->job, res);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	res->status = ret;
+	res->run_ns = ktime_get_ns() - start;
+
+	spin_lock(&exec->done_lock);
+	list_add_tail(&job->node, &exec->done);
+	spin_unlock(&exec->done_lock);
+
+	wake_up_interruptible(&exec->done_wq);
+}
+
+/**
+ * btintel_test_exec_worker_fn - Worker thread main loop
+ * @data: struct btintel_test_exec_worker
+ *
+ * Return: 0
+ */
+static int btintel_test_exec_worker_fn(void *data)
+{
+	struct btintel_test_exec_worker *w = data;
+	struct btintel_test_exec *exec = w->exec;
+	struct btintel_test_exec_job *job;
+
+	while (!kthread_should_stop()) {
+		job = btintel_test_exec_pop(w);
+		if (!job)
+			job = btintel_test_exec_steal(w);
+		if (!job) {
+			wait_event_interruptible(exec->work_wq,
+						 kthread_should_stop() ||
+						 atomic_read(&exec->queued));
+			continue;
+		}
+
+		atomic_dec(&exec->queued);
+		btintel_test_exec_run(w, job);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/**
+ * btintel_test_exec_stop - Stop the workers and drop every job
+ * @exec: Executor
+ *
+ * Context: Called with @exec->lock held, or at module unload
+ */
+static void btintel_test_exec_stop(struct btintel_test_exec *exec)
+{
+	struct btintel_test_exec_job *job, *tmp;
+	unsigned int i;
+
+	for (i = 0; i < exec->nr_workers; i++) {
+		if (exec->workers[i].task)
+			kthread_stop(exec->workers[i].task);
+	}
+
+	for (i = 0; i < exec->nr_workers; i++) {
+		list_for_each_entry_safe(job, tmp, &exec->workers[i].queue, node)
+			kfree(job);
+	}
+	list_for_each_entry_safe(job, tmp, &exec->done, node)
+		kfree(job);
+	INIT_LIST_HEAD(&exec->done);
+
+	atomic_set(&exec->queued, 0);
+	atomic_set(&exec->pending, 0);
+
+	kfree(exec->workers);
+	exec->workers = NULL;
+	exec->nr_workers = 0;
+}
+
+/**
+ * btintel_test_exec_start - Start the executor workers
+ * @exec: Executor, with no workers running
+ * @cfg: Worker count and CPU affinity
+ *
+ * Context: Called with @exec->lock held
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_exec_start(struct btintel_test_exec *exec,
+				   struct btintel_test_exec_config *cfg)
+{
+	struct btintel_test_exec_worker *workers;
+	unsigned int i, cpu, nr_workers;
+	cpumask_var_t cpus;
+	int ret = 0;
+
+	if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+		return -ENOMEM;
+
+	for (cpu = 0; cpu < min_t(unsigned int, nr_cpu_ids,
+				  BTINTEL_TEST_EXEC_CPU_WORDS * 64); cpu++) {
+		if (cfg->cpus[cpu / 64] & BIT_ULL(cpu % 64))
+			cpumask_set_cpu(cpu, cpus);
+	}
+	cpumask_and(cpus, cpus, cpu_online_mask);
+	if (cpumask_empty(cpus))
+		cpumask_copy(cpus, cpu_online_mask);
+
+	nr_workers = cfg->workers ? cfg->workers : cpumask_weight(cpus);
+	nr_workers = min_t(unsigned int, nr_workers,
+			   BTINTEL_TEST_EXEC_MAX_WORKERS);
+
+	workers = kcalloc(nr_workers, sizeof(*workers), GFP_KERNEL);
+	if (!workers) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		spin_lock_init(&workers[i].lock);
+		INIT_LIST_HEAD(&workers[i].queue);
+		workers[i].exec = exec;
+		workers[i].index = i;
+	}
+
+	exec->workers = workers;
+	exec->nr_workers = nr_workers;
+	exec->next_worker = 0;
+
+	cpu = cpumask_first(cpus);
+	for (i = 0; i < nr_workers; i++) {
+		struct task_struct *task;
+
+		task = kthread_create_on_node(btintel_test_exec_worker_fn,
+					      &workers[i], cpu_to_node(cpu),
+					      "btintel_test/%u:%u", cpu, i);
+		if (IS_ERR(task)) {
+			ret = PTR_ERR(task);
+			break;
+		}
+
+		kthread_bind(task, cpu);
+		workers[i].task = task;
+		workers[i].cpu = cpu;
+
+		cpu = cpumask_next(cpu, cpus);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpus);
+	}
+
+	for (i = 0; i < nr_workers && workers[i].task; i++)
+		wake_up_process(workers[i].task);
+
+	if (ret)
+		btintel_test_exec_stop(exec);
+	else
+		pr_debug_dev("Executor running %u workers\n", nr_workers);
+
+out:
+	free_cpumask_var(cpus);
+	return ret;
+}
+
+/**
+ * btintel_test_exec_init - Initialize the executor, without workers
+ * @exec: Executor
+ * @dev: Device structure the jobs run against
+ */
+static void btintel_test_exec_init(struct btintel_test_exec *exec,
+				   struct btintel_test_device *dev)
+{
+	exec->dev = dev;
+	mutex_init(&exec->lock);
+	atomic_set(&exec->queued, 0);
+	atomic_set(&exec->pending, 0);
+	init_waitqueue_head(&exec->work_wq);
+	init_waitqueue_head(&exec->done_wq);
+	spin_lock_init(&exec->done_lock);
+	INIT_LIST_HEAD(&exec->done);
+}
+
+/**
+ * btintel_test_ioctl_exec_config - Handle BTINTEL_TEST_IOC_EXEC_CONFIG
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_exec_config
+ *
+ * Return: 0 on success, -EBUSY while jobs are pending
+ */
+static int btintel_test_ioctl_exec_config(struct btintel_test_device *dev,
+					  void __user *argp)
+{
+	struct btintel_test_exec *exec = &dev->exec;
+	struct btintel_test_exec_config *cfg;
+	int ret;
+
+	cfg = memdup_user(argp, sizeof(*cfg));
+	if (IS_ERR(cfg))
+		return PTR_ERR(cfg);
+
+	if (cfg->workers > BTINTEL_TEST_EXEC_MAX_WORKERS) {
+		ret = -EINVAL;
+		goto out_free;
+	}
+
+	mutex_lock(&exec->lock);
+	if (btintel_test_exec_pending(exec)) {
+		ret = -EBUSY;
+	} else {
+		btintel_test_exec_stop(exec);
+		ret = btintel_test_exec_start(exec, cfg);
+	}
+	mutex_unlock(&exec->lock);
+
+out_free:
+	kfree(cfg);
+	return ret;
+}
+
+/**
+ * btintel_test_ioctl_exec_submit - Handle BTINTEL_TEST_IOC_EXEC_SUBMIT
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_exec_submit
+ *
+ * Jobs are spread round robin over the worker queues; idle workers steal
+ * from busy ones, so uneven jobs still keep every worker occupied.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_exec_submit(struct btintel_test_device *dev,
+					  void __user *argp)
+{
+	struct btintel_test_exec *exec = &dev->exec;
+	struct btintel_test_exec_submit sub;
+	struct btintel_test_exec_job **batch;
+	struct btintel_test_job *jobs;
+	u64 now;
+	u32 i;
+	int ret = 0;
+
+	if (copy_from_user(&sub, argp, sizeof(sub)))
+		return -EFAULT;
+
+	if (!sub.count || sub.count > BTINTEL_TEST_EXEC_MAX_JOBS)
+		return -EINVAL;
+
+	jobs = vmemdup_user(u64_to_user_ptr(sub.jobs),
+			    array_size(sub.count, sizeof(*jobs)));
+	if (IS_ERR(jobs))
+		return PTR_ERR(jobs);
+
+	batch = kvcalloc(sub.count, sizeof(*batch), GFP_KERNEL);
+	if (!batch) {
+		ret = -ENOMEM;
+		goto out_free_jobs;
+	}
+
+	for (i = 0; i < sub.count; i++) {
+		if ((jobs[i].type == BTINTEL_TEST_JOB_HCI_BATCH &&
+		     (jobs[i].hci.plen > BTINTEL_TEST_JOB_HCI_MAX_PARAM ||
+		      jobs[i].hci.count > BTINTEL_TEST_JOB_HCI_MAX_COUNT ||
+		      jobs[i].hci.flags & ~BTINTEL_TEST_HCI_POLL)) ||
+		    (jobs[i].type == BTINTEL_TEST_JOB_BUF_PATTERN &&
+		     jobs[i].buf.iterations > BTINTEL_TEST_JOB_BUF_MAX_ITERATIONS)) {
+			ret = -EINVAL;
+			goto out_free_batch;
+		}
+
+		batch[i] = kzalloc(sizeof(*batch[i]), GFP_KERNEL);
+		if (!batch[i]) {
+			ret = -ENOMEM;
+			goto out_free_batch;
+		}
+		batch[i]->job = jobs[i];
+		batch[i]->res.cookie = jobs[i].cookie;
+		batch[i]->res.type = jobs[i].type;
+	}
+
+	mutex_lock(&exec->lock);
+
+	if (!exec->nr_workers) {
+		struct btintel_test_exec_config cfg = {};
+
+		ret = btintel_test_exec_start(exec, &cfg);
+		if (ret)
+			goto out_unlock;
+	}
+
+	if (btintel_test_exec_pending(exec) + sub.count >
+	    BTINTEL_TEST_EXEC_MAX_PENDING) {
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+
+	now = ktime_get_ns();
+	for (i = 0; i < sub.count; i++) {
+		struct btintel_test_exec_worker *w;
+
+		w = &exec->workers[exec->next_worker++ % exec->nr_workers];
+		batch[i]->owner = w->index;
+		batch[i]->submit_ns = now;
+
+		spin_lock(&w->lock);
+		list_add_tail(&batch[i]->node, &w->queue);
+		spin_unlock(&w->lock);
+		batch[i] = NULL;
+	}
+
+	atomic_add(sub.count, &exec->pending);
+	atomic_add(sub.count, &exec->queued);
+	wake_up_all(&exec->work_wq);
+
+	sub.pending = btintel_test_exec_pending(exec);
+	if (copy_to_user(argp, &sub, sizeof(sub)))
+		ret = -EFAULT;
+
+out_unlock:
+	mutex_unlock(&exec->lock);
+out_free_batch:
+	for (i = 0; i < sub.count; i++)
+		kfree(batch[i]);
+	kvfree(batch);
+out_free_jobs:
+	kvfree(jobs);
+	return ret;
+}
+
+/**
+ * btintel_test_ioctl_exec_collect - Handle BTINTEL_TEST_IOC_EXEC_COLLECT
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_exec_collect
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_exec_collect(struct btintel_test_device *dev,
+					   void __user *argp)
+{
+	struct btintel_test_exec *exec = &dev->exec;
+	struct btintel_test_job_result __user *ures;
+	struct btintel_test_exec_collect col;
+	struct btintel_test_exec_job *job, *tmp;
+	LIST_HEAD(batch);
+	int ret = 0;
+
+	if (copy_from_user(&col, argp, sizeof(col)))
+		return -EFAULT;
+
+	if ((col.flags & BTINTEL_TEST_EXEC_WAIT) && col.max) {
+		ret = wait_event_interruptible(exec->done_wq,
+					       !list_empty_careful(&exec->done) ||
+					       !btintel_test_exec_pending(exec));
+		if (ret)
+			return ret;
+	}
+
+	col.count = 0;
+	spin_lock(&exec->done_lock);
+	list_for_each_entry_safe(job, tmp, &exec->done, node) {
+		if (col.count == col.max)
+			break;
+		list_move_tail(&job->node, &batch);
+		col.count++;
+	}
+	spin_unlock(&exec->done_lock);
+
+	atomic_sub(col.count, &exec->pending);
+	col.pending = btintel_test_exec_pending(exec);
+
+	ures = u64_to_user_ptr(col.results);
+	col.count = 0;
+	list_for_each_entry_safe(job, tmp, &batch, node) {
+		if (!ret && copy_to_user(&ures[col.count++], &job->res,
+					 sizeof(job->res)))
+			ret = -EFAULT;
+		kfree(job);
+	}
+
+	if (!ret && copy_to_user(argp, &col, sizeof(col)))
+		ret = -EFAULT;
+
+	return ret;
+}
+
+/* ============================================================================
+ * CONTROLLER MEMORY DUMPS
+ * ============================================================================ */
+
+/**
+ * btintel_test_dump_free - Free a dump and its pages
+ * @dump: Dump, may be NULL
+ */
+static void btintel_test_dump_free(struct btintel_test_dump *dump)
+{
+	unsigned int i;
+
+	if (!dump)
+		return;
+
+	for (i = 0; i < dump->nr_pages; i++)
+		__free_page(dump->pages[i]);
+	kvfree(dump->pages);
+	kfree(dump);
+}
+
+/**
+ * btintel_test_dump_alloc - Allocate a page-backed dump buffer
+ * @capacity: Largest stream the dump may hold
+ * @node: NUMA node of the pages, or NUMA_NO_NODE
+ *
+ * Return: Dump, or NULL
+ */
+static struct btintel_test_dump *btintel_test_dump_alloc(size_t capacity,
+							 int node)
+{
+	struct btintel_test_dump *dump;
+	unsigned int i, nr_pages = DIV_ROUND_UP(capacity, PAGE_SIZE);
+
+	dump = kzalloc(sizeof(*dump), GFP_KERNEL);
+	if (!dump)
+		return NULL;
+
+	dump->pages = kvcalloc(nr_pages, sizeof(*dump->pages), GFP_KERNEL);
+	if (!dump->pages)
+		goto err;
+
+	for (i = 0; i < nr_pages; i++) {
+		dump->pages[i] = alloc_pages_node(node, GFP_KERNEL, 0);
+		if (!dump->pages[i])
+			goto err;
+		dump->nr_pages++;
+	}
+
+	return dump;
+
+err:
+	btintel_test_dump_free(dump);
+	return NULL;
+}
+
+/**
+ * btintel_test_dump_append - Append bytes to the stream of a dump
+ * @dump: Dump
+ * @src: Data
+ * @len: Bytes to append, must fit in the dump
+ */
+static void btintel_test_dump_append(struct btintel_test_dump *dump,
+				     const void *src, size_t len)
+{
+	while (len) {
+		size_t off = offset_in_page(dump->size);
+		size_t n = min_t(size_t, len, PAGE_SIZE - off);
+
+		memcpy(page_address(dump->pages[dump->size >> PAGE_SHIFT]) + off,
+		       src, n);
+		dump->size += n;
+		src += n;
+		len -= n;
+	}
+}
+
+/**
+ * btintel_test_dump_read_mem - Read one chunk of controller memory
+ * @src: Emulated region
+ * @addr: Offset into @src
+ * @dst: Destination
+ * @len: Bytes to read, 4-byte multiple
+ * @delay_ns: Simulated access time of the emulated region
+ */
+static void btintel_test_dump_read_mem(const void *src, u64 addr,
+				       void *dst, size_t len, u32 delay_ns)
+{
+	memcpy(dst, src + addr, len);
+	if (delay_ns >= NSEC_PER_USEC * 10)
+		usleep_range(delay_ns / NSEC_PER_USEC,
+			     delay_ns / NSEC_PER_USEC + 1);
+	else if (delay_ns)
+		ndelay(delay_ns);
+}
+
+/**
+ * btintel_test_emul_mem_get - Get the emulated controller memory region
+ * @dev: Device structure
+ *
+ * The region looks like a sparsely used SRAM: a stretch of tagged words
+ * followed by zeroes, so dumps of it compress like real ones.
+ *
+ * Context: Called with @dev->lock held
+ * Return: Region of BTINTEL_TEST_DUMP_MAX_SIZE bytes, or NULL
+ */
+static u32 *btintel_test_emul_mem_get(struct btintel_test_device *dev)
+{
+	u32 i;
+
+	if (dev->emul_mem)
+		return dev->emul_mem;
+
+	dev->emul_mem = vzalloc_node(BTINTEL_TEST_DUMP_MAX_SIZE,
+				     btintel_test_alloc_node(dev));
+	if (!dev->emul_mem)
+		return NULL;
+
+	for (i = 0; i < BTINTEL_TEST_DUMP_MAX_SIZE / sizeof(u32) / 4; i++)
+		dev->emul_mem[i] = 0xb7000000 | (i * 4);
+
+	return dev->emul_mem;
+}
+
+/**
+ * btintel_test_dump_capture - Read a memory region into a dump stream
+ * @src: Emulated region the request was checked against
+ * @req: Parameters in, timings out
+ * @dump: Dump to fill
+ *
+ * Raw dumps are read chunk by chunk straight into the dump pages. LZ4
+ * dumps go through a staging block of BTINTEL_TEST_DUMP_LZ4_BLOCK bytes,
+ * compressed independently so that userspace can decode them one by one.
+ *
+ * Return: 0 on success, -EINTR if a signal arrived, or another negative
+ * error code
+ */
+static int btintel_test_dump_capture(const void *src,
+				     struct btintel_test_mem_dump *req,
+				     struct btintel_test_dump *dump)
+{
+	bool lz4 = req->flags & BTINTEL_TEST_DUMP_LZ4;
+	u32 chunk = req->chunk_size ? req->chunk_size : PAGE_SIZE;
+	void *stage = NULL, *packed = NULL, *wrkmem = NULL;
+	u32 done = 0, block, n;
+	u64 t;
+	int ret = 0;
+
+	if (lz4) {
+#if IS_REACHABLE(CONFIG_LZ4_COMPRESS)
+		stage = vmalloc(BTINTEL_TEST_DUMP_LZ4_BLOCK);
+		packed = vmalloc(LZ4_COMPRESSBOUND(BTINTEL_TEST_DUMP_LZ4_BLOCK));
+		wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+		if (!stage || !packed || !wrkmem) {
+			ret = -ENOMEM;
+			goto out;
+		}
+#else
+		return -EOPNOTSUPP;
+#endif
+	}
+
+	while (done < req->length) {
+		struct btintel_test_dump_block hdr;
+		int packed_len = 0;
+
+		block = lz4 ? min_t(u32, req->length - done,
+				    BTINTEL_TEST_DUMP_LZ4_BLOCK) :
+			      req->length - done;
+
+		/* Read the block, never crossing a dump page in raw mode */
+		t = ktime_get_ns();
+		for (n = 0; n < block; req->chunks++) {
+			u32 len = min(chunk, block - n);
+			void *dst;
+
+			if (lz4) {
+				dst = stage + n;
+			} else {
+				len = min_t(u32, len,
+					    PAGE_SIZE - offset_in_page(dump->size));
+				dst = page_address(dump->pages[dump->size >> PAGE_SHIFT]) +
+				      offset_in_page(dump->size);
+			}
+
+			btintel_test_dump_read_mem(src, req->address + done + n,
+						   dst, len,
+						   req->emul_chunk_delay_ns);
+			if (!lz4)
+				dump->size += len;
+			n += len;
+		}
+		req->capture_ns += ktime_get_ns() - t;
+
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			goto out;
+		}
+		done += block;
+
+		if (!lz4)
+			continue;
+
+#if IS_REACHABLE(CONFIG_LZ4_COMPRESS)
+		t = ktime_get_ns();
+		packed_len = LZ4_compress_default(stage, packed, block,
+						  LZ4_COMPRESSBOUND(BTINTEL_TEST_DUMP_LZ4_BLOCK),
+						  wrkmem);
+		req->compress_ns += ktime_get_ns() - t;
+#endif
+		hdr.raw_len = block;
+		if (packed_len > 0 && packed_len < block) {
+			hdr.stored_len = packed_len;
+			btintel_test_dump_append(dump, &hdr, sizeof(hdr));
+			btintel_test_dump_append(dump, packed, packed_len);
+		} else {
+			hdr.stored_len = block;
+			btintel_test_dump_append(dump, &hdr, sizeof(hdr));
+			btintel_test_dump_append(dump, stage, block);
+		}
+	}
+
+#if IS_REACHABLE(CONFIG_LZ4_COMPRESS)
+out:
+#endif
+	vfree(wrkmem);
+	vfree(packed);
+	vfree(stage);
+	return ret;
+}
+
+/**
+ * btintel_test_dump_fop_read - Stream a dump to userspace
+ * @filp: Dump file
+ * @buf: User-space buffer
+ * @count: Number of bytes to read
+ * @f_pos: File position
+ *
+ * Return: Number of bytes read, or negative error code
+ */
+static ssize_t btintel_test_dump_fop_read(struct file *filp, char __user *buf,
+					  size_t count, loff_t *f_pos)
+{
+	struct btintel_test_dump *dump = filp->private_data;
+	size_t done = 0;
+
+	if (*f_pos >= dump->size)
+		return 0;
+
+	count = min_t(size_t, count, dump->size - *f_pos);
+
+	while (done < count) {
+		size_t off = offset_in_page(*f_pos);
+		size_t n = min_t(size_t, count - done, PAGE_SIZE - off);
+
+		if (copy_to_user(buf + done,
+				 page_address(dump->pages[*f_pos >> PAGE_SHIFT]) + off,
+				 n))
+			return done ? done : -EFAULT;
+
+		done += n;
+		*f_pos += n;
+	}
+
+	return done;
+}
+
+/**
+ * btintel_test_dump_fop_llseek - Seek within a dump
+ * @filp: Dump file
+ * @offset: Offset
+ * @whence: SEEK_SET, SEEK_CUR or SEEK_END
+ *
+ * Return: New position, or negative error code
+ */
+static loff_t btintel_test_dump_fop_llseek(struct file *filp, loff_t offset,
+					   int whence)
+{
+	struct btintel_test_dump *dump = filp->private_data;
+
+	return fixed_size_llseek(filp, offset, whence, dump->size);
+}
+
+/**
+ * btintel_test_dump_fop_mmap - Map the pages of a dump read-only
+ * @filp: Dump file
+ * @vma: Mapping
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_dump_fop_mmap(struct file *filp,
+				      struct vm_area_struct *vma)
+{
+	struct btintel_test_dump *dump = filp->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	return vm_map_pages(vma, dump->pages, DIV_ROUND_UP(dump->size, PAGE_SIZE));
+}
+
+/**
+ * btintel_test_dump_fop_release - Free a dump once its file is closed
+ * @inode: Inode structure
+ * @filp: Dump file
+ *
+ * Return: 0
+ */
+static int btintel_test_dump_fop_release(struct inode *inode, struct file *filp)
+{
+	btintel_test_dump_free(filp->private_data);
+	return 0;
+}
+
+static const struct file_operations btintel_test_dump_fops = {
+	.owner = THIS_MODULE,
+	.read = btintel_test_dump_fop_read,
+	.llseek = btintel_test_dump_fop_llseek,
+	.mmap = btintel_test_dump_fop_mmap,
+	.release = btintel_test_dump_fop_release,
+};
+
+/**
+ * btintel_test_ioctl_mem_dump - Handle BTINTEL_TEST_IOC_MEM_DUMP
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_mem_dump
+ *
+ * The capture is complete before the ioctl returns; the returned file
+ * only hands out the already captured pages.
+ *
+ * BAR0 of the controller is CSR space, where a read can acknowledge an
+ * interrupt or pop a FIFO, and btintel_pcie offers no window onto
+ * controller memory to borrow. BTINTEL_TEST_DUMP_SRC_BAR is therefore
+ * refused.
+ *
+ * Return: 0 on success, -EOPNOTSUPP for BTINTEL_TEST_DUMP_SRC_BAR, or
+ * another negative error code
+ */
+static int btintel_test_ioctl_mem_dump(struct btintel_test_device *dev,
+				       void __user *argp)
+{
+	struct btintel_test_mem_dump req;
+	struct btintel_test_dump *dump;
+	struct file *file;
+	size_t capacity;
+	const void *src;
+	int ret, fd;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (req.source > BTINTEL_TEST_DUMP_SRC_EMUL ||
+	    req.flags & ~BTINTEL_TEST_DUMP_LZ4 ||
+	    !req.length || req.length > BTINTEL_TEST_DUMP_MAX_SIZE ||
+	    req.address > BTINTEL_TEST_DUMP_MAX_SIZE - req.length ||
+	    !IS_ALIGNED(req.address, 4) || !IS_ALIGNED(req.length, 4) ||
+	    !IS_ALIGNED(req.chunk_size, 4) ||
+	    req.emul_chunk_delay_ns > BTINTEL_TEST_DUMP_MAX_CHUNK_DELAY_NS)
+		return -EINVAL;
+
+	if (req.source == BTINTEL_TEST_DUMP_SRC_BAR)
+		return -EOPNOTSUPP;
+
+	/* Stored blocks never exceed their raw size, plus one header each */
+	capacity = req.length;
+	if (req.flags & BTINTEL_TEST_DUMP_LZ4)
+		capacity += DIV_ROUND_UP(req.length, BTINTEL_TEST_DUMP_LZ4_BLOCK) *
+			    sizeof(struct btintel_test_dump_block);
+
+	dump = btintel_test_dump_alloc(capacity, btintel_test_alloc_node(dev));
+	if (!dump)
+		return -ENOMEM;
+
+	req.chunks = 0;
+	req.capture_ns = 0;
+	req.compress_ns = 0;
+
+	ret = mutex_lock_interruptible(&dev->lock);
+	if (ret)
+		goto err_free;
+	src = btintel_test_emul_mem_get(dev);
+	if (src)
+		dev->emul_mem_users++;
+	mutex_unlock(&dev->lock);
+	if (!src) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	/* Pinned by emul_mem_users; the delays must not stall other ioctls */
+	ret = btintel_test_dump_capture(src, &req, dump);
+
+	mutex_lock(&dev->lock);
+	dev->emul_mem_users--;
+	mutex_unlock(&dev->lock);
+	if (ret)
+		goto err_free;
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		ret = fd;
+		goto err_free;
+	}
+
+	file = anon_inode_getfile("[btintel_test_dump]", &btintel_test_dump_fops,
+				  dump, O_RDONLY);
+	if (IS_ERR(file)) {
+		ret = PTR_ERR(file);
+		goto err_put_fd;
+	}
+
+	req.fd = fd;
+	req.stream_size = dump->size;
+
+	/* Only publish the fd once userspace has been told its number */
+	if (copy_to_user(argp, &req, sizeof(req))) {
+		/* Releasing the file frees @dump */
+		fput(file);
+		put_unused_fd(fd);
+		return -EFAULT;
+	}
+
+	fd_install(fd, file);
+
+	pr_debug_dev("Dumped %u bytes into a %llu byte stream\n", req.length,
+		     req.stream_size);
+	return 0;
+
+err_put_fd:
+	put_unused_fd(fd);
+err_free:
+	btintel_test_dump_free(dump);
+	return ret;
+}
+
+/* ============================================================================
+ * RESET CYCLE STRESS
+ * ============================================================================ */
+
+/**
+ * btintel_test_reset_boot_stage - Sample the boot stage register
+ * @dev: Device structure
+ * @valid: Set to the stages the sample says anything about
+ *
+ * The btintel_pcie recovery path unbinds and rescans the function, so
+ * neither the pci_dev nor its driver data found at load time can be
+ * trusted. Only read the register while a driver is bound to the live
+ * function; a sample that races with the rebind is skipped.
+ *
+ * Return: BTINTEL_TEST_RESET_STAGE_* bits set in the register
+ */
+static u32 btintel_test_reset_boot_stage(struct btintel_test_device *dev,
+					 u32 *valid)
+{
+	u32 stages = 0;
+
+	*valid = 0;
+
+#ifdef BTINTEL_PCIE_CSR_BOOT_STAGE_REG
+	{
+		struct btintel_pcie_data *btintel_data;
+		struct pci_dev *pdev;
+		u32 reg;
+
+		pdev = btintel_test_pdev_get(dev);
+		if (!pdev)
+			return 0;
+
+		if (!device_trylock(&pdev->dev))
+			goto put;
+
+		btintel_data = pci_get_drvdata(pdev);
+		if (!btintel_data || !btintel_data->base_addr)
+			goto unlock;
+
+		reg = BTINTEL_TEST_READ_REG(btintel_data->base_addr,
+					    BTINTEL_PCIE_CSR_BOOT_STAGE_REG);
+		if (reg == U32_MAX)
+			goto unlock;	/* Function in reset */
+
+		*valid = BTINTEL_TEST_RESET_BOOT_STAGES;
+		if (reg & BTINTEL_PCIE_CSR_BOOT_STAGE_ROM)
+			stages |= BIT(BTINTEL_TEST_RESET_STAGE_ROM);
+		if (reg & BTINTEL_PCIE_CSR_BOOT_STAGE_IML)
+			stages |= BIT(BTINTEL_TEST_RESET_STAGE_IML);
+		if (reg & BTINTEL_PCIE_CSR_BOOT_STAGE_OPFW)
+			stages |= BIT(BTINTEL_TEST_RESET_STAGE_OPFW);
+		if (reg & BTINTEL_PCIE_CSR_BOOT_STAGE_ALIVE)
+			stages |= BIT(BTINTEL_TEST_RESET_STAGE_ALIVE);
+unlock:
+		device_unlock(&pdev->dev);
+put:
+		pci_dev_put(pdev);
+	}
+#endif
+
+	return stages;
+}
+
+/**
+ * btintel_test_reset_observe - Sample the state of the controller
+ * @dev: Device structure
+ * @run: Run state
+ * @now: Sample time
+ * @valid: Set to the stages the sample says anything about
+ *
+ * The emulated controller is ready and fully booted until its scripted
+ * DOWN time, then reports each boot stage and READY from its scripted time.
+ *
+ * Return: Bitmask of the BTINTEL_TEST_RESET_STAGE_* conditions that hold
+ */
+static u32 btintel_test_reset_observe(struct btintel_test_device *dev,
+				      struct btintel_test_reset_run *run,
+				      u64 now, u32 *valid)
+{
+	struct hci_dev *hdev;
+	u32 stages = 0;
+	bool ready;
+	int i;
+
+	if (run->req->backend == BTINTEL_TEST_BACKEND_EMUL) {
+		*valid = BTINTEL_TEST_RESET_BOOT_STAGES;
+		if (now < run->due[BTINTEL_TEST_RESET_STAGE_DOWN])
+			return BTINTEL_TEST_RESET_BOOT_STAGES |
+			       BIT(BTINTEL_TEST_RESET_STAGE_READY);
+
+		for (i = BTINTEL_TEST_RESET_STAGE_ROM;
+		     i < BTINTEL_TEST_RESET_STAGES; i++)
+			if (now >= run->due[i])
+				stages |= BIT(i);
+		ready = stages & BIT(BTINTEL_TEST_RESET_STAGE_READY);
+	} else {
+		stages = btintel_test_reset_boot_stage(dev, valid);
+
+		hdev = hci_dev_get(run->hci_id);
+		ready = hdev && test_bit(HCI_UP, &hdev->flags) &&
+			!test_bit(HCI_INIT, &hdev->flags) &&
+			!hci_dev_test_flag(hdev, HCI_SETUP);
+		if (hdev)
+			hci_dev_put(hdev);
+	}
+
+	stages |= ready ? BIT(BTINTEL_TEST_RESET_STAGE_READY) :
+			  BIT(BTINTEL_TEST_RESET_STAGE_DOWN);
+
+	return stages;
+}
+
+/**
+ * btintel_test_reset_issue - Start one reset of the controller
+ * @dev: Device structure
+ * @run: Run state
+ *
+ * A real controller is reset through its driver's recovery hook, the one
+ * the HCI core uses on a command timeout.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_reset_issue(struct btintel_test_device *dev,
+				    struct btintel_test_reset_run *run)
+{
+	struct btintel_test_reset_cycle *req = run->req;
+	struct hci_dev *hdev;
+	u64 due;
+	int i;
+
+	run->t0 = ktime_get_ns();
+	btintel_test_rsp_cache_invalidate(dev);
+
+	if (req->backend == BTINTEL_TEST_BACKEND_EMUL) {
+		due = run->t0;
+		for (i = 0; i < BTINTEL_TEST_RESET_STAGES; i++) {
+			due += req->emul_stage_delay_ns[i];
+			if (req->emul_jitter_ns)
+				due += get_random_u32() % req->emul_jitter_ns;
+			run->due[i] = due;
+		}
+		return 0;
+	}
+
+	hdev = hci_dev_get(run->hci_id);
+	if (!hdev)
+		return -ENODEV;
+
+	if (!hdev->reset) {
+		hci_dev_put(hdev);
+		return -EOPNOTSUPP;
+	}
+
+	hdev->reset(hdev);
+	hci_dev_put(hdev);
+
+	return 0;
+}
+
+/**
+ * btintel_test_reset_one - Run one reset cycle and account its stages
+ * @dev: Device structure
+ * @run: Run state
+ *
+ * A stage is taken when it is first seen after DOWN. Boot stages must
+ * also have been seen clear since the reset, so that the register value
+ * left over from the previous boot is not mistaken for a new transition.
+ *
+ * Return: 0 when the cycle completed or timed out, negative error code
+ * otherwise
+ */
+static int btintel_test_reset_one(struct btintel_test_device *dev,
+				  struct btintel_test_reset_run *run)
+{
+	struct btintel_test_reset_cycle *req = run->req;
+	u64 at[BTINTEL_TEST_RESET_STAGES] = { 0 }, now, prev;
+	u32 seen = 0, cleared = 0, stages, valid;
+	int i, ret;
+
+	ret = btintel_test_reset_issue(dev, run);
+	if (ret)
+		return ret;
+
+	for (;;) {
+		now = ktime_get_ns();
+		if (now - run->t0 > (u64)req->timeout_ms * NSEC_PER_MSEC) {
+			req->timeouts++;
+			return 0;
+		}
+
+		stages = btintel_test_reset_observe(dev, run, now, &valid);
+
+		for (i = 0; i < BTINTEL_TEST_RESET_STAGES; i++) {
+			if (seen & BIT(i) || !(stages & BIT(i)))
+				continue;
+			if (i != BTINTEL_TEST_RESET_STAGE_DOWN &&
+			    !(seen & BIT(BTINTEL_TEST_RESET_STAGE_DOWN)))
+				continue;
+			if (BIT(i) & BTINTEL_TEST_RESET_BOOT_STAGES &&
+			    !(cleared & BIT(i)))
+				continue;
+			seen |= BIT(i);
+			at[i] = now;
+		}
+		cleared |= valid & ~stages;
+
+		if (seen & BIT(BTINTEL_TEST_RESET_STAGE_READY))
+			break;
+
+		ret = btintel_test_iso_sleep_until(ns_to_ktime(now + req->poll_ns));
+		if (ret)
+			return ret;
+	}
+
+	prev = run->t0;
+	for (i = 0; i < BTINTEL_TEST_RESET_STAGES; i++) {
+		if (!(seen & BIT(i)))
+			continue;
+		btintel_test_lat_add(&run->acc[i], at[i] - prev);
+		prev = at[i];
+	}
+	btintel_test_lat_add(&run->total,
+			     at[BTINTEL_TEST_RESET_STAGE_READY] - run->t0);
+	req->completed++;
+
+	return 0;
+}
+
+/**
+ * btintel_test_reset_wait_ready - Wait for the controller to be ready
+ * @dev: Device structure
+ * @run: Run state
+ *
+ * Return: 0 once ready, -ETIMEDOUT or -EINTR otherwise
+ */
+static int btintel_test_reset_wait_ready(struct btintel_test_device *dev,
+					 struct btintel_test_reset_run *run)
+{
+	u64 start = ktime_get_ns(), now;
+	u32 valid;
+	int ret;
+
+	for (;;) {
+		now = ktime_get_ns();
+		if (btintel_test_reset_observe(dev, run, now, &valid) &
+		    BIT(BTINTEL_TEST_RESET_STAGE_READY))
+			return 0;
+		if (now - start > (u64)run->req->timeout_ms * NSEC_PER_MSEC)
+			return -ETIMEDOUT;
+
+		ret = btintel_test_iso_sleep_until(
+			ns_to_ktime(now + run->req->poll_ns));
+		if (ret)
+			return ret;
+	}
+}
+
+/**
+ * btintel_test_reset_cycle_run - Run the reset cycle stress for either ioctl
+ * @dev: Device structure
+ * @argp: User pointer to the request
+ * @size: Size of the request, struct btintel_test_reset_cycle or
+ *        struct btintel_test_reset_cycle_v2; only that much is copied
+ *
+ * Every cycle starts from a ready controller, so a cycle that timed out
+ * is followed by a wait of up to @timeout_ms for the recovery to finish.
+ *
+ * The recovery makes btintel_pcie free the MSI-X vectors an active IRQ
+ * monitor shares, so the monitor is stopped for the run and restarted
+ * once the controller is back.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_reset_cycle_run(struct btintel_test_device *dev,
+					void __user *argp, size_t size)
+{
+	struct btintel_test_irq_mon *mon = &dev->irq_mon;
+	struct btintel_test_reset_cycle_v2 *req2;
+	struct btintel_test_reset_cycle *req;
+	struct btintel_test_reset_run *run;
+	struct hci_dev *hdev;
+	u32 i, irq_flags = 0;
+	int ret;
+
+	req2 = kzalloc(sizeof(*req2), GFP_KERNEL);
+	if (!req2)
+		return -ENOMEM;
+	req = &req2->cycle;
+
+	if (copy_from_user(req2, argp, size)) {
+		ret = -EFAULT;
+		goto out_free_req;
+	}
+
+	if ((req->backend != BTINTEL_TEST_BACKEND_HW &&
+	     req->backend != BTINTEL_TEST_BACKEND_EMUL) ||
+	    !req->cycles || req->cycles > BTINTEL_TEST_RESET_MAX_CYCLES ||
+	    (req->poll_ns && req->poll_ns < BTINTEL_TEST_RESET_MIN_POLL_NS)) {
+		ret = -EINVAL;
+		goto out_free_req;
+	}
+
+	if (!req->poll_ns)
+		req->poll_ns = 100 * NSEC_PER_USEC;
+	if (!req->timeout_ms)
+		req->timeout_ms = 10 * MSEC_PER_SEC;
+	req->completed = 0;
+	req->timeouts = 0;
+	req2->flags = 0;
+	req2->reserved = 0;
+
+	run = kzalloc(sizeof(*run), GFP_KERNEL);
+	if (!run) {
+		ret = -ENOMEM;
+		goto out_free_req;
+	}
+	run->req = req;
+	for (i = 0; i < BTINTEL_TEST_RESET_STAGES; i++)
+		btintel_test_lat_init(&run->acc[i]);
+	btintel_test_lat_init(&run->total);
+
+	if (req->backend == BTINTEL_TEST_BACKEND_HW) {
+		hdev = btintel_test_hdev_get(dev, req->backend, 0);
+		if (!hdev) {
+			ret = -ENODEV;
+			goto out_free_run;
+		}
+		run->hci_id = hdev->id;
+		hci_dev_put(hdev);
+#ifndef BTINTEL_PCIE_CSR_BOOT_STAGE_REG
+		req2->flags |= BTINTEL_TEST_RESET_NO_BOOT_STAGE;
+#endif
+	}
+
+	ret = mutex_lock_interruptible(&dev->lock);
+	if (ret)
+		goto out_free_run;
+
+	/* Held for the run so that the monitor can't be restarted under us */
+	mutex_lock(&mon->lock);
+	if (req->backend == BTINTEL_TEST_BACKEND_HW && mon->active &&
+	    mon->flags & BTINTEL_TEST_IRQ_HW) {
+		irq_flags = mon->flags;
+		btintel_test_irq_stop(mon);
+		req2->flags |= BTINTEL_TEST_RESET_IRQ_PAUSED;
+	}
+
+	for (i = 0; i < req->cycles; i++) {
+		ret = btintel_test_reset_wait_ready(dev, run);
+		if (ret)
+			break;
+
+		ret = btintel_test_reset_one(dev, run);
+		if (ret)
+			break;
+
+		if (req->settle_ms) {
+			ret = btintel_test_iso_sleep_until(
+				ktime_add_ms(ktime_get(), req->settle_ms));
+			if (ret)
+				break;
+		}
+	}
+
+	if (req2->flags & BTINTEL_TEST_RESET_IRQ_PAUSED &&
+	    btintel_test_irq_start(dev, irq_flags))
+		pr_warn("IRQ monitor not restarted after the reset cycles\n");
+	mutex_unlock(&mon->lock);
+	mutex_unlock(&dev->lock);
+
+	for (i = 0; i < BTINTEL_TEST_RESET_STAGES; i++)
+		btintel_test_lat_finish(&run->acc[i], &req->stage[i]);
+	btintel_test_lat_finish(&run->total, &req->total);
+
+	pr_debug_dev("Reset cycles: %u completed, %u timed out\n",
+		     req->completed, req->timeouts);
+
+	if (!ret && copy_to_user(argp, req2, size))
+		ret = -EFAULT;
+
+out_free_run:
+	kfree(run);
+out_free_req:
+	kfree(req2);
+	return ret;
+}
+
+/**
+ * btintel_test_ioctl_reset_cycle - Handle BTINTEL_TEST_IOC_RESET_CYCLE
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_reset_cycle
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_reset_cycle(struct btintel_test_device *dev,
+					  void __user *argp)
+{
+	return btintel_test_reset_cycle_run(dev, argp,
+					    sizeof(struct btintel_test_reset_cycle));
+}
+
+/**
+ * btintel_test_ioctl_reset_cycle_v2 - Handle BTINTEL_TEST_IOC_RESET_CYCLE_V2
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_reset_cycle_v2
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_reset_cycle_v2(struct btintel_test_device *dev,
+					     void __user *argp)
+{
+	return btintel_test_reset_cycle_run(dev, argp,
+					    sizeof(struct btintel_test_reset_cycle_v2));
+}
+
+/* ============================================================================
+ * FIRMWARE IMAGE CACHE
+ * ============================================================================ */
+
+/* Layout of the Intel CSS signed images, as parsed by btintel */
+#define BTINTEL_TEST_FW_CSS_VER_OFFSET		8
+#define BTINTEL_TEST_FW_RSA_HEADER_LEN		644
+#define BTINTEL_TEST_FW_ECDSA_HEADER_LEN	320
+#define BTINTEL_TEST_FW_SECURE_SEND		0xfc09
+
+/**
+ * btintel_test_fw_image_size - Memory an image accounts for in the cache
+ * @img: Image
+ *
+ * Return: Size in bytes
+ */
+static size_t btintel_test_fw_image_size(struct btintel_test_fw_image *img)
+{
+	return img->fw->size + img->nr_recs * sizeof(*img->recs);
+}
+
+/**
+ * btintel_test_fw_image_release - Free an image once nothing references it
+ * @kref: Reference counter of struct btintel_test_fw_image
+ */
+static void btintel_test_fw_image_release(struct kref *kref)
+{
+	struct btintel_test_fw_image *img =
+		container_of(kref, struct btintel_test_fw_image, kref);
+
+	release_firmware(img->fw);
+	kvfree(img->recs);
+	kfree(img);
+}
+
+/**
+ * btintel_test_fw_add_rec - Account, and once allocated store, a record
+ * @img: Image; records are only counted while @recs is NULL
+ * @type: Fragment type
+ * @offset: Start of the record
+ * @len: Length of the record
+ */
+static void btintel_test_fw_add_rec(struct btintel_test_fw_image *img, u8 type,
+				    u32 offset, u32 len)
+{
+	if (img->recs) {
+		img->recs[img->nr_recs].type = type;
+		img->recs[img->nr_recs].offset = offset;
+		img->recs[img->nr_recs].len = len;
+	}
+	img->nr_recs++;
+	img->fragments += DIV_ROUND_UP(len, BTINTEL_TEST_FW_FRAG_MAX);
+}
+
+/**
+ * btintel_test_fw_css_ver - Read a CSS header version
+ * @data: Start of the CSS header
+ *
+ * Return: Header version
+ */
+static u32 btintel_test_fw_css_ver(const u8 *data)
+{
+	__le32 ver;
+
+	memcpy(&ver, data + BTINTEL_TEST_FW_CSS_VER_OFFSET, sizeof(ver));
+
+	return le32_to_cpu(ver);
+}
+
+/**
+ * btintel_test_fw_parse_cmds - Split an HCI command stream into records
+ * @img: Image
+ * @start: Offset of the first command
+ *
+ * Commands are grouped the way btintel downloads them: a record ends at
+ * the first command boundary that is a multiple of 4 bytes.
+ *
+ * Return: 0 on success, -EINVAL if the stream is malformed
+ */
+static int btintel_test_fw_parse_cmds(struct btintel_test_fw_image *img,
+				      u32 start)
+{
+	const u8 *data = img->fw->data;
+	u32 size = img->fw->size, pos = start, rec = start;
+
+	while (pos < size) {
+		if (size - pos < HCI_COMMAND_HDR_SIZE)
+			return -EINVAL;
+
+		pos += HCI_COMMAND_HDR_SIZE +
+		       ((struct hci_command_hdr *)(data + pos))->plen;
+		if (pos > size)
+			return -EINVAL;
+
+		if (!((pos - rec) % 4)) {
+			btintel_test_fw_add_rec(img, 0x01, rec, pos - rec);
+			rec = pos;
+		}
+	}
+
+	return pos == rec ? 0 : -EINVAL;
+}
+
+/**
+ * btintel_test_fw_parse_recs - Walk an image and produce its records
+ * @img: Image with @fw loaded
+ *
+ * Signed images are recognised by their CSS header version, as btintel
+ * does, and split into header, public key, signature and command records.
+ * Anything else, including a signed image whose command stream does not
+ * parse, is downloaded as one opaque data record. The storing pass keeps
+ * the format the counting pass settled on.
+ */
+static void btintel_test_fw_parse_recs(struct btintel_test_fw_image *img)
+{
+	const u8 *data = img->fw->data;
+	u32 size = img->fw->size, hdr, ecdsa = BTINTEL_TEST_FW_RSA_HEADER_LEN;
+	bool raw = img->recs && img->format == BTINTEL_TEST_FW_FMT_RAW;
+
+	img->nr_recs = 0;
+	img->fragments = 0;
+	img->format = BTINTEL_TEST_FW_FMT_RAW;
+
+	if (!raw && size > BTINTEL_TEST_FW_RSA_HEADER_LEN &&
+	    btintel_test_fw_css_ver(data) == 0x00010000) {
+		img->format = BTINTEL_TEST_FW_FMT_RSA;
+		hdr = BTINTEL_TEST_FW_RSA_HEADER_LEN;
+
+		if (size > ecdsa + BTINTEL_TEST_FW_ECDSA_HEADER_LEN &&
+		    data[ecdsa] == 0x06 &&
+		    btintel_test_fw_css_ver(data + ecdsa) == 0x00020000) {
+			img->format = BTINTEL_TEST_FW_FMT_ECDSA;
+			hdr += BTINTEL_TEST_FW_ECDSA_HEADER_LEN;
+		}
+
+		if (img->format == BTINTEL_TEST_FW_FMT_RSA) {
+			btintel_test_fw_add_rec(img, 0x00, 0, 128);
+			btintel_test_fw_add_rec(img, 0x03, 128, 256);
+			btintel_test_fw_add_rec(img, 0x02, 388, 256);
+		} else {
+			btintel_test_fw_add_rec(img, 0x00, ecdsa, 128);
+			btintel_test_fw_add_rec(img, 0x03, ecdsa + 128, 96);
+			btintel_test_fw_add_rec(img, 0x02, ecdsa + 224, 96);
+		}
+
+		if (!btintel_test_fw_parse_cmds(img, hdr))
+			return;
+
+		img->nr_recs = 0;
+		img->fragments = 0;
+		img->format = BTINTEL_TEST_FW_FMT_RAW;
+	}
+
+	btintel_test_fw_add_rec(img, 0x01, 0, size);
+}
+
+/**
+ * btintel_test_fw_parse - Pre-compute the download records of an image
+ * @img: Image with @fw loaded
+ *
+ * The first pass only counts, so that the record array is sized exactly.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_fw_parse(struct btintel_test_fw_image *img)
+{
+	if (!img->fw->size || img->fw->size > U32_MAX)
+		return -EINVAL;
+
+	btintel_test_fw_parse_recs(img);
+
+	img->recs = kvcalloc(img->nr_recs, sizeof(*img->recs), GFP_KERNEL);
+	if (!img->recs)
+		return -ENOMEM;
+
+	btintel_test_fw_parse_recs(img);
+
+	return 0;
+}
+
+/**
+ * btintel_test_fw_load_image - Load and parse an image from the filesystem
+ * @dev: Device structure
+ * @name: Firmware file name
+ * @parse_ns: Set to the time spent parsing
+ *
+ * Return: Image with one reference, or ERR_PTR
+ */
+static struct btintel_test_fw_image *
+btintel_test_fw_load_image(struct btintel_test_device *dev, const char *name,
+			   u64 *parse_ns)
+{
+	struct btintel_test_fw_image *img;
+	u64 t;
+	int ret;
+
+	img = kzalloc(sizeof(*img), GFP_KERNEL);
+	if (!img)
+		return ERR_PTR(-ENOMEM);
+
+	kref_init(&img->kref);
+	INIT_LIST_HEAD(&img->list);
+	strscpy(img->name, name, sizeof(img->name));
+
+	ret = request_firmware(&img->fw, name, dev->misc.this_device);
+	if (ret) {
+		kfree(img);
+		return ERR_PTR(ret);
+	}
+
+	t = ktime_get_ns();
+	ret = btintel_test_fw_parse(img);
+	*parse_ns = ktime_get_ns() - t;
+	if (ret) {
+		kref_put(&img->kref, btintel_test_fw_image_release);
+		return ERR_PTR(ret);
+	}
+
+	return img;
+}
+
+/**
+ * btintel_test_fw_cache_insert - Cache a freshly loaded image
+ * @img: Image, not yet cached
+ *
+ * Least recently used images are evicted to make room; images still in
+ * use stay alive until their last user is done. An image larger than the
+ * whole cache is not cached. If another loader cached the same name in
+ * the meantime, that copy is returned instead.
+ *
+ * Context: Called with btintel_test_fw_cache.lock held
+ * Return: Image to use, with one reference
+ */
+static struct btintel_test_fw_image *
+btintel_test_fw_cache_insert(struct btintel_test_fw_image *img)
+{
+	struct btintel_test_fw_cache *cache = &btintel_test_fw_cache;
+	size_t max = (size_t)fw_cache_kb * 1024, size;
+	struct btintel_test_fw_image *old;
+
+	list_for_each_entry(old, &cache->lru, list) {
+		if (strcmp(old->name, img->name))
+			continue;
+		kref_put(&img->kref, btintel_test_fw_image_release);
+		kref_get(&old->kref);
+		return old;
+	}
+
+	size = btintel_test_fw_image_size(img);
+	if (size > max)
+		return img;
+
+	while (cache->bytes + size > max) {
+		old = list_last_entry(&cache->lru, struct btintel_test_fw_image,
+				      list);
+		list_del_init(&old->list);
+		cache->bytes -= btintel_test_fw_image_size(old);
+		cache->evictions++;
+		kref_put(&old->kref, btintel_test_fw_image_release);
+	}
+
+	kref_get(&img->kref);
+	list_add(&img->list, &cache->lru);
+	cache->bytes += size;
+
+	return img;
+}
+
+/**
+ * btintel_test_fw_get - Get a parsed image, from the cache if possible
+ * @dev: Device structure
+ * @req: Request; @hit, @load_ns and @parse_ns are filled in
+ *
+ * The filesystem is accessed without the cache lock held, so a slow load
+ * does not hold up hits on other images.
+ *
+ * Return: Image with one reference (drop with btintel_test_fw_put()),
+ * or ERR_PTR
+ */
+static struct btintel_test_fw_image *
+btintel_test_fw_get(struct btintel_test_device *dev,
+		    struct btintel_test_fw_load *req)
+{
+	struct btintel_test_fw_cache *cache = &btintel_test_fw_cache;
+	struct btintel_test_fw_image *img;
+	bool nocache = req->flags & BTINTEL_TEST_FW_NOCACHE;
+	u64 t = ktime_get_ns();
+
+	if (!nocache) {
+		mutex_lock(&cache->lock);
+		list_for_each_entry(img, &cache->lru, list) {
+			if (strcmp(img->name, req->name))
+				continue;
+			list_move(&img->list, &cache->lru);
+			kref_get(&img->kref);
+			req->load_ns = ktime_get_ns() - t;
+			req->hit = 1;
+			cache->hits++;
+			btintel_test_lat_add(&cache->hit_lat, req->load_ns);
+			mutex_unlock(&cache->lock);
+			return img;
+		}
+		mutex_unlock(&cache->lock);
+	}
+
+	img = btintel_test_fw_load_image(dev, req->name, &req->parse_ns);
+	if (IS_ERR(img))
+		return img;
+
+	req->load_ns = ktime_get_ns() - t;
+
+	mutex_lock(&cache->lock);
+	if (!nocache) {
+		cache->misses++;
+		btintel_test_lat_add(&cache->miss_lat, req->load_ns);
+		img = btintel_test_fw_cache_insert(img);
+	}
+	mutex_unlock(&cache->lock);
+
+	return img;
+}
+
+/**
+ * btintel_test_fw_put - Release an image obtained with btintel_test_fw_get()
+ * @img: Image
+ */
+static void btintel_test_fw_put(struct btintel_test_fw_image *img)
+{
+	kref_put(&img->kref, btintel_test_fw_image_release);
+}
+
+/**
+ * btintel_test_fw_download - Download a parsed image with secure send
+ * @dev: Device structure
+ * @hdev: Controller, or NULL for the virtual HCI
+ * @img: Image
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_fw_download(struct btintel_test_device *dev,
+				    struct hci_dev *hdev,
+				    struct btintel_test_fw_image *img)
+{
+	u8 param[1 + BTINTEL_TEST_FW_FRAG_MAX];
+	struct sk_buff *skb;
+	u32 i, off, len;
+	int ret;
+
+	for (i = 0; i < img->nr_recs; i++) {
+		struct btintel_test_fw_rec *rec = &img->recs[i];
+
+		for (off = 0; off < rec->len; off += len) {
+			len = min_t(u32, rec->len - off,
+				    BTINTEL_TEST_FW_FRAG_MAX);
+			param[0] = rec->type;
+			memcpy(param + 1, img->fw->data + rec->offset + off, len);
+
+			skb = btintel_test_hci_cmd(dev, hdev,
+						   BTINTEL_TEST_FW_SECURE_SEND,
+						   1 + len, param, 0);
+			if (IS_ERR(skb))
+				return PTR_ERR(skb);
+
+			ret = skb->len && skb->data[0] ? -EIO : 0;
+			kfree_skb(skb);
+			if (ret)
+				return ret;
+
+			if (signal_pending(current))
+				return -EINTR;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * btintel_test_hdev_in_bootloader - Check that a controller awaits firmware
+ * @hdev: Controller, up
+ *
+ * Asks with Intel Read Version, straight to the controller so that no
+ * cached answer from before a firmware load can vouch for it. Both the
+ * legacy reply and the TLV reply of newer controllers are understood.
+ *
+ * Return: true if the controller reports its bootloader image running
+ */
+static bool btintel_test_hdev_in_bootloader(struct hci_dev *hdev)
+{
+	const u8 param = BTINTEL_TEST_VER_TLV;
+	bool boot = false;
+	struct sk_buff *skb;
+	u32 off;
+
+	skb = hci_cmd_sync(hdev, BTINTEL_TEST_OP_READ_VERSION, 1, &param,
+			   HCI_CMD_TIMEOUT);
+	if (IS_ERR(skb))
+		return false;
+
+	if (skb->len < 1 || skb->data[0])
+		goto out;
+
+	if (skb->len == BTINTEL_TEST_VER_LEGACY_LEN &&
+	    skb->data[1] == BTINTEL_TEST_VER_LEGACY_PLATFORM) {
+		boot = skb->data[4] == BTINTEL_TEST_VER_LEGACY_BOOTLOADER;
+		goto out;
+	}
+
+	/* Type, length, value, after the status */
+	for (off = 1; off + 2 <= skb->len &&
+	     off + 2 + skb->data[off + 1] <= skb->len;
+	     off += 2 + skb->data[off + 1]) {
+		if (skb->data[off] == BTINTEL_TEST_VER_TLV_IMAGE_TYPE &&
+		    skb->data[off + 1] >= 1) {
+			boot = skb->data[off + 2] ==
+			       BTINTEL_TEST_VER_IMAGE_BOOTLOADER;
+			break;
+		}
+	}
+out:
+	kfree_skb(skb);
+	return boot;
+}
+
+/**
+ * btintel_test_fw_target_get - Resolve a firmware download target
+ * @dev: Device structure
+ * @index: hciN index of the target
+ *
+ * Only two kinds of controller take a download: a virtual one such as
+ * hci_vhci, and one that reports it is still in its bootloader. Anything
+ * else already runs operational firmware and would reject, or worse act
+ * on, the image.
+ *
+ * Return: Referenced hci_dev (drop with hci_dev_put()), ERR_PTR(-ENODEV)
+ * if there is no such controller, ERR_PTR(-EOPNOTSUPP) if it is the
+ * controller of @dev itself, or ERR_PTR(-EPERM) if it is neither virtual
+ * nor in its bootloader
+ */
+static struct hci_dev *
+btintel_test_fw_target_get(struct btintel_test_device *dev, u32 index)
+{
+	struct hci_dev *hdev;
+
+	hdev = hci_dev_get(index);
+	if (!hdev)
+		return ERR_PTR(-ENODEV);
+
+	if (btintel_test_hdev_is_own(dev, hdev)) {
+		hci_dev_put(hdev);
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+
+	if (hdev->bus != HCI_VIRTUAL &&
+	    (!test_bit(HCI_UP, &hdev->flags) ||
+	     !btintel_test_hdev_in_bootloader(hdev))) {
+		hci_dev_put(hdev);
+		return ERR_PTR(-EPERM);
+	}
+
+	return hdev;
+}
+
+/**
+ * btintel_test_ioctl_fw_load - Handle BTINTEL_TEST_IOC_FW_LOAD
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_fw_load
+ *
+ * A controller running operational firmware is never a download target,
+ * see btintel_test_fw_target_get(). Naming the controller of this device
+ * by hciN index does not get around that.
+ *
+ * Return: 0 on success, -EOPNOTSUPP for the controller of this device,
+ * -EPERM for another controller not waiting for firmware, or another
+ * negative error code
+ */
+static int btintel_test_ioctl_fw_load(struct btintel_test_device *dev,
+				      void __user *argp)
+{
+	struct btintel_test_emul_cfg cfg = {}, saved;
+	struct btintel_test_fw_load req;
+	struct btintel_test_fw_image *img;
+	struct hci_dev *hdev = NULL;
+	u64 t;
+	int ret = 0;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	req.name[sizeof(req.name) - 1] = '\0';
+	if (!req.name[0] ||
+	    req.flags & ~(BTINTEL_TEST_FW_DOWNLOAD | BTINTEL_TEST_FW_NOCACHE))
+		return -EINVAL;
+
+	if (req.flags & BTINTEL_TEST_FW_DOWNLOAD) {
+		if (req.backend == BTINTEL_TEST_BACKEND_HCI_INDEX) {
+			hdev = btintel_test_fw_target_get(dev, req.hci_index);
+			if (IS_ERR(hdev))
+				return PTR_ERR(hdev);
+		} else if (req.backend != BTINTEL_TEST_BACKEND_EMUL) {
+			return -EOPNOTSUPP;
+		}
+	}
+
+	req.hit = 0;
+	req.parse_ns = 0;
+	req.download_ns = 0;
+
+	img = btintel_test_fw_get(dev, &req);
+	if (IS_ERR(img)) {
+		ret = PTR_ERR(img);
+		goto out_put_hdev;
+	}
+
+	req.format = img->format;
+	req.size = img->fw->size;
+	req.fragments = img->fragments;
+
+	if (req.flags & BTINTEL_TEST_FW_DOWNLOAD) {
+		ret = mutex_lock_interruptible(&dev->lock);
+		if (ret)
+			goto out_put_img;
+
+		if (!hdev) {
+			cfg.latency_ns = req.emul_latency_ns;
+			ret = btintel_test_emul_hci_config(&dev->emul, &cfg,
+							   &saved);
+			if (ret) {
+				mutex_unlock(&dev->lock);
+				goto out_put_img;
+			}
+		}
+
+		t = ktime_get_ns();
+		ret = btintel_test_fw_download(dev, hdev, img);
+		req.download_ns = ktime_get_ns() - t;
+		if (!hdev)
+			btintel_test_emul_hci_restore(&dev->emul, &saved);
+		/* The target may now run different firmware */
+		btintel_test_rsp_cache_invalidate(dev);
+		mutex_unlock(&dev->lock);
+	}
+
+	pr_debug_dev("Firmware %s: %s, %u bytes, %llu ns\n", req.name,
+		     req.hit ? "hit" : "miss", req.size, req.load_ns);
+
+	if (!ret && copy_to_user(argp, &req, sizeof(req)))
+		ret = -EFAULT;
+
+out_put_img:
+	btintel_test_fw_put(img);
+out_put_hdev:
+	if (hdev)
+		hci_dev_put(hdev);
+	return ret;
+}
+
+/**
+ * btintel_test_ioctl_fw_cache_stats - Handle BTINTEL_TEST_IOC_FW_CACHE_STATS
+ * @dev: Device structure, unused as the cache is shared by all devices
+ * @argp: User pointer to struct btintel_test_fw_cache_stats
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_fw_cache_stats(struct btintel_test_device *dev,
+					     void __user *argp)
+{
+	struct btintel_test_fw_cache *cache = &btintel_test_fw_cache;
+	struct btintel_test_fw_cache_stats *st;
+	struct btintel_test_fw_image *img;
+	int ret = 0;
+
+	st = kzalloc(sizeof(*st), GFP_KERNEL);
+	if (!st)
+		return -ENOMEM;
+
+	mutex_lock(&cache->lock);
+	st->hits = cache->hits;
+	st->misses = cache->misses;
+	st->evictions = cache->evictions;
+	st->bytes = cache->bytes;
+	st->max_bytes = (u64)fw_cache_kb * 1024;
+	list_for_each_entry(img, &cache->lru, list)
+		st->entries++;
+	btintel_test_lat_finish(&cache->hit_lat, &st->hit_latency);
+	btintel_test_lat_finish(&cache->miss_lat, &st->miss_latency);
+	mutex_unlock(&cache->lock);
+
+	if (copy_to_user(argp, st, sizeof(*st)))
+		ret = -EFAULT;
+
+	kfree(st);
+	return ret;
+}
+
+/**
+ * btintel_test_fw_cache_flush - Drop every cached image
+ *
+ * Images still in use are freed by their last user.
+ */
+static void btintel_test_fw_cache_flush(void)
+{
+	struct btintel_test_fw_cache *cache = &btintel_test_fw_cache;
+	struct btintel_test_fw_image *img, *tmp;
+
+	mutex_lock(&cache->lock);
+	list_for_each_entry_safe(img, tmp, &cache->lru, list) {
+		list_del_init(&img->list);
+		kref_put(&img->kref, btintel_test_fw_image_release);
+	}
+	cache->bytes = 0;
+	mutex_unlock(&cache->lock);
+}
+
+/**
+ * btintel_test_fw_cache_init - Initialize the firmware image cache
+ */
+static void btintel_test_fw_cache_init(void)
+{
+	struct btintel_test_fw_cache *cache = &btintel_test_fw_cache;
+
+	mutex_init(&cache->lock);
+	INIT_LIST_HEAD(&cache->lru);
+	btintel_test_lat_init(&cache->hit_lat);
+	btintel_test_lat_init(&cache->miss_lat);
+}
+
+/* ============================================================================
+ * POWER-STATE TRANSITION LATENCY
+ * ============================================================================ */
+
+/**
+ * btintel_test_pm_emul_transition - Simulate one emulated transition
+ * @req: Parameters
+ * @ns: Nominal transition time
+ *
+ * Return: 0 on success, -EINTR if a signal is pending
+ */
+static int btintel_test_pm_emul_transition(struct btintel_test_pm_cycle *req,
+					   u32 ns)
+{
+	u64 delay = ns;
+
+	if (req->emul_jitter_ns)
+		delay += get_random_u32() % req->emul_jitter_ns;
+
+	return btintel_test_iso_sleep_until(ktime_add_ns(ktime_get(), delay));
+}
+
+/**
+ * btintel_test_pm_suspend - Take the device to its low-power state
+ * @pdev: PCI function, NULL for the emulated backend
+ * @req: Parameters
+ * @held: Whether we hold a runtime PM usage count, updated
+ *
+ * Return: 0 once suspended, -EAGAIN if the device stayed active, or
+ * another negative error code on failure
+ */
+static int btintel_test_pm_suspend(struct pci_dev *pdev,
+				   struct btintel_test_pm_cycle *req,
+				   bool *held)
+{
+	int ret;
+
+	if (!pdev) {
+		ret = btintel_test_pm_emul_transition(req, req->emul_suspend_ns);
+		if (ret)
+			return ret;
+		return get_random_u32() % 100 < req->emul_fail_pct ? -EAGAIN : 0;
+	}
+
+	if (req->mode == BTINTEL_TEST_PM_D3HOT) {
+		pci_save_state(pdev);
+		ret = pci_set_power_state(pdev, PCI_D3hot);
+		if (ret)
+			return ret;
+		return pdev->current_state == PCI_D3hot ? 0 : -EAGAIN;
+	}
+
+	/* Drop our usage count; suspends unless someone else holds one */
+	ret = pm_runtime_put_sync_suspend(&pdev->dev);
+	*held = false;
+	if (ret < 0)
+		return ret;
+
+	return pm_runtime_suspended(&pdev->dev) ? 0 : -EAGAIN;
+}
+
+/**
+ * btintel_test_pm_resume - Return the device to full power
+ * @pdev: PCI function, NULL for the emulated backend
+ * @req: Parameters
+ * @held: Whether we hold a runtime PM usage count, updated
+ *
+ * Runtime PM is resumed even after a failed suspend, to take back the
+ * usage count btintel_test_pm_suspend() dropped. A failed resume leaves
+ * it dropped.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_pm_resume(struct pci_dev *pdev,
+				  struct btintel_test_pm_cycle *req,
+				  bool *held)
+{
+	int ret;
+
+	if (!pdev)
+		return btintel_test_pm_emul_transition(req, req->emul_resume_ns);
+
+	if (req->mode == BTINTEL_TEST_PM_D3HOT) {
+		ret = pci_set_power_state(pdev, PCI_D0);
+		if (ret)
+			return ret;
+		pci_restore_state(pdev);
+		return 0;
+	}
+
+	ret = pm_runtime_resume_and_get(&pdev->dev);
+	if (ret < 0)
+		return ret;
+
+	*held = true;
+	return 0;
+}
+
+/**
+ * btintel_test_pm_run - Run the suspend/resume cycles
+ * @pdev: PCI function, NULL for the emulated backend
+ * @req: Parameters and results
+ * @held: Whether we hold a runtime PM usage count, updated as the cycles
+ *        drop and take it back
+ *
+ * Suspend failures are counted in @req rather than returned. A failed
+ * resume is counted and also ends the run with its error, since the
+ * device is then in an unknown state.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_pm_run(struct pci_dev *pdev,
+			       struct btintel_test_pm_cycle *req, bool *held)
+{
+	struct btintel_test_lat_acc *acc;
+	u64 t0, t1, t2, t3;
+	int ret = 0, err, resume_err;
+	u32 i;
+
+	acc = kcalloc(3, sizeof(*acc), GFP_KERNEL);
+	if (!acc)
+		return -ENOMEM;
+	for (i = 0; i < 3; i++)
+		btintel_test_lat_init(&acc[i]);
+
+	for (i = 0; i < req->cycles && !ret; i++) {
+		t0 = ktime_get_ns();
+		err = btintel_test_pm_suspend(pdev, req, held);
+		t1 = ktime_get_ns();
+		if (err == -EINTR) {
+			ret = err;
+			break;
+		}
+
+		/* A dwell cut short by a signal still resumes the device */
+		if (err)
+			req->suspend_failures++;
+		else if (req->dwell_us)
+			ret = btintel_test_iso_sleep_until(
+				ktime_add_us(ktime_get(), req->dwell_us));
+
+		t2 = ktime_get_ns();
+		resume_err = btintel_test_pm_resume(pdev, req, held);
+		t3 = ktime_get_ns();
+		if (resume_err == -EINTR) {
+			ret = resume_err;
+			break;
+		}
+		if (resume_err) {
+			req->resume_failures++;
+			ret = resume_err;
+			break;
+		}
+
+		if (err || ret)
+			continue;
+
+		btintel_test_lat_add(&acc[0], t1 - t0);
+		btintel_test_lat_add(&acc[1], t3 - t2);
+		btintel_test_lat_add(&acc[2], (t1 - t0) + (t3 - t2));
+		req->completed++;
+	}
+
+	btintel_test_lat_finish(&acc[0], &req->suspend);
+	btintel_test_lat_finish(&acc[1], &req->resume);
+	btintel_test_lat_finish(&acc[2], &req->cycle);
+	kfree(acc);
+
+	return ret;
+}
+
+/**
+ * btintel_test_ioctl_pm_cycle - Handle BTINTEL_TEST_IOC_PM_CYCLE
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_pm_cycle
+ *
+ * BTINTEL_TEST_PM_RUNTIME goes through the PM core, so the driver's own
+ * runtime callbacks are part of what is measured. BTINTEL_TEST_PM_D3HOT
+ * drives the PCI power state directly, which would pull the device from
+ * under a driver, and is therefore only allowed while none is bound; the
+ * device lock keeps one from binding during the run.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_pm_cycle(struct btintel_test_device *dev,
+				       void __user *argp)
+{
+	struct btintel_test_pm_cycle *req;
+	struct pci_dev *pdev = NULL;
+	bool held = false;
+	int ret;
+
+	req = memdup_user(argp, sizeof(*req));
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	if ((req->backend != BTINTEL_TEST_BACKEND_HW &&
+	     req->backend != BTINTEL_TEST_BACKEND_EMUL) ||
+	    req->mode > BTINTEL_TEST_PM_D3HOT || !req->cycles ||
+	    req->cycles > BTINTEL_TEST_PM_MAX_CYCLES ||
+	    req->emul_fail_pct > 100) {
+		ret = -EINVAL;
+		goto out_free;
+	}
+
+	req->completed = 0;
+	req->suspend_failures = 0;
+	req->resume_failures = 0;
+
+	if (req->backend == BTINTEL_TEST_BACKEND_HW) {
+		pdev = btintel_test_pdev_get(dev);
+		if (!pdev) {
+			ret = -ENODEV;
+			goto out_free;
+		}
+	}
+
+	ret = mutex_lock_interruptible(&dev->lock);
+	if (ret)
+		goto out_put;
+
+	if (!pdev) {
+		ret = btintel_test_pm_run(NULL, req, &held);
+	} else if (req->mode == BTINTEL_TEST_PM_D3HOT) {
+		device_lock(&pdev->dev);
+		ret = pdev->dev.driver ? -EBUSY :
+		      btintel_test_pm_run(pdev, req, &held);
+		device_unlock(&pdev->dev);
+	} else if (!pm_runtime_enabled(&pdev->dev)) {
+		ret = -EOPNOTSUPP;
+	} else {
+		/* Hold a usage count for btintel_test_pm_suspend() to drop */
+		ret = pm_runtime_resume_and_get(&pdev->dev);
+		if (!ret) {
+			held = true;
+			ret = btintel_test_pm_run(pdev, req, &held);
+			/* Not held if the last resume failed */
+			if (held)
+				pm_runtime_put(&pdev->dev);
+		}
+	}
+
+	mutex_unlock(&dev->lock);
+
+	pr_debug_dev("PM cycles: %u completed, %u/%u suspend/resume failures\n",
+		     req->completed, req->suspend_failures,
+		     req->resume_failures);
+
+	/* After a failed resume, report how far the run got */
+	if ((!ret || req->resume_failures) &&
+	    copy_to_user(argp, req, sizeof(*req)) && !ret)
+		ret = -EFAULT;
+
+out_put:
+	pci_dev_put(pdev);
+out_free:
+	kfree(req);
+	return ret;
+}
+
+/* ============================================================================
+ * INTERRUPT INSTRUMENTATION
+ * ============================================================================ */
+
+/**
+ * btintel_test_irq_account - Account one interrupt on a vector
+ * @vec: Vector
+ *
+ * Context: Hard interrupt
+ * Return: true if the interrupt was one we injected
+ */
+static bool btintel_test_irq_account(struct btintel_test_irq_vec *vec)
+{
+	u64 now = ktime_get_ns();
+	bool injected = false;
+
+	spin_lock(&vec->lock);
+	if (vec->count)
+		btintel_test_lat_add(&vec->interval, now - vec->last_ns);
+	vec->count++;
+	vec->last_ns = now;
+	if (vec->inject_ns) {
+		btintel_test_lat_add(&vec->latency, now - vec->inject_ns);
+		vec->inject_ns = 0;
+		injected = true;
+	}
+	spin_unlock(&vec->lock);
+
+	if (injected)
+		complete(&vec->injected);
+
+	return injected;
+}
+
+/**
+ * btintel_test_irq_handler - Shared handler chained on an MSI-X vector
+ * @irq: Interrupt number
+ * @data: struct btintel_test_irq_vec
+ *
+ * Interrupts raised by the controller are left to its driver.
+ *
+ * Return: IRQ_HANDLED for an injected interrupt, IRQ_NONE otherwise
+ */
+static irqreturn_t btintel_test_irq_handler(int irq, void *data)
+{
+	return btintel_test_irq_account(data) ? IRQ_HANDLED : IRQ_NONE;
+}
+
+/**
+ * btintel_test_irq_work - Handler of the software vector
+ * @work: Work embedded in struct btintel_test_irq_vec
+ */
+static void btintel_test_irq_work(struct irq_work *work)
+{
+	btintel_test_irq_account(container_of(work, struct btintel_test_irq_vec,
+					      work));
+}
+
+/**
+ * btintel_test_irq_vec_reset - Clear the counters of a vector
+ * @vec: Vector
+ * @all: Also clear the interrupt count
+ *
+ * Context: Called with @vec->lock held
+ */
+static void btintel_test_irq_vec_reset(struct btintel_test_irq_vec *vec,
+				       bool all)
+{
+	btintel_test_lat_init(&vec->latency);
+	btintel_test_lat_init(&vec->interval);
+	if (all) {
+		vec->count = 0;
+		vec->read_count = 0;
+	}
+}
+
+/**
+ * btintel_test_irq_stop - Detach from every vector
+ * @mon: Interrupt instrumentation
+ *
+ * Context: Called with @mon->lock held
+ */
+static void btintel_test_irq_stop(struct btintel_test_irq_mon *mon)
+{
+	unsigned int i;
+
+	if (!mon->active)
+		return;
+
+	for (i = 0; i < mon->nr_vecs; i++) {
+		if (mon->vecs[i].kind == BTINTEL_TEST_IRQ_VEC_MSIX)
+			free_irq(mon->vecs[i].irq, &mon->vecs[i]);
+		else
+			irq_work_sync(&mon->vecs[i].work);
+	}
+
+	pci_dev_put(mon->pdev);
+	mon->pdev = NULL;
+	mon->nr_vecs = 0;
+	mon->active = false;
+}
+
+/**
+ * btintel_test_irq_start - Attach to the software and MSI-X vectors
+ * @dev: Device structure
+ * @flags: BTINTEL_TEST_IRQ_*
+ *
+ * btintel_pcie requests its vectors with IRQF_SHARED, which lets our
+ * handler run alongside its own on the real interrupt path. The monitor
+ * must be stopped before anything that makes the driver free its vectors;
+ * a reset cycle does that itself.
+ *
+ * Context: Called with @dev->irq_mon.lock held
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_irq_start(struct btintel_test_device *dev, u32 flags)
+{
+	struct btintel_test_irq_mon *mon = &dev->irq_mon;
+	struct btintel_test_irq_vec *vec;
+	unsigned int i;
+	int irq, ret;
+
+	btintel_test_irq_stop(mon);
+
+	for (i = 0; i < BTINTEL_TEST_IRQ_MAX_VECTORS; i++) {
+		vec = &mon->vecs[i];
+		spin_lock_init(&vec->lock);
+		init_completion(&vec->injected);
+		vec->inject_ns = 0;
+		btintel_test_irq_vec_reset(vec, true);
+	}
+
+	vec = &mon->vecs[0];
+	vec->kind = BTINTEL_TEST_IRQ_VEC_SW;
+	vec->irq = 0;
+	vec->index = 0;
+	vec->work = IRQ_WORK_INIT_HARD(btintel_test_irq_work);
+	mon->nr_vecs = 1;
+	mon->active = true;
+	mon->flags = flags;
+	mon->read_ns = ktime_get_ns();
+
+	if (!(flags & BTINTEL_TEST_IRQ_HW))
+		return 0;
+
+	mon->pdev = btintel_test_pdev_get(dev);
+	if (!mon->pdev || !mon->pdev->msix_enabled) {
+		btintel_test_irq_stop(mon);
+		return -ENODEV;
+	}
+
+	for (i = 0; mon->nr_vecs < BTINTEL_TEST_IRQ_MAX_VECTORS; i++) {
+		irq = pci_irq_vector(mon->pdev, i);
+		if (irq < 0)
+			break;
+
+		vec = &mon->vecs[mon->nr_vecs];
+		vec->kind = BTINTEL_TEST_IRQ_VEC_MSIX;
+		vec->irq = irq;
+		vec->index = i;
+
+		ret = request_irq(irq, btintel_test_irq_handler, IRQF_SHARED,
+				  DRIVER_NAME, vec);
+		if (ret) {
+			pr_err("Cannot share MSI-X vector %u (irq %d): %d\n",
+			       i, irq, ret);
+			btintel_test_irq_stop(mon);
+			return ret;
+		}
+		mon->nr_vecs++;
+	}
+
+	return 0;
+}
+
+/**
+ * btintel_test_ioctl_irq_monitor - Handle BTINTEL_TEST_IOC_IRQ_MONITOR
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_irq_monitor
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_irq_monitor(struct btintel_test_device *dev,
+					  void __user *argp)
+{
+	struct btintel_test_irq_monitor req;
+	int ret = 0;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (req.flags & ~BTINTEL_TEST_IRQ_HW)
+		return -EINVAL;
+
+	mutex_lock(&dev->irq_mon.lock);
+	if (req.enable)
+		ret = btintel_test_irq_start(dev, req.flags);
+	else
+		btintel_test_irq_stop(&dev->irq_mon);
+	mutex_unlock(&dev->irq_mon.lock);
+
+	return ret;
+}
+
+/**
+ * btintel_test_irq_raise - Raise one interrupt on a vector
+ * @vec: Vector
+ * @cpu: CPU for the software vector, negative for the current one
+ *
+ * MSI-X vectors are re-triggered through the interrupt chip, or resent by
+ * the IRQ core where the chip cannot, so delivery follows the vector's
+ * real affinity.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_irq_raise(struct btintel_test_irq_vec *vec, int cpu)
+{
+	if (vec->kind == BTINTEL_TEST_IRQ_VEC_MSIX) {
+#ifdef CONFIG_GENERIC_IRQ_INJECTION
+		return irq_inject_interrupt(vec->irq);
+#else
+		return -EOPNOTSUPP;
+#endif
+	}
+
+	if (cpu < 0)
+		irq_work_queue(&vec->work);
+	else
+		irq_work_queue_on(&vec->work, cpu);
+
+	return 0;
+}
+
+/**
+ * btintel_test_ioctl_irq_inject - Handle BTINTEL_TEST_IOC_IRQ_INJECT
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_irq_inject
+ *
+ * Injections are serialized: the next one is only raised once the handler
+ * has seen the previous one, so each latency sample is unambiguous.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_irq_inject(struct btintel_test_device *dev,
+					 void __user *argp)
+{
+	struct btintel_test_irq_mon *mon = &dev->irq_mon;
+	struct btintel_test_irq_inject req;
+	struct btintel_test_irq_vec *vec;
+	unsigned long flags;
+	u32 i;
+	int ret = 0;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (!req.count || req.count > BTINTEL_TEST_IRQ_MAX_INJECT ||
+	    (req.cpu >= 0 && (req.cpu >= nr_cpu_ids || !cpu_online(req.cpu))))
+		return -EINVAL;
+
+	req.delivered = 0;
+	req.lost = 0;
+
+	ret = mutex_lock_interruptible(&mon->lock);
+	if (ret)
+		return ret;
+
+	if (!mon->active || req.vector >= mon->nr_vecs) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+	vec = &mon->vecs[req.vector];
+
+	for (i = 0; i < req.count; i++) {
+		reinit_completion(&vec->injected);
+
+		spin_lock_irqsave(&vec->lock, flags);
+		vec->inject_ns = ktime_get_ns();
+		spin_unlock_irqrestore(&vec->lock, flags);
+
+		ret = btintel_test_irq_raise(vec, req.cpu);
+		if (ret)
+			break;
+
+		if (wait_for_completion_timeout(&vec->injected,
+						msecs_to_jiffies(100))) {
+			req.delivered++;
+		} else {
+			spin_lock_irqsave(&vec->lock, flags);
+			vec->inject_ns = 0;
+			spin_unlock_irqrestore(&vec->lock, flags);
+			req.lost++;
+		}
+
+		if (req.interval_ns) {
+			ret = btintel_test_iso_sleep_until(
+				ktime_add_ns(ktime_get(), req.interval_ns));
+			if (ret)
+				break;
+		} else if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+	}
+
+out_unlock:
+	mutex_unlock(&mon->lock);
+
+	if (!ret && copy_to_user(argp, &req, sizeof(req)))
+		ret = -EFAULT;
+
+	return ret;
+}
+
+/**
+ * btintel_test_ioctl_irq_stats - Handle BTINTEL_TEST_IOC_IRQ_STATS
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_irq_stats
+ *
+ * Each snapshot closes a rate sampling window and opens the next one.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_irq_stats(struct btintel_test_device *dev,
+					void __user *argp)
+{
+	struct btintel_test_irq_mon *mon = &dev->irq_mon;
+	struct btintel_test_irq_stats *st;
+	struct btintel_test_irq_vector *out;
+	struct btintel_test_irq_vec *vec;
+	unsigned long flags;
+	unsigned int i;
+	u64 now;
+	int ret = 0;
+
+	st = memdup_user(argp, sizeof(*st));
+	if (IS_ERR(st))
+		return PTR_ERR(st);
+
+	mutex_lock(&mon->lock);
+
+	now = ktime_get_ns();
+	st->nr_vectors = mon->nr_vecs;
+	st->window_ns = mon->active ? now - mon->read_ns : 0;
+	mon->read_ns = now;
+
+	for (i = 0; i < mon->nr_vecs; i++) {
+		vec = &mon->vecs[i];
+		out = &st->vectors[i];
+
+		memset(out, 0, sizeof(*out));
+		out->kind = vec->kind;
+		out->irq = vec->irq;
+		out->index = vec->index;
+
+		spin_lock_irqsave(&vec->lock, flags);
+		out->count = vec->count;
+		if (st->window_ns)
+			out->rate = div64_u64((vec->count - vec->read_count) *
+					      NSEC_PER_SEC, st->window_ns);
+		vec->read_count = vec->count;
+		btintel_test_lat_finish(&vec->latency, &out->latency);
+		btintel_test_lat_finish(&vec->interval, &out->interval);
+		if (st->reset)
+			btintel_test_irq_vec_reset(vec, false);
+		spin_unlock_irqrestore(&vec->lock, flags);
+	}
+
+	mutex_unlock(&mon->lock);
+
+	if (copy_to_user(argp, st, sizeof(*st)))
+		ret = -EFAULT;
+
+	kfree(st);
+	return ret;
+}
+
+/* ============================================================================
+ * BUSY-POLL COMMAND COMPLETION
+ * ============================================================================ */
+
+/**
+ * btintel_test_hci_poll - Time command round trips with and without polling
+ * @dev: Device structure
+ * @req: Parameters in, results out
+ *
+ * Commands go out one at a time and alternate between the sleeping and the
+ * polling wait, so that both paths see the same controller and system
+ * conditions. Latency runs from submission to the moment the submitting
+ * thread has the completion in hand, which is where the two paths differ.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_hci_poll(struct btintel_test_device *dev,
+				 struct btintel_test_hci_poll *req)
+{
+	struct btintel_test_lat_acc *acc;
+	struct btintel_test_emul_cfg saved;
+	struct btintel_test_pipe_evt evt;
+	struct btintel_test_pipe *p;
+	struct hci_dev *hdev;
+	struct sk_buff *skb;
+	bool poll;
+	u64 send_ns;
+	u32 i;
+	int ret;
+
+	if (!req->count || req->count > BTINTEL_TEST_PIPE_MAX_COMMANDS ||
+	    req->plen > BTINTEL_TEST_JOB_HCI_MAX_PARAM ||
+	    req->busy_poll_ns > BTINTEL_TEST_POLL_MAX_BUDGET_NS)
+		return -EINVAL;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	acc = kcalloc(2, sizeof(*acc), GFP_KERNEL);
+	if (!p || !acc) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	if (req->backend == BTINTEL_TEST_BACKEND_EMUL) {
+		struct btintel_test_emul_cfg cfg = {
+			.latency_ns = req->emul_latency_ns,
+			.jitter_ns = req->emul_jitter_ns,
+		};
+
+		ret = btintel_test_emul_hci_config(&dev->emul, &cfg, &saved);
+		if (ret)
+			goto out_free;
+	}
+
+	ret = btintel_test_pipe_attach(dev, p, req->backend, req->hci_index,
+				       &hdev);
+	if (ret)
+		goto out_restore;
+
+	btintel_test_lat_init(&acc[0]);
+	btintel_test_lat_init(&acc[1]);
+	req->errors = 0;
+
+	for (i = 0; i < 2 * req->count; i++) {
+		poll = i & 1;
+		p->poll_ns = poll ? req->busy_poll_ns : 0;
+
+		skb = btintel_test_pipe_cmd_alloc(req->opcode, req->plen,
+						  req->param);
+		if (!skb) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		btintel_test_pipe_send(dev, p, hdev, skb);
+
+		/* Skip credit updates for commands the HCI core sent itself */
+		do {
+			ret = btintel_test_pipe_next_evt(p, &evt);
+		} while (!ret && !btintel_test_pipe_complete(p, &evt, &send_ns));
+		if (ret)
+			break;
+
+		btintel_test_lat_add(&acc[poll], ktime_get_ns() - send_ns);
+		if (evt.status)
+			req->errors++;
+	}
+
+	req->polled = p->polled;
+	req->poll_fallbacks = p->poll_fallbacks;
+	btintel_test_lat_finish(&acc[0], &req->sleep);
+	btintel_test_lat_finish(&acc[1], &req->poll);
+
+	pr_debug_dev("HCI poll: %u polled, %u fell back to sleeping\n",
+		     req->polled, req->poll_fallbacks);
+
+	btintel_test_pipe_detach(dev, p, hdev, ret);
+out_restore:
+	if (req->backend == BTINTEL_TEST_BACKEND_EMUL)
+		btintel_test_emul_hci_restore(&dev->emul, &saved);
+out_free:
+	kfree(acc);
+	kfree(p);
+	return ret;
+}
+
+/**
+ * btintel_test_ioctl_hci_poll - Handle BTINTEL_TEST_IOC_HCI_POLL
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_hci_poll
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_hci_poll(struct btintel_test_device *dev,
+				       void __user *argp)
+{
+	struct btintel_test_hci_poll *req;
+	int ret;
+
+	req = memdup_user(argp, sizeof(*req));
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	ret = mutex_lock_interruptible(&dev->lock);
+	if (ret)
+		goto out_free;
+
+	ret = btintel_test_hci_poll(dev, req);
+	mutex_unlock(&dev->lock);
+
+	if (!ret && copy_to_user(argp, req, sizeof(*req)))
+		ret = -EFAULT;
+
+out_free:
+	kfree(req);
+	return ret;
+}
+
+/* ============================================================================
+ * NUMA PLACEMENT
+ * ============================================================================ */
+
+/**
+ * btintel_test_alloc_node - Node device memory should be allocated on
+ * @dev: Device structure
+ *
+ * Return: The node set through BTINTEL_TEST_IOC_SET_NUMA_NODE, else the
+ *         node of the controller, else NUMA_NO_NODE
+ */
+static int btintel_test_alloc_node(struct btintel_test_device *dev)
+{
+	if (dev->numa_node != NUMA_NO_NODE)
+		return dev->numa_node;
+
+	if (dev->pdev)
+		return dev_to_node(&dev->pdev->dev);
+
+	return NUMA_NO_NODE;
+}
+
+/**
+ * btintel_test_mem_node - Node a kernel allocation actually landed on
+ * @addr: kmalloc or vmalloc address
+ *
+ * vmalloc areas may straddle nodes; the node of the first page is reported.
+ *
+ * Return: Node, or NUMA_NO_NODE for a NULL or empty allocation
+ */
+static int btintel_test_mem_node(const void *addr)
+{
+	struct page *page;
+
+	if (ZERO_OR_NULL_PTR(addr))
+		return NUMA_NO_NODE;
+
+	page = is_vmalloc_addr(addr) ? vmalloc_to_page(addr) :
+				       virt_to_page(addr);
+
+	return page ? page_to_nid(page) : NUMA_NO_NODE;
+}
+
+/**
+ * btintel_test_ioctl_set_numa_node - Move device memory to another node
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_numa_node
+ *
+ * Reallocates the internal buffer on the new node, keeping its contents and
+ * its huge page preference.
+ * The emulated memory region is dropped and rebuilt on next use, unless a
+ * dump is still reading it. Later
+ * BTINTEL_TEST_IOC_SET_BUFFER_SIZE and dump buffers follow the node too.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_set_numa_node(struct btintel_test_device *dev,
+					    void __user *argp)
+{
+	struct btintel_test_numa_node req;
+	struct btintel_test_hugebuf *hb;
+	size_t off, len;
+	int old_node, ret;
+	void *buf, *dst, *src;
+	u32 backing;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (req.node != NUMA_NO_NODE &&
+	    (req.node < 0 || req.node >= nr_node_ids || !node_online(req.node)))
+		return -EINVAL;
+
+	ret = mutex_lock_interruptible(&dev->lock);
+	if (ret)
+		return ret;
+
+	old_node = dev->numa_node;
+	dev->numa_node = req.node;
+
+	buf = btintel_test_buffer_alloc(dev->buffer_size, dev->buffer_huge,
+					btintel_test_alloc_node(dev), &hb,
+					&backing);
+	if (!buf) {
+		dev->numa_node = old_node;
+		ret = -ENOMEM;
+		goto out_unlock;
+	}
+
+	for (off = 0; dev->buffer && off < dev->buffer_size; off += len) {
+		len = dev->buffer_size - off;
+		dst = btintel_test_buf_at(buf, hb, off, &len);
+		src = btintel_test_buffer_at(dev, off, &len);
+		memcpy(dst, src, len);
+	}
+	btintel_test_buffer_free(dev->buffer, dev->huge);
+	dev->buffer = buf;
+	dev->huge = hb;
+	dev->buffer_backing = backing;
+
+	if (!dev->emul_mem_users) {
+		vfree(dev->emul_mem);
+		dev->emul_mem = NULL;
+	}
+
+	pr_debug_dev("Device memory on node %d (buffer on node %d)\n",
+		     btintel_test_alloc_node(dev),
+		     btintel_test_mem_node(dev->buffer));
+
+out_unlock:
+	mutex_unlock(&dev->lock);
+	return ret;
+}
+
+/**
+ * btintel_test_numa_pass - Time read and write passes over one buffer
+ * @buf: Buffer, @size bytes
+ * @size: Bytes per pass, a multiple of sizeof(u64)
+ * @passes: Passes of each kind
+ * @res: Result to fill in
+ *
+ * Return: 0 on success, -EINTR if a fatal signal arrived
+ */
+static int btintel_test_numa_pass(u64 *buf, size_t size, u32 passes,
+				  struct btintel_test_numa_result *res)
+{
+	size_t i, words = size / sizeof(u64);
+	u64 t0, sum = 0;
+	u32 p;
+
+	/* Fault in and warm the TLB before timing anything */
+	memset(buf, 0, size);
+
+	for (p = 0; p < passes; p++) {
+		t0 = ktime_get_ns();
+		memset(buf, p, size);
+		res->write_ns += ktime_get_ns() - t0;
+
+		t0 = ktime_get_ns();
+		for (i = 0; i < words; i++)
+			sum += READ_ONCE(buf[i]);
+		res->read_ns += ktime_get_ns() - t0;
+
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		cond_resched();
+	}
+
+	/* Keep the reads from being optimized out */
+	OPTIMIZER_HIDE_VAR(sum);
+
+	return 0;
+}
+
+/**
+ * btintel_test_ioctl_numa_bench - Memory bandwidth of each NUMA node
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_numa_bench
+ *
+ * Allocates a buffer on every online node in turn and streams through it
+ * from the calling CPU, so that the local and remote cost can be compared
+ * with the controller's node. Results are only meaningful when the caller
+ * is pinned to one node for the whole run.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_numa_bench(struct btintel_test_device *dev,
+					 void __user *argp)
+{
+	struct btintel_test_numa_bench *req;
+	struct btintel_test_numa_result *res;
+	size_t size;
+	u64 *buf;
+	int nid, ret;
+
+	req = memdup_user(argp, sizeof(*req));
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	if (!req->size || req->size > BTINTEL_TEST_NUMA_BENCH_MAX_SIZE ||
+	    !req->passes || req->passes > BTINTEL_TEST_NUMA_BENCH_MAX_PASSES) {
+		ret = -EINVAL;
+		goto out_free;
+	}
+
+	size = round_up(req->size, sizeof(u64));
+	req->nr_nodes = 0;
+	req->cpu_node = numa_node_id();
+	req->dev_node = dev->pdev ? dev_to_node(&dev->pdev->dev) :
+				    NUMA_NO_NODE;
+	memset(req->nodes, 0, sizeof(req->nodes));
+
+	ret = mutex_lock_interruptible(&dev->lock);
+	if (ret)
+		goto out_free;
+
+	for_each_online_node(nid) {
+		if (req->nr_nodes == BTINTEL_TEST_NUMA_MAX_NODES)
+			break;
+
+		buf = vmalloc_node(size, nid);
+		if (!buf) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		res = &req->nodes[req->nr_nodes++];
+		res->node = nid;
+		res->placed = btintel_test_mem_node(buf);
+		ret = btintel_test_numa_pass(buf, size, req->passes, res);
+		vfree(buf);
+		if (ret)
+			break;
+	}
+
+	mutex_unlock(&dev->lock);
+
+	if (!ret && copy_to_user(argp, req, sizeof(*req)))
+		ret = -EFAULT;
+
+out_free:
+	kfree(req);
+	return ret;
+}
+
+/* ============================================================================
+ * HUGE PAGE BUFFERS
+ * ============================================================================ */
+
+#define BTINTEL_TEST_HUGE_ORDER		(PMD_SHIFT - PAGE_SHIFT)
+
+/**
+ * btintel_test_hugebuf_free - Free the huge page backing of a buffer
+ * @hb: Backing, may be NULL
+ */
+static void btintel_test_hugebuf_free(struct btintel_test_hugebuf *hb)
+{
+	unsigned int i;
+
+	if (!hb)
+		return;
+
+	for (i = 0; i < hb->nr; i++)
+		__free_pages(hb->chunks[i], BTINTEL_TEST_HUGE_ORDER);
+	kfree(hb);
+}
+
+/**
+ * btintel_test_hugebuf_alloc - Back a buffer with huge pages
+ * @size: Buffer size, a multiple of PMD_SIZE
+ * @node: NUMA node of the pages, or NUMA_NO_NODE
+ * @hbp: Returns the backing
+ *
+ * Does not retry or compact hard: when memory is too fragmented for huge
+ * pages the caller is better off falling back to base pages right away.
+ *
+ * Return: Zeroed, virtually contiguous mapping of the buffer, or NULL
+ */
+static void *btintel_test_hugebuf_alloc(size_t size, int node,
+					struct btintel_test_hugebuf **hbp)
+{
+	const unsigned int per_chunk = 1U << BTINTEL_TEST_HUGE_ORDER;
+	unsigned int i, j, nr = size >> PMD_SHIFT;
+	struct btintel_test_hugebuf *hb;
+	struct page **pages;
+	void *buf = NULL;
+
+	hb = kzalloc(struct_size(hb, chunks, nr), GFP_KERNEL);
+	pages = kvmalloc_array(size >> PAGE_SHIFT, sizeof(*pages), GFP_KERNEL);
+	if (!hb || !pages)
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		struct page *page;
+
+		page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO |
+					      __GFP_COMP | __GFP_NOWARN |
+					      __GFP_NORETRY,
+					BTINTEL_TEST_HUGE_ORDER);
+		if (!page)
+			goto out;
+
+		hb->chunks[hb->nr++] = page;
+		for (j = 0; j < per_chunk; j++)
+			pages[i * per_chunk + j] = page + j;
+	}
+
+	buf = vmap(pages, size >> PAGE_SHIFT, VM_MAP, PAGE_KERNEL);
+
+out:
+	kvfree(pages);
+	if (!buf) {
+		btintel_test_hugebuf_free(hb);
+		return NULL;
+	}
+
+	*hbp = hb;
+	return buf;
+}
+
+/**
+ * btintel_test_buffer_alloc - Allocate a zeroed device buffer
+ * @size: Buffer size
+ * @huge: Prefer huge pages
+ * @node: NUMA node of the buffer, or NUMA_NO_NODE
+ * @hbp: Returns the huge page backing, NULL for other backings
+ * @backing: Returns the BTINTEL_TEST_BUF_BACKING_* the buffer got
+ *
+ * Huge pages are only used when @size is a whole number of them; any other
+ * size, or a failure to find free huge pages, falls back to kvzalloc().
+ *
+ * Return: Buffer, free with btintel_test_buffer_free(), or NULL
+ */
+static void *btintel_test_buffer_alloc(size_t size, bool huge, int node,
+				       struct btintel_test_hugebuf **hbp,
+				       u32 *backing)
+{
+	void *buf;
+
+	*hbp = NULL;
+
+	if (huge && size && IS_ALIGNED(size, PMD_SIZE)) {
+		buf = btintel_test_hugebuf_alloc(size, node, hbp);
+		if (buf) {
+			*backing = BTINTEL_TEST_BUF_BACKING_HUGE;
+			return buf;
+		}
+		pr_debug_dev("No huge pages for %zu bytes, using base pages\n",
+			     size);
+	}
+
+	buf = kvzalloc_node(size, GFP_KERNEL, node);
+	if (buf)
+		*backing = is_vmalloc_addr(buf) ? BTINTEL_TEST_BUF_BACKING_VMALLOC :
+						  BTINTEL_TEST_BUF_BACKING_LINEAR;
+
+	return buf;
+}
+
+/**
+ * btintel_test_buffer_free - Free a buffer from btintel_test_buffer_alloc()
+ * @buf: Buffer, may be NULL
+ * @hb: Its huge page backing, or NULL
+ */
+static void btintel_test_buffer_free(void *buf, struct btintel_test_hugebuf *hb)
+{
+	if (!hb) {
+		kvfree(buf);
+		return;
+	}
+
+	vunmap(buf);
+	btintel_test_hugebuf_free(hb);
+}
+
+/**
+ * btintel_test_buf_at - Address of a buffer for bulk access
+ * @buf: Buffer from btintel_test_buffer_alloc()
+ * @hb: Its huge page backing, or NULL
+ * @off: Offset into the buffer
+ * @len: Bytes wanted, trimmed to what is contiguous at the address
+ *
+ * Return: Linear map address of @off when the buffer has huge pages,
+ *         otherwise @buf + @off
+ */
+static void *btintel_test_buf_at(void *buf, struct btintel_test_hugebuf *hb,
+				 size_t off, size_t *len)
+{
+	size_t in = off & (PMD_SIZE - 1);
+
+	if (!hb)
+		return buf + off;
+
+	*len = min_t(size_t, *len, PMD_SIZE - in);
+	return page_address(hb->chunks[off >> PMD_SHIFT]) + in;
+}
+
+/**
+ * btintel_test_buffer_at - Address of the device buffer for bulk access
+ * @dev: Device structure
+ * @off: Offset into the buffer
+ * @len: Bytes wanted, trimmed to what is contiguous at the address
+ *
+ * Return: See btintel_test_buf_at()
+ */
+static void *btintel_test_buffer_at(struct btintel_test_device *dev,
+				    size_t off, size_t *len)
+{
+	return btintel_test_buf_at(dev->buffer, dev->huge, off, len);
+}
+
+/**
+ * btintel_test_buf_bench_run - Time sequential and random access
+ * @chunks: Addresses of the PMD_SIZE pieces of the buffer
+ * @nr: Number of entries in @chunks
+ * @req: Benchmark parameters
+ * @res: Result to fill in
+ *
+ * Both backings go through @chunks the same way, so the only difference
+ * between them is how many TLB entries the accesses need. Random reads
+ * form a dependency chain and so measure latency, TLB misses included.
+ *
+ * Return: 0 on success, -EINTR if a fatal signal arrived
+ */
+static int btintel_test_buf_bench_run(void **chunks, unsigned int nr,
+				      const struct btintel_test_buf_bench *req,
+				      struct btintel_test_buf_bench_result *res)
+{
+	const size_t words = PMD_SIZE / sizeof(u64);
+	u64 t0, sum = 0, x = 0x9e3779b97f4a7c15ULL;
+	unsigned int i;
+	size_t j;
+	u32 p, n;
+
+	for (p = 0; p < req->passes; p++) {
+		t0 = ktime_get_ns();
+		for (i = 0; i < nr; i++)
+			memset(chunks[i], p, PMD_SIZE);
+		res->seq_write_ns += ktime_get_ns() - t0;
+
+		t0 = ktime_get_ns();
+		for (i = 0; i < nr; i++)
+			for (j = 0; j < words; j++)
+				sum += READ_ONCE(((u64 *)chunks[i])[j]);
+		res->seq_read_ns += ktime_get_ns() - t0;
+
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		cond_resched();
+	}
+
+	t0 = ktime_get_ns();
+	for (n = 0; n < req->random; n++) {
+		u64 idx;
+
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		idx = ((x & U32_MAX) * (nr * words)) >> 32;
+		x += READ_ONCE(((u64 *)chunks[idx / words])[idx % words]);
+	}
+	res->rand_read_ns = ktime_get_ns() - t0;
+
+	/* Keep the reads from being optimized out */
+	sum += x;
+	OPTIMIZER_HIDE_VAR(sum);
+
+	return 0;
+}
+
+/**
+ * btintel_test_ioctl_buf_bench - Compare base and huge page buffers
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_buf_bench
+ *
+ * Allocates one buffer of base pages and one of huge pages on the device's
+ * node and runs the same access pattern over both. The device buffer
+ * itself is left alone.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_buf_bench(struct btintel_test_device *dev,
+					void __user *argp)
+{
+	struct btintel_test_buf_bench req;
+	struct btintel_test_hugebuf *hb = NULL;
+	void *base = NULL, *huge = NULL;
+	void **chunks = NULL;
+	unsigned int i, nr;
+	int node, ret;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (!req.size || req.size > BTINTEL_TEST_BUF_BENCH_MAX_SIZE ||
+	    !IS_ALIGNED(req.size, PMD_SIZE) ||
+	    req.passes > BTINTEL_TEST_BUF_BENCH_MAX_PASSES ||
+	    req.random > BTINTEL_TEST_BUF_BENCH_MAX_RANDOM)
+		return -EINVAL;
+
+	nr = req.size >> PMD_SHIFT;
+	node = btintel_test_alloc_node(dev);
+	req.huge_size = PMD_SIZE;
+	memset(&req.base, 0, sizeof(req.base));
+	memset(&req.huge, 0, sizeof(req.huge));
+
+	ret = mutex_lock_interruptible(&dev->lock);
+	if (ret)
+		return ret;
+
+	chunks = kmalloc_array(nr, sizeof(*chunks), GFP_KERNEL);
+	base = vzalloc_node(req.size, node);
+	huge = btintel_test_buffer_alloc(req.size, true, node, &hb,
+					 &req.huge.backing);
+	if (!chunks || !base || !huge) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	req.base.backing = BTINTEL_TEST_BUF_BACKING_VMALLOC;
+	for (i = 0; i < nr; i++)
+		chunks[i] = base + (size_t)i * PMD_SIZE;
+	ret = btintel_test_buf_bench_run(chunks, nr, &req, &req.base);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < nr; i++)
+		chunks[i] = hb ? page_address(hb->chunks[i]) :
+				 huge + (size_t)i * PMD_SIZE;
+	ret = btintel_test_buf_bench_run(chunks, nr, &req, &req.huge);
+
+out:
+	btintel_test_buffer_free(huge, hb);
+	vfree(base);
+	kfree(chunks);
+	mutex_unlock(&dev->lock);
+
+	if (!ret && copy_to_user(argp, &req, sizeof(req)))
+		ret = -EFAULT;
+
+	return ret;
+}
+
+/* ============================================================================
+ * INSTRUMENTATION CONTROL
+ * ============================================================================ */
+
+/**
+ * btintel_test_trace_record - Account one sample of an instrumentation point
+ * @point: BTINTEL_TEST_TRACE_*
+ * @ns: Duration of the section
+ *
+ * Kept out of line so that the disabled points stay small.
+ */
+static noinline void btintel_test_trace_record(unsigned int point, u64 ns)
+{
+	struct btintel_test_trace_cpu *tc = get_cpu_ptr(&btintel_test_trace_cpu);
+
+	btintel_test_lat_add(&tc->points[point], ns);
+	put_cpu_ptr(&btintel_test_trace_cpu);
+}
+
+/**
+ * btintel_test_trace_set - Toggle and reset the instrumentation points
+ * @flags: BTINTEL_TEST_TRACE_ENABLE, _DISABLE and _RESET
+ *
+ * Samples are reset whenever the points go from disabled to enabled, so a
+ * new session never mixes with an old one.
+ */
+static void btintel_test_trace_set(u32 flags)
+{
+	unsigned int point;
+	int cpu;
+
+	mutex_lock(&btintel_test_trace_lock);
+
+	if (flags & BTINTEL_TEST_TRACE_DISABLE)
+		static_branch_disable(&btintel_test_trace_key);
+
+	if (flags & BTINTEL_TEST_TRACE_RESET ||
+	    (flags & BTINTEL_TEST_TRACE_ENABLE &&
+	     !static_key_enabled(&btintel_test_trace_key))) {
+		for_each_possible_cpu(cpu) {
+			struct btintel_test_trace_cpu *tc;
+
+			tc = per_cpu_ptr(&btintel_test_trace_cpu, cpu);
+			for (point = 0; point < BTINTEL_TEST_TRACE_POINTS; point++)
+				btintel_test_lat_init(&tc->points[point]);
+		}
+	}
+
+	if (flags & BTINTEL_TEST_TRACE_ENABLE)
+		static_branch_enable(&btintel_test_trace_key);
+
+	mutex_unlock(&btintel_test_trace_lock);
+}
+
+/**
+ * btintel_test_ioctl_trace - Handle BTINTEL_TEST_IOC_TRACE
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_trace
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_trace(struct btintel_test_device *dev,
+				    void __user *argp)
+{
+	struct btintel_test_lat_acc *acc;
+	struct btintel_test_trace *req;
+	unsigned int point, i;
+	u32 flags;
+	int cpu, ret = 0;
+
+	if (get_user(flags, (u32 __user *)argp))
+		return -EFAULT;
+
+	if (flags & ~(BTINTEL_TEST_TRACE_ENABLE | BTINTEL_TEST_TRACE_DISABLE |
+		      BTINTEL_TEST_TRACE_RESET) ||
+	    (flags & BTINTEL_TEST_TRACE_ENABLE &&
+	     flags & BTINTEL_TEST_TRACE_DISABLE))
+		return -EINVAL;
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	acc = kcalloc(BTINTEL_TEST_TRACE_POINTS, sizeof(*acc), GFP_KERNEL);
+	if (!req || !acc) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	req->flags = flags;
+	req->enabled = static_key_enabled(&btintel_test_trace_key);
+
+	for (point = 0; point < BTINTEL_TEST_TRACE_POINTS; point++)
+		btintel_test_lat_init(&acc[point]);
+
+	/* Racy against points recording right now, which is fine for stats */
+	for_each_possible_cpu(cpu) {
+		struct btintel_test_trace_cpu *tc;
+
+		tc = per_cpu_ptr(&btintel_test_trace_cpu, cpu);
+		for (point = 0; point < BTINTEL_TEST_TRACE_POINTS; point++) {
+			const struct btintel_test_lat_acc *src = &tc->points[point];
+
+			if (!src->lat.samples)
+				continue;
+			acc[point].sum_ns += src->sum_ns;
+			acc[point].lat.samples += src->lat.samples;
+			acc[point].lat.min_ns = min(acc[point].lat.min_ns,
+						    src->lat.min_ns);
+			acc[point].lat.max_ns = max(acc[point].lat.max_ns,
+						    src->lat.max_ns);
+			for (i = 0; i < BTINTEL_TEST_HIST_BUCKETS; i++)
+				acc[point].lat.hist[i] += src->lat.hist[i];
+		}
+	}
+
+	for (point = 0; point < BTINTEL_TEST_TRACE_POINTS; point++)
+		btintel_test_lat_finish(&acc[point], &req->points[point]);
+
+	if (flags)
+		btintel_test_trace_set(flags);
+
+	if (copy_to_user(argp, req, sizeof(*req)))
+		ret = -EFAULT;
+
+out:
+	kfree(acc);
+	kfree(req);
+	return ret;
+}
+
+/**
+ * btintel_test_trace_loop_bare - Benchmark loop without a point
+ * @loops: Iterations
+ *
+ * Return: Elapsed time in ns
+ */
+static noinline u64 btintel_test_trace_loop_bare(u32 loops)
+{
+	u64 t0 = ktime_get_ns();
+	u32 i;
+
+	for (i = 0; i < loops; i++)
+		barrier();
+
+	return ktime_get_ns() - t0;
+}
+
+/**
+ * btintel_test_trace_loop_point - Benchmark loop around one point
+ * @loops: Iterations
+ *
+ * Same loop as btintel_test_trace_loop_bare(), with the body instrumented
+ * the way the driver paths are.
+ *
+ * Return: Elapsed time in ns
+ */
+static noinline u64 btintel_test_trace_loop_point(u32 loops)
+{
+	u64 t0 = ktime_get_ns(), start;
+	u32 i;
+
+	for (i = 0; i < loops; i++) {
+		start = btintel_test_trace_start();
+		barrier();
+		btintel_test_trace_end(BTINTEL_TEST_TRACE_BENCH, start);
+	}
+
+	return ktime_get_ns() - t0;
+}
+
+/**
+ * btintel_test_ioctl_trace_bench - Handle BTINTEL_TEST_IOC_TRACE_BENCH
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_trace_bench
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_trace_bench(struct btintel_test_device *dev,
+					  void __user *argp)
+{
+	struct btintel_test_trace_bench req;
+	bool was;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (!req.loops || req.loops > BTINTEL_TEST_TRACE_BENCH_MAX_LOOPS)
+		return -EINVAL;
+
+	mutex_lock(&btintel_test_trace_lock);
+	was = static_key_enabled(&btintel_test_trace_key);
+
+	req.bare_ns = btintel_test_trace_loop_bare(req.loops);
+
+	static_branch_disable(&btintel_test_trace_key);
+	req.off_ns = btintel_test_trace_loop_point(req.loops);
+
+	static_branch_enable(&btintel_test_trace_key);
+	req.on_ns = btintel_test_trace_loop_point(req.loops);
+
+	if (!was)
+		static_branch_disable(&btintel_test_trace_key);
+	mutex_unlock(&btintel_test_trace_lock);
+
+	pr_debug_dev("Trace point: %llu/%llu/%llu ns per %u loops\n",
+		     req.bare_ns, req.off_ns, req.on_ns, req.loops);
+
+	if (copy_to_user(argp, &req, sizeof(req)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* ============================================================================
+ * PERFORMANCE COUNTERS
+ * ============================================================================ */
+
+#ifdef CONFIG_PERF_EVENTS
+
+static const struct {
+	u32 type;
+	u64 config;
+} btintel_test_perf_events[BTINTEL_TEST_PERF_COUNTERS] = {
+	[BTINTEL_TEST_PERF_CYCLES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[BTINTEL_TEST_PERF_INSTRUCTIONS] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[BTINTEL_TEST_PERF_CACHE_MISSES] = {
+		PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	[BTINTEL_TEST_PERF_CONTEXT_SWITCHES] = {
+		PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	[BTINTEL_TEST_PERF_TASK_CLOCK] = {
+		PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	[BTINTEL_TEST_PERF_CPU_MIGRATIONS] = {
+		PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+	[BTINTEL_TEST_PERF_PAGE_FAULTS] = {
+		PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+/**
+ * btintel_test_perf_open - Create the counters for the current task
+ * @perf: Counter set
+ *
+ * Counters the machine cannot provide, typically the hardware ones in a
+ * VM without a virtual PMU, are left out rather than failing the run.
+ *
+ * Return: Bit per counter that was created
+ */
+static u32 btintel_test_perf_open(struct btintel_test_perf *perf)
+{
+	struct perf_event_attr attr;
+	struct perf_event *ev;
+	u32 valid = 0;
+	int i;
+
+	for (i = 0; i < BTINTEL_TEST_PERF_COUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.type = btintel_test_perf_events[i].type;
+		attr.config = btintel_test_perf_events[i].config;
+		attr.size = sizeof(attr);
+		attr.disabled = 1;
+		attr.exclude_hv = 1;
+
+		ev = perf_event_create_kernel_counter(&attr, -1, current,
+						      NULL, NULL);
+		perf->ev[i] = IS_ERR(ev) ? NULL : ev;
+		if (perf->ev[i])
+			valid |= BIT(i);
+	}
+
+	return valid;
+}
+
+/**
+ * btintel_test_perf_enable - Start or stop counting
+ * @perf: Counter set
+ * @on: Start when true
+ */
+static void btintel_test_perf_enable(struct btintel_test_perf *perf, bool on)
+{
+	int i;
+
+	for (i = 0; i < BTINTEL_TEST_PERF_COUNTERS; i++) {
+		if (!perf->ev[i])
+			continue;
+		if (on)
+			perf_event_enable(perf->ev[i]);
+		else
+			perf_event_disable(perf->ev[i]);
+	}
+}
+
+/**
+ * btintel_test_perf_close - Read and release the counters
+ * @perf: Counter set
+ * @counts: Values, scaled up for counters that only ran part of the time
+ *
+ * Return: Bit per counter that had to be scaled
+ */
+static u32 btintel_test_perf_close(struct btintel_test_perf *perf,
+				   u64 *counts)
+{
+	u64 enabled, running;
+	u32 multiplexed = 0;
+	int i;
+
+	for (i = 0; i < BTINTEL_TEST_PERF_COUNTERS; i++) {
+		if (!perf->ev[i])
+			continue;
+
+		counts[i] = perf_event_read_value(perf->ev[i], &enabled,
+						  &running);
+		if (running < enabled) {
+			counts[i] = running ?
+				mul_u64_u64_div_u64(counts[i], enabled, running) : 0;
+			multiplexed |= BIT(i);
+		}
+
+		perf_event_release_kernel(perf->ev[i]);
+	}
+
+	return multiplexed;
+}
+
+#else /* !CONFIG_PERF_EVENTS */
+
+static u32 btintel_test_perf_open(struct btintel_test_perf *perf)
+{
+	return 0;
+}
+
+static void btintel_test_perf_enable(struct btintel_test_perf *perf, bool on)
+{
+}
+
+static u32 btintel_test_perf_close(struct btintel_test_perf *perf,
+				   u64 *counts)
+{
+	return 0;
+}
+
+#endif /* CONFIG_PERF_EVENTS */
+
+/**
+ * btintel_test_ioctl_perf_run - Handle BTINTEL_TEST_IOC_PERF_RUN
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_perf_run
+ *
+ * Runs the wrapped command through the regular dispatch, so it is also
+ * accounted in BTINTEL_TEST_IOC_IOCTL_STATS. Creating the counters happens
+ * outside the counted window.
+ *
+ * Return: 0 once the wrapped command ran, whatever it returned, or a
+ *         negative error code
+ */
+static int btintel_test_ioctl_perf_run(struct btintel_test_device *dev,
+				       void __user *argp)
+{
+	struct btintel_test_perf_run req;
+	struct btintel_test_perf perf = {};
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (req.cmd == BTINTEL_TEST_IOC_PERF_RUN)
+		return -EINVAL;
+
+	memset(req.counts, 0, sizeof(req.counts));
+	req.valid = btintel_test_perf_open(&perf);
+
+	btintel_test_perf_enable(&perf, true);
+	req.ret = btintel_test_ioctl_dispatch(dev, req.cmd,
+					      u64_to_user_ptr(req.arg));
+	btintel_test_perf_enable(&perf, false);
+
+	req.multiplexed = btintel_test_perf_close(&perf, req.counts);
+
+	if (copy_to_user(argp, &req, sizeof(req)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* ============================================================================
+ * STATS SAMPLER
+ * ============================================================================ */
+
+/**
+ * btintel_test_sampler_snap - Read the cumulative counters
+ * @dev: Device structure
+ * @snap: Snapshot to fill in
+ *
+ * The counters are updated without a common lock, so the snapshot is not
+ * atomic as a whole; each counter is read once.
+ */
+static void btintel_test_sampler_snap(struct btintel_test_device *dev,
+				      struct btintel_test_sampler_snap *snap)
+{
+	snap->ns = ktime_get_ns();
+	snap->reads = READ_ONCE(dev->stats.read_count);
+	snap->writes = READ_ONCE(dev->stats.write_count);
+	snap->ioctls = READ_ONCE(dev->stats.ioctl_count);
+	snap->errors = READ_ONCE(dev->stats.errors);
+	snap->read_bytes = READ_ONCE(dev->stats.read_bytes);
+	snap->write_bytes = READ_ONCE(dev->stats.write_bytes);
+	snap->hci_cmds = atomic64_read(&dev->hci.cmds);
+	snap->hci_ns = atomic64_read(&dev->hci.total_ns);
+}
+
+/**
+ * btintel_test_sampler_delta - Growth of a counter over one interval
+ * @cur: Current value
+ * @prev: Value at the previous sample
+ *
+ * BTINTEL_TEST_IOC_RESET_STATS may have cleared the counter in between, in
+ * which case everything it counted since belongs to this interval.
+ *
+ * Return: Growth of the counter
+ */
+static u64 btintel_test_sampler_delta(u64 cur, u64 prev)
+{
+	return cur >= prev ? cur - prev : cur;
+}
+
+/**
+ * btintel_test_sampler_take - Append one sample to the history
+ * @dev: Device structure
+ *
+ * Context: @dev->sampler.ring_lock held
+ */
+static void btintel_test_sampler_take(struct btintel_test_device *dev)
+{
+	struct btintel_test_stats_sampler *sampler = &dev->sampler;
+	struct btintel_test_sampler_snap *prev = &sampler->prev;
+	struct btintel_test_sampler_snap cur;
+	struct btintel_test_sample *s;
+	u64 hci_ns;
+
+	btintel_test_sampler_snap(dev, &cur);
+
+	s = &sampler->ring[sampler->seq % BTINTEL_TEST_SAMPLER_RING];
+	s->seq = sampler->seq++;
+	s->timestamp_ns = cur.ns;
+	s->interval_ns = cur.ns - prev->ns;
+	s->reads = btintel_test_sampler_delta(cur.reads, prev->reads);
+	s->writes = btintel_test_sampler_delta(cur.writes, prev->writes);
+	s->ioctls = btintel_test_sampler_delta(cur.ioctls, prev->ioctls);
+	s->errors = btintel_test_sampler_delta(cur.errors, prev->errors);
+	s->read_bytes = btintel_test_sampler_delta(cur.read_bytes,
+						   prev->read_bytes);
+	s->write_bytes = btintel_test_sampler_delta(cur.write_bytes,
+						    prev->write_bytes);
+	s->hci_cmds = cur.hci_cmds - prev->hci_cmds;
+	hci_ns = cur.hci_ns - prev->hci_ns;
+	s->hci_mean_ns = s->hci_cmds ? div64_u64(hci_ns, s->hci_cmds) : 0;
+	s->hci_max_ns = atomic64_xchg(&dev->hci.max_ns, 0);
+
+	*prev = cur;
+}
+
+/**
+ * btintel_test_sampler_timer - Take a sample every period
+ * @timer: Timer embedded in struct btintel_test_stats_sampler
+ *
+ * Periods the timer missed are folded into the next sample, whose
+ * interval_ns shows the real length.
+ *
+ * Return: HRTIMER_RESTART
+ */
+static enum hrtimer_restart btintel_test_sampler_timer(struct hrtimer *timer)
+{
+	struct btintel_test_device *dev =
+		container_of(timer, struct btintel_test_device, sampler.timer);
+	struct btintel_test_stats_sampler *sampler = &dev->sampler;
+
+	spin_lock(&sampler->ring_lock);
+	btintel_test_sampler_take(dev);
+	spin_unlock(&sampler->ring_lock);
+
+	hrtimer_forward_now(timer, sampler->period);
+	return HRTIMER_RESTART;
+}
+
+/**
+ * btintel_test_sampler_init - Initialize the stats sampler
+ * @sampler: Sampler
+ */
+static void btintel_test_sampler_init(struct btintel_test_stats_sampler *sampler)
+{
+	mutex_init(&sampler->lock);
+	spin_lock_init(&sampler->ring_lock);
+	hrtimer_init(&sampler->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	sampler->timer.function = btintel_test_sampler_timer;
+}
+
+/**
+ * btintel_test_sampler_stop - Stop taking samples, keeping the history
+ * @sampler: Sampler
+ *
+ * Context: @sampler->lock held, or the device is being torn down
+ */
+static void btintel_test_sampler_stop(struct btintel_test_stats_sampler *sampler)
+{
+	hrtimer_cancel(&sampler->timer);
+	sampler->running = false;
+}
+
+/**
+ * btintel_test_sampler_start - (Re)start taking samples
+ * @dev: Device structure
+ * @period_us: Sampling period
+ *
+ * The first sample covers the time from now to the first period.
+ *
+ * Context: @dev->sampler.lock held
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_sampler_start(struct btintel_test_device *dev,
+				      u32 period_us)
+{
+	struct btintel_test_stats_sampler *sampler = &dev->sampler;
+
+	if (period_us < BTINTEL_TEST_SAMPLER_MIN_PERIOD_US ||
+	    period_us > BTINTEL_TEST_SAMPLER_MAX_PERIOD_US)
+		return -EINVAL;
+
+	if (!sampler->ring) {
+		sampler->ring = kvzalloc_node(array_size(BTINTEL_TEST_SAMPLER_RING,
+							 sizeof(*sampler->ring)),
+					      GFP_KERNEL,
+					      btintel_test_alloc_node(dev));
+		if (!sampler->ring)
+			return -ENOMEM;
+	}
+
+	btintel_test_sampler_stop(sampler);
+
+	spin_lock_bh(&sampler->ring_lock);
+	btintel_test_sampler_snap(dev, &sampler->prev);
+	atomic64_set(&dev->hci.max_ns, 0);
+	spin_unlock_bh(&sampler->ring_lock);
+
+	sampler->period = us_to_ktime(period_us);
+	sampler->running = true;
+	hrtimer_start(&sampler->timer, sampler->period, HRTIMER_MODE_REL_SOFT);
+
+	return 0;
+}
+
+/**
+ * btintel_test_ioctl_sampler - Handle BTINTEL_TEST_IOC_SAMPLER
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_sampler
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_sampler(struct btintel_test_device *dev,
+				      void __user *argp)
+{
+	struct btintel_test_stats_sampler *sampler = &dev->sampler;
+	struct btintel_test_sampler req;
+	int ret = 0;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (req.flags & ~(BTINTEL_TEST_SAMPLER_START | BTINTEL_TEST_SAMPLER_STOP |
+			  BTINTEL_TEST_SAMPLER_RESET) ||
+	    (req.flags & BTINTEL_TEST_SAMPLER_START &&
+	     req.flags & BTINTEL_TEST_SAMPLER_STOP))
+		return -EINVAL;
+
+	mutex_lock(&sampler->lock);
+
+	if (req.flags & BTINTEL_TEST_SAMPLER_STOP)
+		btintel_test_sampler_stop(sampler);
+
+	if (req.flags & BTINTEL_TEST_SAMPLER_RESET) {
+		spin_lock_bh(&sampler->ring_lock);
+		sampler->seq = 0;
+		spin_unlock_bh(&sampler->ring_lock);
+	}
+
+	if (req.flags & BTINTEL_TEST_SAMPLER_START)
+		ret = btintel_test_sampler_start(dev, req.period_us);
+
+	req.period_us = ktime_to_us(sampler->period);
+	req.running = sampler->running;
+	req.capacity = BTINTEL_TEST_SAMPLER_RING;
+	spin_lock_bh(&sampler->ring_lock);
+	req.next_seq = sampler->seq;
+	spin_unlock_bh(&sampler->ring_lock);
+
+	mutex_unlock(&sampler->lock);
+
+	if (ret)
+		return ret;
+
+	if (copy_to_user(argp, &req, sizeof(req)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/**
+ * btintel_test_ioctl_sampler_read - Handle BTINTEL_TEST_IOC_SAMPLER_READ
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_sampler_read
+ *
+ * Copies the samples from @seq on, oldest first. Samples the ring already
+ * overwrote are skipped and counted in @lost, so a reader that polls at
+ * least once per BTINTEL_TEST_SAMPLER_RING periods sees every sample.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_sampler_read(struct btintel_test_device *dev,
+					   void __user *argp)
+{
+	struct btintel_test_stats_sampler *sampler = &dev->sampler;
+	struct btintel_test_sampler_read req;
+	struct btintel_test_sample *out = NULL;
+	u64 oldest, first;
+	u32 i, n;
+	int ret = 0;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	n = min_t(u32, req.count, BTINTEL_TEST_SAMPLER_RING);
+	if (n) {
+		out = kvmalloc_array(n, sizeof(*out), GFP_KERNEL);
+		if (!out)
+			return -ENOMEM;
+	}
+
+	spin_lock_bh(&sampler->ring_lock);
+	oldest = sampler->seq > BTINTEL_TEST_SAMPLER_RING ?
+		 sampler->seq - BTINTEL_TEST_SAMPLER_RING : 0;
+	first = clamp(req.seq, oldest, sampler->seq);
+	req.lost = first > req.seq ? first - req.seq : 0;
+	n = min_t(u64, n, sampler->seq - first);
+	for (i = 0; i < n; i++)
+		out[i] = sampler->ring[(first + i) % BTINTEL_TEST_SAMPLER_RING];
+	spin_unlock_bh(&sampler->ring_lock);
+
+	req.seq = first + n;
+	req.count = n;
+
+	if (n && copy_to_user(u64_to_user_ptr(req.samples), out,
+			      array_size(n, sizeof(*out))))
+		ret = -EFAULT;
+	else if (copy_to_user(argp, &req, sizeof(req)))
+		ret = -EFAULT;
+
+	kvfree(out);
+	return ret;
+}
+
+/* ============================================================================
+ * METRICS EXPORTER
+ * ============================================================================ */
+
+/*
+ * <debugfs>/btintel_test_generic_driver/metrics renders the device state
+ * in the Prometheus text exposition format. Every value is read with plain
+ * loads from where the hot paths keep it, per-CPU data is summed on the
+ * fly, and no lock is taken, so a scrape never stalls a reader, writer or
+ * ioctl. A scrape racing an update may see a value from just before it.
+ */
+
+static const char * const btintel_test_trace_names[BTINTEL_TEST_TRACE_POINTS] = {
+	[BTINTEL_TEST_TRACE_READ] = "read",
+	[BTINTEL_TEST_TRACE_WRITE] = "write",
+	[BTINTEL_TEST_TRACE_IOCTL] = "ioctl",
+	[BTINTEL_TEST_TRACE_HCI_CMD] = "hci_cmd",
+	[BTINTEL_TEST_TRACE_BENCH] = "bench",
+};
+
+static const char * const btintel_test_backing_names[] = {
+	[BTINTEL_TEST_BUF_BACKING_LINEAR] = "linear",
+	[BTINTEL_TEST_BUF_BACKING_VMALLOC] = "vmalloc",
+	[BTINTEL_TEST_BUF_BACKING_HUGE] = "huge",
+};
+
+/**
+ * btintel_test_metrics_family - Emit the HELP and TYPE lines of a metric
+ * @m: Output
+ * @name: Metric name without the btintel_test_ prefix
+ * @type: counter, gauge or histogram
+ * @help: Description
+ */
+static void btintel_test_metrics_family(struct seq_file *m, const char *name,
+					const char *type, const char *help)
+{
+	seq_printf(m, "# HELP btintel_test_%s %s\n", name, help);
+	seq_printf(m, "# TYPE btintel_test_%s %s\n", name, type);
+}
+
+/**
+ * btintel_test_metrics_u64 - Emit a metric family with a single value
+ * @m: Output
+ * @name: Metric name without the btintel_test_ prefix
+ * @type: counter or gauge
+ * @help: Description
+ * @val: Value
+ */
+static void btintel_test_metrics_u64(struct seq_file *m, const char *name,
+				     const char *type, const char *help,
+				     u64 val)
+{
+	btintel_test_metrics_family(m, name, type, help);
+	seq_printf(m, "btintel_test_%s %llu\n", name, val);
+}
+
+/**
+ * btintel_test_metrics_seconds - Print nanoseconds as decimal seconds
+ * @m: Output
+ * @ns: Duration
+ */
+static void btintel_test_metrics_seconds(struct seq_file *m, u64 ns)
+{
+	u32 rem;
+	u64 s = div_u64_rem(ns, NSEC_PER_SEC, &rem);
+
+	seq_printf(m, "%llu.%09u\n", s, rem);
+}
+
+/**
+ * btintel_test_metrics_trace - Emit the instrumentation points as histograms
+ * @m: Output
+ *
+ * The log2 buckets map directly onto cumulative "le" buckets: bucket i
+ * holds the samples below 2^i ns, the last one everything above.
+ */
+static void btintel_test_metrics_trace(struct seq_file *m)
+{
+	u64 hist[BTINTEL_TEST_HIST_BUCKETS];
+	unsigned int point, i;
+	u64 sum, seen;
+	int cpu;
+
+	btintel_test_metrics_u64(m, "trace_enabled", "gauge",
+				 "Whether the instrumentation points are on",
+				 static_key_enabled(&btintel_test_trace_key));
+
+	btintel_test_metrics_family(m, "trace_duration_seconds", "histogram",
+				    "Time spent in each instrumented path");
+	for (point = 0; point < BTINTEL_TEST_TRACE_POINTS; point++) {
+		const char *name = btintel_test_trace_names[point];
+
+		memset(hist, 0, sizeof(hist));
+		sum = 0;
+		for_each_possible_cpu(cpu) {
+			const struct btintel_test_lat_acc *acc =
+				&per_cpu_ptr(&btintel_test_trace_cpu, cpu)->points[point];
+
+			sum += READ_ONCE(acc->sum_ns);
+			for (i = 0; i < BTINTEL_TEST_HIST_BUCKETS; i++)
+				hist[i] += READ_ONCE(acc->lat.hist[i]);
+		}
+
+		seen = 0;
+		for (i = 0; i < BTINTEL_TEST_HIST_BUCKETS - 1; i++) {
+			seen += hist[i];
+			seq_printf(m, "btintel_test_trace_duration_seconds_bucket{point=\"%s\",le=\"%u.%09u\"} %llu\n",
+				   name, (u32)((1U << i) / NSEC_PER_SEC),
+				   (u32)((1U << i) % NSEC_PER_SEC), seen);
+		}
+		/*
+		 * The buckets are read one by one while points may record, so
+		 * derive the count from them rather than from the sample counter.
+		 */
+		seen += hist[i];
+		seq_printf(m, "btintel_test_trace_duration_seconds_bucket{point=\"%s\",le=\"+Inf\"} %llu\n",
+			   name, seen);
+		seq_printf(m, "btintel_test_trace_duration_seconds_sum{point=\"%s\"} ",
+			   name);
+		btintel_test_metrics_seconds(m, sum);
+		seq_printf(m, "btintel_test_trace_duration_seconds_count{point=\"%s\"} %llu\n",
+			   name, seen);
+	}
+}
+
+/**
+ * btintel_test_metrics_ioctls - Emit the per-command ioctl costs
+ * @m: Output
+ * @dev: Device structure
+ */
+static void btintel_test_metrics_ioctls(struct seq_file *m,
+					struct btintel_test_device *dev)
+{
+	static const char * const families[][3] = {
+		{ "ioctl_calls_total", "counter", "Calls of each ioctl command" },
+		{ "ioctl_errors_total", "counter", "Failed calls of each ioctl command" },
+		{ "ioctl_seconds_total", "counter", "Time spent in each ioctl command" },
+		{ "ioctl_max_seconds", "gauge", "Longest call of each ioctl command" },
+	};
+	struct btintel_test_ioctl_acct sum;
+	unsigned int f, nr;
+	int cpu;
+
+	for (f = 0; f < ARRAY_SIZE(families); f++) {
+		btintel_test_metrics_family(m, families[f][0], families[f][1],
+					    families[f][2]);
+		for (nr = 0; nr < ARRAY_SIZE(btintel_test_ioctls); nr++) {
+			if (!btintel_test_ioctls[nr].handler)
+				continue;
+
+			memset(&sum, 0, sizeof(sum));
+			for_each_possible_cpu(cpu) {
+				const struct btintel_test_ioctl_acct *acct =
+					&per_cpu_ptr(dev->ioctl_acct, cpu)[nr];
+
+				sum.calls += READ_ONCE(acct->calls);
+				sum.errors += READ_ONCE(acct->errors);
+				sum.total_ns += READ_ONCE(acct->total_ns);
+				sum.max_ns = max(sum.max_ns, READ_ONCE(acct->max_ns));
+			}
+
+			seq_printf(m, "btintel_test_%s{cmd=\"%s\"} ", families[f][0],
+				   btintel_test_ioctls[nr].name);
+			switch (f) {
+			case 0:
+				seq_printf(m, "%llu\n", sum.calls);
+				break;
+			case 1:
+				seq_printf(m, "%llu\n", sum.errors);
+				break;
+			case 2:
+				btintel_test_metrics_seconds(m, sum.total_ns);
+				break;
+			default:
+				btintel_test_metrics_seconds(m, sum.max_ns);
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * btintel_test_metrics_irqs - Emit the interrupt monitor's vector counters
+ * @m: Output
+ * @dev: Device structure
+ */
+static void btintel_test_metrics_irqs(struct seq_file *m,
+				      struct btintel_test_device *dev)
+{
+	struct btintel_test_irq_mon *mon = &dev->irq_mon;
+	unsigned int i, nr_vecs;
+	bool active;
+
+	active = READ_ONCE(mon->active);
+	nr_vecs = min_t(unsigned int, READ_ONCE(mon->nr_vecs),
+			BTINTEL_TEST_IRQ_MAX_VECTORS);
+
+	btintel_test_metrics_u64(m, "irq_monitor_active", "gauge",
+				 "Whether the interrupt monitor is running",
+				 active);
+
+	btintel_test_metrics_family(m, "irq_interrupts_total", "counter",
+				    "Interrupts seen on each monitored vector");
+	for (i = 0; active && i < nr_vecs; i++) {
+		const struct btintel_test_irq_vec *vec = &mon->vecs[i];
+
+		seq_printf(m, "btintel_test_irq_interrupts_total{vector=\"%u\",kind=\"%s\"} %llu\n",
+			   READ_ONCE(vec->index),
+			   READ_ONCE(vec->kind) == BTINTEL_TEST_IRQ_VEC_SW ?
+			   "sw" : "msix",
+			   READ_ONCE(vec->count));
+	}
+}
+
+/**
+ * btintel_test_metrics_show - Render every metric of the device
+ * @m: Output, private data is the device
+ * @v: Unused
+ *
+ * Return: 0
+ */
+static int btintel_test_metrics_show(struct seq_file *m, void *v)
+{
+	struct btintel_test_device *dev = m->private;
+	u32 backing = READ_ONCE(dev->buffer_backing);
+
+	btintel_test_metrics_family(m, "info", "gauge", "Driver version");
+	seq_printf(m, "btintel_test_info{version=\"%s\",emulated=\"%d\"} 1\n",
+		   DRIVER_VERSION, !dev->pdev);
+
+	btintel_test_metrics_u64(m, "active", "gauge",
+				 "Whether the device accepts new opens",
+				 READ_ONCE(dev->active));
+	btintel_test_metrics_u64(m, "open_files", "gauge",
+				 "Open file descriptors", READ_ONCE(dev->refcount));
+	btintel_test_metrics_u64(m, "buffer_size_bytes", "gauge",
+				 "Size of the internal buffer",
+				 READ_ONCE(dev->buffer_size));
+
+	btintel_test_metrics_family(m, "buffer_backing", "gauge",
+				    "Memory backing the internal buffer");
+	seq_printf(m, "btintel_test_buffer_backing{backing=\"%s\"} 1\n",
+		   backing < ARRAY_SIZE(btintel_test_backing_names) ?
+		   btintel_test_backing_names[backing] : "unknown");
+
+	btintel_test_metrics_family(m, "numa_node", "gauge",
+				    "NUMA node buffers are placed on, -1 if any");
+	seq_printf(m, "btintel_test_numa_node %d\n", btintel_test_alloc_node(dev));
+
+	btintel_test_metrics_u64(m, "reads_total", "counter", "Read operations",
+				 READ_ONCE(dev->stats.read_count));
+	btintel_test_metrics_u64(m, "writes_total", "counter", "Write operations",
+				 READ_ONCE(dev->stats.write_count));
+	btintel_test_metrics_u64(m, "ioctls_total", "counter", "Ioctl operations",
+				 READ_ONCE(dev->stats.ioctl_count));
+	btintel_test_metrics_u64(m, "errors_total", "counter",
+				 "Failed operations", READ_ONCE(dev->stats.errors));
+	btintel_test_metrics_u64(m, "read_bytes_total", "counter", "Bytes read",
+				 READ_ONCE(dev->stats.read_bytes));
+	btintel_test_metrics_u64(m, "written_bytes_total", "counter",
+				 "Bytes written", READ_ONCE(dev->stats.write_bytes));
+
+	btintel_test_metrics_u64(m, "hci_commands_total", "counter",
+				 "HCI commands completed on any backend",
+				 atomic64_read(&dev->hci.cmds));
+	btintel_test_metrics_family(m, "hci_command_seconds_total", "counter",
+				    "Time spent waiting for HCI commands");
+	seq_puts(m, "btintel_test_hci_command_seconds_total ");
+	btintel_test_metrics_seconds(m, atomic64_read(&dev->hci.total_ns));
+
+	btintel_test_metrics_u64(m, "hci_rsp_cache_hits_total", "counter",
+				 "HCI commands answered from the response cache",
+				 READ_ONCE(dev->rsp_cache.hits));
+	btintel_test_metrics_u64(m, "hci_rsp_cache_misses_total", "counter",
+				 "Cacheable HCI commands sent to the controller",
+				 READ_ONCE(dev->rsp_cache.misses));
+	btintel_test_metrics_u64(m, "hci_rsp_cache_invalidations_total",
+				 "counter",
+				 "Times cached HCI responses were dropped",
+				 READ_ONCE(dev->rsp_cache.invalidations));
+	btintel_test_metrics_u64(m, "hci_rsp_cache_entries", "gauge",
+				 "HCI responses currently cached",
+				 READ_ONCE(dev->rsp_cache.entries));
+
+	btintel_test_metrics_ioctls(m, dev);
+	btintel_test_metrics_trace(m);
+	btintel_test_metrics_irqs(m, dev);
+
+	btintel_test_metrics_u64(m, "sampler_running", "gauge",
+				 "Whether the stats sampler is running",
+				 READ_ONCE(dev->sampler.running));
+	btintel_test_metrics_u64(m, "sampler_samples_total", "counter",
+				 "Samples taken since the last sampler reset",
+				 READ_ONCE(dev->sampler.seq));
+
+	btintel_test_metrics_u64(m, "fw_cache_hits_total", "counter",
+				 "Firmware loads served from the cache",
+				 READ_ONCE(btintel_test_fw_cache.hits));
+	btintel_test_metrics_u64(m, "fw_cache_misses_total", "counter",
+				 "Firmware loads that went to the filesystem",
+				 READ_ONCE(btintel_test_fw_cache.misses));
+	btintel_test_metrics_u64(m, "fw_cache_evictions_total", "counter",
+				 "Firmware images dropped to stay within fw_cache_kb",
+				 READ_ONCE(btintel_test_fw_cache.evictions));
+	btintel_test_metrics_u64(m, "fw_cache_bytes", "gauge",
+				 "Memory held by cached firmware images",
+				 READ_ONCE(btintel_test_fw_cache.bytes));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(btintel_test_metrics);
+
+/**
+ * btintel_test_metrics_register - Create the device's debugfs metrics node
+ * @dev: Device structure
+ *
+ * Failure is not fatal; debugfs may be disabled or not mounted.
+ */
+static void btintel_test_metrics_register(struct btintel_test_device *dev)
+{
+	dev->debugfs = debugfs_create_dir(dev->misc.name, NULL);
+	debugfs_create_file("metrics", 0444, dev->debugfs, dev,
+			    &btintel_test_metrics_fops);
+}
+
+/* ============================================================================
+ * HCI COMMAND REPLAY
+ * ============================================================================ */
+
+/**
+ * btintel_test_replay_check - Validate a replay script before running it
+ * @script: Script, see struct btintel_test_replay_hdr
+ * @len: Script size
+ * @script_ns: Returns the duration of the original capture
+ *
+ * Return: Number of commands, or negative error code if malformed
+ */
+static int btintel_test_replay_check(const u8 *script, u32 len, u64 *script_ns)
+{
+	const u32 rec = sizeof(struct btintel_test_replay_cmd);
+	u32 i, count, delay_us, off;
+
+	if (len < sizeof(struct btintel_test_replay_hdr) ||
+	    get_unaligned_le32(script) != BTINTEL_TEST_REPLAY_MAGIC)
+		return -EINVAL;
+
+	count = get_unaligned_le32(script + 4);
+	off = sizeof(struct btintel_test_replay_hdr);
+	*script_ns = 0;
+
+	for (i = 0; i < count; i++) {
+		if (len - off < rec || len - off - rec < script[off + 2])
+			return -EINVAL;
+
+		delay_us = get_unaligned_le32(script + off + 4);
+		if (delay_us > BTINTEL_TEST_REPLAY_MAX_DELAY_US)
+			return -EINVAL;
+
+		*script_ns += (u64)delay_us * NSEC_PER_USEC;
+		off += rec + script[off + 2];
+	}
+
+	/* Trailing bytes mean the count and the commands disagree */
+	if (off != len || count > INT_MAX)
+		return -EINVAL;
+
+	return count;
+}
+
+/**
+ * btintel_test_hci_replay - Replay a script against one backend
+ * @dev: Device structure
+ * @req: Parameters in, results out
+ * @script: Script already validated by btintel_test_replay_check()
+ * @count: Number of commands in @script
+ * @res: Per-command results, the first @nr_res commands
+ * @nr_res: Entries in @res
+ *
+ * Every command is due a recorded delay after the previous command was
+ * due, not after it completed, so a slow answer does not shift the rest of
+ * the capture: the commands after it go out late until the schedule
+ * catches up. The wait is an absolute hrtimer sleep. Commands are sent one
+ * at a time, as hci_cmd_sync() callers issued them in the capture.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_hci_replay(struct btintel_test_device *dev,
+				   struct btintel_test_hci_replay *req,
+				   const u8 *script, u32 count,
+				   struct btintel_test_replay_result *res,
+				   u32 nr_res)
+{
+	const bool fast = req->flags & BTINTEL_TEST_REPLAY_FAST;
+	struct btintel_test_lat_acc latency, lag;
+	struct btintel_test_replay_result r;
+	u32 i, off = sizeof(struct btintel_test_replay_hdr);
+	struct btintel_test_emul_cfg saved;
+	struct hci_dev *hdev = NULL;
+	ktime_t t0, due, sent;
+	struct sk_buff *skb;
+	const u8 *cmd;
+	int ret = 0;
+
+	if (req->backend == BTINTEL_TEST_BACKEND_EMUL) {
+		struct btintel_test_emul_cfg cfg = {
+			.latency_ns = req->emul_latency_ns,
+			.jitter_ns = req->emul_jitter_ns,
+		};
+
+		ret = btintel_test_emul_hci_config(&dev->emul, &cfg, &saved);
+		if (ret)
+			return ret;
+	} else {
+		hdev = btintel_test_hdev_get(dev, req->backend, req->hci_index);
+		if (!hdev)
+			return -ENODEV;
+	}
+
+	btintel_test_lat_init(&latency);
+	btintel_test_lat_init(&lag);
+	req->executed = 0;
+	req->divergences = 0;
+	req->first_divergence = U32_MAX;
+	req->max_lag_ns = 0;
+
+	t0 = ktime_get();
+	due = t0;
+
+	for (i = 0; i < count; i++) {
+		cmd = script + off;
+		off += sizeof(struct btintel_test_replay_cmd) + cmd[2];
+
+		r.opcode = get_unaligned_le16(cmd);
+		r.expected = cmd[3];
+
+		if (fast) {
+			if (signal_pending(current)) {
+				ret = -EINTR;
+				break;
+			}
+			due = ktime_get();
+		} else {
+			due = ktime_add_us(due, get_unaligned_le32(cmd + 4));
+			ret = btintel_test_iso_sleep_until(due);
+			if (ret)
+				break;
+		}
+
+		sent = ktime_get();
+		/* A replay measures the controller, never the cache */
+		skb = btintel_test_hci_cmd(dev, hdev, r.opcode, cmd[2],
+					   cmd + sizeof(struct btintel_test_replay_cmd),
+					   BTINTEL_TEST_HCI_NOCACHE);
+		r.latency_ns = ktime_to_ns(ktime_sub(ktime_get(), sent));
+		r.due_ns = ktime_to_ns(ktime_sub(due, t0));
+		r.lag_ns = ktime_to_ns(ktime_sub(sent, due));
+
+		r.error = 0;
+		r.status = 0xff;
+		if (IS_ERR(skb))
+			r.error = PTR_ERR(skb);
+		else if (!skb->len)
+			r.error = -EPROTO;
+		else
+			r.status = skb->data[0];
+		if (!IS_ERR(skb))
+			kfree_skb(skb);
+
+		btintel_test_lat_add(&latency, r.latency_ns);
+		btintel_test_lat_add(&lag, r.lag_ns);
+		req->max_lag_ns = max(req->max_lag_ns, r.lag_ns);
+		if (i < nr_res)
+			res[i] = r;
+		req->executed++;
+
+		if (r.error || (r.expected != BTINTEL_TEST_REPLAY_ANY_STATUS &&
+				r.status != r.expected)) {
+			if (!req->divergences++)
+				req->first_divergence = i;
+			if (req->flags & BTINTEL_TEST_REPLAY_STOP)
+				break;
+		}
+	}
+
+	req->elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+	btintel_test_lat_finish(&latency, &req->latency);
+	btintel_test_lat_finish(&lag, &req->lag);
+
+	pr_debug_dev("HCI replay: %u of %u commands, %u divergences\n",
+		     req->executed, count, req->divergences);
+
+	if (hdev)
+		hci_dev_put(hdev);
+	else
+		btintel_test_emul_hci_restore(&dev->emul, &saved);
+	return ret;
+}
+
+/**
+ * btintel_test_ioctl_hci_replay - Handle BTINTEL_TEST_IOC_HCI_REPLAY
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_hci_replay
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_hci_replay(struct btintel_test_device *dev,
+					 void __user *argp)
+{
+	struct btintel_test_replay_result *res = NULL;
+	struct btintel_test_hci_replay *req;
+	u32 nr_res = 0;
+	u8 *script;
+	int count, ret;
+
+	req = memdup_user(argp, sizeof(*req));
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	if (req->script_len > BTINTEL_TEST_REPLAY_MAX_SCRIPT ||
+	    req->flags & ~(BTINTEL_TEST_REPLAY_FAST | BTINTEL_TEST_REPLAY_STOP)) {
+		ret = -EINVAL;
+		goto out_req;
+	}
+
+	script = vmemdup_user(u64_to_user_ptr(req->script), req->script_len);
+	if (IS_ERR(script)) {
+		ret = PTR_ERR(script);
+		goto out_req;
+	}
+
+	count = btintel_test_replay_check(script, req->script_len,
+					  &req->script_ns);
+	if (count < 0) {
+		ret = count;
+		goto out_script;
+	}
+
+	if (req->results) {
+		nr_res = min_t(u32, req->max_results, count);
+		res = kvcalloc(nr_res, sizeof(*res), GFP_KERNEL);
+		if (nr_res && !res) {
+			ret = -ENOMEM;
+			goto out_script;
+		}
+	}
+
+	ret = mutex_lock_interruptible(&dev->lock);
+	if (ret)
+		goto out_res;
+
+	ret = btintel_test_hci_replay(dev, req, script, count, res, nr_res);
+	mutex_unlock(&dev->lock);
+
+	if (ret)
+		goto out_res;
+
+	nr_res = min(nr_res, req->executed);
+	if ((nr_res && copy_to_user(u64_to_user_ptr(req->results), res,
+				    array_size(nr_res, sizeof(*res)))) ||
+	    copy_to_user(argp, req, sizeof(*req)))
+		ret = -EFAULT;
+
+out_res:
+	kvfree(res);
+out_script:
+	kvfree(script);
+out_req:
+	kfree(req);
+	return ret;
+}
+
+/* ============================================================================
+ * DMA DESCRIPTOR RING
+ * ============================================================================ */
+
+/* Descriptor flags */
+#define BTINTEL_TEST_DMA_OWN		BIT(0)	/* Posted, owned by the engine */
+#define BTINTEL_TEST_DMA_DONE		BIT(1)	/* Completed by the engine */
+
+/* Completion status written by the emulated engine */
+#define BTINTEL_TEST_DMA_ST_OK		0
+#define BTINTEL_TEST_DMA_ST_NOT_OWNED	1
+#define BTINTEL_TEST_DMA_ST_BAD_DATA	2
+
+/**
+ * struct btintel_test_dma_desc - Transfer descriptor, 128-byte aligned like
+ * the controller's TX and RX queue entries
+ * @addr: Bus address of the data buffer
+ * @len: Bytes to transfer
+ * @flags: BTINTEL_TEST_DMA_OWN, replaced by BTINTEL_TEST_DMA_DONE
+ * @index: Slot of the descriptor in its ring
+ * @status: BTINTEL_TEST_DMA_ST_*
+ * @done_len: Bytes the engine transferred
+ * @cookie: Sequence number of the transfer
+ * @reserved: Pads the descriptor to BTINTEL_TEST_DMA_DESC_SIZE
+ */
+struct btintel_test_dma_desc {
+	__le64 addr;
+	__le32 len;
+	__le16 flags;
+	__le16 index;
+	__le32 status;
+	__le32 done_len;
+	__le64 cookie;
+	u8 reserved[96];
+} __aligned(BTINTEL_TEST_DMA_DESC_SIZE);
+
+static_assert(sizeof(struct btintel_test_dma_desc) ==
+	      BTINTEL_TEST_DMA_DESC_SIZE);
+
+/**
+ * struct btintel_test_dma_slot - Host state of one descriptor
+ * @buf: Data buffer
+ * @addr: Bus address of @buf while mapped
+ * @posted_ns: When the descriptor was handed to the engine
+ * @due: When the emulated engine completes it
+ */
+struct btintel_test_dma_slot {
+	void *buf;
+	dma_addr_t addr;
+	u64 posted_ns;
+	ktime_t due;
+};
+
+/**
+ * struct btintel_test_dma_ring - Descriptor ring and its emulated engine
+ * @dmadev: Device the ring and buffers are mapped for
+ * @dir: Direction of the data buffers
+ * @desc: Descriptors, in coherent memory
+ * @desc_dma: Bus address of @desc
+ * @rx_cookie: RX only: per-descriptor header the engine writes, in
+ *             coherent memory
+ * @rx_cookie_dma: Bus address of @rx_cookie
+ * @slots: Host state, one per descriptor
+ * @size: Descriptors in the ring
+ * @mask: @size - 1
+ * @buf_size: Bytes per data buffer
+ * @map_each: Buffers are mapped per transfer rather than once
+ * @head: Next slot the host posts
+ * @tail: Next slot the host reaps
+ * @lock: Protects @doorbell, @hw_tail and @last_due against the engine
+ * @doorbell: Slots before this one were handed to the engine
+ * @hw_tail: Next slot the engine completes
+ * @last_due: Completion time of the last slot handed to the engine
+ * @latency_ns: Engine completion latency
+ * @jitter_ns: Random engine delay on top of @latency_ns
+ * @timer: Completes the due descriptors
+ * @wq: Woken when the engine completed descriptors
+ */
+struct btintel_test_dma_ring {
+	struct device *dmadev;
+	enum dma_data_direction dir;
+	struct btintel_test_dma_desc *desc;
+	dma_addr_t desc_dma;
+	__le64 *rx_cookie;
+	dma_addr_t rx_cookie_dma;
+	struct btintel_test_dma_slot *slots;
+	u32 size;
+	u32 mask;
+	u32 buf_size;
+	bool map_each;
+	u32 head;
+	u32 tail;
+	spinlock_t lock;
+	u32 doorbell;
+	u32 hw_tail;
+	ktime_t last_due;
+	u64 latency_ns;
+	u32 jitter_ns;
+	struct hrtimer timer;
+	wait_queue_head_t wq;
+};
+
+/**
+ * btintel_test_dma_engine - Complete every due descriptor
+ * @ring: Ring, with @ring->lock held
+ * @now: Current time
+ *
+ * Stands in for the controller's DMA engine: it checks the header byte the
+ * host wrote for TX, writes a header for RX, and hands each descriptor back
+ * in ring order. Payload bytes are not copied, so the results measure the
+ * ring and mapping overhead rather than memory bandwidth.
+ *
+ * An RX buffer belongs to the device while it is mapped, and a CPU store
+ * to it would be lost to the bounce buffer or the cache maintenance of
+ * the next sync. The RX header therefore goes to @ring->rx_cookie.
+ */
+static void btintel_test_dma_engine(struct btintel_test_dma_ring *ring,
+				    ktime_t now)
+{
+	struct btintel_test_dma_desc *desc;
+	struct btintel_test_dma_slot *slot;
+	u32 status;
+	u8 cookie;
+
+	while (ring->hw_tail != ring->doorbell) {
+		slot = &ring->slots[ring->hw_tail & ring->mask];
+		desc = &ring->desc[ring->hw_tail & ring->mask];
+		if (ktime_after(slot->due, now))
+			break;
+
+		dma_rmb();
+		cookie = le64_to_cpu(desc->cookie);
+		status = BTINTEL_TEST_DMA_ST_OK;
+		if (!(le16_to_cpu(desc->flags) & BTINTEL_TEST_DMA_OWN))
+			status = BTINTEL_TEST_DMA_ST_NOT_OWNED;
+		else if (ring->dir == DMA_FROM_DEVICE)
+			ring->rx_cookie[ring->hw_tail & ring->mask] = desc->cookie;
+		else if (*(u8 *)slot->buf != cookie)
+			status = BTINTEL_TEST_DMA_ST_BAD_DATA;
+
+		desc->status = cpu_to_le32(status);
+		desc->done_len = status ? 0 : desc->len;
+		dma_wmb();
+		desc->flags = cpu_to_le16(BTINTEL_TEST_DMA_DONE);
+		ring->hw_tail++;
+	}
+}
+
+/**
+ * btintel_test_dma_timer - Complete due descriptors on the emulated engine
+ * @timer: Timer embedded in struct btintel_test_dma_ring
+ *
+ * Return: HRTIMER_RESTART while descriptors are still outstanding
+ */
+static enum hrtimer_restart btintel_test_dma_timer(struct hrtimer *timer)
+{
+	struct btintel_test_dma_ring *ring =
+		container_of(timer, struct btintel_test_dma_ring, timer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+
+	spin_lock(&ring->lock);
+	btintel_test_dma_engine(ring, ktime_get());
+	if (ring->hw_tail != ring->doorbell) {
+		hrtimer_set_expires(timer,
+				    ring->slots[ring->hw_tail & ring->mask].due);
+		ret = HRTIMER_RESTART;
+	}
+	spin_unlock(&ring->lock);
+
+	wake_up(&ring->wq);
+	return ret;
+}
+
+/**
+ * btintel_test_dma_doorbell - Hand every posted descriptor to the engine
+ * @ring: Ring
+ *
+ * Without latency or jitter the engine completes them right here, which
+ * leaves only the host-side cost in the measurement.
+ */
+static void btintel_test_dma_doorbell(struct btintel_test_dma_ring *ring)
+{
+	ktime_t now = ktime_get(), due;
+	bool arm;
+	u32 i;
+
+	spin_lock_bh(&ring->lock);
+	arm = ring->hw_tail == ring->doorbell;
+	for (i = ring->doorbell; i != ring->head; i++) {
+		due = ktime_add_ns(now, ring->latency_ns);
+		if (ring->jitter_ns)
+			due = ktime_add_ns(due, get_random_u32() % ring->jitter_ns);
+		/* The engine completes in ring order */
+		if (ktime_before(due, ring->last_due))
+			due = ring->last_due;
+		ring->last_due = due;
+		ring->slots[i & ring->mask].due = due;
+	}
+	ring->doorbell = ring->head;
+
+	if (!ring->latency_ns && !ring->jitter_ns)
+		btintel_test_dma_engine(ring, now);
+	else if (arm)
+		hrtimer_start(&ring->timer,
+			      ring->slots[ring->hw_tail & ring->mask].due,
+			      HRTIMER_MODE_ABS_SOFT);
+	spin_unlock_bh(&ring->lock);
+}
+
+/**
+ * btintel_test_dma_post - Fill and post the descriptor at the ring head
+ * @ring: Ring with at least one free descriptor
+ * @cookie: Sequence number of the transfer
+ * @req: Request, for the mapping cost
+ *
+ * Return: 0 on success, negative error code if the buffer failed to map
+ */
+static int btintel_test_dma_post(struct btintel_test_dma_ring *ring,
+				 u64 cookie, struct btintel_test_dma_bench *req)
+{
+	u32 idx = ring->head & ring->mask;
+	struct btintel_test_dma_slot *slot = &ring->slots[idx];
+	struct btintel_test_dma_desc *desc = &ring->desc[idx];
+	u64 start;
+
+	if (ring->dir == DMA_TO_DEVICE)
+		*(u8 *)slot->buf = cookie;
+
+	start = ktime_get_ns();
+	if (ring->map_each) {
+		slot->addr = dma_map_single(ring->dmadev, slot->buf,
+					    ring->buf_size, ring->dir);
+		if (dma_mapping_error(ring->dmadev, slot->addr)) {
+			slot->addr = DMA_MAPPING_ERROR;
+			return -ENOMEM;
+		}
+	} else {
+		dma_sync_single_for_device(ring->dmadev, slot->addr,
+					   ring->buf_size, ring->dir);
+	}
+	slot->posted_ns = ktime_get_ns();
+	req->map_ns += slot->posted_ns - start;
+	req->map_calls++;
+
+	desc->addr = cpu_to_le64(slot->addr);
+	desc->len = cpu_to_le32(ring->buf_size);
+	desc->index = cpu_to_le16(idx);
+	desc->status = 0;
+	desc->done_len = 0;
+	desc->cookie = cpu_to_le64(cookie);
+	/* The engine must see a complete descriptor once it owns it */
+	dma_wmb();
+	desc->flags = cpu_to_le16(BTINTEL_TEST_DMA_OWN);
+
+	ring->head++;
+	return 0;
+}
+
+/**
+ * btintel_test_dma_reap - Take back every descriptor the engine completed
+ * @ring: Ring
+ * @req: Request, for the results
+ * @acc: Per-descriptor latency accumulator
+ *
+ * Return: Descriptors reaped
+ */
+static u32 btintel_test_dma_reap(struct btintel_test_dma_ring *ring,
+				 struct btintel_test_dma_bench *req,
+				 struct btintel_test_lat_acc *acc)
+{
+	struct btintel_test_dma_desc *desc;
+	struct btintel_test_dma_slot *slot;
+	u32 hw_tail, n = 0;
+	u64 now, start;
+
+	spin_lock_bh(&ring->lock);
+	hw_tail = ring->hw_tail;
+	spin_unlock_bh(&ring->lock);
+
+	for (; ring->tail != hw_tail; ring->tail++, n++) {
+		slot = &ring->slots[ring->tail & ring->mask];
+		desc = &ring->desc[ring->tail & ring->mask];
+		now = ktime_get_ns();
+
+		dma_rmb();
+		if (le16_to_cpu(desc->flags) != BTINTEL_TEST_DMA_DONE ||
+		    le32_to_cpu(desc->status) != BTINTEL_TEST_DMA_ST_OK ||
+		    le32_to_cpu(desc->done_len) != ring->buf_size ||
+		    (ring->dir == DMA_FROM_DEVICE &&
+		     ring->rx_cookie[ring->tail & ring->mask] != desc->cookie))
+			req->errors++;
+		else
+			req->completed++;
+
+		start = ktime_get_ns();
+		if (ring->map_each) {
+			dma_unmap_single(ring->dmadev, slot->addr,
+					 ring->buf_size, ring->dir);
+			slot->addr = DMA_MAPPING_ERROR;
+		} else {
+			dma_sync_single_for_cpu(ring->dmadev, slot->addr,
+						ring->buf_size, ring->dir);
+		}
+		req->map_ns += ktime_get_ns() - start;
+		req->map_calls++;
+
+		btintel_test_lat_add(acc, now - slot->posted_ns);
+	}
+
+	return n;
+}
+
+/**
+ * btintel_test_dma_ring_free - Release a ring and everything it mapped
+ * @ring: Ring, possibly only partly set up
+ */
+static void btintel_test_dma_ring_free(struct btintel_test_dma_ring *ring)
+{
+	u32 i;
+
+	hrtimer_cancel(&ring->timer);
+
+	if (ring->slots) {
+		for (i = 0; i < ring->size; i++) {
+			struct btintel_test_dma_slot *slot = &ring->slots[i];
+
+			/* Premapped, or posted and never reaped */
+			if (slot->addr != DMA_MAPPING_ERROR)
+				dma_unmap_single(ring->dmadev, slot->addr,
+						 ring->buf_size, ring->dir);
+			kfree(slot->buf);
+		}
+		kvfree(ring->slots);
+	}
+
+	if (ring->rx_cookie)
+		dma_free_coherent(ring->dmadev,
+				  (size_t)ring->size * sizeof(*ring->rx_cookie),
+				  ring->rx_cookie, ring->rx_cookie_dma);
+	if (ring->desc)
+		dma_free_coherent(ring->dmadev,
+				  (size_t)ring->size * sizeof(*ring->desc),
+				  ring->desc, ring->desc_dma);
+	kfree(ring);
+}
+
+/**
+ * btintel_test_dma_ring_alloc - Allocate a ring, its buffers and mappings
+ * @dmadev: Device to map for
+ * @req: Validated request
+ *
+ * Return: Ring, or ERR_PTR
+ */
+static struct btintel_test_dma_ring *
+btintel_test_dma_ring_alloc(struct device *dmadev,
+			    const struct btintel_test_dma_bench *req)
+{
+	struct btintel_test_dma_ring *ring;
+	struct btintel_test_dma_slot *slot;
+	u32 i;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return ERR_PTR(-ENOMEM);
+
+	ring->dmadev = dmadev;
+	ring->dir = req->direction == BTINTEL_TEST_DMA_TX ?
+		    DMA_TO_DEVICE : DMA_FROM_DEVICE;
+	ring->size = req->ring_size;
+	ring->mask = req->ring_size - 1;
+	ring->buf_size = req->buf_size;
+	ring->map_each = req->flags & BTINTEL_TEST_DMA_MAP_EACH;
+	ring->latency_ns = req->emul_latency_ns;
+	ring->jitter_ns = req->emul_jitter_ns;
+	spin_lock_init(&ring->lock);
+	init_waitqueue_head(&ring->wq);
+	hrtimer_init(&ring->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+	ring->timer.function = btintel_test_dma_timer;
+
+	ring->desc = dma_alloc_coherent(dmadev,
+					(size_t)ring->size * sizeof(*ring->desc),
+					&ring->desc_dma, GFP_KERNEL);
+	ring->slots = kvcalloc(ring->size, sizeof(*ring->slots), GFP_KERNEL);
+	if (!ring->desc || !ring->slots)
+		goto err;
+
+	if (ring->dir == DMA_FROM_DEVICE) {
+		ring->rx_cookie = dma_alloc_coherent(dmadev,
+						     (size_t)ring->size *
+						     sizeof(*ring->rx_cookie),
+						     &ring->rx_cookie_dma,
+						     GFP_KERNEL);
+		if (!ring->rx_cookie)
+			goto err;
+	}
+
+	for (i = 0; i < ring->size; i++) {
+		slot = &ring->slots[i];
+		slot->addr = DMA_MAPPING_ERROR;
+		slot->buf = kzalloc(ring->buf_size, GFP_KERNEL);
+		if (!slot->buf)
+			goto err;
+		if (ring->map_each)
+			continue;
+
+		slot->addr = dma_map_single(dmadev, slot->buf, ring->buf_size,
+					    ring->dir);
+		if (dma_mapping_error(dmadev, slot->addr)) {
+			slot->addr = DMA_MAPPING_ERROR;
+			goto err;
+		}
+	}
+
+	return ring;
+
+err:
+	btintel_test_dma_ring_free(ring);
+	return ERR_PTR(-ENOMEM);
+}
+
+/**
+ * btintel_test_dma_run - Stream descriptors through a ring
+ * @dmadev: Device to map for
+ * @req: Validated request, results are filled in
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_dma_run(struct device *dmadev,
+				struct btintel_test_dma_bench *req)
+{
+	struct btintel_test_dma_ring *ring;
+	struct btintel_test_lat_acc acc;
+	u64 start, posted = 0;
+	bool blocked = false;
+	long left;
+	int ret = 0;
+	u32 i, n;
+
+	start = ktime_get_ns();
+	ring = btintel_test_dma_ring_alloc(dmadev, req);
+	if (IS_ERR(ring))
+		return PTR_ERR(ring);
+	req->setup_ns = ktime_get_ns() - start;
+
+	btintel_test_lat_init(&acc);
+	start = ktime_get_ns();
+
+	while (posted < req->count || ring->tail != ring->head) {
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		n = min_t(u64, req->batch, req->count - posted);
+		if (n && ring->head - ring->tail + n <= ring->size) {
+			for (i = 0; i < n; i++) {
+				ret = btintel_test_dma_post(ring, posted + i,
+							    req);
+				if (ret)
+					break;
+			}
+			posted += i;
+			btintel_test_dma_doorbell(ring);
+			if (ret)
+				break;
+
+			req->max_inflight = max(req->max_inflight,
+						ring->head - ring->tail);
+			blocked = false;
+			btintel_test_dma_reap(ring, req, &acc);
+			continue;
+		}
+
+		/* Ring full, or everything posted: wait for the engine */
+		if (n && !blocked) {
+			req->ring_full++;
+			blocked = true;
+		}
+		if (btintel_test_dma_reap(ring, req, &acc))
+			continue;
+
+		left = wait_event_interruptible_timeout(ring->wq,
+				READ_ONCE(ring->hw_tail) != ring->tail,
+				msecs_to_jiffies(BTINTEL_TEST_DRAIN_MS));
+		if (left < 0) {
+			ret = -EINTR;
+			break;
+		}
+		if (!left) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+	}
+
+	req->elapsed_ns = ktime_get_ns() - start;
+	if (req->elapsed_ns)
+		req->bytes_per_sec =
+			mul_u64_u64_div_u64((u64)req->completed * req->buf_size,
+					    NSEC_PER_SEC, req->elapsed_ns);
+	btintel_test_lat_finish(&acc, &req->latency);
+
+	btintel_test_dma_ring_free(ring);
+	return ret;
+}
+
+/**
+ * btintel_test_dma_dev - Device to allocate and map the rings for
+ * @dev: Device structure
+ * @pdevp: Returns the referenced controller, NULL without one
+ *
+ * Rings are mapped for the controller when there is one, so IOMMU costs
+ * are real; the controller belongs to btintel_pcie, so completions always
+ * come from the emulated engine. Without a controller the device node
+ * stands in, with direct mapping.
+ *
+ * Return: Device, or NULL if there is none to map for
+ */
+static struct device *btintel_test_dma_dev(struct btintel_test_device *dev,
+					   struct pci_dev **pdevp)
+{
+	struct device *dmadev = dev->misc.this_device;
+
+	*pdevp = btintel_test_pdev_get(dev);
+	if (*pdevp)
+		return &(*pdevp)->dev;
+
+	if (!dmadev || dma_coerce_mask_and_coherent(dmadev, DMA_BIT_MASK(64)))
+		return NULL;
+
+	return dmadev;
+}
+
+/**
+ * btintel_test_ioctl_dma_bench - Handle BTINTEL_TEST_IOC_DMA_BENCH
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_dma_bench
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_dma_bench(struct btintel_test_device *dev,
+					void __user *argp)
+{
+	struct btintel_test_dma_bench req;
+	struct pci_dev *pdev;
+	struct device *dmadev;
+	int ret;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if (req.direction > BTINTEL_TEST_DMA_RX ||
+	    req.flags & ~BTINTEL_TEST_DMA_MAP_EACH ||
+	    !req.ring_size || req.ring_size > BTINTEL_TEST_DMA_MAX_RING ||
+	    !is_power_of_2(req.ring_size) ||
+	    !req.batch || req.batch > req.ring_size ||
+	    !req.buf_size || req.buf_size > BTINTEL_TEST_DMA_MAX_BUF ||
+	    !req.count)
+		return -EINVAL;
+
+	memset(&req.completed, 0,
+	       sizeof(req) - offsetof(struct btintel_test_dma_bench, completed));
+
+	ret = mutex_lock_interruptible(&dev->lock);
+	if (ret)
+		return ret;
+
+	dmadev = btintel_test_dma_dev(dev, &pdev);
+	if (dmadev)
+		ret = btintel_test_dma_run(dmadev, &req);
+	else
+		ret = -ENODEV;
+	pci_dev_put(pdev);
+	mutex_unlock(&dev->lock);
+
+	if (!ret && copy_to_user(argp, &req, sizeof(req)))
+		ret = -EFAULT;
+
+	return ret;
+}
+
+/* ============================================================================
+ * HCI RESPONSE CACHE
+ * ============================================================================ */
+
+#define BTINTEL_TEST_INTEL_RESET		0xfc01	/* Intel vendor reset */
+
+/**
+ * btintel_test_hci_watch_data_ready - Note a controller lifecycle event
+ * @sk: Socket of struct btintel_test_hci_watch
+ *
+ * Context: Called by the HCI core while it registers, unregisters, opens or
+ * closes a controller, with its socket list locked
+ */
+static void btintel_test_hci_watch_data_ready(struct sock *sk)
+{
+	struct btintel_test_hci_watch *w;
+
+	atomic64_inc(&btintel_test_hci_watch.gen);
+
+	/* Cleared once the watch is stopping */
+	read_lock_bh(&sk->sk_callback_lock);
+	w = sk->sk_user_data;
+	if (w)
+		schedule_work(&w->work);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+/**
+ * btintel_test_hci_watch_work - Discard the events queued on the socket
+ * @work: Work item embedded in struct btintel_test_hci_watch
+ *
+ * Only their arrival matters, and a full receive queue would drop the
+ * next one unseen.
+ */
+static void btintel_test_hci_watch_work(struct work_struct *work)
+{
+	struct btintel_test_hci_watch *w =
+		container_of(work, struct btintel_test_hci_watch, work);
+	u8 buf[16];
+	struct kvec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+	struct msghdr msg = {};
+
+	while (kernel_recvmsg(w->sock, &msg, &iov, 1, sizeof(buf),
+			      MSG_DONTWAIT) >= 0)
+		;
+}
+
+/**
+ * btintel_test_hci_watch_start - Start listening for controller lifecycle
+ * events
+ *
+ * Without the listener the response cache only serves the virtual HCI.
+ */
+static void btintel_test_hci_watch_start(void)
+{
+	struct btintel_test_hci_watch *w = &btintel_test_hci_watch;
+	struct sockaddr_hci addr = {
+		.hci_family = AF_BLUETOOTH,
+		.hci_dev = HCI_DEV_NONE,
+		.hci_channel = HCI_CHANNEL_RAW,
+	};
+	/* The filter keeps the low six bits of the event code */
+	u32 ev = HCI_EV_STACK_INTERNAL & HCI_FLT_EVENT_BITS;
+	struct hci_ufilter flt = {
+		.type_mask = BIT(HCI_EVENT_PKT),
+	};
+	struct socket *sock;
+	int ret;
+
+	INIT_WORK(&w->work, btintel_test_hci_watch_work);
+	flt.event_mask[ev / 32] = BIT(ev % 32);
+
+	ret = sock_create_kern(&init_net, PF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI,
+			       &sock);
+	if (ret)
+		goto out_warn;
+
+	ret = kernel_bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+	if (!ret)
+		ret = sock->ops->setsockopt(sock, SOL_HCI, HCI_FILTER,
+					    KERNEL_SOCKPTR(&flt), sizeof(flt));
+	if (ret) {
+		sock_release(sock);
+		goto out_warn;
+	}
+
+	w->sock = sock;
+	write_lock_bh(&sock->sk->sk_callback_lock);
+	sock->sk->sk_user_data = w;
+	sock->sk->sk_data_ready = btintel_test_hci_watch_data_ready;
+	write_unlock_bh(&sock->sk->sk_callback_lock);
+	return;
+
+out_warn:
+	pr_warn("Controller events unavailable (%d), caching virtual HCI responses only\n",
+		ret);
+}
+
+/**
+ * btintel_test_hci_watch_stop - Stop listening for controller lifecycle
+ * events
+ */
+static void btintel_test_hci_watch_stop(void)
+{
+	struct btintel_test_hci_watch *w = &btintel_test_hci_watch;
+
+	if (!w->sock)
+		return;
+
+	write_lock_bh(&w->sock->sk->sk_callback_lock);
+	w->sock->sk->sk_user_data = NULL;
+	write_unlock_bh(&w->sock->sk->sk_callback_lock);
+	cancel_work_sync(&w->work);
+
+	sock_release(w->sock);
+	w->sock = NULL;
+}
+
+/**
+ * btintel_test_rsp_cache_init - Initialize a device's response cache
+ * @c: Cache, disabled until BTINTEL_TEST_IOC_RSP_CACHE selects opcodes
+ */
+static void btintel_test_rsp_cache_init(struct btintel_test_rsp_store *c)
+{
+	mutex_init(&c->lock);
+	INIT_LIST_HEAD(&c->lru);
+	/* 0 tells btintel_test_rsp_cache_put() not to cache */
+	c->gen = 1;
+	c->hci_gen = atomic64_read(&btintel_test_hci_watch.gen);
+	btintel_test_lat_init(&c->hit_lat);
+	btintel_test_lat_init(&c->miss_lat);
+}
+
+/**
+ * btintel_test_rsp_cache_drop - Drop every cached response
+ * @c: Cache
+ * @invalidation: Count the drop in @c->invalidations if it dropped anything
+ *
+ * Context: Called with @c->lock held
+ */
+static void btintel_test_rsp_cache_drop(struct btintel_test_rsp_store *c,
+					bool invalidation)
+{
+	struct btintel_test_rsp_entry *e, *tmp;
+
+	if (invalidation && c->entries)
+		c->invalidations++;
+
+	list_for_each_entry_safe(e, tmp, &c->lru, list) {
+		list_del(&e->list);
+		kfree(e);
+	}
+	c->entries = 0;
+	c->gen++;
+}
+
+/**
+ * btintel_test_rsp_cache_sync - Empty the cache if a controller came or went
+ * @c: Cache
+ *
+ * Context: Called with @c->lock held
+ */
+static void btintel_test_rsp_cache_sync(struct btintel_test_rsp_store *c)
+{
+	s64 hci_gen = atomic64_read(&btintel_test_hci_watch.gen);
+
+	if (c->hci_gen == hci_gen)
+		return;
+
+	btintel_test_rsp_cache_drop(c, true);
+	c->hci_gen = hci_gen;
+}
+
+/**
+ * btintel_test_rsp_cache_invalidate - Empty the cache after the controller
+ * may have changed state
+ * @dev: Device structure
+ *
+ * Responses still outstanding at this point are not cached either.
+ */
+static void btintel_test_rsp_cache_invalidate(struct btintel_test_device *dev)
+{
+	struct btintel_test_rsp_store *c = &dev->rsp_cache;
+
+	mutex_lock(&c->lock);
+	btintel_test_rsp_cache_drop(c, true);
+	mutex_unlock(&c->lock);
+}
+
+/**
+ * btintel_test_rsp_cache_invalidates - Whether a command changes the state
+ * cached responses describe
+ * @opcode: HCI opcode
+ */
+static bool btintel_test_rsp_cache_invalidates(u16 opcode)
+{
+	return opcode == HCI_OP_RESET || opcode == BTINTEL_TEST_INTEL_RESET ||
+	       opcode == BTINTEL_TEST_FW_SECURE_SEND;
+}
+
+/**
+ * btintel_test_rsp_entry_match - Whether an entry answers a command
+ * @e: Cached response
+ * @hdev: Controller, NULL for the virtual HCI
+ * @opcode: HCI opcode
+ * @plen: Parameter length
+ * @param: Parameters
+ */
+static bool btintel_test_rsp_entry_match(const struct btintel_test_rsp_entry *e,
+					 const struct hci_dev *hdev, u16 opcode,
+					 u32 plen, const void *param)
+{
+	return e->hdev == hdev && e->opcode == opcode &&
+	       e->plen == plen && !memcmp(e->param, param, plen);
+}
+
+/**
+ * btintel_test_rsp_cache_get - Answer a command from the response cache
+ * @dev: Device structure
+ * @hdev: Controller, or NULL for the virtual HCI
+ * @opcode: HCI opcode
+ * @plen: Parameter length
+ * @param: Parameters
+ * @flags: BTINTEL_TEST_HCI_NOCACHE to neither answer nor cache the command
+ * @gen: Set to the generation to hand to btintel_test_rsp_cache_put()
+ *       on a miss, 0 if the command is not cached
+ *
+ * Commands that reset the controller or download firmware to it empty the
+ * cache before they are sent, with or without BTINTEL_TEST_HCI_NOCACHE.
+ * Responses of a real controller are only cached while controller events
+ * can be seen, so that the cache is emptied when it goes down or away.
+ *
+ * Return: Copy of the cached response, or NULL to send the command
+ */
+static struct sk_buff *btintel_test_rsp_cache_get(struct btintel_test_device *dev,
+						  struct hci_dev *hdev,
+						  u16 opcode, u32 plen,
+						  const void *param, u32 flags,
+						  u64 *gen)
+{
+	struct btintel_test_rsp_store *c = &dev->rsp_cache;
+	struct btintel_test_rsp_entry *e;
+	struct sk_buff *skb = NULL;
+	u64 start = ktime_get_ns();
+	u32 i;
+
+	*gen = 0;
+
+	/* Off unless a test selected opcodes, and then empty */
+	if (!READ_ONCE(c->nr_opcodes))
+		return NULL;
+
+	mutex_lock(&c->lock);
+	btintel_test_rsp_cache_sync(c);
+
+	if (btintel_test_rsp_cache_invalidates(opcode)) {
+		btintel_test_rsp_cache_drop(c, true);
+		goto out_unlock;
+	}
+
+	if (flags & BTINTEL_TEST_HCI_NOCACHE ||
+	    plen > BTINTEL_TEST_RSP_CACHE_MAX_PARAM ||
+	    (hdev && !btintel_test_hci_watch.sock))
+		goto out_unlock;
+
+	for (i = 0; i < c->nr_opcodes; i++)
+		if (c->opcodes[i] == opcode)
+			break;
+	if (i == c->nr_opcodes)
+		goto out_unlock;
+
+	list_for_each_entry(e, &c->lru, list) {
+		if (!btintel_test_rsp_entry_match(e, hdev, opcode, plen, param))
+			continue;
+
+		/* Without memory for the copy, ask the controller */
+		skb = alloc_skb(e->rlen, GFP_KERNEL);
+		if (!skb)
+			break;
+		skb_put_data(skb, e->rsp, e->rlen);
+
+		list_move(&e->list, &c->lru);
+		c->hits++;
+		btintel_test_lat_add(&c->hit_lat, ktime_get_ns() - start);
+		goto out_unlock;
+	}
+
+	*gen = c->gen;
+
+out_unlock:
+	mutex_unlock(&c->lock);
+	return skb;
+}
+
+/**
+ * btintel_test_rsp_cache_put - Account a miss and cache its response
+ * @dev: Device structure
+ * @hdev: Controller, or NULL for the virtual HCI
+ * @opcode: HCI opcode
+ * @plen: Parameter length
+ * @param: Parameters
+ * @skb: Response, or ERR_PTR
+ * @ns: Round trip of the command
+ * @gen: Generation btintel_test_rsp_cache_get() returned
+ *
+ * Only successful responses are cached, and only if the cache was not
+ * invalidated while the command was outstanding. The least recently used
+ * response makes room when the cache is full.
+ */
+static void btintel_test_rsp_cache_put(struct btintel_test_device *dev,
+				       struct hci_dev *hdev, u16 opcode,
+				       u32 plen, const void *param,
+				       const struct sk_buff *skb, u64 ns,
+				       u64 gen)
+{
+	struct btintel_test_rsp_store *c = &dev->rsp_cache;
+	struct btintel_test_rsp_entry *e = NULL, *old;
+
+	if (!IS_ERR(skb) && skb->len && !skb->data[0] && skb->len <= U8_MAX)
+		e = kmalloc(struct_size(e, rsp, skb->len), GFP_KERNEL);
+	if (e) {
+		e->hdev = hdev;
+		e->opcode = opcode;
+		e->plen = plen;
+		e->rlen = skb->len;
+		memcpy(e->param, param, plen);
+		memcpy(e->rsp, skb->data, skb->len);
+	}
+
+	mutex_lock(&c->lock);
+	c->misses++;
+	btintel_test_lat_add(&c->miss_lat, ns);
+	/* A controller event while the command was out changes @c->gen */
+	btintel_test_rsp_cache_sync(c);
+
+	if (!e || gen != c->gen)
+		goto out_unlock;
+
+	/* Another worker's identical command got there first */
+	list_for_each_entry(old, &c->lru, list)
+		if (btintel_test_rsp_entry_match(old, hdev, opcode, plen, param))
+			goto out_unlock;
+
+	if (c->entries == BTINTEL_TEST_RSP_CACHE_MAX_ENTRIES) {
+		old = list_last_entry(&c->lru, struct btintel_test_rsp_entry,
+				      list);
+		list_del(&old->list);
+		kfree(old);
+		c->entries--;
+		c->evictions++;
+	}
+
+	list_add(&e->list, &c->lru);
+	c->entries++;
+	e = NULL;
+
+out_unlock:
+	mutex_unlock(&c->lock);
+	kfree(e);
+}
+
+/**
+ * btintel_test_ioctl_rsp_cache - Handle BTINTEL_TEST_IOC_RSP_CACHE
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_rsp_cache
+ *
+ * Selecting a new opcode set empties the cache without counting an
+ * invalidation.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_ioctl_rsp_cache(struct btintel_test_device *dev,
+					void __user *argp)
+{
+	struct btintel_test_rsp_store *c = &dev->rsp_cache;
+	struct btintel_test_rsp_cache *req;
+	int ret = 0;
+
+	req = memdup_user(argp, sizeof(*req));
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	if (req->flags & ~(BTINTEL_TEST_RSP_CACHE_SET |
+			   BTINTEL_TEST_RSP_CACHE_RESET) ||
+	    (req->flags & BTINTEL_TEST_RSP_CACHE_SET &&
+	     req->nr_opcodes > BTINTEL_TEST_RSP_CACHE_MAX_OPCODES)) {
+		ret = -EINVAL;
+		goto out_free;
+	}
+
+	mutex_lock(&c->lock);
+
+	if (req->flags & BTINTEL_TEST_RSP_CACHE_SET) {
+		memcpy(c->opcodes, req->opcodes,
+		       req->nr_opcodes * sizeof(*req->opcodes));
+		WRITE_ONCE(c->nr_opcodes, req->nr_opcodes);
+		btintel_test_rsp_cache_drop(c, false);
+	}
+
+	memset(req->opcodes, 0, sizeof(req->opcodes));
+	memcpy(req->opcodes, c->opcodes, c->nr_opcodes * sizeof(*c->opcodes));
+	req->nr_opcodes = c->nr_opcodes;
+	req->hits = c->hits;
+	req->misses = c->misses;
+	req->invalidations = c->invalidations;
+	req->evictions = c->evictions;
+	req->entries = c->entries;
+	req->reserved = 0;
+	btintel_test_lat_finish(&c->hit_lat, &req->hit_latency);
+	btintel_test_lat_finish(&c->miss_lat, &req->miss_latency);
+
+	if (req->flags & BTINTEL_TEST_RSP_CACHE_RESET) {
+		c->hits = 0;
+		c->misses = 0;
+		c->invalidations = 0;
+		c->evictions = 0;
+		btintel_test_lat_init(&c->hit_lat);
+		btintel_test_lat_init(&c->miss_lat);
+	}
+
+	mutex_unlock(&c->lock);
+
+	if (copy_to_user(argp, req, sizeof(*req)))
+		ret = -EFAULT;
+
+out_free:
+	kfree(req);
+	return ret;
+}
+
+/**
+ * btintel_test_ioctl_rsp_cache_flush - Handle BTINTEL_TEST_IOC_RSP_CACHE_FLUSH
+ * @dev: Device structure
+ * @argp: Unused
+ *
+ * Return: 0
+ */
+static int btintel_test_ioctl_rsp_cache_flush(struct btintel_test_device *dev,
+					      void __user *argp)
+{
+	btintel_test_rsp_cache_invalidate(dev);
+	return 0;
+}
+
+/* ============================================================================
+ * FIRMWARE DOWNLOAD SWEEP
+ * ============================================================================ */
+
+/**
+ * btintel_test_fw_stage - Sweep stage a secure send record belongs to
+ * @type: Secure send fragment type
+ *
+ * Return: BTINTEL_TEST_FW_STAGE_*
+ */
+static u32 btintel_test_fw_stage(u8 type)
+{
+	switch (type) {
+	case 0x00:
+		return BTINTEL_TEST_FW_STAGE_HEADER;
+	case 0x03:
+		return BTINTEL_TEST_FW_STAGE_PKEY;
+	case 0x02:
+		return BTINTEL_TEST_FW_STAGE_SIGNATURE;
+	default:
+		return BTINTEL_TEST_FW_STAGE_PAYLOAD;
+	}
+}
+
+/**
+ * btintel_test_fw_sweep_download - Download an image with pipelined
+ * secure send
+ * @dev: Device structure
+ * @p: Pipeline state attached to the target
+ * @hdev: Target, or NULL for the virtual HCI
+ * @img: Image
+ * @res: Configuration being measured; @errors, @max_outstanding and
+ *       @stage_ns are accumulated
+ * @credits: Commands the target accepts, carried across downloads
+ *
+ * Up to @res->depth commands of a stage are in flight at once. Each stage
+ * drains before the next one starts, as the bootloader checks the header
+ * and signature before it accepts the payload.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_fw_sweep_download(struct btintel_test_device *dev,
+					  struct btintel_test_pipe *p,
+					  struct hci_dev *hdev,
+					  struct btintel_test_fw_image *img,
+					  struct btintel_test_fw_sweep_result *res,
+					  u32 *credits)
+{
+	u8 param[1 + BTINTEL_TEST_FW_FRAG_MAX];
+	struct btintel_test_pipe_evt evt;
+	struct btintel_test_fw_rec *rec;
+	u32 i = 0, off = 0, len, stage;
+	struct sk_buff *skb;
+	u64 t0, send_ns;
+	int ret;
+
+	while (i < img->nr_recs) {
+		stage = btintel_test_fw_stage(img->recs[i].type);
+		t0 = ktime_get_ns();
+
+		for (;;) {
+			while (i < img->nr_recs && *credits &&
+			       p->outstanding < res->depth &&
+			       !btintel_test_pipe_core_busy(hdev) &&
+			       btintel_test_fw_stage(img->recs[i].type) == stage) {
+				rec = &img->recs[i];
+				len = min(rec->len - off, res->chunk);
+				param[0] = rec->type;
+				memcpy(param + 1, img->fw->data + rec->offset + off,
+				       len);
+
+				skb = btintel_test_pipe_cmd_alloc(BTINTEL_TEST_FW_SECURE_SEND,
+								  1 + len, param);
+				if (!skb)
+					return -ENOMEM;
+				btintel_test_pipe_send(dev, p, hdev, skb);
+
+				(*credits)--;
+				res->max_outstanding = max(res->max_outstanding,
+							   p->outstanding);
+
+				off += len;
+				if (off == rec->len) {
+					i++;
+					off = 0;
+				}
+			}
+
+			/* Stage sent and acknowledged */
+			if (!p->outstanding &&
+			    (i == img->nr_recs ||
+			     btintel_test_fw_stage(img->recs[i].type) != stage))
+				break;
+
+			ret = btintel_test_pipe_next_evt(p, &evt);
+			if (ret)
+				return ret;
+
+			*credits = evt.ncmd;
+
+			/* Credit updates for commands the HCI core sent itself */
+			if (!btintel_test_pipe_complete(p, &evt, &send_ns))
+				continue;
+
+			if (evt.status)
+				res->errors++;
+		}
+
+		res->stage_ns[stage] += ktime_get_ns() - t0;
+
+		if (signal_pending(current))
+			return -EINTR;
+	}
+
+	return 0;
+}
+
+/**
+ * btintel_test_fw_sweep_one - Measure one chunk size and depth
+ * @dev: Device structure
+ * @p: Pipeline state attached to the target
+ * @hdev: Target, or NULL for the virtual HCI
+ * @req: Request; @size and @format are filled in
+ * @res: Configuration, with @chunk and @depth set
+ * @credits: Commands the target accepts, carried across downloads
+ *
+ * The image is obtained through the firmware cache before every download,
+ * so the load stage shows what a bring-up would pay for it.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_fw_sweep_one(struct btintel_test_device *dev,
+				     struct btintel_test_pipe *p,
+				     struct hci_dev *hdev,
+				     struct btintel_test_fw_sweep *req,
+				     struct btintel_test_fw_sweep_result *res,
+				     u32 *credits)
+{
+	struct btintel_test_fw_load load = {};
+	struct btintel_test_fw_image *img;
+	u64 t0, total = 0;
+	u32 i, r;
+	int ret = 0;
+
+	strscpy(load.name, req->name, sizeof(load.name));
+	load.flags = req->flags;
+
+	for (r = 0; r < req->repeat; r++) {
+		t0 = ktime_get_ns();
+		img = btintel_test_fw_get(dev, &load);
+		if (IS_ERR(img))
+			return PTR_ERR(img);
+		res->stage_ns[BTINTEL_TEST_FW_STAGE_LOAD] += ktime_get_ns() - t0;
+
+		req->size = img->fw->size;
+		req->format = img->format;
+		res->commands = 0;
+		for (i = 0; i < img->nr_recs; i++)
+			res->commands += DIV_ROUND_UP(img->recs[i].len,
+						      res->chunk);
+
+		ret = btintel_test_fw_sweep_download(dev, p, hdev, img, res,
+						     credits);
+		btintel_test_fw_put(img);
+		if (ret)
+			break;
+
+		total += ktime_get_ns() - t0;
+		res->downloads++;
+	}
+
+	if (res->downloads) {
+		res->total_ns = div64_u64(total, res->downloads);
+		for (i = 0; i < BTINTEL_TEST_FW_STAGES; i++)
+			res->stage_ns[i] = div64_u64(res->stage_ns[i],
+						     res->downloads);
+	}
+	if (total)
+		res->bytes_per_sec =
+			mul_u64_u64_div_u64((u64)req->size * res->downloads,
+					    NSEC_PER_SEC, total);
+
+	return ret;
+}
+
+/**
+ * btintel_test_fw_sweep_run - Sweep every chunk size and depth
+ * @dev: Device structure
+ * @req: Validated request; @best, @size and @format are filled in
+ * @hdev: Target checked by btintel_test_fw_target_get(), NULL for the
+ *        virtual HCI
+ * @res: Results, @req->nr_chunks * @req->nr_depths of them, chunk-major
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_fw_sweep_run(struct btintel_test_device *dev,
+				     struct btintel_test_fw_sweep *req,
+				     struct hci_dev *hdev,
+				     struct btintel_test_fw_sweep_result *res)
+{
+	struct btintel_test_fw_sweep_result *r;
+	struct btintel_test_emul_cfg saved;
+	struct btintel_test_pipe *p;
+	u32 c, d, credits;
+	int ret = 0;
 
-	case BTINTEL_TEST_IOC_GET_STATS:
-		stats.read_count = dev->stats.read_count;
-		stats.write_count = dev->stats.write_count;
-		stats.ioctl_count = dev->stats.ioctl_count;
-		stats.errors = dev->stats.errors;
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
 
-		if (copy_to_user((void __user *)arg, &stats, sizeof(stats))) {
-			ret = -EFAULT;
-			dev->stats.errors++;
-		}
-		pr_debug_dev("GET_STATS ioctl\n");
-		break;
+	if (!hdev) {
+		struct btintel_test_emul_cfg cfg = {
+			.latency_ns = req->emul_latency_ns,
+			.jitter_ns = req->emul_jitter_ns,
+			.credits = req->emul_credits,
+			.bytes_per_sec = req->emul_bytes_per_sec,
+		};
 
-	case BTINTEL_TEST_IOC_RESET_STATS:
-		dev->stats.read_count = 0;
-		dev->stats.write_count = 0;
-		dev->stats.ioctl_count = 0;
-		dev->stats.errors = 0;
-		pr_debug_dev("RESET_STATS ioctl\n");
-		break;
+		ret = btintel_test_emul_hci_config(&dev->emul, &cfg, &saved);
+		if (ret)
+			goto out_free;
+	}
 
-	case BTINTEL_TEST_IOC_CLEAR_BUFFER:
-		if (dev->buffer)
-			memset(dev->buffer, 0, dev->buffer_size);
-		pr_debug_dev("CLEAR_BUFFER ioctl\n");
-		break;
+	/* The target that was checked, not whatever holds its index now */
+	ret = btintel_test_pipe_attach_hdev(p, hdev);
+	if (ret)
+		goto out_restore;
 
-	case BTINTEL_TEST_IOC_SET_BUFFER_SIZE:
-		if (copy_from_user(&buf_data, (void __user *)arg,
-				   sizeof(buf_data))) {
-			ret = -EFAULT;
-			dev->stats.errors++;
-			break;
-		}
+	/* Every controller accepts one command until it says otherwise */
+	credits = hdev ? 1 : dev->emul.credits;
 
-		if (buf_data.size > BTINTEL_TEST_MAX_BUFFER_SIZE) {
-			ret = -EINVAL;
-			dev->stats.errors++;
-			break;
-		}
+	req->best = -1;
+	for (c = 0; c < req->nr_chunks && !ret; c++) {
+		for (d = 0; d < req->nr_depths && !ret; d++) {
+			r = &res[c * req->nr_depths + d];
+			r->chunk = req->chunks[c];
+			r->depth = req->depths[d];
 
-		if (dev->buffer)
-			kfree(dev->buffer);
+			ret = btintel_test_fw_sweep_one(dev, p, hdev, req, r,
+							&credits);
 
-		dev->buffer = kzalloc(buf_data.size, GFP_KERNEL);
-		if (!dev->buffer) {
-			ret = -ENOMEM;
-			dev->stats.errors++;
-			break;
+			if (!ret && !r->errors && (req->best < 0 ||
+			    r->bytes_per_sec > res[req->best].bytes_per_sec))
+				req->best = c * req->nr_depths + d;
 		}
+	}
 
-		dev->buffer_size = buf_data.size;
-		pr_debug_dev("SET_BUFFER_SIZE ioctl (size=%zu)\n",
-			     buf_data.size);
-		break;
+	pr_debug_dev("Firmware sweep %s: best configuration %d\n", req->name,
+		     req->best);
 
-	case BTINTEL_TEST_IOC_GET_STATUS:
-		/* TODO: Implement device-specific status */
-		pr_debug_dev("GET_STATUS ioctl\n");
-		break;
+	btintel_test_pipe_detach(dev, p, hdev, ret);
+out_restore:
+	if (!hdev)
+		btintel_test_emul_hci_restore(&dev->emul, &saved);
+out_free:
+	kfree(p);
+	/* The target may now run different firmware */
+	btintel_test_rsp_cache_invalidate(dev);
+	return ret;
+}
 
-	case BTINTEL_TEST_IOC_ENABLE:
-		dev->active = true;
-		pr_debug_dev("ENABLE ioctl\n");
-		break;
+/**
+ * btintel_test_ioctl_fw_sweep - Handle BTINTEL_TEST_IOC_FW_SWEEP
+ * @dev: Device structure
+ * @argp: User pointer to struct btintel_test_fw_sweep
+ *
+ * As with BTINTEL_TEST_IOC_FW_LOAD, the controller of this device is never
+ * a target, not even by hciN index; a controller waiting in its bootloader
+ * is reached by hciN index. Once it has taken an image it no longer is,
+ * and nothing here can reset it, so such a target gets exactly one
+ * download: a single configuration with a @repeat of 1.
+ *
+ * Return: 0 on success, -EOPNOTSUPP for the controller of this device,
+ * -EPERM for another controller not waiting for firmware, or another
+ * negative error code
+ */
+static int btintel_test_ioctl_fw_sweep(struct btintel_test_device *dev,
+				       void __user *argp)
+{
+	struct btintel_test_fw_sweep_result *res;
+	struct btintel_test_fw_sweep req;
+	struct hci_dev *hdev = NULL;
+	u32 i, nr;
+	int ret;
 
-	case BTINTEL_TEST_IOC_DISABLE:
-		dev->active = false;
-		pr_debug_dev("DISABLE ioctl\n");
-		break;
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
 
-	default:
-		pr_warn("Unknown ioctl command: 0x%x\n", cmd);
-		ret = -ENOTTY;
-		dev->stats.errors++;
-		break;
+	req.name[sizeof(req.name) - 1] = '\0';
+	if (!req.name[0] || req.flags & ~BTINTEL_TEST_FW_NOCACHE ||
+	    !req.repeat || req.repeat > BTINTEL_TEST_FW_SWEEP_MAX_REPEAT ||
+	    !req.nr_chunks || req.nr_chunks > BTINTEL_TEST_FW_SWEEP_MAX_CHUNKS ||
+	    !req.nr_depths || req.nr_depths > BTINTEL_TEST_FW_SWEEP_MAX_DEPTHS)
+		return -EINVAL;
+
+	for (i = 0; i < req.nr_chunks; i++)
+		if (!req.chunks[i] || req.chunks[i] > BTINTEL_TEST_FW_FRAG_MAX)
+			return -EINVAL;
+	for (i = 0; i < req.nr_depths; i++)
+		if (!req.depths[i] || req.depths[i] > BTINTEL_TEST_PIPE_MAX_DEPTH)
+			return -EINVAL;
+
+	if (req.backend == BTINTEL_TEST_BACKEND_HCI_INDEX) {
+		/* The sweep can't put the target back in its bootloader */
+		if (req.repeat != 1 || req.nr_chunks != 1 || req.nr_depths != 1)
+			return -EINVAL;
+
+		hdev = btintel_test_fw_target_get(dev, req.hci_index);
+		if (IS_ERR(hdev))
+			return PTR_ERR(hdev);
+	} else if (req.backend != BTINTEL_TEST_BACKEND_EMUL) {
+		return -EOPNOTSUPP;
 	}
 
-	dev->stats.ioctl_count++;
+	nr = req.nr_chunks * req.nr_depths;
+	res = kcalloc(nr, sizeof(*res), GFP_KERNEL);
+	if (!res) {
+		ret = -ENOMEM;
+		goto out_put;
+	}
+
+	ret = mutex_lock_interruptible(&dev->lock);
+	if (ret)
+		goto out_free;
+
+	ret = btintel_test_fw_sweep_run(dev, &req, hdev, res);
+	mutex_unlock(&dev->lock);
+
+	if (!ret && (copy_to_user(u64_to_user_ptr(req.results), res,
+				  array_size(nr, sizeof(*res))) ||
+		     copy_to_user(argp, &req, sizeof(req))))
+		ret = -EFAULT;
 
+out_free:
+	kfree(res);
+out_put:
+	if (hdev)
+		hci_dev_put(hdev);
 	return ret;
 }
 
@@ -390,6 +8980,90 @@ static long btintel_test_ioctl(struct file *filp, unsigned int cmd,
 
 
 
+/**
+ * btintel_test_device_destroy - Stop everything a device runs and free it
+ * @dev: Device structure, possibly only partly set up
+ */
+static void btintel_test_device_destroy(struct btintel_test_device *dev)
+{
+	debugfs_remove_recursive(dev->debugfs);
+
+	mutex_lock(&dev->irq_mon.lock);
+	btintel_test_irq_stop(&dev->irq_mon);
+	mutex_unlock(&dev->irq_mon.lock);
+	btintel_test_sampler_stop(&dev->sampler);
+	kvfree(dev->sampler.ring);
+	/* Answer workers blocked on the virtual HCI so they see the stop */
+	btintel_test_emul_hci_flush(&dev->emul);
+	btintel_test_exec_stop(&dev->exec);
+	btintel_test_emul_hci_flush(&dev->emul);
+	btintel_test_rsp_cache_drop(&dev->rsp_cache, false);
+	vfree(dev->emul_mem);
+	free_percpu(dev->ioctl_acct);
+
+	btintel_test_buffer_free(dev->buffer, dev->huge);
+	dev->buffer = NULL;
+
+	kfree(dev);
+}
+
+/**
+ * btintel_test_device_create - Allocate and initialize a device structure
+ * @pdev: Controller, or NULL to run against the emulated backends only
+ *
+ * Return: Device structure, or NULL on allocation failure
+ */
+static struct btintel_test_device *btintel_test_device_create(struct pci_dev *pdev)
+{
+	struct btintel_test_device *dev;
+
+	dev = kzalloc_node(sizeof(*dev), GFP_KERNEL,
+			   pdev ? dev_to_node(&pdev->dev) : NUMA_NO_NODE);
+	if (!dev) {
+		pr_err("Failed to allocate device structure\n");
+		return NULL;
+	}
+
+	dev->active = true;
+	dev->buffer_size = BTINTEL_TEST_DEFAULT_BUFFER_SIZE;
+	dev->numa_node = NUMA_NO_NODE;
+	mutex_init(&dev->lock);
+	mutex_init(&dev->irq_mon.lock);
+	btintel_test_emul_hci_init(&dev->emul);
+	btintel_test_exec_init(&dev->exec, dev);
+	btintel_test_sampler_init(&dev->sampler);
+	btintel_test_rsp_cache_init(&dev->rsp_cache);
+
+	/* Store PCI device reference */
+	dev->pdev = pdev;
+	if (pdev)
+		pr_info("Stored PCI device reference: %s\n", pci_name(pdev));
+
+	/* Allocate internal buffer on the controller's node */
+	dev->buffer = btintel_test_buffer_alloc(dev->buffer_size, false,
+						btintel_test_alloc_node(dev),
+						&dev->huge, &dev->buffer_backing);
+	if (!dev->buffer) {
+		pr_err("Failed to allocate device buffer\n");
+		goto err;
+	}
+
+	dev->ioctl_acct =
+		__alloc_percpu(sizeof(struct btintel_test_ioctl_acct) *
+			       BTINTEL_TEST_IOC_MAX_NR,
+			       __alignof__(struct btintel_test_ioctl_acct));
+	if (!dev->ioctl_acct) {
+		pr_err("Failed to allocate ioctl accounting\n");
+		goto err;
+	}
+
+	return dev;
+
+err:
+	btintel_test_device_destroy(dev);
+	return NULL;
+}
+
 /**
  * btintel_test_device_cleanup - Cleanup device structure
  */
@@ -400,12 +9074,7 @@ static void btintel_test_device_cleanup(void)
 
 	pr_info("Cleaning up device\n");
 
-	if (btintel_test_dev->buffer) {
-		kfree(btintel_test_dev->buffer);
-		btintel_test_dev->buffer = NULL;
-	}
-
-	kfree(btintel_test_dev);
+	btintel_test_device_destroy(btintel_test_dev);
 	btintel_test_dev = NULL;
 }
 
@@ -452,17 +9121,102 @@ static void btintel_test_misc_unregister(void)
 	}
 }
 
+/**
+ * btintel_test_misc_register - Register the device node of a device
+ * @dev: Device structure
+ * @instance: 0 for the primary device, N for emulated instance N
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_misc_register(struct btintel_test_device *dev,
+				      unsigned int instance)
+{
+	int ret;
+
+	if (instance)
+		snprintf(dev->name, sizeof(dev->name), "%s%u", DRIVER_NAME,
+			 instance);
+	else
+		strscpy(dev->name, DRIVER_NAME, sizeof(dev->name));
+
+	/* Setup miscdevice structure */
+	dev->misc.minor = MISC_DYNAMIC_MINOR;
+	dev->misc.name = dev->name;
+	dev->misc.fops = &btintel_test_fops;
+
+	ret = misc_register(&dev->misc);
+	if (ret)
+		return ret;
+
+	pr_info("Miscdevice registered: /dev/%s (minor: %d)\n",
+		dev->name, dev->misc.minor);
+
+	btintel_test_metrics_register(dev);
+	return 0;
+}
+
+/**
+ * btintel_test_instances_create - Register the emulated instances
+ *
+ * Instances have no controller and run against the emulated backends.
+ * One that fails to come up ends the sequence; the devices registered
+ * so far stay usable.
+ */
+static void btintel_test_instances_create(void)
+{
+	unsigned int i, nr = min_t(unsigned int, emul_instances,
+				   BTINTEL_TEST_MAX_INSTANCES);
+	struct btintel_test_device *dev;
+
+	if (emul_instances > nr)
+		pr_warn("Limiting emulated instances to %u\n", nr);
+
+	for (i = 0; i < nr; i++) {
+		dev = btintel_test_device_create(NULL);
+		if (!dev)
+			break;
+
+		if (btintel_test_misc_register(dev, i + 1)) {
+			pr_err("Failed to register emulated instance %u\n",
+			       i + 1);
+			btintel_test_device_destroy(dev);
+			break;
+		}
+
+		btintel_test_instances[btintel_test_nr_instances++] = dev;
+	}
+}
+
+/**
+ * btintel_test_instances_destroy - Unregister and free the emulated instances
+ */
+static void btintel_test_instances_destroy(void)
+{
+	struct btintel_test_device *dev;
+
+	while (btintel_test_nr_instances) {
+		dev = btintel_test_instances[--btintel_test_nr_instances];
+		btintel_test_instances[btintel_test_nr_instances] = NULL;
+		misc_deregister(&dev->misc);
+		btintel_test_device_destroy(dev);
+	}
+}
+
 void test_function(void)
 {
 	struct hci_dev *hdev;
-	struct pci_dev *pdev = btintel_test_dev->pdev;
-	struct btintel_pcie_data *btintel_data;
 	u8 param[] = {0xff};
+	struct sk_buff *skb;
 
-	btintel_data = pci_get_drvdata(pdev);
-	hdev = btintel_data->hdev;
-	hci_cmd_sync(hdev, 0xfc05, 1, param, HCI_CMD_TIMEOUT); /* Example HCI command */
+	hdev = btintel_test_hdev_get(btintel_test_dev, BTINTEL_TEST_BACKEND_HW, 0);
+	if (!hdev)
+		return;
+
+	skb = hci_cmd_sync(hdev, 0xfc05, 1, param, HCI_CMD_TIMEOUT); /* Example HCI command */
+	if (!IS_ERR(skb))
+		kfree_skb(skb);
 
+	hci_dev_put(hdev);
 }
 
 /* ============================================================================
@@ -480,58 +9234,40 @@ static int __init btintel_test_init(void)
 
 	pr_info("Loading %s driver version %s\n", DRIVER_NAME, DRIVER_VERSION);
 
+	btintel_test_fw_cache_init();
+	btintel_test_trace_set(BTINTEL_TEST_TRACE_RESET);
+
 	/* Search for Intel Bluetooth devices */
 	struct pci_dev *pdev = find_intel_bt_devices();
-	if (!pdev) {
+	if (!pdev && !emulate) {
 		pr_warn("No Intel Bluetooth devices found\n");
 		return -ENODEV;
 	}
-	pr_info("Found Intel Bluetooth PCIe device\n");
+	if (pdev)
+		pr_info("Found Intel Bluetooth PCIe device\n");
+	else
+		pr_info("No Intel Bluetooth devices found, using emulated backends\n");
 
 	/* Initialize device */
 	pr_info("Initializing device\n");
 
-	btintel_test_dev = kzalloc(sizeof(*btintel_test_dev), GFP_KERNEL);
-	if (!btintel_test_dev) {
-		pr_err("Failed to allocate device structure\n");
-		return -ENOMEM;
-	}
-
-	btintel_test_dev->active = true;
-	btintel_test_dev->buffer_size = BTINTEL_TEST_DEFAULT_BUFFER_SIZE;
-
-	/* Allocate internal buffer */
-	btintel_test_dev->buffer = kzalloc(btintel_test_dev->buffer_size, GFP_KERNEL);
-	if (!btintel_test_dev->buffer) {
-		pr_err("Failed to allocate device buffer\n");
-		kfree(btintel_test_dev);
-		btintel_test_dev = NULL;
+	btintel_test_dev = btintel_test_device_create(pdev);
+	if (!btintel_test_dev)
 		return -ENOMEM;
-	}
-
-	/* Store PCI device reference */
-	btintel_test_dev->pdev = pdev;
-	pr_info("Stored PCI device reference: %s\n", pci_name(pdev));
 
 	test_function();
 	/* Register miscdevice */
 	pr_info("Registering miscdevice\n");
 
-	/* Setup miscdevice structure */
-	btintel_test_dev->misc.minor = MISC_DYNAMIC_MINOR;
-	btintel_test_dev->misc.name = DRIVER_NAME;
-	btintel_test_dev->misc.fops = &btintel_test_fops;
-
-	/* Register miscdevice */
-	ret = misc_register(&btintel_test_dev->misc);
+	ret = btintel_test_misc_register(btintel_test_dev, 0);
 	if (ret) {
 		pr_err("Failed to register miscdevice\n");
 		btintel_test_device_cleanup();
 		return ret;
 	}
 
-	pr_info("Miscdevice registered: /dev/%s (minor: %d)\n",
-		DRIVER_NAME, btintel_test_dev->misc.minor);
+	btintel_test_hci_watch_start();
+	btintel_test_instances_create();
 
 	pr_info("Driver loaded successfully\n");
 	return 0;
@@ -544,8 +9280,11 @@ static void __exit btintel_test_exit(void)
 {
 	pr_info("Unloading %s driver\n", DRIVER_NAME);
 
+	btintel_test_instances_destroy();
 	btintel_test_misc_unregister();
 	btintel_test_device_cleanup();
+	btintel_test_hci_watch_stop();
+	btintel_test_fw_cache_flush();
 
 	pr_info("Driver unloaded\n");
 }
@@ -553,6 +9292,451 @@ static void __exit btintel_test_exit(void)
 module_init(btintel_test_init);
 module_exit(btintel_test_exit);
 
+/* ============================================================================
+ * KUNIT TESTS
+ * ============================================================================ */
+
+#if defined(BTINTEL_TEST_KUNIT) && IS_ENABLED(CONFIG_KUNIT)
+
+/*
+ * Correctness checks and timings of the driver's own paths: ioctl dispatch,
+ * read/write, CLEAR_BUFFER and SET_BUFFER_SIZE. Each case runs on a private
+ * device with no controller behind it, and user memory comes from a KUnit
+ * mapping, so the suite runs under UML or QEMU. Timings are reported with
+ * kunit_info() as ns per operation.
+ */
+
+#define BTINTEL_TEST_KUNIT_IO_MAX	(1024 * 1024)
+#define BTINTEL_TEST_KUNIT_IO_BYTES	(64 * 1024 * 1024)	/* Per size */
+#define BTINTEL_TEST_KUNIT_IOCTL_LOOPS	100000
+#define BTINTEL_TEST_KUNIT_RESIZE_LOOPS	100
+
+/**
+ * struct btintel_test_kunit - Per-case fixture
+ * @dev: Private device, not registered as a misc device
+ * @filp: File handed to the file operations, private data is @dev
+ * @arg: User memory for ioctl arguments
+ * @src: User memory for write data, BTINTEL_TEST_KUNIT_IO_MAX bytes
+ * @dst: User memory for read data, BTINTEL_TEST_KUNIT_IO_MAX bytes
+ * @pattern: Kernel copy of what @src holds
+ */
+struct btintel_test_kunit {
+	struct btintel_test_device *dev;
+	struct file filp;
+	void __user *arg;
+	char __user *src;
+	char __user *dst;
+	u8 *pattern;
+};
+
+/**
+ * btintel_test_kunit_init - Set up a private device and user memory
+ * @test: Test case
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int btintel_test_kunit_init(struct kunit *test)
+{
+	struct btintel_test_kunit *ctx;
+	unsigned long umem;
+	u32 i;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+
+	ctx->pattern = kunit_kmalloc(test, BTINTEL_TEST_KUNIT_IO_MAX,
+				     GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx->pattern);
+	for (i = 0; i < BTINTEL_TEST_KUNIT_IO_MAX; i++)
+		ctx->pattern[i] = i * 7 + 1;
+
+	umem = kunit_vm_mmap(test, NULL, 0,
+			     PAGE_SIZE + 2 * BTINTEL_TEST_KUNIT_IO_MAX,
+			     PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0);
+	KUNIT_ASSERT_FALSE_MSG(test, !umem || IS_ERR_VALUE(umem),
+			       "kunit_vm_mmap failed");
+	ctx->arg = (void __user *)umem;
+	ctx->src = (char __user *)umem + PAGE_SIZE;
+	ctx->dst = ctx->src + BTINTEL_TEST_KUNIT_IO_MAX;
+	KUNIT_ASSERT_EQ(test, copy_to_user(ctx->src, ctx->pattern,
+					   BTINTEL_TEST_KUNIT_IO_MAX), 0);
+
+	ctx->dev = btintel_test_device_create(NULL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx->dev);
+	ctx->filp.private_data = ctx->dev;
+
+	test->priv = ctx;
+	return 0;
+}
+
+/**
+ * btintel_test_kunit_exit - Tear down the private device
+ * @test: Test case
+ */
+static void btintel_test_kunit_exit(struct kunit *test)
+{
+	struct btintel_test_kunit *ctx = test->priv;
+
+	if (ctx && ctx->dev)
+		btintel_test_device_destroy(ctx->dev);
+}
+
+/**
+ * btintel_test_kunit_ioctl - Issue an ioctl through the file operation
+ * @ctx: Fixture
+ * @cmd: Command
+ * @arg: Argument, copied to the user argument area when not NULL
+ * @len: Size of @arg
+ *
+ * Return: What the ioctl returned
+ */
+static long btintel_test_kunit_ioctl(struct btintel_test_kunit *ctx,
+				     unsigned int cmd, const void *arg,
+				     size_t len)
+{
+	if (arg && copy_to_user(ctx->arg, arg, len))
+		return -EFAULT;
+
+	return btintel_test_ioctl(&ctx->filp, cmd, (unsigned long)ctx->arg);
+}
+
+/**
+ * btintel_test_kunit_read - Read through the file operation, as read(2) does
+ * @ctx: Fixture
+ * @buf: User memory
+ * @count: Bytes to read
+ * @pos: File position, advanced
+ *
+ * Return: What the file operation returned
+ */
+static ssize_t btintel_test_kunit_read(struct btintel_test_kunit *ctx,
+				       char __user *buf, size_t count,
+				       loff_t *pos)
+{
+	struct iov_iter iter;
+	struct kiocb kiocb;
+	ssize_t ret;
+
+	init_sync_kiocb(&kiocb, &ctx->filp);
+	kiocb.ki_pos = *pos;
+	iov_iter_ubuf(&iter, ITER_DEST, buf, count);
+
+	ret = btintel_test_read_iter(&kiocb, &iter);
+	*pos = kiocb.ki_pos;
+	return ret;
+}
+
+/**
+ * btintel_test_kunit_write - Write through the file operation, as write(2)
+ * does
+ * @ctx: Fixture
+ * @buf: User memory
+ * @count: Bytes to write
+ * @pos: File position, advanced
+ *
+ * Return: What the file operation returned
+ */
+static ssize_t btintel_test_kunit_write(struct btintel_test_kunit *ctx,
+					const char __user *buf, size_t count,
+					loff_t *pos)
+{
+	struct iov_iter iter;
+	struct kiocb kiocb;
+	ssize_t ret;
+
+	init_sync_kiocb(&kiocb, &ctx->filp);
+	kiocb.ki_pos = *pos;
+	iov_iter_ubuf(&iter, ITER_SOURCE, (void __user *)buf, count);
+
+	ret = btintel_test_write_iter(&kiocb, &iter);
+	*pos = kiocb.ki_pos;
+	return ret;
+}
+
+/**
+ * btintel_test_kunit_resize - Set the buffer size through the ioctl
+ * @ctx: Fixture
+ * @size: New size
+ * @flags: BTINTEL_TEST_BUF_*
+ *
+ * Return: What the ioctl returned
+ */
+static long btintel_test_kunit_resize(struct btintel_test_kunit *ctx,
+				      size_t size, u32 flags)
+{
+	struct btintel_test_buffer_data data = {
+		.size = size,
+		.flags = flags,
+	};
+
+	return btintel_test_kunit_ioctl(ctx, BTINTEL_TEST_IOC_SET_BUFFER_SIZE,
+					&data, sizeof(data));
+}
+
+/**
+ * btintel_test_kunit_report - Report the cost of a timed loop
+ * @test: Test case
+ * @what: Operation
+ * @ns: Time of the whole loop
+ * @loops: Iterations
+ * @bytes: Bytes moved per iteration, 0 if not a transfer
+ */
+static void btintel_test_kunit_report(struct kunit *test, const char *what,
+				      u64 ns, u32 loops, size_t bytes)
+{
+	u64 per_op = div_u64(ns, loops);
+
+	if (bytes && ns)
+		kunit_info(test, "%s: %llu ns/op, %llu MB/s (%u ops)\n", what,
+			   per_op, div64_u64((u64)bytes * loops * 1000, ns),
+			   loops);
+	else
+		kunit_info(test, "%s: %llu ns/op (%u ops)\n", what, per_op,
+			   loops);
+}
+
+/**
+ * btintel_test_kunit_dispatch - Ioctl table lookup, accounting and cost
+ * @test: Test case
+ */
+static void btintel_test_kunit_dispatch(struct kunit *test)
+{
+	struct btintel_test_kunit *ctx = test->priv;
+	struct btintel_test_device *dev = ctx->dev;
+	unsigned int nr = _IOC_NR(BTINTEL_TEST_IOC_GET_INFO);
+	struct btintel_test_dev_info info;
+	struct btintel_test_status status;
+	u64 calls = 0, start;
+	u32 i;
+	int cpu;
+
+	KUNIT_ASSERT_EQ(test, btintel_test_kunit_ioctl(ctx,
+			BTINTEL_TEST_IOC_GET_INFO, NULL, 0), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(&info, ctx->arg, sizeof(info)), 0);
+	KUNIT_EXPECT_EQ(test, info.version, BTINTEL_TEST_VERSION_CODE);
+	KUNIT_EXPECT_EQ(test, info.buffer_size,
+			(size_t)BTINTEL_TEST_DEFAULT_BUFFER_SIZE);
+	KUNIT_EXPECT_EQ(test, info.numa_node, NUMA_NO_NODE);
+
+	for_each_possible_cpu(cpu)
+		calls += per_cpu_ptr(dev->ioctl_acct, cpu)[nr].calls;
+	KUNIT_EXPECT_EQ(test, calls, 1);
+
+	/* Unknown number, and a known number with the wrong size */
+	KUNIT_EXPECT_EQ(test, btintel_test_kunit_ioctl(ctx,
+			_IO(BTINTEL_TEST_IOC_MAGIC, BTINTEL_TEST_IOC_MAX_NR - 1),
+			NULL, 0), -ENOTTY);
+	KUNIT_EXPECT_EQ(test, btintel_test_kunit_ioctl(ctx,
+			_IOR(BTINTEL_TEST_IOC_MAGIC, nr, u32), NULL, 0),
+			-ENOTTY);
+	KUNIT_EXPECT_EQ(test, btintel_test_kunit_ioctl(ctx,
+			_IO('x', nr), NULL, 0), -ENOTTY);
+	KUNIT_EXPECT_EQ(test, dev->stats.ioctl_count, 4);
+	KUNIT_EXPECT_EQ(test, dev->stats.errors, 3);
+
+	KUNIT_ASSERT_EQ(test, btintel_test_kunit_ioctl(ctx,
+			BTINTEL_TEST_IOC_GET_STATUS, NULL, 0), 0);
+	KUNIT_ASSERT_EQ(test,
+			copy_from_user(&status, ctx->arg, sizeof(status)), 0);
+	KUNIT_EXPECT_TRUE(test, status.state & BTINTEL_TEST_STATE_BUFFER);
+	KUNIT_EXPECT_EQ(test, status.error_code, ENOTTY);
+
+	start = ktime_get_ns();
+	for (i = 0; i < BTINTEL_TEST_KUNIT_IOCTL_LOOPS; i++)
+		btintel_test_kunit_ioctl(ctx, BTINTEL_TEST_IOC_GET_STATUS,
+					 NULL, 0);
+	btintel_test_kunit_report(test, "GET_STATUS",
+				  ktime_get_ns() - start,
+				  BTINTEL_TEST_KUNIT_IOCTL_LOOPS, 0);
+
+	start = ktime_get_ns();
+	for (i = 0; i < BTINTEL_TEST_KUNIT_IOCTL_LOOPS; i++)
+		btintel_test_kunit_ioctl(ctx, BTINTEL_TEST_IOC_GET_STATS,
+					 NULL, 0);
+	btintel_test_kunit_report(test, "GET_STATS", ktime_get_ns() - start,
+				  BTINTEL_TEST_KUNIT_IOCTL_LOOPS, 0);
+}
+
+/**
+ * btintel_test_kunit_read_write - Data integrity and cost at several sizes
+ * @test: Test case
+ */
+static void btintel_test_kunit_read_write(struct kunit *test)
+{
+	static const size_t sizes[] = { 1, 64, 512, 4096, 65536,
+					BTINTEL_TEST_KUNIT_IO_MAX };
+	struct btintel_test_kunit *ctx = test->priv;
+	u8 *back;
+	u64 start, write_ns, read_ns;
+	unsigned int s;
+	loff_t pos;
+	u32 i, loops;
+	char name[32];
+
+	back = kunit_kmalloc(test, BTINTEL_TEST_KUNIT_IO_MAX, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, back);
+	KUNIT_ASSERT_EQ(test, btintel_test_kunit_resize(ctx,
+			BTINTEL_TEST_KUNIT_IO_MAX, 0), 0);
+
+	for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+		size_t size = sizes[s];
+
+		pos = 0;
+		KUNIT_ASSERT_EQ(test, btintel_test_kunit_write(ctx, ctx->src,
+							       size, &pos),
+				(ssize_t)size);
+		pos = 0;
+		KUNIT_ASSERT_EQ(test, btintel_test_kunit_read(ctx, ctx->dst,
+							      size, &pos),
+				(ssize_t)size);
+		KUNIT_ASSERT_EQ(test, copy_from_user(back, ctx->dst, size), 0);
+		KUNIT_EXPECT_EQ(test, memcmp(back, ctx->pattern, size), 0);
+
+		loops = clamp_t(u32, BTINTEL_TEST_KUNIT_IO_BYTES / size, 16,
+				BTINTEL_TEST_KUNIT_IOCTL_LOOPS);
+
+		start = ktime_get_ns();
+		for (i = 0; i < loops; i++) {
+			pos = 0;
+			btintel_test_kunit_write(ctx, ctx->src, size, &pos);
+		}
+		write_ns = ktime_get_ns() - start;
+
+		start = ktime_get_ns();
+		for (i = 0; i < loops; i++) {
+			pos = 0;
+			btintel_test_kunit_read(ctx, ctx->dst, size, &pos);
+		}
+		read_ns = ktime_get_ns() - start;
+
+		snprintf(name, sizeof(name), "write %zu B", size);
+		btintel_test_kunit_report(test, name, write_ns, loops, size);
+		snprintf(name, sizeof(name), "read %zu B", size);
+		btintel_test_kunit_report(test, name, read_ns, loops, size);
+	}
+
+	/* Transfers are clamped at the end of the buffer */
+	pos = BTINTEL_TEST_KUNIT_IO_MAX - 10;
+	KUNIT_EXPECT_EQ(test, btintel_test_kunit_read(ctx, ctx->dst, 100,
+						      &pos), 10);
+	KUNIT_EXPECT_EQ(test, btintel_test_kunit_read(ctx, ctx->dst, 100,
+						      &pos), 0);
+	KUNIT_EXPECT_EQ(test, btintel_test_kunit_write(ctx, ctx->src, 100,
+						       &pos), -ENOSPC);
+}
+
+/**
+ * btintel_test_kunit_clear_buffer - CLEAR_BUFFER zeroes the buffer, and cost
+ * @test: Test case
+ */
+static void btintel_test_kunit_clear_buffer(struct kunit *test)
+{
+	static const size_t sizes[] = { 4096, BTINTEL_TEST_KUNIT_IO_MAX };
+	struct btintel_test_kunit *ctx = test->priv;
+	u64 start;
+	unsigned int s;
+	loff_t pos;
+	u32 i, loops;
+	char name[32];
+	u8 *back;
+
+	back = kunit_kmalloc(test, BTINTEL_TEST_KUNIT_IO_MAX, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, back);
+
+	for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+		size_t size = sizes[s];
+
+		KUNIT_ASSERT_EQ(test, btintel_test_kunit_resize(ctx, size, 0), 0);
+		pos = 0;
+		KUNIT_ASSERT_EQ(test, btintel_test_kunit_write(ctx, ctx->src,
+							       size, &pos),
+				(ssize_t)size);
+
+		KUNIT_ASSERT_EQ(test, btintel_test_kunit_ioctl(ctx,
+				BTINTEL_TEST_IOC_CLEAR_BUFFER, NULL, 0), 0);
+
+		pos = 0;
+		KUNIT_ASSERT_EQ(test, btintel_test_kunit_read(ctx, ctx->dst,
+							      size, &pos),
+				(ssize_t)size);
+		KUNIT_ASSERT_EQ(test, copy_from_user(back, ctx->dst, size), 0);
+		KUNIT_EXPECT_NULL(test, memchr_inv(back, 0, size));
+
+		loops = clamp_t(u32, BTINTEL_TEST_KUNIT_IO_BYTES / size, 16,
+				BTINTEL_TEST_KUNIT_IOCTL_LOOPS);
+		start = ktime_get_ns();
+		for (i = 0; i < loops; i++)
+			btintel_test_kunit_ioctl(ctx, BTINTEL_TEST_IOC_CLEAR_BUFFER,
+						 NULL, 0);
+		snprintf(name, sizeof(name), "CLEAR_BUFFER %zu B", size);
+		btintel_test_kunit_report(test, name, ktime_get_ns() - start,
+					  loops, size);
+	}
+}
+
+/**
+ * btintel_test_kunit_set_buffer_size - Resizing, validation and cost
+ * @test: Test case
+ */
+static void btintel_test_kunit_set_buffer_size(struct kunit *test)
+{
+	struct btintel_test_kunit *ctx = test->priv;
+	struct btintel_test_device *dev = ctx->dev;
+	struct btintel_test_dev_info info;
+	u64 start;
+	u32 i;
+
+	KUNIT_ASSERT_EQ(test, btintel_test_kunit_resize(ctx, 65536, 0), 0);
+	KUNIT_EXPECT_EQ(test, dev->buffer_size, (size_t)65536);
+	KUNIT_ASSERT_EQ(test, btintel_test_kunit_ioctl(ctx,
+			BTINTEL_TEST_IOC_GET_INFO, NULL, 0), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(&info, ctx->arg, sizeof(info)), 0);
+	KUNIT_EXPECT_EQ(test, info.buffer_size, (size_t)65536);
+
+	KUNIT_EXPECT_EQ(test, btintel_test_kunit_resize(ctx,
+			BTINTEL_TEST_MAX_BUFFER_SIZE + 1, 0), -EINVAL);
+	KUNIT_EXPECT_EQ(test, btintel_test_kunit_resize(ctx, 4096, 0x80),
+			-EINVAL);
+	/* A rejected request leaves the buffer alone */
+	KUNIT_EXPECT_EQ(test, dev->buffer_size, (size_t)65536);
+	KUNIT_EXPECT_NOT_NULL(test, dev->buffer);
+
+	/* Huge pages may be unavailable; any backing will do, but not none */
+	KUNIT_ASSERT_EQ(test, btintel_test_kunit_resize(ctx, 2 * 1024 * 1024,
+			BTINTEL_TEST_BUF_HUGE), 0);
+	KUNIT_EXPECT_LE(test, dev->buffer_backing,
+			(u32)BTINTEL_TEST_BUF_BACKING_HUGE);
+	kunit_info(test, "2 MB huge page request got backing %u\n",
+		   dev->buffer_backing);
+
+	start = ktime_get_ns();
+	for (i = 0; i < BTINTEL_TEST_KUNIT_RESIZE_LOOPS; i++)
+		btintel_test_kunit_resize(ctx, i & 1 ? 4096 :
+					  BTINTEL_TEST_KUNIT_IO_MAX, 0);
+	btintel_test_kunit_report(test, "SET_BUFFER_SIZE 4 KB <-> 1 MB",
+				  ktime_get_ns() - start,
+				  BTINTEL_TEST_KUNIT_RESIZE_LOOPS, 0);
+}
+
+static struct kunit_case btintel_test_kunit_cases[] = {
+	KUNIT_CASE(btintel_test_kunit_dispatch),
+	KUNIT_CASE(btintel_test_kunit_read_write),
+	KUNIT_CASE(btintel_test_kunit_clear_buffer),
+	KUNIT_CASE(btintel_test_kunit_set_buffer_size),
+	{}
+};
+
+static struct kunit_suite btintel_test_kunit_suite = {
+	.name = "btintel_test_generic_driver",
+	.init = btintel_test_kunit_init,
+	.exit = btintel_test_kunit_exit,
+	.test_cases = btintel_test_kunit_cases,
+};
+
+kunit_test_suite(btintel_test_kunit_suite);
+
+#endif /* BTINTEL_TEST_KUNIT && CONFIG_KUNIT */
+
 /* ============================================================================
  * EOF
  * ============================================================================ */
@@ -34,6 +34,185 @@
 /* Magic number for ioctl - use a unique value (ASCII character) */
 #define BTINTEL_TEST_IOC_MAGIC			'B'
 
+/* Latency histograms: bucket i counts samples in [2^(i-1), 2^i) ns */
+#define BTINTEL_TEST_HIST_BUCKETS		32
+
+/* Backends the benchmark engines can drive */
+#define BTINTEL_TEST_BACKEND_HW			0  /* Controller behind pdev */
+#define BTINTEL_TEST_BACKEND_HCI_INDEX		1  /* hciN by index (hci_vhci) */
+#define BTINTEL_TEST_BACKEND_EMUL		2  /* In-module virtual HCI */
+
+/* Isochronous jitter benchmark */
+#define BTINTEL_TEST_ISO_PKT_SCO		0
+#define BTINTEL_TEST_ISO_PKT_ISO		1
+#define BTINTEL_TEST_ISO_MAX_PACKETS		65536
+#define BTINTEL_TEST_ISO_MAX_PAYLOAD		1024
+#define BTINTEL_TEST_ISO_MIN_INTERVAL_NS	100000ULL	/* 100us */
+#define BTINTEL_TEST_ISO_MAX_INTERVAL_NS	1000000000ULL	/* 1s */
+
+/* Parallel test executor */
+#define BTINTEL_TEST_EXEC_MAX_WORKERS		64
+#define BTINTEL_TEST_EXEC_MAX_JOBS		4096	/* Per submission */
+#define BTINTEL_TEST_EXEC_MAX_PENDING		65536	/* Queued + uncollected */
+#define BTINTEL_TEST_EXEC_CPU_WORDS		16	/* 1024 CPUs */
+#define BTINTEL_TEST_EXEC_WAIT			0x1	/* Collect: block */
+
+/* Test job types */
+#define BTINTEL_TEST_JOB_REG_SWEEP		0
+#define BTINTEL_TEST_JOB_BUF_PATTERN		1
+#define BTINTEL_TEST_JOB_HCI_BATCH		2
+
+#define BTINTEL_TEST_JOB_BUF_MAX_SIZE		BTINTEL_TEST_MAX_BUFFER_SIZE
+#define BTINTEL_TEST_JOB_BUF_MAX_ITERATIONS	10000	/* Passes per job */
+#define BTINTEL_TEST_JOB_HCI_MAX_PARAM		32
+#define BTINTEL_TEST_JOB_HCI_MAX_COUNT		10000	/* Commands per job */
+
+/* Emulated backend (virtual HCI) */
+#define BTINTEL_TEST_EMUL_MAX_DELAY_NS		1000000000ULL	/* Latency, jitter */
+#define BTINTEL_TEST_EMUL_MAX_CREDITS		255
+#define BTINTEL_TEST_EMUL_MIN_BYTES_PER_SEC	1000	/* Or 0: unlimited */
+
+/* HCI command pipelining benchmark */
+#define BTINTEL_TEST_PIPE_MAX_DEPTH		64
+#define BTINTEL_TEST_PIPE_MAX_COMMANDS		1000000
+
+/* Controller memory dumps */
+#define BTINTEL_TEST_DUMP_SRC_BAR		0  /* BAR0: refused, see below */
+#define BTINTEL_TEST_DUMP_SRC_EMUL		1  /* Emulated memory region */
+#define BTINTEL_TEST_DUMP_LZ4			0x1  /* Compress the stream */
+#define BTINTEL_TEST_DUMP_MAX_SIZE		(256 * 1024)
+#define BTINTEL_TEST_DUMP_LZ4_BLOCK		(64 * 1024)
+#define BTINTEL_TEST_DUMP_MAX_CHUNK_DELAY_NS	100000
+
+/* Reset cycle stress */
+#define BTINTEL_TEST_RESET_STAGE_DOWN		0  /* hci_dev no longer ready */
+#define BTINTEL_TEST_RESET_STAGE_ROM		1  /* Boot stage: ROM */
+#define BTINTEL_TEST_RESET_STAGE_IML		2  /* Boot stage: IML */
+#define BTINTEL_TEST_RESET_STAGE_OPFW		3  /* Boot stage: operational FW */
+#define BTINTEL_TEST_RESET_STAGE_ALIVE		4  /* Boot stage: alive */
+#define BTINTEL_TEST_RESET_STAGE_READY		5  /* hci_dev up and set up */
+#define BTINTEL_TEST_RESET_STAGES		6
+#define BTINTEL_TEST_RESET_MAX_CYCLES		10000
+#define BTINTEL_TEST_RESET_MIN_POLL_NS		10000
+#define BTINTEL_TEST_RESET_NO_BOOT_STAGE	0x1  /* Out: boot stages not readable */
+#define BTINTEL_TEST_RESET_IRQ_PAUSED		0x2  /* Out: IRQ monitor restarted */
+
+/* Firmware image cache */
+#define BTINTEL_TEST_FW_NAME_MAX		64
+#define BTINTEL_TEST_FW_FRAG_MAX		252  /* Secure send payload */
+#define BTINTEL_TEST_FW_DOWNLOAD		0x1  /* Download to the target */
+#define BTINTEL_TEST_FW_NOCACHE			0x2  /* Bypass the cache */
+#define BTINTEL_TEST_FW_FMT_RAW			0  /* Opaque blob */
+#define BTINTEL_TEST_FW_FMT_RSA			1  /* CSS header, RSA signed */
+#define BTINTEL_TEST_FW_FMT_ECDSA		2  /* CSS headers, RSA + ECDSA */
+
+/* Power-state transition latency */
+#define BTINTEL_TEST_PM_RUNTIME			0  /* Runtime PM via the driver */
+#define BTINTEL_TEST_PM_D3HOT			1  /* PCI D0 <-> D3hot, unbound */
+#define BTINTEL_TEST_PM_MAX_CYCLES		10000
+
+/* Interrupt instrumentation */
+#define BTINTEL_TEST_IRQ_MAX_VECTORS		8
+#define BTINTEL_TEST_IRQ_HW			0x1  /* Attach to MSI-X vectors */
+#define BTINTEL_TEST_IRQ_VEC_SW			0  /* Software vector (irq_work) */
+#define BTINTEL_TEST_IRQ_VEC_MSIX		1  /* Controller MSI-X vector */
+#define BTINTEL_TEST_IRQ_MAX_INJECT		100000
+
+/* Busy-poll command completion */
+#define BTINTEL_TEST_POLL_MAX_BUDGET_NS		1000000
+#define BTINTEL_TEST_POLL_DEFAULT_BUDGET_NS	50000
+#define BTINTEL_TEST_HCI_POLL			0x1  /* Busy-poll completions */
+
+/* NUMA placement */
+#define BTINTEL_TEST_NUMA_MAX_NODES		8
+#define BTINTEL_TEST_NUMA_BENCH_MAX_SIZE	(256 * 1024 * 1024)
+#define BTINTEL_TEST_NUMA_BENCH_MAX_PASSES	1000
+
+/* Device state, struct btintel_test_status */
+#define BTINTEL_TEST_STATE_ACTIVE		0x1  /* Accepts new opens */
+#define BTINTEL_TEST_STATE_HW			0x2  /* Bound to a controller */
+#define BTINTEL_TEST_STATE_BUFFER		0x4  /* Buffer allocated */
+
+/* Device buffer backing */
+#define BTINTEL_TEST_BUF_HUGE			0x1	/* Prefer huge pages */
+#define BTINTEL_TEST_BUF_BACKING_LINEAR		0	/* Physically contiguous */
+#define BTINTEL_TEST_BUF_BACKING_VMALLOC	1	/* Base pages */
+#define BTINTEL_TEST_BUF_BACKING_HUGE		2	/* PMD-sized pages */
+#define BTINTEL_TEST_BUF_BENCH_MAX_SIZE		(256 * 1024 * 1024)
+#define BTINTEL_TEST_BUF_BENCH_MAX_PASSES	1000
+#define BTINTEL_TEST_BUF_BENCH_MAX_RANDOM	(64 * 1024 * 1024)
+
+/* Per-command ioctl accounting */
+#define BTINTEL_TEST_IOC_MAX_NR			64	/* Ioctl numbers accounted */
+#define BTINTEL_TEST_IOC_NAME_LEN		24
+#define BTINTEL_TEST_IOCTL_STATS_RESET		0x1	/* Clear after reading */
+
+/* Runtime instrumentation points */
+#define BTINTEL_TEST_TRACE_READ			0
+#define BTINTEL_TEST_TRACE_WRITE		1
+#define BTINTEL_TEST_TRACE_IOCTL		2
+#define BTINTEL_TEST_TRACE_HCI_CMD		3
+#define BTINTEL_TEST_TRACE_BENCH		4	/* TRACE_BENCH's own point */
+#define BTINTEL_TEST_TRACE_POINTS		5
+
+#define BTINTEL_TEST_TRACE_ENABLE		0x1
+#define BTINTEL_TEST_TRACE_DISABLE		0x2
+#define BTINTEL_TEST_TRACE_RESET		0x4
+
+#define BTINTEL_TEST_TRACE_BENCH_MAX_LOOPS	10000000
+
+/* Performance counters collected by BTINTEL_TEST_IOC_PERF_RUN */
+#define BTINTEL_TEST_PERF_CYCLES		0	/* Hardware */
+#define BTINTEL_TEST_PERF_INSTRUCTIONS		1	/* Hardware */
+#define BTINTEL_TEST_PERF_CACHE_MISSES		2	/* Hardware */
+#define BTINTEL_TEST_PERF_CONTEXT_SWITCHES	3	/* Software */
+#define BTINTEL_TEST_PERF_TASK_CLOCK		4	/* Software, ns */
+#define BTINTEL_TEST_PERF_CPU_MIGRATIONS	5	/* Software */
+#define BTINTEL_TEST_PERF_PAGE_FAULTS		6	/* Software */
+#define BTINTEL_TEST_PERF_COUNTERS		7
+
+/* Time-series stats sampler */
+#define BTINTEL_TEST_SAMPLER_RING		4096	/* Samples of history */
+#define BTINTEL_TEST_SAMPLER_MIN_PERIOD_US	100
+#define BTINTEL_TEST_SAMPLER_MAX_PERIOD_US	10000000
+#define BTINTEL_TEST_SAMPLER_START		0x1
+#define BTINTEL_TEST_SAMPLER_STOP		0x2
+#define BTINTEL_TEST_SAMPLER_RESET		0x4	/* Drop the history */
+
+/* HCI command replay */
+#define BTINTEL_TEST_REPLAY_MAGIC		0x50525442	/* "BTRP" */
+#define BTINTEL_TEST_REPLAY_MAX_SCRIPT		(16 * 1024 * 1024)
+#define BTINTEL_TEST_REPLAY_MAX_DELAY_US	60000000
+#define BTINTEL_TEST_REPLAY_ANY_STATUS		0xff	/* Status not checked */
+#define BTINTEL_TEST_REPLAY_FAST		0x1	/* Ignore the recorded delays */
+#define BTINTEL_TEST_REPLAY_STOP		0x2	/* Stop at the first divergence */
+
+/* DMA descriptor ring benchmark */
+#define BTINTEL_TEST_DMA_DESC_SIZE		128	/* Descriptor size and alignment */
+#define BTINTEL_TEST_DMA_MAX_RING		4096	/* Descriptors, power of two */
+#define BTINTEL_TEST_DMA_MAX_BUF		65536	/* Bytes per descriptor */
+#define BTINTEL_TEST_DMA_TX			0	/* Host to controller */
+#define BTINTEL_TEST_DMA_RX			1	/* Controller to host */
+#define BTINTEL_TEST_DMA_MAP_EACH		0x1	/* Map each buffer per transfer */
+
+/* HCI command response cache */
+#define BTINTEL_TEST_RSP_CACHE_MAX_OPCODES	16	/* Opcodes that may be cached */
+#define BTINTEL_TEST_RSP_CACHE_MAX_PARAM	32	/* Longer commands bypass the cache */
+#define BTINTEL_TEST_RSP_CACHE_MAX_ENTRIES	256	/* Responses held per device */
+#define BTINTEL_TEST_RSP_CACHE_SET		0x1	/* Replace the opcode set */
+#define BTINTEL_TEST_RSP_CACHE_RESET		0x2	/* Clear counters after reading */
+
+/* Firmware download sweep */
+#define BTINTEL_TEST_FW_SWEEP_MAX_CHUNKS	8
+#define BTINTEL_TEST_FW_SWEEP_MAX_DEPTHS	8
+#define BTINTEL_TEST_FW_SWEEP_MAX_REPEAT	100
+#define BTINTEL_TEST_FW_STAGE_LOAD		0	/* Image lookup, load and parse */
+#define BTINTEL_TEST_FW_STAGE_HEADER		1	/* CSS header records */
+#define BTINTEL_TEST_FW_STAGE_PKEY		2	/* Public key records */
+#define BTINTEL_TEST_FW_STAGE_SIGNATURE		3	/* Signature records */
+#define BTINTEL_TEST_FW_STAGE_PAYLOAD		4	/* Command or data records */
+#define BTINTEL_TEST_FW_STAGES			5
+
 /* ============================================================================
  * DATA STRUCTURES FOR IOCTL
  * ============================================================================ */
@@ -44,12 +223,18 @@
  * @buffer_size: Size of internal device buffer
  * @active: Device active status
  * @refcount: Number of open file descriptors
+ * @numa_node: NUMA node of the controller, -1 if unknown
+ * @buffer_node: NUMA node the internal buffer was placed on
+ * @buffer_backing: BTINTEL_TEST_BUF_BACKING_* of the internal buffer
  */
 struct btintel_test_dev_info {
 	u32 version;
 	size_t buffer_size;
 	u8 active;
 	u32 refcount;
+	s32 numa_node;
+	s32 buffer_node;
+	u32 buffer_backing;
 };
 
 /**
@@ -69,17 +254,21 @@ struct btintel_test_stats {
 /**
  * struct btintel_test_buffer_data - Buffer size configuration
  * @size: New buffer size
+ * @flags: BTINTEL_TEST_BUF_HUGE to back the buffer with huge pages when
+ *         @size is a multiple of the huge page size
  * @reserved: Padding for future use
  */
 struct btintel_test_buffer_data {
 	size_t size;
-	u64 reserved;
+	u32 flags;
+	u32 reserved;
 };
 
 /**
  * struct btintel_test_status - Device status
- * @state: Device state flags
- * @error_code: Last error code
+ * @state: BTINTEL_TEST_STATE_* flags
+ * @error_code: errno of the last failed read, write or ioctl since
+ *              BTINTEL_TEST_IOC_RESET_STATS, 0 if none
  * @reserved: Padding for future use
  */
 struct btintel_test_status {
@@ -88,6 +277,1010 @@ struct btintel_test_status {
 	u64 reserved;
 };
 
+/**
+ * struct btintel_test_latency - Latency distribution summary
+ * @samples: Number of samples
+ * @min_ns: Smallest sample
+ * @max_ns: Largest sample
+ * @mean_ns: Arithmetic mean
+ * @p99_ns: 99th percentile, resolved to its histogram bucket
+ * @hist: log2 histogram, see BTINTEL_TEST_HIST_BUCKETS
+ */
+struct btintel_test_latency {
+	u64 samples;
+	u64 min_ns;
+	u64 max_ns;
+	u64 mean_ns;
+	u64 p99_ns;
+	u32 hist[BTINTEL_TEST_HIST_BUCKETS];
+};
+
+/**
+ * struct btintel_test_iso_record - Timeline of one injected packet
+ * @scheduled_ns: Slot the packet was due in (CLOCK_MONOTONIC)
+ * @send_ns: Time the packet was handed to the backend
+ * @complete_ns: Time the backend released the packet, 0 if it never did
+ */
+struct btintel_test_iso_record {
+	u64 scheduled_ns;
+	u64 send_ns;
+	u64 complete_ns;
+};
+
+/**
+ * struct btintel_test_iso_jitter - Periodic SCO/ISO injection benchmark
+ * @backend: BTINTEL_TEST_BACKEND_* to inject into
+ * @hci_index: hciN index for BTINTEL_TEST_BACKEND_HCI_INDEX
+ * @pkt_type: BTINTEL_TEST_ISO_PKT_SCO or BTINTEL_TEST_ISO_PKT_ISO
+ * @handle: Connection handle written into each packet header
+ * @payload_len: Payload bytes per packet
+ * @count: Number of packets to inject
+ * @interval_ns: Injection period, e.g. 7500000 for 7.5ms
+ * @deadline_ns: Allowed send lateness before a slot counts as missed,
+ *               0 means one full interval
+ * @emul_latency_ns: Completion latency of the emulated backend
+ * @emul_jitter_ns: Random latency added on top by the emulated backend
+ * @reserved: Padding for future use
+ * @records: Optional user pointer to @count struct btintel_test_iso_record
+ * @sent: Packets handed to the backend
+ * @completed: Packets released by the backend before the run ended
+ * @missed_deadlines: Packets sent later than @deadline_ns after their slot
+ * @reserved2: Padding for future use
+ * @jitter: Distribution of send time minus scheduled time
+ * @latency: Distribution of completion time minus send time
+ */
+struct btintel_test_iso_jitter {
+	u32 backend;
+	u32 hci_index;
+	u32 pkt_type;
+	u32 handle;
+	u32 payload_len;
+	u32 count;
+	u64 interval_ns;
+	u64 deadline_ns;
+	u64 emul_latency_ns;
+	u32 emul_jitter_ns;
+	u32 reserved;
+	u64 records;
+	u32 sent;
+	u32 completed;
+	u32 missed_deadlines;
+	u32 reserved2;
+	struct btintel_test_latency jitter;
+	struct btintel_test_latency latency;
+};
+
+/**
+ * struct btintel_test_exec_config - Executor worker configuration
+ * @workers: Number of worker threads, 0 for one per CPU in @cpus
+ * @reserved: Padding for future use
+ * @cpus: CPUs the workers are bound to, round robin; empty means all online
+ */
+struct btintel_test_exec_config {
+	u32 workers;
+	u32 reserved;
+	u64 cpus[BTINTEL_TEST_EXEC_CPU_WORDS];
+};
+
+/**
+ * struct btintel_test_job - One test job for the executor
+ * @cookie: Caller-chosen value echoed in the result
+ * @type: BTINTEL_TEST_JOB_*
+ * @backend: BTINTEL_TEST_BACKEND_* the job runs against
+ * @hci_index: hciN index for BTINTEL_TEST_BACKEND_HCI_INDEX
+ * @reserved: Padding for future use
+ * @reg: Register sweep: read @count registers from BAR0 @offset, @stride apart
+ * @buf: Buffer pattern: fill and verify @size bytes @iterations times, at
+ *	most BTINTEL_TEST_JOB_BUF_MAX_ITERATIONS
+ * @hci: HCI batch: send @opcode with @param @count times, at most
+ *	BTINTEL_TEST_JOB_HCI_MAX_COUNT; @flags BTINTEL_TEST_HCI_POLL
+ *	busy-polls for each completion
+ */
+struct btintel_test_job {
+	u64 cookie;
+	u32 type;
+	u32 backend;
+	u32 hci_index;
+	u32 reserved;
+	union {
+		struct {
+			u32 offset;
+			u32 count;
+			u32 stride;
+			u32 reserved;
+		} reg;
+		struct {
+			u32 size;
+			u32 seed;
+			u32 iterations;
+			u32 reserved;
+		} buf;
+		struct {
+			u16 opcode;
+			u8 plen;
+			u8 flags;
+			u32 count;
+			u8 param[BTINTEL_TEST_JOB_HCI_MAX_PARAM];
+		} hci;
+	};
+};
+
+/**
+ * struct btintel_test_job_result - Outcome of one executed job
+ * @cookie: Copied from struct btintel_test_job
+ * @type: Copied from struct btintel_test_job
+ * @status: 0 on success, negative error code on failure
+ * @cpu: CPU the job ran on
+ * @stolen: Non-zero if a worker other than the one it was queued on ran it
+ * @queue_ns: Time from submission to start of execution
+ * @run_ns: Execution time
+ * @ops: Registers read, bytes verified or commands sent
+ * @value: XOR of registers read, mismatching bytes or failed commands
+ */
+struct btintel_test_job_result {
+	u64 cookie;
+	u32 type;
+	s32 status;
+	u32 cpu;
+	u32 stolen;
+	u64 queue_ns;
+	u64 run_ns;
+	u64 ops;
+	u64 value;
+};
+
+/**
+ * struct btintel_test_exec_submit - Queue a list of jobs
+ * @jobs: User pointer to @count struct btintel_test_job
+ * @count: Number of jobs
+ * @pending: Jobs queued or awaiting collection after this submission
+ */
+struct btintel_test_exec_submit {
+	u64 jobs;
+	u32 count;
+	u32 pending;
+};
+
+/**
+ * struct btintel_test_exec_collect - Fetch results of finished jobs
+ * @results: User pointer to room for @max struct btintel_test_job_result
+ * @max: Capacity of @results
+ * @flags: BTINTEL_TEST_EXEC_WAIT to block until a result is available
+ * @count: Results returned, in completion order
+ * @pending: Jobs still queued, running or awaiting collection
+ */
+struct btintel_test_exec_collect {
+	u64 results;
+	u32 max;
+	u32 flags;
+	u32 count;
+	u32 pending;
+};
+
+/**
+ * struct btintel_test_hci_pipeline - Pipelined HCI command benchmark
+ * @backend: BTINTEL_TEST_BACKEND_* to send the commands to
+ * @hci_index: hciN index for BTINTEL_TEST_BACKEND_HCI_INDEX
+ * @opcode: HCI opcode sent repeatedly
+ * @plen: Parameter length
+ * @flags: BTINTEL_TEST_HCI_POLL to spin for up to
+ *         BTINTEL_TEST_POLL_DEFAULT_BUDGET_NS on each completion before
+ *         sleeping
+ * @depth: Commands kept outstanding at most, further limited by credits
+ * @count: Number of commands to complete
+ * @param: Command parameters
+ * @emul_latency_ns: Response delay of the emulated backend
+ * @emul_jitter_ns: Random delay added on top by the emulated backend
+ * @emul_credits: Command credits the emulated backend advertises
+ * @completed: Commands answered by Command Complete or Command Status
+ * @errors: Commands answered with a non-zero status
+ * @max_outstanding: Highest number of commands in flight at once
+ * @max_credits: Highest credit count the controller advertised
+ * @polled: Completions caught while busy-polling
+ * @poll_fallbacks: Busy-polls that ran out of budget and slept
+ * @elapsed_ns: Time from first submission to last completion
+ * @cmds_per_sec: Achieved completion rate
+ * @starved_ns: Time spent with commands ready but no credit to send them
+ * @avg_outstanding_milli: Time-weighted mean commands in flight, x1000
+ * @latency: Per-command submission to completion latency
+ */
+struct btintel_test_hci_pipeline {
+	u32 backend;
+	u32 hci_index;
+	u16 opcode;
+	u8 plen;
+	u8 flags;
+	u32 depth;
+	u32 count;
+	u8 param[BTINTEL_TEST_JOB_HCI_MAX_PARAM];
+	u64 emul_latency_ns;
+	u32 emul_jitter_ns;
+	u32 emul_credits;
+	u32 completed;
+	u32 errors;
+	u32 max_outstanding;
+	u32 max_credits;
+	u32 polled;
+	u32 poll_fallbacks;
+	u64 elapsed_ns;
+	u64 cmds_per_sec;
+	u64 starved_ns;
+	u64 avg_outstanding_milli;
+	struct btintel_test_latency latency;
+};
+
+/**
+ * struct btintel_test_dump_block - Block header of an LZ4 dump stream
+ * @raw_len: Bytes of controller memory the block covers
+ * @stored_len: Bytes following the header; equal to @raw_len when the
+ *              block did not compress and is stored as is
+ */
+struct btintel_test_dump_block {
+	u32 raw_len;
+	u32 stored_len;
+};
+
+/**
+ * struct btintel_test_mem_dump - Capture a controller memory region
+ * @source: BTINTEL_TEST_DUMP_SRC_EMUL. BTINTEL_TEST_DUMP_SRC_BAR fails with
+ *          EOPNOTSUPP: BAR0 is CSR space, where reads have side effects
+ * @flags: BTINTEL_TEST_DUMP_LZ4 for a stream of LZ4 blocks, raw otherwise
+ * @address: Start of the region, 4-byte aligned
+ * @length: Bytes to capture, 4-byte multiple up to BTINTEL_TEST_DUMP_MAX_SIZE
+ * @chunk_size: Bytes read per access burst, 0 for PAGE_SIZE
+ * @emul_chunk_delay_ns: Access time per chunk of the emulated region, up
+ *                       to BTINTEL_TEST_DUMP_MAX_CHUNK_DELAY_NS
+ * @fd: Read-only file the stream can be read or mmapped from
+ * @chunks: Access bursts issued
+ * @reserved: Padding for future use
+ * @stream_size: Bytes readable from @fd
+ * @capture_ns: Time spent reading controller memory
+ * @compress_ns: Time spent compressing
+ */
+struct btintel_test_mem_dump {
+	u32 source;
+	u32 flags;
+	u64 address;
+	u32 length;
+	u32 chunk_size;
+	u32 emul_chunk_delay_ns;
+	s32 fd;
+	u32 chunks;
+	u32 reserved;
+	u64 stream_size;
+	u64 capture_ns;
+	u64 compress_ns;
+};
+
+/**
+ * struct btintel_test_reset_cycle - Reset/recovery cycle stress parameters
+ * @backend: BTINTEL_TEST_BACKEND_HW or BTINTEL_TEST_BACKEND_EMUL
+ * @cycles: Number of reset cycles to run
+ * @poll_ns: Stage polling period, 0 for 100 us; bounds stage resolution
+ * @timeout_ms: Time a cycle may take to reach READY, 0 for 10 s
+ * @settle_ms: Pause between a READY and the next reset
+ * @emul_jitter_ns: Random delay added to each scripted stage delay
+ * @emul_stage_delay_ns: Scripted delay of each stage after the previous
+ *                       one, indexed by BTINTEL_TEST_RESET_STAGE_*
+ * @completed: Cycles that reached READY
+ * @timeouts: Cycles that did not reach READY within @timeout_ms
+ * @stage: Time from the previously observed stage (or from the reset
+ *         for DOWN) to each stage, over the completed cycles. A stage
+ *         missed by the poller contributes no sample.
+ * @total: Time from the reset to READY
+ */
+struct btintel_test_reset_cycle {
+	u32 backend;
+	u32 cycles;
+	u32 poll_ns;
+	u32 timeout_ms;
+	u32 settle_ms;
+	u32 emul_jitter_ns;
+	u32 emul_stage_delay_ns[BTINTEL_TEST_RESET_STAGES];
+	u32 completed;
+	u32 timeouts;
+	struct btintel_test_latency stage[BTINTEL_TEST_RESET_STAGES];
+	struct btintel_test_latency total;
+};
+
+/**
+ * struct btintel_test_reset_cycle_v2 - Reset cycle stress with run flags
+ * @cycle: As for BTINTEL_TEST_IOC_RESET_CYCLE
+ * @flags: Out: BTINTEL_TEST_RESET_NO_BOOT_STAGE if the boot stage register
+ *         is not known to this build, so only DOWN and READY are timed;
+ *         BTINTEL_TEST_RESET_IRQ_PAUSED if the IRQ monitor was attached to
+ *         the MSI-X vectors and was stopped for the run, then restarted
+ *         with cleared counters
+ * @reserved: Padding for future use
+ */
+struct btintel_test_reset_cycle_v2 {
+	struct btintel_test_reset_cycle cycle;
+	u32 flags;
+	u32 reserved;
+};
+
+/**
+ * struct btintel_test_fw_load - Load a firmware image through the cache
+ * @name: Firmware file name, NUL terminated, as for request_firmware()
+ * @flags: BTINTEL_TEST_FW_DOWNLOAD and/or BTINTEL_TEST_FW_NOCACHE
+ * @backend: Download target, BTINTEL_TEST_BACKEND_HCI_INDEX or
+ *           BTINTEL_TEST_BACKEND_EMUL
+ * @hci_index: hciN index for BTINTEL_TEST_BACKEND_HCI_INDEX; a virtual
+ *             controller, or one up and waiting in its bootloader
+ * @emul_latency_ns: Response delay of the emulated download target
+ * @hit: Image was served from the cache
+ * @format: BTINTEL_TEST_FW_FMT_* the image was parsed as
+ * @size: Image size in bytes
+ * @fragments: Secure send commands a download of the image takes
+ * @load_ns: Time to obtain the parsed image, lookup or load plus parse
+ * @parse_ns: Part of @load_ns spent parsing, 0 on a hit
+ * @download_ns: Time to download the image to the target
+ */
+struct btintel_test_fw_load {
+	char name[BTINTEL_TEST_FW_NAME_MAX];
+	u32 flags;
+	u32 backend;
+	u32 hci_index;
+	u32 emul_latency_ns;
+	u32 hit;
+	u32 format;
+	u32 size;
+	u32 fragments;
+	u64 load_ns;
+	u64 parse_ns;
+	u64 download_ns;
+};
+
+/**
+ * struct btintel_test_fw_cache_stats - Firmware image cache counters
+ * @hits: Loads served from the cache
+ * @misses: Loads that went to the filesystem
+ * @evictions: Images dropped to stay within @max_bytes
+ * @bytes: Memory held by cached images
+ * @max_bytes: Cache bound, set by the fw_cache_kb module parameter
+ * @entries: Images currently cached
+ * @reserved: Padding for future use
+ * @hit_latency: Load time of hits
+ * @miss_latency: Load time of misses, filesystem and parsing included
+ */
+struct btintel_test_fw_cache_stats {
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+	u64 bytes;
+	u64 max_bytes;
+	u32 entries;
+	u32 reserved;
+	struct btintel_test_latency hit_latency;
+	struct btintel_test_latency miss_latency;
+};
+
+/**
+ * struct btintel_test_pm_cycle - Power-state transition measurement
+ * @backend: BTINTEL_TEST_BACKEND_HW or BTINTEL_TEST_BACKEND_EMUL
+ * @mode: BTINTEL_TEST_PM_RUNTIME or BTINTEL_TEST_PM_D3HOT
+ * @cycles: Number of suspend/resume cycles
+ * @dwell_us: Time spent suspended in each cycle
+ * @emul_suspend_ns: Suspend time of the emulated backend
+ * @emul_resume_ns: Resume time of the emulated backend
+ * @emul_jitter_ns: Random time added to each emulated transition
+ * @emul_fail_pct: Percentage of emulated suspends that fail
+ * @completed: Cycles that suspended and resumed
+ * @suspend_failures: Suspends that failed or left the device active
+ * @resume_failures: Resumes that failed; the run stops at the first one
+ *                   and the ioctl fails with its error, these counters
+ *                   still filled in
+ * @reserved: Padding for future use
+ * @suspend: Time to enter the low-power state
+ * @resume: Time to return to D0 / RPM_ACTIVE
+ * @cycle: Suspend plus resume, dwell excluded
+ */
+struct btintel_test_pm_cycle {
+	u32 backend;
+	u32 mode;
+	u32 cycles;
+	u32 dwell_us;
+	u32 emul_suspend_ns;
+	u32 emul_resume_ns;
+	u32 emul_jitter_ns;
+	u32 emul_fail_pct;
+	u32 completed;
+	u32 suspend_failures;
+	u32 resume_failures;
+	u32 reserved;
+	struct btintel_test_latency suspend;
+	struct btintel_test_latency resume;
+	struct btintel_test_latency cycle;
+};
+
+/**
+ * struct btintel_test_irq_monitor - Start or stop interrupt instrumentation
+ * @enable: Non-zero to start, zero to stop and detach
+ * @flags: BTINTEL_TEST_IRQ_HW to also instrument the controller's MSI-X
+ *         vectors; needs a driver that requested them with IRQF_SHARED
+ */
+struct btintel_test_irq_monitor {
+	u32 enable;
+	u32 flags;
+};
+
+/**
+ * struct btintel_test_irq_inject - Inject interrupts on one vector
+ * @vector: Index into struct btintel_test_irq_stats.vectors
+ * @count: Interrupts to inject, one at a time
+ * @interval_ns: Pause between a handled interrupt and the next injection
+ * @cpu: CPU to raise the software vector on, -1 for the current one;
+ *       MSI-X vectors are delivered according to their affinity
+ * @delivered: Injections that reached the handler
+ * @lost: Injections not handled within 100 ms
+ */
+struct btintel_test_irq_inject {
+	u32 vector;
+	u32 count;
+	u32 interval_ns;
+	s32 cpu;
+	u32 delivered;
+	u32 lost;
+};
+
+/**
+ * struct btintel_test_irq_vector - Counters of one instrumented vector
+ * @kind: BTINTEL_TEST_IRQ_VEC_*
+ * @irq: Linux interrupt number, 0 for the software vector
+ * @index: MSI-X table index
+ * @reserved: Padding for future use
+ * @count: Interrupts seen since the monitor was started
+ * @rate: Interrupts per second over the last sampling window
+ * @latency: Injection to handler latency of injected interrupts
+ * @interval: Time between consecutive interrupts
+ */
+struct btintel_test_irq_vector {
+	u32 kind;
+	u32 irq;
+	u32 index;
+	u32 reserved;
+	u64 count;
+	u64 rate;
+	struct btintel_test_latency latency;
+	struct btintel_test_latency interval;
+};
+
+/**
+ * struct btintel_test_irq_stats - Snapshot of the interrupt counters
+ * @nr_vectors: Valid entries in @vectors
+ * @reset: In: clear the distributions after taking the snapshot
+ * @window_ns: Sampling window of the rates, since the previous snapshot
+ * @vectors: Per-vector counters, the software vector first
+ */
+struct btintel_test_irq_stats {
+	u32 nr_vectors;
+	u32 reset;
+	u64 window_ns;
+	struct btintel_test_irq_vector vectors[BTINTEL_TEST_IRQ_MAX_VECTORS];
+};
+
+/**
+ * struct btintel_test_hci_poll - Sleeping vs busy-polling completion waits
+ * @backend: BTINTEL_TEST_BACKEND_*
+ * @hci_index: hciN index for BTINTEL_TEST_BACKEND_HCI_INDEX
+ * @opcode: HCI opcode to send
+ * @plen: Parameter length
+ * @reserved: Padding for future use
+ * @count: Commands to send per path
+ * @param: Command parameters
+ * @busy_poll_ns: Time the polling path spins before it falls back to
+ *                sleeping, up to BTINTEL_TEST_POLL_MAX_BUDGET_NS
+ * @emul_jitter_ns: Random delay added on top by the emulated backend
+ * @emul_latency_ns: Response delay of the emulated backend
+ * @polled: Completions the polling path caught within its budget
+ * @poll_fallbacks: Polling waits that ran out of budget and slept
+ * @errors: Commands answered with a non-zero status
+ * @reserved2: Padding for future use
+ * @sleep: Submission to wake-up latency of the sleeping path
+ * @poll: Submission to wake-up latency of the polling path
+ */
+struct btintel_test_hci_poll {
+	u32 backend;
+	u32 hci_index;
+	u16 opcode;
+	u8 plen;
+	u8 reserved;
+	u32 count;
+	u8 param[BTINTEL_TEST_JOB_HCI_MAX_PARAM];
+	u32 busy_poll_ns;
+	u32 emul_jitter_ns;
+	u64 emul_latency_ns;
+	u32 polled;
+	u32 poll_fallbacks;
+	u32 errors;
+	u32 reserved2;
+	struct btintel_test_latency sleep;
+	struct btintel_test_latency poll;
+};
+
+/**
+ * struct btintel_test_numa_node - Override the node device memory lives on
+ * @node: NUMA node, or -1 to follow the controller's node
+ * @reserved: Padding for future use
+ */
+struct btintel_test_numa_node {
+	s32 node;
+	u32 reserved;
+};
+
+/**
+ * struct btintel_test_numa_result - Bandwidth of one node's memory
+ * @node: Node the buffer was requested on
+ * @placed: Node the buffer's first page actually landed on
+ * @read_ns: Time of all read passes
+ * @write_ns: Time of all write passes
+ */
+struct btintel_test_numa_result {
+	s32 node;
+	s32 placed;
+	u64 read_ns;
+	u64 write_ns;
+};
+
+/**
+ * struct btintel_test_numa_bench - Local vs remote memory benchmark
+ * @size: Buffer size per node, up to BTINTEL_TEST_NUMA_BENCH_MAX_SIZE
+ * @passes: Read and write passes over each buffer, up to
+ *          BTINTEL_TEST_NUMA_BENCH_MAX_PASSES
+ * @nr_nodes: Valid entries in @nodes, one per online node
+ * @cpu_node: Node of the CPU the benchmark started on; pin the caller to
+ *            choose it
+ * @dev_node: Node of the controller, -1 if unknown
+ * @reserved: Padding for future use
+ * @nodes: Per-node results
+ */
+struct btintel_test_numa_bench {
+	u32 size;
+	u32 passes;
+	u32 nr_nodes;
+	s32 cpu_node;
+	s32 dev_node;
+	u32 reserved;
+	struct btintel_test_numa_result nodes[BTINTEL_TEST_NUMA_MAX_NODES];
+};
+
+/**
+ * struct btintel_test_buf_bench_result - Access times of one buffer backing
+ * @backing: BTINTEL_TEST_BUF_BACKING_* the buffer ended up with
+ * @reserved: Padding for future use
+ * @seq_read_ns: Time of all sequential read passes
+ * @seq_write_ns: Time of all sequential write passes
+ * @rand_read_ns: Time of all random 8-byte reads
+ */
+struct btintel_test_buf_bench_result {
+	u32 backing;
+	u32 reserved;
+	u64 seq_read_ns;
+	u64 seq_write_ns;
+	u64 rand_read_ns;
+};
+
+/**
+ * struct btintel_test_buf_bench - Base page vs huge page buffer benchmark
+ * @size: Buffer size, a multiple of the huge page size, up to
+ *        BTINTEL_TEST_BUF_BENCH_MAX_SIZE
+ * @passes: Sequential read and write passes, up to
+ *          BTINTEL_TEST_BUF_BENCH_MAX_PASSES
+ * @random: Random reads, up to BTINTEL_TEST_BUF_BENCH_MAX_RANDOM
+ * @huge_size: Huge page size of the kernel
+ * @base: Buffer of base pages
+ * @huge: Buffer of huge pages, or the fallback if none were available
+ */
+struct btintel_test_buf_bench {
+	u32 size;
+	u32 passes;
+	u32 random;
+	u32 huge_size;
+	struct btintel_test_buf_bench_result base;
+	struct btintel_test_buf_bench_result huge;
+};
+
+/**
+ * struct btintel_test_ioctl_cost - Cost of one ioctl command
+ * @name: Command name without the BTINTEL_TEST_IOC_ prefix, empty for
+ *        unused numbers
+ * @calls: Times the command ran
+ * @errors: Times it returned an error
+ * @total_ns: Time spent in it, summed over all calls
+ * @max_ns: Longest single call
+ */
+struct btintel_test_ioctl_cost {
+	char name[BTINTEL_TEST_IOC_NAME_LEN];
+	u64 calls;
+	u64 errors;
+	u64 total_ns;
+	u64 max_ns;
+};
+
+/**
+ * struct btintel_test_ioctl_stats - Per-command ioctl accounting
+ * @flags: BTINTEL_TEST_IOCTL_STATS_RESET to clear the counters once read
+ * @nr_cmds: Valid entries in @cmds, indexed by ioctl number
+ * @cmds: Per-command costs
+ */
+struct btintel_test_ioctl_stats {
+	u32 flags;
+	u32 nr_cmds;
+	struct btintel_test_ioctl_cost cmds[BTINTEL_TEST_IOC_MAX_NR];
+};
+
+/**
+ * struct btintel_test_trace - Control and read the instrumentation points
+ * @flags: BTINTEL_TEST_TRACE_ENABLE or _DISABLE, optionally with _RESET,
+ *         applied after the current samples are returned
+ * @enabled: Whether the points were enabled when the samples were taken
+ * @points: Duration of each instrumented path, see BTINTEL_TEST_TRACE_*
+ */
+struct btintel_test_trace {
+	u32 flags;
+	u32 enabled;
+	struct btintel_test_latency points[BTINTEL_TEST_TRACE_POINTS];
+};
+
+/**
+ * struct btintel_test_trace_bench - Cost of one instrumentation point
+ * @loops: Iterations of each loop, up to BTINTEL_TEST_TRACE_BENCH_MAX_LOOPS
+ * @reserved: Padding for future use
+ * @bare_ns: Time of a loop without a point
+ * @off_ns: Time of the same loop with a disabled point
+ * @on_ns: Time of the same loop with an enabled point
+ *
+ * The points are toggled for the measurement and restored afterwards.
+ */
+struct btintel_test_trace_bench {
+	u32 loops;
+	u32 reserved;
+	u64 bare_ns;
+	u64 off_ns;
+	u64 on_ns;
+};
+
+/**
+ * struct btintel_test_perf_run - Run one ioctl under performance counters
+ * @cmd: Ioctl command to run, any but BTINTEL_TEST_IOC_PERF_RUN
+ * @ret: What @cmd returned, 0 or a negative error code
+ * @arg: Argument of @cmd, usually a pointer to its request structure
+ * @valid: Bit per BTINTEL_TEST_PERF_* counter that could be opened;
+ *         hardware counters are missing on machines without a usable PMU
+ * @multiplexed: Bit per counter that shared the PMU and was scaled up
+ * @counts: Counter values over the run of @cmd, for the calling task only;
+ *          work @cmd hands to other threads is not included
+ */
+struct btintel_test_perf_run {
+	u32 cmd;
+	s32 ret;
+	u64 arg;
+	u32 valid;
+	u32 multiplexed;
+	u64 counts[BTINTEL_TEST_PERF_COUNTERS];
+};
+
+/**
+ * struct btintel_test_sample - Counters over one sampling period
+ * @seq: Sequence number, counting from 0 since the last reset
+ * @timestamp_ns: CLOCK_MONOTONIC time the sample was taken
+ * @interval_ns: Time since the previous sample; longer than the period
+ *               when the timer ran late
+ * @reads: Read operations in the interval
+ * @writes: Write operations in the interval
+ * @ioctls: Ioctl operations in the interval
+ * @errors: Errors in the interval
+ * @read_bytes: Bytes read in the interval
+ * @write_bytes: Bytes written in the interval
+ * @hci_cmds: HCI commands completed in the interval, on any backend
+ * @hci_mean_ns: Mean latency of those commands
+ * @hci_max_ns: Worst latency of those commands
+ */
+struct btintel_test_sample {
+	u64 seq;
+	u64 timestamp_ns;
+	u64 interval_ns;
+	u64 reads;
+	u64 writes;
+	u64 ioctls;
+	u64 errors;
+	u64 read_bytes;
+	u64 write_bytes;
+	u64 hci_cmds;
+	u64 hci_mean_ns;
+	u64 hci_max_ns;
+};
+
+/**
+ * struct btintel_test_sampler - Control the time-series stats sampler
+ * @flags: BTINTEL_TEST_SAMPLER_START or _STOP, optionally with _RESET;
+ *         0 only reports the state
+ * @period_us: Sampling period for _START, between
+ *             BTINTEL_TEST_SAMPLER_MIN_PERIOD_US and _MAX_PERIOD_US;
+ *             returns the current period
+ * @running: Returns whether the sampler is running
+ * @capacity: Returns the number of samples the history holds
+ * @next_seq: Returns the sequence number of the next sample
+ */
+struct btintel_test_sampler {
+	u32 flags;
+	u32 period_us;
+	u32 running;
+	u32 capacity;
+	u64 next_seq;
+};
+
+/**
+ * struct btintel_test_sampler_read - Read samples from the history
+ * @seq: First sequence number wanted; returns the sequence number to ask
+ *       for next time
+ * @samples: User pointer to an array of struct btintel_test_sample
+ * @count: Entries in @samples; returns the number filled in
+ * @reserved: Padding for future use
+ * @lost: Returns how many wanted samples were already overwritten
+ */
+struct btintel_test_sampler_read {
+	u64 seq;
+	u64 samples;
+	u32 count;
+	u32 reserved;
+	u64 lost;
+};
+
+/**
+ * struct btintel_test_replay_hdr - Header of an HCI replay script
+ * @magic: BTINTEL_TEST_REPLAY_MAGIC
+ * @count: Number of commands that follow
+ *
+ * A script is this header followed by @count commands, each a struct
+ * btintel_test_replay_cmd immediately followed by its parameter bytes.
+ * Commands are packed back to back without padding and every field is
+ * little endian.
+ */
+struct btintel_test_replay_hdr {
+	u32 magic;
+	u32 count;
+};
+
+/**
+ * struct btintel_test_replay_cmd - One command of an HCI replay script
+ * @opcode: HCI opcode
+ * @plen: Number of parameter bytes following this structure
+ * @status: Command Complete status the capture saw, or
+ *          BTINTEL_TEST_REPLAY_ANY_STATUS
+ * @delay_us: Time from the previous command's scheduled send to this one's,
+ *            up to BTINTEL_TEST_REPLAY_MAX_DELAY_US
+ */
+struct btintel_test_replay_cmd {
+	u16 opcode;
+	u8 plen;
+	u8 status;
+	u32 delay_us;
+};
+
+/**
+ * struct btintel_test_replay_result - Outcome of one replayed command
+ * @opcode: HCI opcode
+ * @expected: Status from the script
+ * @status: Status the controller returned, 0xff if it did not answer
+ * @error: 0, or the negative error code of a failed round trip
+ * @due_ns: Time the command was scheduled for, from the start of the replay
+ * @lag_ns: How late the command was sent compared to @due_ns
+ * @latency_ns: Send to Command Complete latency
+ */
+struct btintel_test_replay_result {
+	u16 opcode;
+	u8 expected;
+	u8 status;
+	s32 error;
+	u64 due_ns;
+	u64 lag_ns;
+	u64 latency_ns;
+};
+
+/**
+ * struct btintel_test_hci_replay - Replay a captured HCI command sequence
+ * @backend: BTINTEL_TEST_BACKEND_*
+ * @hci_index: hciN index for BTINTEL_TEST_BACKEND_HCI_INDEX
+ * @script: User pointer to the script, see struct btintel_test_replay_hdr
+ * @script_len: Script size in bytes, up to BTINTEL_TEST_REPLAY_MAX_SCRIPT
+ * @flags: BTINTEL_TEST_REPLAY_FAST, BTINTEL_TEST_REPLAY_STOP
+ * @results: Optional user pointer to an array of struct
+ *           btintel_test_replay_result, one per command
+ * @max_results: Entries in @results
+ * @emul_jitter_ns: Random delay added on top by the emulated backend
+ * @emul_latency_ns: Response delay of the emulated backend
+ * @executed: Commands sent
+ * @divergences: Commands whose status differed from the script, or that
+ *               got no answer
+ * @first_divergence: Index of the first divergent command, U32_MAX if none
+ * @reserved: Padding for future use
+ * @script_ns: Duration of the original capture, the sum of the delays
+ * @elapsed_ns: Duration of the replay
+ * @max_lag_ns: Worst lateness of a send against its schedule
+ * @latency: Send to Command Complete latency
+ * @lag: Lateness of each send against its schedule; a command is late when
+ *       the previous one took longer than the recorded gap
+ */
+struct btintel_test_hci_replay {
+	u32 backend;
+	u32 hci_index;
+	u64 script;
+	u32 script_len;
+	u32 flags;
+	u64 results;
+	u32 max_results;
+	u32 emul_jitter_ns;
+	u64 emul_latency_ns;
+	u32 executed;
+	u32 divergences;
+	u32 first_divergence;
+	u32 reserved;
+	u64 script_ns;
+	u64 elapsed_ns;
+	u64 max_lag_ns;
+	struct btintel_test_latency latency;
+	struct btintel_test_latency lag;
+};
+
+/**
+ * struct btintel_test_dma_bench - Run the DMA descriptor ring benchmark
+ * @direction: BTINTEL_TEST_DMA_TX or BTINTEL_TEST_DMA_RX
+ * @flags: BTINTEL_TEST_DMA_MAP_EACH to map and unmap every data buffer
+ *         around its transfer; otherwise the buffers are mapped once and
+ *         only synced per transfer
+ * @ring_size: Descriptors in the ring, a power of two up to
+ *             BTINTEL_TEST_DMA_MAX_RING
+ * @batch: Descriptors posted per doorbell, up to @ring_size
+ * @buf_size: Bytes per descriptor, up to BTINTEL_TEST_DMA_MAX_BUF
+ * @count: Descriptors to transfer
+ * @emul_latency_ns: Completion latency of the emulated DMA engine after the
+ *                   doorbell; with no latency and no jitter descriptors
+ *                   complete within the doorbell
+ * @emul_jitter_ns: Random delay added on top
+ * @reserved: Padding for future use
+ * @completed: Descriptors completed successfully
+ * @errors: Descriptors completed with a bad status, length or data
+ * @max_inflight: Most descriptors posted and not yet reaped
+ * @ring_full: Batches that had to wait for free descriptors
+ * @setup_ns: Time to allocate the ring and buffers and pre-map the buffers
+ * @elapsed_ns: First post to last reap
+ * @bytes_per_sec: Payload throughput
+ * @map_ns: Time spent mapping, unmapping or syncing data buffers
+ * @map_calls: DMA API calls @map_ns covers
+ * @latency: Post to reap latency of each descriptor
+ */
+struct btintel_test_dma_bench {
+	u32 direction;
+	u32 flags;
+	u32 ring_size;
+	u32 batch;
+	u32 buf_size;
+	u32 count;
+	u64 emul_latency_ns;
+	u32 emul_jitter_ns;
+	u32 reserved;
+	u32 completed;
+	u32 errors;
+	u32 max_inflight;
+	u32 ring_full;
+	u64 setup_ns;
+	u64 elapsed_ns;
+	u64 bytes_per_sec;
+	u64 map_ns;
+	u64 map_calls;
+	struct btintel_test_latency latency;
+};
+
+/**
+ * struct btintel_test_rsp_cache - Configure and read the HCI response cache
+ * @flags: BTINTEL_TEST_RSP_CACHE_SET and/or BTINTEL_TEST_RSP_CACHE_RESET;
+ *         0 only reads the counters
+ * @nr_opcodes: In with BTINTEL_TEST_RSP_CACHE_SET: entries of @opcodes to
+ *              cache, 0 disables the cache. Out: size of the current set
+ * @opcodes: Opcodes whose successful responses are cached. Only read-only
+ *           queries belong here: a cached command never reaches the
+ *           controller
+ * @hits: Commands answered from the cache
+ * @misses: Commands of a cached opcode sent to the controller
+ * @invalidations: Times cached responses were dropped by a reset, a
+ *                 firmware download, a controller coming up, going down
+ *                 or away, or BTINTEL_TEST_IOC_RSP_CACHE_FLUSH
+ * @evictions: Responses dropped to stay within
+ *             BTINTEL_TEST_RSP_CACHE_MAX_ENTRIES
+ * @entries: Responses currently cached
+ * @reserved: Padding for future use
+ * @hit_latency: Time to answer a hit
+ * @miss_latency: Round trip of a miss
+ */
+struct btintel_test_rsp_cache {
+	u32 flags;
+	u32 nr_opcodes;
+	u16 opcodes[BTINTEL_TEST_RSP_CACHE_MAX_OPCODES];
+	u64 hits;
+	u64 misses;
+	u64 invalidations;
+	u64 evictions;
+	u32 entries;
+	u32 reserved;
+	struct btintel_test_latency hit_latency;
+	struct btintel_test_latency miss_latency;
+};
+
+/**
+ * struct btintel_test_fw_sweep_result - Outcome of one sweep configuration
+ * @chunk: Secure send payload bytes per command
+ * @depth: Secure send commands kept in flight
+ * @downloads: Downloads that completed
+ * @errors: Secure send commands the target failed
+ * @commands: Secure send commands one download takes
+ * @max_outstanding: Most commands in flight at once, bounded by the
+ *                   target's credits as well as @depth
+ * @total_ns: Mean time of one download, image load included
+ * @bytes_per_sec: Image bytes downloaded per second over @total_ns
+ * @stage_ns: Mean time of each BTINTEL_TEST_FW_STAGE_*
+ */
+struct btintel_test_fw_sweep_result {
+	u32 chunk;
+	u32 depth;
+	u32 downloads;
+	u32 errors;
+	u32 commands;
+	u32 max_outstanding;
+	u64 total_ns;
+	u64 bytes_per_sec;
+	u64 stage_ns[BTINTEL_TEST_FW_STAGES];
+};
+
+/**
+ * struct btintel_test_fw_sweep - Download an image over a grid of chunk
+ * sizes and pipelining depths
+ * @name: Firmware file name, NUL terminated, as for request_firmware()
+ * @backend: BTINTEL_TEST_BACKEND_HCI_INDEX or BTINTEL_TEST_BACKEND_EMUL
+ * @hci_index: hciN index for BTINTEL_TEST_BACKEND_HCI_INDEX; the
+ *             controller must be up and waiting in its bootloader. Only
+ *             the first download after boot is valid, so this backend
+ *             takes one configuration and a @repeat of 1
+ * @flags: BTINTEL_TEST_FW_NOCACHE to load the image afresh every download
+ * @repeat: Downloads per configuration
+ * @nr_chunks: Entries in @chunks
+ * @nr_depths: Entries in @depths
+ * @chunks: Payload bytes per command to try, up to BTINTEL_TEST_FW_FRAG_MAX
+ * @depths: Commands in flight to try, up to BTINTEL_TEST_PIPE_MAX_DEPTH
+ * @emul_latency_ns: Time the emulated target takes to process a command
+ * @emul_bytes_per_sec: Bandwidth of the emulated link, which carries one
+ *                      command at a time; 0 for unlimited
+ * @emul_jitter_ns: Random processing delay on top of @emul_latency_ns
+ * @emul_credits: Commands the emulated target accepts at once, 0 for 1
+ * @results: User pointer to @nr_chunks * @nr_depths
+ *           struct btintel_test_fw_sweep_result, chunk-major
+ * @best: Out: index in @results of the fastest configuration that
+ *        completed every download without errors, -1 if none did
+ * @size: Out: image size in bytes
+ * @format: Out: BTINTEL_TEST_FW_FMT_* the image was parsed as
+ * @reserved: Padding for future use
+ */
+struct btintel_test_fw_sweep {
+	char name[BTINTEL_TEST_FW_NAME_MAX];
+	u32 backend;
+	u32 hci_index;
+	u32 flags;
+	u32 repeat;
+	u32 nr_chunks;
+	u32 nr_depths;
+	u32 chunks[BTINTEL_TEST_FW_SWEEP_MAX_CHUNKS];
+	u32 depths[BTINTEL_TEST_FW_SWEEP_MAX_DEPTHS];
+	u64 emul_latency_ns;
+	u64 emul_bytes_per_sec;
+	u32 emul_jitter_ns;
+	u32 emul_credits;
+	u64 results;
+	s32 best;
+	u32 size;
+	u32 format;
+	u32 reserved;
+};
+
 /* ============================================================================
  * IOCTL COMMAND DEFINITIONS
  * ============================================================================ */
@@ -156,6 +1349,247 @@ struct btintel_test_status {
 #define BTINTEL_TEST_IOC_DISABLE \
 	_IO(BTINTEL_TEST_IOC_MAGIC, 7)
 
+/**
+ * BTINTEL_TEST_IOC_ISO_JITTER - Run periodic SCO/ISO injection benchmark
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_iso_jitter
+ */
+#define BTINTEL_TEST_IOC_ISO_JITTER \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 8, struct btintel_test_iso_jitter)
+
+/**
+ * BTINTEL_TEST_IOC_EXEC_CONFIG - Set executor worker count and affinity
+ * Type: Write (IOW)
+ * Argument: pointer to struct btintel_test_exec_config
+ */
+#define BTINTEL_TEST_IOC_EXEC_CONFIG \
+	_IOW(BTINTEL_TEST_IOC_MAGIC, 9, struct btintel_test_exec_config)
+
+/**
+ * BTINTEL_TEST_IOC_EXEC_SUBMIT - Queue test jobs on the executor
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_exec_submit
+ */
+#define BTINTEL_TEST_IOC_EXEC_SUBMIT \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 10, struct btintel_test_exec_submit)
+
+/**
+ * BTINTEL_TEST_IOC_EXEC_COLLECT - Collect results of finished jobs
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_exec_collect
+ */
+#define BTINTEL_TEST_IOC_EXEC_COLLECT \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 11, struct btintel_test_exec_collect)
+
+/**
+ * BTINTEL_TEST_IOC_HCI_PIPELINE - Run pipelined HCI command benchmark
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_hci_pipeline
+ */
+#define BTINTEL_TEST_IOC_HCI_PIPELINE \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 12, struct btintel_test_hci_pipeline)
+
+/**
+ * BTINTEL_TEST_IOC_MEM_DUMP - Capture controller memory into a stream
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_mem_dump
+ */
+#define BTINTEL_TEST_IOC_MEM_DUMP \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 13, struct btintel_test_mem_dump)
+
+/**
+ * BTINTEL_TEST_IOC_RESET_CYCLE - Run the reset/recovery cycle stress
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_reset_cycle
+ */
+#define BTINTEL_TEST_IOC_RESET_CYCLE \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 14, struct btintel_test_reset_cycle)
+
+/**
+ * BTINTEL_TEST_IOC_FW_LOAD - Load, and optionally download, a firmware image
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_fw_load
+ */
+#define BTINTEL_TEST_IOC_FW_LOAD \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 15, struct btintel_test_fw_load)
+
+/**
+ * BTINTEL_TEST_IOC_FW_CACHE_STATS - Get firmware image cache counters
+ * Type: Read (IOR)
+ * Argument: pointer to struct btintel_test_fw_cache_stats
+ */
+#define BTINTEL_TEST_IOC_FW_CACHE_STATS \
+	_IOR(BTINTEL_TEST_IOC_MAGIC, 16, struct btintel_test_fw_cache_stats)
+
+/**
+ * BTINTEL_TEST_IOC_FW_CACHE_FLUSH - Drop every cached firmware image
+ * Type: None (IO)
+ * Argument: none
+ */
+#define BTINTEL_TEST_IOC_FW_CACHE_FLUSH \
+	_IO(BTINTEL_TEST_IOC_MAGIC, 17)
+
+/**
+ * BTINTEL_TEST_IOC_PM_CYCLE - Measure suspend/resume transition latency
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_pm_cycle
+ */
+#define BTINTEL_TEST_IOC_PM_CYCLE \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 18, struct btintel_test_pm_cycle)
+
+/**
+ * BTINTEL_TEST_IOC_IRQ_MONITOR - Start or stop interrupt instrumentation
+ * Type: Write (IOW)
+ * Argument: pointer to struct btintel_test_irq_monitor
+ */
+#define BTINTEL_TEST_IOC_IRQ_MONITOR \
+	_IOW(BTINTEL_TEST_IOC_MAGIC, 19, struct btintel_test_irq_monitor)
+
+/**
+ * BTINTEL_TEST_IOC_IRQ_INJECT - Inject interrupts on an instrumented vector
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_irq_inject
+ */
+#define BTINTEL_TEST_IOC_IRQ_INJECT \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 20, struct btintel_test_irq_inject)
+
+/**
+ * BTINTEL_TEST_IOC_IRQ_STATS - Get per-vector interrupt counters
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_irq_stats
+ */
+#define BTINTEL_TEST_IOC_IRQ_STATS \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 21, struct btintel_test_irq_stats)
+
+/**
+ * BTINTEL_TEST_IOC_HCI_POLL - Compare sleeping and busy-polling command waits
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_hci_poll
+ */
+#define BTINTEL_TEST_IOC_HCI_POLL \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 22, struct btintel_test_hci_poll)
+
+/**
+ * BTINTEL_TEST_IOC_SET_NUMA_NODE - Choose the node of device memory
+ * Type: Write (IOW)
+ * Argument: pointer to struct btintel_test_numa_node
+ */
+#define BTINTEL_TEST_IOC_SET_NUMA_NODE \
+	_IOW(BTINTEL_TEST_IOC_MAGIC, 23, struct btintel_test_numa_node)
+
+/**
+ * BTINTEL_TEST_IOC_NUMA_BENCH - Measure memory bandwidth per NUMA node
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_numa_bench
+ */
+#define BTINTEL_TEST_IOC_NUMA_BENCH \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 24, struct btintel_test_numa_bench)
+
+/**
+ * BTINTEL_TEST_IOC_BUF_BENCH - Compare base and huge page buffer access
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_buf_bench
+ */
+#define BTINTEL_TEST_IOC_BUF_BENCH \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 25, struct btintel_test_buf_bench)
+
+/**
+ * BTINTEL_TEST_IOC_IOCTL_STATS - Read per-command ioctl costs
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_ioctl_stats
+ */
+#define BTINTEL_TEST_IOC_IOCTL_STATS \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 26, struct btintel_test_ioctl_stats)
+
+/**
+ * BTINTEL_TEST_IOC_TRACE - Read and toggle the instrumentation points
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_trace
+ */
+#define BTINTEL_TEST_IOC_TRACE \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 27, struct btintel_test_trace)
+
+/**
+ * BTINTEL_TEST_IOC_TRACE_BENCH - Measure the cost of an instrumentation point
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_trace_bench
+ */
+#define BTINTEL_TEST_IOC_TRACE_BENCH \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 28, struct btintel_test_trace_bench)
+
+/**
+ * BTINTEL_TEST_IOC_PERF_RUN - Run an ioctl and count its events
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_perf_run
+ */
+#define BTINTEL_TEST_IOC_PERF_RUN \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 29, struct btintel_test_perf_run)
+
+/**
+ * BTINTEL_TEST_IOC_SAMPLER - Start, stop or reset the stats sampler
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_sampler
+ */
+#define BTINTEL_TEST_IOC_SAMPLER \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 30, struct btintel_test_sampler)
+
+/**
+ * BTINTEL_TEST_IOC_SAMPLER_READ - Read samples from the sampler history
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_sampler_read
+ */
+#define BTINTEL_TEST_IOC_SAMPLER_READ \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 31, struct btintel_test_sampler_read)
+
+/**
+ * BTINTEL_TEST_IOC_HCI_REPLAY - Replay an HCI command script
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_hci_replay
+ */
+#define BTINTEL_TEST_IOC_HCI_REPLAY \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 32, struct btintel_test_hci_replay)
+
+/**
+ * BTINTEL_TEST_IOC_DMA_BENCH - Run the DMA descriptor ring benchmark
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_dma_bench
+ */
+#define BTINTEL_TEST_IOC_DMA_BENCH \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 33, struct btintel_test_dma_bench)
+
+/**
+ * BTINTEL_TEST_IOC_RSP_CACHE - Configure the HCI response cache, read counters
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_rsp_cache
+ */
+#define BTINTEL_TEST_IOC_RSP_CACHE \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 34, struct btintel_test_rsp_cache)
+
+/**
+ * BTINTEL_TEST_IOC_RSP_CACHE_FLUSH - Drop every cached HCI response
+ * Type: None (IO)
+ * Argument: none
+ */
+#define BTINTEL_TEST_IOC_RSP_CACHE_FLUSH \
+	_IO(BTINTEL_TEST_IOC_MAGIC, 35)
+
+/**
+ * BTINTEL_TEST_IOC_FW_SWEEP - Sweep firmware download chunk size and depth
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_fw_sweep
+ */
+#define BTINTEL_TEST_IOC_FW_SWEEP \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 36, struct btintel_test_fw_sweep)
+
+/**
+ * BTINTEL_TEST_IOC_RESET_CYCLE_V2 - Run the reset/recovery cycle stress and
+ * report how the run was set up
+ * Type: Read/Write (IOWR)
+ * Argument: pointer to struct btintel_test_reset_cycle_v2
+ */
+#define BTINTEL_TEST_IOC_RESET_CYCLE_V2 \
+	_IOWR(BTINTEL_TEST_IOC_MAGIC, 37, struct btintel_test_reset_cycle_v2)
+
 /* ============================================================================
  * REGISTER DEFINITIONS (if applicable)
  * ============================================================================ */
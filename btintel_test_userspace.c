@@ -8,10 +8,11 @@
  * This program demonstrates how to interact with the btintel_test_generic_driver
  * using ioctl commands.
  *
- * Build: gcc -o btintel_test_userspace btintel_test_userspace.c
- * Usage: ./btintel_test_userspace
+ * Build: gcc -o btintel_test_userspace btintel_test_userspace.c -pthread
+ * Usage: ./btintel_test_userspace [command [options]]
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,10 +20,31 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <glob.h>
+#include <sys/utsname.h>
 
 #include "btintel_test_userspace.h"
 
 #define DEVICE_PATH "/dev/btintel_test_generic_driver"
+#define VHCI_PATH "/dev/vhci"
+
+/* Bluetooth definitions, to avoid depending on BlueZ headers */
+#ifndef AF_BLUETOOTH
+#define AF_BLUETOOTH		31
+#endif
+#define BTPROTO_HCI		1
+#define HCIDEVUP		_IOW('H', 201, int)
+#define HCI_COMMAND_PKT		0x01
+#define HCI_EVENT_PKT		0x04
+#define HCI_VENDOR_PKT		0xff
+#define HCI_EV_CMD_COMPLETE	0x0e
 
 /* ============================================================================
  * HELPER FUNCTIONS
@@ -77,10 +99,90 @@ static void close_device(int fd)
 	}
 }
 
+/* Run every driver ioctl under BTINTEL_TEST_IOC_PERF_RUN ("perf" prefix) */
+static int perf_mode;
+
+/**
+ * print_perf - Print the counters of one wrapped ioctl
+ */
+static void print_perf(const struct btintel_test_perf_run *run)
+{
+	static const char * const names[BTINTEL_TEST_PERF_COUNTERS] = {
+		[BTINTEL_TEST_PERF_CYCLES] = "cycles",
+		[BTINTEL_TEST_PERF_INSTRUCTIONS] = "instructions",
+		[BTINTEL_TEST_PERF_CACHE_MISSES] = "cache-misses",
+		[BTINTEL_TEST_PERF_CONTEXT_SWITCHES] = "context-switches",
+		[BTINTEL_TEST_PERF_TASK_CLOCK] = "task-clock-ns",
+		[BTINTEL_TEST_PERF_CPU_MIGRATIONS] = "cpu-migrations",
+		[BTINTEL_TEST_PERF_PAGE_FAULTS] = "page-faults",
+	};
+	int i;
+
+	printf("  [perf] ioctl %u returned %d\n", _IOC_NR(run->cmd), run->ret);
+	for (i = 0; i < BTINTEL_TEST_PERF_COUNTERS; i++) {
+		if (!(run->valid & (1U << i))) {
+			printf("  [perf]   %-17s n/a\n", names[i]);
+			continue;
+		}
+		printf("  [perf]   %-17s %llu%s\n", names[i],
+		       (unsigned long long)run->counts[i],
+		       run->multiplexed & (1U << i) ? " (scaled)" : "");
+	}
+	if ((run->valid & (1U << BTINTEL_TEST_PERF_CYCLES)) &&
+	    (run->valid & (1U << BTINTEL_TEST_PERF_INSTRUCTIONS)) &&
+	    run->counts[BTINTEL_TEST_PERF_CYCLES])
+		printf("  [perf]   %-17s %.2f\n", "IPC",
+		       (double)run->counts[BTINTEL_TEST_PERF_INSTRUCTIONS] /
+		       run->counts[BTINTEL_TEST_PERF_CYCLES]);
+}
+
+/**
+ * dev_ioctl - Issue a driver ioctl, under performance counters in perf mode
+ */
+static int dev_ioctl(int fd, unsigned long cmd, void *arg)
+{
+	struct btintel_test_perf_run run;
+
+	if (!perf_mode)
+		return ioctl(fd, cmd, arg);
+
+	memset(&run, 0, sizeof(run));
+	run.cmd = cmd;
+	run.arg = (uintptr_t)arg;
+
+	if (ioctl(fd, BTINTEL_TEST_IOC_PERF_RUN, &run) < 0)
+		return -1;
+
+	print_perf(&run);
+
+	if (run.ret < 0) {
+		errno = -run.ret;
+		return -1;
+	}
+	return run.ret;
+}
+
 /* ============================================================================
  * IOCTL COMMAND TESTS
  * ============================================================================ */
 
+/**
+ * backing_name - Name of a BTINTEL_TEST_BUF_BACKING_* value
+ */
+static const char *backing_name(uint32_t backing)
+{
+	switch (backing) {
+	case BTINTEL_TEST_BUF_BACKING_LINEAR:
+		return "linear";
+	case BTINTEL_TEST_BUF_BACKING_VMALLOC:
+		return "base pages";
+	case BTINTEL_TEST_BUF_BACKING_HUGE:
+		return "huge pages";
+	default:
+		return "unknown";
+	}
+}
+
 /**
  * test_get_info - Test GET_INFO ioctl
  */
@@ -91,7 +193,7 @@ static int test_get_info(int fd)
 
 	print_info("Testing BTINTEL_TEST_IOC_GET_INFO...");
 
-	ret = ioctl(fd, BTINTEL_TEST_IOC_GET_INFO, &info);
+	ret = dev_ioctl(fd, BTINTEL_TEST_IOC_GET_INFO, &info);
 	if (ret < 0) {
 		print_error("GET_INFO ioctl failed");
 		return -1;
@@ -102,6 +204,9 @@ static int test_get_info(int fd)
 	printf("    Buffer Size: %zu bytes\n", info.buffer_size);
 	printf("    Active:      %s\n", info.active ? "Yes" : "No");
 	printf("    Refcount:    %u\n", info.refcount);
+	printf("    NUMA Node:   %d (buffer on %d)\n", info.numa_node,
+	       info.buffer_node);
+	printf("    Backing:     %s\n", backing_name(info.buffer_backing));
 
 	print_success("GET_INFO completed");
 	return 0;
@@ -117,7 +222,7 @@ static int test_get_stats(int fd)
 
 	print_info("Testing BTINTEL_TEST_IOC_GET_STATS...");
 
-	ret = ioctl(fd, BTINTEL_TEST_IOC_GET_STATS, &stats);
+	ret = dev_ioctl(fd, BTINTEL_TEST_IOC_GET_STATS, &stats);
 	if (ret < 0) {
 		print_error("GET_STATS ioctl failed");
 		return -1;
@@ -142,7 +247,7 @@ static int test_reset_stats(int fd)
 
 	print_info("Testing BTINTEL_TEST_IOC_RESET_STATS...");
 
-	ret = ioctl(fd, BTINTEL_TEST_IOC_RESET_STATS);
+	ret = dev_ioctl(fd, BTINTEL_TEST_IOC_RESET_STATS, NULL);
 	if (ret < 0) {
 		print_error("RESET_STATS ioctl failed");
 		return -1;
@@ -161,7 +266,7 @@ static int test_clear_buffer(int fd)
 
 	print_info("Testing BTINTEL_TEST_IOC_CLEAR_BUFFER...");
 
-	ret = ioctl(fd, BTINTEL_TEST_IOC_CLEAR_BUFFER);
+	ret = dev_ioctl(fd, BTINTEL_TEST_IOC_CLEAR_BUFFER, NULL);
 	if (ret < 0) {
 		print_error("CLEAR_BUFFER ioctl failed");
 		return -1;
@@ -183,9 +288,10 @@ static int test_set_buffer_size(int fd, size_t new_size)
 	printf("  Requesting buffer size: %zu bytes\n", new_size);
 
 	buf_data.size = new_size;
+	buf_data.flags = 0;
 	buf_data.reserved = 0;
 
-	ret = ioctl(fd, BTINTEL_TEST_IOC_SET_BUFFER_SIZE, &buf_data);
+	ret = dev_ioctl(fd, BTINTEL_TEST_IOC_SET_BUFFER_SIZE, &buf_data);
 	if (ret < 0) {
 		print_error("SET_BUFFER_SIZE ioctl failed");
 		return -1;
@@ -205,15 +311,20 @@ static int test_get_status(int fd)
 
 	print_info("Testing BTINTEL_TEST_IOC_GET_STATUS...");
 
-	ret = ioctl(fd, BTINTEL_TEST_IOC_GET_STATUS, &status);
+	ret = dev_ioctl(fd, BTINTEL_TEST_IOC_GET_STATUS, &status);
 	if (ret < 0) {
 		print_error("GET_STATUS ioctl failed");
 		return -1;
 	}
 
 	printf("  Device Status:\n");
-	printf("    State:      0x%08x\n", status.state);
-	printf("    Error Code: 0x%08x\n", status.error_code);
+	printf("    State:      0x%08x%s%s%s\n", status.state,
+	       status.state & BTINTEL_TEST_STATE_ACTIVE ? " active" : "",
+	       status.state & BTINTEL_TEST_STATE_HW ? " hw" : "",
+	       status.state & BTINTEL_TEST_STATE_BUFFER ? " buffer" : "");
+	printf("    Error Code: %u%s%s\n", status.error_code,
+	       status.error_code ? " " : "",
+	       status.error_code ? strerror(status.error_code) : "");
 
 	print_success("GET_STATUS completed");
 	return 0;
@@ -228,7 +339,7 @@ static int test_enable(int fd)
 
 	print_info("Testing BTINTEL_TEST_IOC_ENABLE...");
 
-	ret = ioctl(fd, BTINTEL_TEST_IOC_ENABLE);
+	ret = dev_ioctl(fd, BTINTEL_TEST_IOC_ENABLE, NULL);
 	if (ret < 0) {
 		print_error("ENABLE ioctl failed");
 		return -1;
@@ -247,7 +358,7 @@ static int test_disable(int fd)
 
 	print_info("Testing BTINTEL_TEST_IOC_DISABLE...");
 
-	ret = ioctl(fd, BTINTEL_TEST_IOC_DISABLE);
+	ret = dev_ioctl(fd, BTINTEL_TEST_IOC_DISABLE, NULL);
 	if (ret < 0) {
 		print_error("DISABLE ioctl failed");
 		return -1;
@@ -295,13 +406,3729 @@ static int test_read_write(int fd)
 }
 
 /* ============================================================================
- * MAIN PROGRAM
+ * BENCHMARK COMMANDS
  * ============================================================================ */
 
-int main(int argc, char *argv[])
+/**
+ * parse_backend - Parse a --backend argument
+ */
+static int parse_backend(const char *arg, uint32_t *backend)
 {
-	int fd;
-	int ret = 0;
+	if (!strcmp(arg, "hw"))
+		*backend = BTINTEL_TEST_BACKEND_HW;
+	else if (!strcmp(arg, "hci"))
+		*backend = BTINTEL_TEST_BACKEND_HCI_INDEX;
+	else if (!strcmp(arg, "emul"))
+		*backend = BTINTEL_TEST_BACKEND_EMUL;
+	else
+		return -1;
+	return 0;
+}
+
+/**
+ * print_latency - Print a latency summary and its non-empty histogram buckets
+ */
+static void print_latency(const char *name,
+			  const struct btintel_test_latency *lat)
+{
+	int i;
+
+	printf("  %s: %llu samples\n", name, (unsigned long long)lat->samples);
+	if (!lat->samples)
+		return;
+
+	printf("    Min:  %llu ns\n", (unsigned long long)lat->min_ns);
+	printf("    Mean: %llu ns\n", (unsigned long long)lat->mean_ns);
+	printf("    P99:  %llu ns\n", (unsigned long long)lat->p99_ns);
+	printf("    Max:  %llu ns\n", (unsigned long long)lat->max_ns);
+
+	for (i = 0; i < BTINTEL_TEST_HIST_BUCKETS; i++) {
+		if (!lat->hist[i])
+			continue;
+		printf("    [%10llu, %10llu) ns: %u\n",
+		       i ? 1ULL << (i - 1) : 0ULL, 1ULL << i, lat->hist[i]);
+	}
+}
+
+/**
+ * cmd_iso_jitter - Run the periodic SCO/ISO injection benchmark
+ */
+static int cmd_iso_jitter(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "backend",    required_argument, NULL, 'b' },
+		{ "index",      required_argument, NULL, 'i' },
+		{ "iso",        no_argument,       NULL, 'I' },
+		{ "handle",     required_argument, NULL, 'H' },
+		{ "len",        required_argument, NULL, 'l' },
+		{ "count",      required_argument, NULL, 'c' },
+		{ "interval-us", required_argument, NULL, 't' },
+		{ "deadline-us", required_argument, NULL, 'd' },
+		{ "latency-us", required_argument, NULL, 'L' },
+		{ "jitter-us",  required_argument, NULL, 'j' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct btintel_test_iso_jitter req;
+	int opt;
+
+	memset(&req, 0, sizeof(req));
+	req.backend = BTINTEL_TEST_BACKEND_HW;
+	req.pkt_type = BTINTEL_TEST_ISO_PKT_SCO;
+	req.payload_len = 60;
+	req.count = 1000;
+	req.interval_ns = 7500000;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			if (parse_backend(optarg, &req.backend) < 0) {
+				fprintf(stderr, "Unknown backend: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'i':
+			req.hci_index = strtoul(optarg, NULL, 0);
+			break;
+		case 'I':
+			req.pkt_type = BTINTEL_TEST_ISO_PKT_ISO;
+			break;
+		case 'H':
+			req.handle = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			req.payload_len = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			req.count = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			req.interval_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'd':
+			req.deadline_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'L':
+			req.emul_latency_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'j':
+			req.emul_jitter_ns = strtod(optarg, NULL) * 1000;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_ISO_JITTER...");
+	printf("  %u %s packets of %u bytes every %.3f ms\n", req.count,
+	       req.pkt_type == BTINTEL_TEST_ISO_PKT_ISO ? "ISO" : "SCO",
+	       req.payload_len, req.interval_ns / 1e6);
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_ISO_JITTER, &req) < 0) {
+		print_error("ISO_JITTER ioctl failed");
+		return -1;
+	}
+
+	printf("  Sent:             %u\n", req.sent);
+	printf("  Completed:        %u\n", req.completed);
+	printf("  Missed deadlines: %u\n", req.missed_deadlines);
+	print_latency("Send jitter", &req.jitter);
+	print_latency("Completion latency", &req.latency);
+
+	print_success("ISO_JITTER completed");
+	return 0;
+}
+
+/**
+ * now_ns - CLOCK_MONOTONIC time in nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * parse_cpus - Parse a CPU list such as "0-3,8" into an executor mask
+ */
+static int parse_cpus(const char *arg, uint64_t *mask)
+{
+	char *end;
+	long first, last;
+
+	while (*arg) {
+		first = strtol(arg, &end, 10);
+		last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		if (end == arg || first < 0 || last < first ||
+		    last >= BTINTEL_TEST_EXEC_CPU_WORDS * 64)
+			return -1;
+		for (; first <= last; first++)
+			mask[first / 64] |= 1ULL << (first % 64);
+		arg = *end == ',' ? end + 1 : end;
+		if (*end && *end != ',')
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * cmd_exec - Run a job list on the parallel in-kernel executor
+ */
+static int cmd_exec(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "workers", required_argument, NULL, 'w' },
+		{ "cpus",    required_argument, NULL, 'C' },
+		{ "type",    required_argument, NULL, 'T' },
+		{ "jobs",    required_argument, NULL, 'n' },
+		{ "backend", required_argument, NULL, 'b' },
+		{ "index",   required_argument, NULL, 'i' },
+		{ "size",    required_argument, NULL, 's' },
+		{ "iterations", required_argument, NULL, 'r' },
+		{ "offset",  required_argument, NULL, 'o' },
+		{ "count",   required_argument, NULL, 'c' },
+		{ "opcode",  required_argument, NULL, 'O' },
+		{ "poll",    no_argument,       NULL, 'P' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct btintel_test_exec_config cfg;
+	struct btintel_test_exec_submit sub;
+	struct btintel_test_exec_collect col;
+	struct btintel_test_job_result *results;
+	struct btintel_test_job tmpl, *jobs;
+	uint64_t start, wall_ns, busy_ns = 0, failed = 0, stolen = 0;
+	uint32_t nr_jobs = 64, done = 0, i;
+	uint32_t size = 1024 * 1024, iterations = 4, offset = 0, count = 0;
+	uint16_t opcode = 0x1001;	/* Read Local Version Information */
+	int poll = 0;
+	int opt, ret = -1;
+
+	memset(&cfg, 0, sizeof(cfg));
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.type = BTINTEL_TEST_JOB_BUF_PATTERN;
+	tmpl.backend = BTINTEL_TEST_BACKEND_EMUL;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'w':
+			cfg.workers = strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			if (parse_cpus(optarg, cfg.cpus) < 0) {
+				fprintf(stderr, "Bad CPU list: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'T':
+			if (!strcmp(optarg, "reg"))
+				tmpl.type = BTINTEL_TEST_JOB_REG_SWEEP;
+			else if (!strcmp(optarg, "buf"))
+				tmpl.type = BTINTEL_TEST_JOB_BUF_PATTERN;
+			else if (!strcmp(optarg, "hci"))
+				tmpl.type = BTINTEL_TEST_JOB_HCI_BATCH;
+			else {
+				fprintf(stderr, "Unknown job type: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'n':
+			nr_jobs = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			if (parse_backend(optarg, &tmpl.backend) < 0) {
+				fprintf(stderr, "Unknown backend: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'i':
+			tmpl.hci_index = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			offset = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'O':
+			opcode = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			poll = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (!nr_jobs || nr_jobs > BTINTEL_TEST_EXEC_MAX_JOBS) {
+		fprintf(stderr, "Job count must be 1..%u\n",
+			BTINTEL_TEST_EXEC_MAX_JOBS);
+		return -1;
+	}
+
+	switch (tmpl.type) {
+	case BTINTEL_TEST_JOB_REG_SWEEP:
+		tmpl.reg.offset = offset;
+		tmpl.reg.count = count ? count : 256;
+		tmpl.reg.stride = 4;
+		break;
+	case BTINTEL_TEST_JOB_BUF_PATTERN:
+		tmpl.buf.size = size;
+		tmpl.buf.iterations = iterations;
+		if (iterations > BTINTEL_TEST_JOB_BUF_MAX_ITERATIONS) {
+			fprintf(stderr, "Buffer iterations must be 0..%u\n",
+				BTINTEL_TEST_JOB_BUF_MAX_ITERATIONS);
+			return -1;
+		}
+		break;
+	case BTINTEL_TEST_JOB_HCI_BATCH:
+		tmpl.hci.opcode = opcode;
+		tmpl.hci.count = count ? count : 16;
+		tmpl.hci.flags = poll ? BTINTEL_TEST_HCI_POLL : 0;
+		if (tmpl.hci.count > BTINTEL_TEST_JOB_HCI_MAX_COUNT) {
+			fprintf(stderr, "HCI batch count must be 1..%u\n",
+				BTINTEL_TEST_JOB_HCI_MAX_COUNT);
+			return -1;
+		}
+		break;
+	}
+
+	jobs = calloc(nr_jobs, sizeof(*jobs));
+	results = calloc(nr_jobs, sizeof(*results));
+	if (!jobs || !results) {
+		print_error("Out of memory");
+		goto out;
+	}
+
+	for (i = 0; i < nr_jobs; i++) {
+		jobs[i] = tmpl;
+		jobs[i].cookie = i;
+		if (tmpl.type == BTINTEL_TEST_JOB_BUF_PATTERN)
+			jobs[i].buf.seed = i;
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_EXEC_CONFIG...");
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_EXEC_CONFIG, &cfg) < 0) {
+		print_error("EXEC_CONFIG ioctl failed");
+		goto out;
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_EXEC_SUBMIT...");
+	start = now_ns();
+	sub.jobs = (uintptr_t)jobs;
+	sub.count = nr_jobs;
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_EXEC_SUBMIT, &sub) < 0) {
+		print_error("EXEC_SUBMIT ioctl failed");
+		goto out;
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_EXEC_COLLECT...");
+	while (done < nr_jobs) {
+		col.results = (uintptr_t)(results + done);
+		col.max = nr_jobs - done;
+		col.flags = BTINTEL_TEST_EXEC_WAIT;
+		if (dev_ioctl(fd, BTINTEL_TEST_IOC_EXEC_COLLECT, &col) < 0) {
+			print_error("EXEC_COLLECT ioctl failed");
+			goto out;
+		}
+		done += col.count;
+		if (!col.count && !col.pending)
+			break;
+	}
+	wall_ns = now_ns() - start;
+
+	for (i = 0; i < done; i++) {
+		busy_ns += results[i].run_ns;
+		stolen += results[i].stolen != 0;
+		if (results[i].status || results[i].value)
+			failed++;
+	}
+
+	printf("  Jobs:         %u collected, %llu failed, %llu stolen\n",
+	       done, (unsigned long long)failed,
+	       (unsigned long long)stolen);
+	printf("  Wall time:    %.3f ms\n", wall_ns / 1e6);
+	printf("  Serial time:  %.3f ms\n", busy_ns / 1e6);
+	if (wall_ns)
+		printf("  Speedup:      %.2fx\n", (double)busy_ns / wall_ns);
+
+	ret = failed ? -1 : 0;
+	if (!ret)
+		print_success("EXEC completed");
+out:
+	free(jobs);
+	free(results);
+	return ret;
+}
+
+/**
+ * parse_hex - Parse a hex byte string such as "01ff" into a buffer
+ */
+static int parse_hex(const char *arg, uint8_t *buf, size_t max)
+{
+	size_t len = strlen(arg) / 2, i;
+	unsigned int byte;
+
+	if (strlen(arg) % 2 || len > max)
+		return -1;
+
+	for (i = 0; i < len; i++) {
+		if (sscanf(arg + 2 * i, "%2x", &byte) != 1)
+			return -1;
+		buf[i] = byte;
+	}
+	return len;
+}
+
+/**
+ * cmd_hci_pipeline - Run the pipelined HCI command benchmark
+ */
+static int cmd_hci_pipeline(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "backend",    required_argument, NULL, 'b' },
+		{ "index",      required_argument, NULL, 'i' },
+		{ "opcode",     required_argument, NULL, 'O' },
+		{ "param",      required_argument, NULL, 'p' },
+		{ "depth",      required_argument, NULL, 'D' },
+		{ "count",      required_argument, NULL, 'c' },
+		{ "latency-us", required_argument, NULL, 'L' },
+		{ "jitter-us",  required_argument, NULL, 'j' },
+		{ "credits",    required_argument, NULL, 'C' },
+		{ "poll",       no_argument,       NULL, 'P' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct btintel_test_hci_pipeline req;
+	int opt, len;
+
+	memset(&req, 0, sizeof(req));
+	req.backend = BTINTEL_TEST_BACKEND_HW;
+	req.opcode = 0x1001;	/* Read Local Version Information */
+	req.depth = 8;
+	req.count = 1000;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			if (parse_backend(optarg, &req.backend) < 0) {
+				fprintf(stderr, "Unknown backend: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'i':
+			req.hci_index = strtoul(optarg, NULL, 0);
+			break;
+		case 'O':
+			req.opcode = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			len = parse_hex(optarg, req.param, sizeof(req.param));
+			if (len < 0) {
+				fprintf(stderr, "Bad parameters: %s\n", optarg);
+				return -1;
+			}
+			req.plen = len;
+			break;
+		case 'D':
+			req.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			req.count = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			req.emul_latency_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'j':
+			req.emul_jitter_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'C':
+			req.emul_credits = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			req.flags |= BTINTEL_TEST_HCI_POLL;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_HCI_PIPELINE...");
+	printf("  %u x opcode 0x%04x, up to %u in flight\n", req.count,
+	       req.opcode, req.depth);
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_HCI_PIPELINE, &req) < 0) {
+		print_error("HCI_PIPELINE ioctl failed");
+		return -1;
+	}
+
+	printf("  Completed:       %u (%u errors)\n", req.completed, req.errors);
+	printf("  Throughput:      %llu commands/s\n",
+	       (unsigned long long)req.cmds_per_sec);
+	printf("  Max in flight:   %u\n", req.max_outstanding);
+	printf("  Avg in flight:   %.3f\n", req.avg_outstanding_milli / 1000.0);
+	printf("  Max credits:     %u\n", req.max_credits);
+	printf("  Credit starved:  %.3f ms of %.3f ms\n", req.starved_ns / 1e6,
+	       req.elapsed_ns / 1e6);
+	if (req.flags & BTINTEL_TEST_HCI_POLL)
+		printf("  Busy-polled:     %u (%u fell back to sleeping)\n",
+		       req.polled, req.poll_fallbacks);
+	print_latency("Command latency", &req.latency);
+
+	print_success("HCI_PIPELINE completed");
+	return req.errors ? -1 : 0;
+}
+
+/**
+ * cmd_mem_dump - Capture controller memory and save the dump stream
+ */
+static int cmd_mem_dump(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "source",         required_argument, NULL, 's' },
+		{ "address",        required_argument, NULL, 'a' },
+		{ "length",         required_argument, NULL, 'l' },
+		{ "chunk",          required_argument, NULL, 'c' },
+		{ "chunk-delay-us", required_argument, NULL, 'd' },
+		{ "lz4",            no_argument,       NULL, 'z' },
+		{ "output",         required_argument, NULL, 'o' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct btintel_test_mem_dump req;
+	const char *output = "btintel_dump.bin";
+	char buf[65536];
+	unsigned long long total = 0;
+	ssize_t n;
+	int opt, out, ret = 0;
+
+	memset(&req, 0, sizeof(req));
+	req.source = BTINTEL_TEST_DUMP_SRC_EMUL;
+	req.length = 4096;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			if (!strcmp(optarg, "bar")) {
+				req.source = BTINTEL_TEST_DUMP_SRC_BAR;
+			} else if (!strcmp(optarg, "emul")) {
+				req.source = BTINTEL_TEST_DUMP_SRC_EMUL;
+			} else {
+				fprintf(stderr, "Unknown source: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'a':
+			req.address = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			req.length = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			req.chunk_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			req.emul_chunk_delay_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'z':
+			req.flags |= BTINTEL_TEST_DUMP_LZ4;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_MEM_DUMP...");
+	printf("  %u bytes at 0x%llx%s\n", req.length,
+	       (unsigned long long)req.address,
+	       req.flags & BTINTEL_TEST_DUMP_LZ4 ? ", LZ4" : "");
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_MEM_DUMP, &req) < 0) {
+		print_error("MEM_DUMP ioctl failed");
+		return -1;
+	}
+
+	out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		print_error("Failed to create output file");
+		close(req.fd);
+		return -1;
+	}
+
+	while ((n = read(req.fd, buf, sizeof(buf))) > 0) {
+		if (write(out, buf, n) != n) {
+			print_error("Failed to write output file");
+			ret = -1;
+			break;
+		}
+		total += n;
+	}
+	if (n < 0) {
+		print_error("Failed to read dump");
+		ret = -1;
+	}
+
+	close(out);
+	close(req.fd);
+
+	printf("  Chunks:          %u\n", req.chunks);
+	printf("  Stream size:     %llu bytes (%.1f%% of raw)\n",
+	       (unsigned long long)req.stream_size,
+	       100.0 * req.stream_size / req.length);
+	printf("  Capture time:    %.3f ms (%.1f MB/s)\n", req.capture_ns / 1e6,
+	       req.capture_ns ? req.length * 1e3 / req.capture_ns : 0.0);
+	printf("  Compress time:   %.3f ms\n", req.compress_ns / 1e6);
+	printf("  Saved:           %llu bytes to %s\n", total, output);
+
+	if (ret)
+		return ret;
+
+	print_success("MEM_DUMP completed");
+	return 0;
+}
+
+/**
+ * cmd_reset_cycle - Run the reset/recovery cycle stress
+ */
+static int cmd_reset_cycle(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "backend",    required_argument, NULL, 'b' },
+		{ "cycles",     required_argument, NULL, 'c' },
+		{ "poll-us",    required_argument, NULL, 'p' },
+		{ "timeout-ms", required_argument, NULL, 't' },
+		{ "settle-ms",  required_argument, NULL, 's' },
+		{ "stage-us",   required_argument, NULL, 'S' },
+		{ "jitter-us",  required_argument, NULL, 'j' },
+		{ NULL, 0, NULL, 0 }
+	};
+	static const char * const stage_names[BTINTEL_TEST_RESET_STAGES] = {
+		"Down", "ROM", "IML", "Op. firmware", "Alive", "HCI ready",
+	};
+	/* Scripted boot of the emulated backend, roughly a real one */
+	static const double stage_us[BTINTEL_TEST_RESET_STAGES] = {
+		200, 5000, 20000, 150000, 30000, 80000,
+	};
+	struct btintel_test_reset_cycle_v2 v2;
+	struct btintel_test_reset_cycle *req = &v2.cycle;
+	char *arg, *tok, *save;
+	int opt, i;
+
+	memset(&v2, 0, sizeof(v2));
+	req->backend = BTINTEL_TEST_BACKEND_HW;
+	req->cycles = 10;
+	req->settle_ms = 500;
+	for (i = 0; i < BTINTEL_TEST_RESET_STAGES; i++)
+		req->emul_stage_delay_ns[i] = stage_us[i] * 1000;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			if (parse_backend(optarg, &req->backend) < 0) {
+				fprintf(stderr, "Unknown backend: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'c':
+			req->cycles = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			req->poll_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 't':
+			req->timeout_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			req->settle_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			/* Comma-separated delays, one per stage in order */
+			arg = optarg;
+			for (i = 0; i < BTINTEL_TEST_RESET_STAGES; i++, arg = NULL) {
+				tok = strtok_r(arg, ",", &save);
+				if (!tok)
+					break;
+				req->emul_stage_delay_ns[i] = strtod(tok, NULL) * 1000;
+			}
+			break;
+		case 'j':
+			req->emul_jitter_ns = strtod(optarg, NULL) * 1000;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_RESET_CYCLE_V2...");
+	printf("  %u reset cycles\n", req->cycles);
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_RESET_CYCLE_V2, &v2) < 0) {
+		print_error("RESET_CYCLE_V2 ioctl failed");
+		return -1;
+	}
+
+	printf("  Completed:       %u (%u timed out)\n", req->completed,
+	       req->timeouts);
+	if (v2.flags & BTINTEL_TEST_RESET_NO_BOOT_STAGE)
+		printf("  Boot stages:     not readable, DOWN/READY only\n");
+	if (v2.flags & BTINTEL_TEST_RESET_IRQ_PAUSED)
+		printf("  IRQ monitor:     restarted, counters cleared\n");
+	for (i = 0; i < BTINTEL_TEST_RESET_STAGES; i++)
+		print_latency(stage_names[i], &req->stage[i]);
+	print_latency("Reset to ready", &req->total);
+
+	print_success("RESET_CYCLE completed");
+	return req->timeouts ? -1 : 0;
+}
+
+/**
+ * print_fw_cache_stats - Print the firmware image cache counters
+ */
+static int print_fw_cache_stats(int fd)
+{
+	struct btintel_test_fw_cache_stats st;
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_FW_CACHE_STATS, &st) < 0) {
+		print_error("FW_CACHE_STATS ioctl failed");
+		return -1;
+	}
+
+	printf("  Cache hits:      %llu\n", (unsigned long long)st.hits);
+	printf("  Cache misses:    %llu\n", (unsigned long long)st.misses);
+	printf("  Evictions:       %llu\n", (unsigned long long)st.evictions);
+	printf("  Cached:          %u images, %llu of %llu bytes\n", st.entries,
+	       (unsigned long long)st.bytes, (unsigned long long)st.max_bytes);
+	print_latency("Hit load time", &st.hit_latency);
+	print_latency("Miss load time", &st.miss_latency);
+
+	return 0;
+}
+
+/**
+ * cmd_fw_load - Load firmware images through the cache
+ */
+static int cmd_fw_load(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "download",   no_argument,       NULL, 'd' },
+		{ "backend",    required_argument, NULL, 'b' },
+		{ "index",      required_argument, NULL, 'i' },
+		{ "latency-us", required_argument, NULL, 'L' },
+		{ "nocache",    no_argument,       NULL, 'n' },
+		{ "repeat",     required_argument, NULL, 'r' },
+		{ "flush",      no_argument,       NULL, 'f' },
+		{ NULL, 0, NULL, 0 }
+	};
+	static const char * const formats[] = { "raw", "RSA", "ECDSA" };
+	struct btintel_test_fw_load req;
+	unsigned int repeat = 1, n;
+	int opt, i, flush = 0;
+
+	memset(&req, 0, sizeof(req));
+	req.backend = BTINTEL_TEST_BACKEND_EMUL;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			req.flags |= BTINTEL_TEST_FW_DOWNLOAD;
+			break;
+		case 'b':
+			if (parse_backend(optarg, &req.backend) < 0) {
+				fprintf(stderr, "Unknown backend: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'i':
+			req.hci_index = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			req.emul_latency_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'n':
+			req.flags |= BTINTEL_TEST_FW_NOCACHE;
+			break;
+		case 'r':
+			repeat = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			flush = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_FW_LOAD...");
+
+	if (flush && dev_ioctl(fd, BTINTEL_TEST_IOC_FW_CACHE_FLUSH, NULL) < 0) {
+		print_error("FW_CACHE_FLUSH ioctl failed");
+		return -1;
+	}
+
+	/* Every remaining argument is a firmware file name */
+	for (n = 0; n < repeat; n++) {
+		for (i = optind; i < argc; i++) {
+			snprintf(req.name, sizeof(req.name), "%s", argv[i]);
+
+			if (dev_ioctl(fd, BTINTEL_TEST_IOC_FW_LOAD, &req) < 0) {
+				fprintf(stderr, "ERROR: %s: %s\n", req.name,
+					strerror(errno));
+				return -1;
+			}
+
+			printf("  %s: %s, %s, %u bytes, %u fragments",
+			       req.name, req.hit ? "hit" : "miss",
+			       req.format < 3 ? formats[req.format] : "?",
+			       req.size, req.fragments);
+			printf(", load %.3f ms (parse %.3f ms)", req.load_ns / 1e6,
+			       req.parse_ns / 1e6);
+			if (req.flags & BTINTEL_TEST_FW_DOWNLOAD)
+				printf(", download %.3f ms", req.download_ns / 1e6);
+			printf("\n");
+		}
+	}
+
+	if (print_fw_cache_stats(fd) < 0)
+		return -1;
+
+	print_success("FW_LOAD completed");
+	return 0;
+}
+
+/**
+ * cmd_pm_cycle - Measure suspend/resume transition latency
+ */
+static int cmd_pm_cycle(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "backend",    required_argument, NULL, 'b' },
+		{ "d3hot",      no_argument,       NULL, 'D' },
+		{ "cycles",     required_argument, NULL, 'c' },
+		{ "dwell-us",   required_argument, NULL, 'w' },
+		{ "suspend-us", required_argument, NULL, 's' },
+		{ "resume-us",  required_argument, NULL, 'r' },
+		{ "jitter-us",  required_argument, NULL, 'j' },
+		{ "fail-pct",   required_argument, NULL, 'f' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct btintel_test_pm_cycle req;
+	int opt;
+
+	memset(&req, 0, sizeof(req));
+	req.backend = BTINTEL_TEST_BACKEND_HW;
+	req.mode = BTINTEL_TEST_PM_RUNTIME;
+	req.cycles = 100;
+	req.dwell_us = 1000;
+	req.emul_suspend_ns = 2000000;
+	req.emul_resume_ns = 10000000;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			if (parse_backend(optarg, &req.backend) < 0) {
+				fprintf(stderr, "Unknown backend: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'D':
+			req.mode = BTINTEL_TEST_PM_D3HOT;
+			break;
+		case 'c':
+			req.cycles = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			req.dwell_us = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			req.emul_suspend_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'r':
+			req.emul_resume_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'j':
+			req.emul_jitter_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'f':
+			req.emul_fail_pct = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_PM_CYCLE...");
+	printf("  %u %s cycles\n", req.cycles,
+	       req.mode == BTINTEL_TEST_PM_D3HOT ? "D0/D3hot" : "runtime PM");
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_PM_CYCLE, &req) < 0) {
+		fprintf(stderr, "ERROR: PM_CYCLE: %s\n", strerror(errno));
+		if (req.resume_failures)
+			printf("  Completed %u cycles before a resume failed\n",
+			       req.completed);
+		return -1;
+	}
+
+	printf("  Completed:       %u\n", req.completed);
+	printf("  Failures:        %u suspend, %u resume\n",
+	       req.suspend_failures, req.resume_failures);
+	print_latency("Suspend", &req.suspend);
+	print_latency("Resume", &req.resume);
+	print_latency("Suspend + resume", &req.cycle);
+
+	print_success("PM_CYCLE completed");
+	return req.suspend_failures || req.resume_failures ? -1 : 0;
+}
+
+/**
+ * print_irq_stats - Print the per-vector interrupt counters
+ */
+static int print_irq_stats(int fd, int reset)
+{
+	struct btintel_test_irq_stats st;
+	struct btintel_test_irq_vector *v;
+	char name[32];
+	unsigned int i;
+
+	memset(&st, 0, sizeof(st));
+	st.reset = reset;
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_IRQ_STATS, &st) < 0) {
+		print_error("IRQ_STATS ioctl failed");
+		return -1;
+	}
+
+	printf("  Sampling window: %.3f ms\n", st.window_ns / 1e6);
+	for (i = 0; i < st.nr_vectors && i < BTINTEL_TEST_IRQ_MAX_VECTORS; i++) {
+		v = &st.vectors[i];
+		if (v->kind == BTINTEL_TEST_IRQ_VEC_MSIX)
+			snprintf(name, sizeof(name), "MSI-X %u (irq %u)",
+				 v->index, v->irq);
+		else
+			snprintf(name, sizeof(name), "Software");
+
+		printf("  [%u] %s: %llu interrupts, %llu/s\n", i, name,
+		       (unsigned long long)v->count,
+		       (unsigned long long)v->rate);
+		print_latency("Injection latency", &v->latency);
+		print_latency("Inter-arrival", &v->interval);
+	}
+
+	return 0;
+}
+
+/**
+ * cmd_irq - Instrument interrupts and optionally inject some
+ */
+static int cmd_irq(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "hw",          no_argument,       NULL, 'H' },
+		{ "vector",      required_argument, NULL, 'v' },
+		{ "inject",      required_argument, NULL, 'n' },
+		{ "interval-us", required_argument, NULL, 'i' },
+		{ "cpu",         required_argument, NULL, 'c' },
+		{ "sample-ms",   required_argument, NULL, 's' },
+		{ "keep",        no_argument,       NULL, 'k' },
+		{ "attach",      no_argument,       NULL, 'a' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct btintel_test_irq_monitor mon;
+	struct btintel_test_irq_inject inj;
+	unsigned int sample_ms = 0;
+	int opt, keep = 0, attach = 0, ret = 0;
+
+	memset(&mon, 0, sizeof(mon));
+	memset(&inj, 0, sizeof(inj));
+	mon.enable = 1;
+	inj.cpu = -1;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'H':
+			mon.flags |= BTINTEL_TEST_IRQ_HW;
+			break;
+		case 'v':
+			inj.vector = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			inj.count = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			inj.interval_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'c':
+			inj.cpu = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			sample_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		case 'a':
+			/* Use a monitor left running by an earlier --keep */
+			attach = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_IRQ_MONITOR...");
+
+	if (!attach && dev_ioctl(fd, BTINTEL_TEST_IOC_IRQ_MONITOR, &mon) < 0) {
+		print_error("IRQ_MONITOR ioctl failed");
+		return -1;
+	}
+
+	if (inj.count) {
+		if (dev_ioctl(fd, BTINTEL_TEST_IOC_IRQ_INJECT, &inj) < 0) {
+			print_error("IRQ_INJECT ioctl failed");
+			ret = -1;
+		} else {
+			printf("  Injected:        %u delivered, %u lost\n",
+			       inj.delivered, inj.lost);
+			if (inj.lost)
+				ret = -1;
+		}
+	}
+
+	if (sample_ms)
+		usleep(sample_ms * 1000);
+
+	if (print_irq_stats(fd, 0) < 0)
+		ret = -1;
+
+	if (!keep) {
+		mon.enable = 0;
+		if (dev_ioctl(fd, BTINTEL_TEST_IOC_IRQ_MONITOR, &mon) < 0) {
+			print_error("IRQ_MONITOR ioctl failed");
+			ret = -1;
+		}
+	}
+
+	if (!ret)
+		print_success("IRQ instrumentation completed");
+	return ret;
+}
+
+/**
+ * cmd_hci_poll - Compare sleeping and busy-polling command completion waits
+ */
+static int cmd_hci_poll(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "backend",    required_argument, NULL, 'b' },
+		{ "index",      required_argument, NULL, 'i' },
+		{ "opcode",     required_argument, NULL, 'O' },
+		{ "param",      required_argument, NULL, 'p' },
+		{ "count",      required_argument, NULL, 'c' },
+		{ "budget-us",  required_argument, NULL, 'B' },
+		{ "latency-us", required_argument, NULL, 'L' },
+		{ "jitter-us",  required_argument, NULL, 'j' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct btintel_test_hci_poll req;
+	int opt, len;
+
+	memset(&req, 0, sizeof(req));
+	req.backend = BTINTEL_TEST_BACKEND_HW;
+	req.opcode = 0x1001;	/* Read Local Version Information */
+	req.count = 1000;
+	req.busy_poll_ns = 50000;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			if (parse_backend(optarg, &req.backend) < 0) {
+				fprintf(stderr, "Unknown backend: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'i':
+			req.hci_index = strtoul(optarg, NULL, 0);
+			break;
+		case 'O':
+			req.opcode = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			len = parse_hex(optarg, req.param, sizeof(req.param));
+			if (len < 0) {
+				fprintf(stderr, "Bad parameters: %s\n", optarg);
+				return -1;
+			}
+			req.plen = len;
+			break;
+		case 'c':
+			req.count = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			req.busy_poll_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'L':
+			req.emul_latency_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'j':
+			req.emul_jitter_ns = strtod(optarg, NULL) * 1000;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_HCI_POLL...");
+	printf("  %u x opcode 0x%04x per path, %.1f us poll budget\n",
+	       req.count, req.opcode, req.busy_poll_ns / 1e3);
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_HCI_POLL, &req) < 0) {
+		print_error("HCI_POLL ioctl failed");
+		return -1;
+	}
+
+	printf("  Polled:          %u of %u (%u fell back to sleeping)\n",
+	       req.polled, req.count, req.poll_fallbacks);
+	printf("  Errors:          %u\n", req.errors);
+	print_latency("Sleeping wait", &req.sleep);
+	print_latency("Busy-poll wait", &req.poll);
+	if (req.sleep.samples && req.poll.samples)
+		printf("  Mean saved:      %.3f us\n",
+		       ((double)req.sleep.mean_ns - (double)req.poll.mean_ns) / 1e3);
+
+	print_success("HCI_POLL completed");
+	return req.errors ? -1 : 0;
+}
+
+/**
+ * numa_mbps - Bandwidth of @passes passes of @size bytes in @ns
+ */
+static double numa_mbps(uint32_t size, uint32_t passes, uint64_t ns)
+{
+	return ns ? (double)size * passes / ns * 1e3 : 0;
+}
+
+/**
+ * cmd_numa - Place device memory and compare local vs remote bandwidth
+ *
+ * Optionally moves the device buffer to another node, then runs the
+ * per-node bandwidth benchmark from a CPU pinned with --cpu. On a single
+ * node host, boot with numa=fake=N to get several nodes.
+ */
+static int cmd_numa(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "node",    required_argument, NULL, 'n' },
+		{ "size-kb", required_argument, NULL, 's' },
+		{ "passes",  required_argument, NULL, 'p' },
+		{ "cpu",     required_argument, NULL, 'c' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct btintel_test_numa_node place = { .node = -1 };
+	struct btintel_test_numa_bench req;
+	struct btintel_test_dev_info info;
+	int set_node = 0;
+	int cpu = -1, opt;
+	uint32_t i;
+
+	memset(&req, 0, sizeof(req));
+	req.size = 64 * 1024 * 1024;
+	req.passes = 4;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			/* "dev" follows the controller again */
+			place.node = strcmp(optarg, "dev") ?
+				     strtol(optarg, NULL, 0) : -1;
+			set_node = 1;
+			break;
+		case 's':
+			req.size = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		case 'p':
+			req.passes = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cpu = strtol(optarg, NULL, 0);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			print_error("Failed to pin to CPU");
+			return -1;
+		}
+	}
+
+	if (set_node) {
+		print_info("Testing BTINTEL_TEST_IOC_SET_NUMA_NODE...");
+		if (dev_ioctl(fd, BTINTEL_TEST_IOC_SET_NUMA_NODE, &place) < 0) {
+			print_error("SET_NUMA_NODE ioctl failed");
+			return -1;
+		}
+	}
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_GET_INFO, &info) < 0) {
+		print_error("GET_INFO ioctl failed");
+		return -1;
+	}
+	printf("  Controller node: %d\n", info.numa_node);
+	printf("  Buffer node:     %d\n", info.buffer_node);
+
+	print_info("Testing BTINTEL_TEST_IOC_NUMA_BENCH...");
+	printf("  %u KB x %u passes per node\n", req.size / 1024, req.passes);
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_NUMA_BENCH, &req) < 0) {
+		print_error("NUMA_BENCH ioctl failed");
+		return -1;
+	}
+
+	printf("  CPU node:        %d\n", req.cpu_node);
+	printf("  %-6s %-7s %12s %12s\n", "Node", "Placed", "Read MB/s",
+	       "Write MB/s");
+	for (i = 0; i < req.nr_nodes; i++) {
+		const struct btintel_test_numa_result *r = &req.nodes[i];
+
+		printf("  %-6d %-7d %12.1f %12.1f%s\n", r->node, r->placed,
+		       numa_mbps(req.size, req.passes, r->read_ns),
+		       numa_mbps(req.size, req.passes, r->write_ns),
+		       r->node == req.cpu_node ? "  (local)" :
+		       r->node == req.dev_node ? "  (controller)" : "");
+	}
+	if (req.nr_nodes < 2)
+		print_info("Single node, no remote memory to compare against");
+
+	print_success("NUMA_BENCH completed");
+	return 0;
+}
+
+/**
+ * cmd_buffer - Resize the device buffer, optionally on huge pages
+ */
+static int cmd_buffer(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "size-kb", required_argument, NULL, 's' },
+		{ "huge",    no_argument,       NULL, 'H' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct btintel_test_buffer_data buf_data;
+	struct btintel_test_dev_info info;
+	int opt;
+
+	memset(&buf_data, 0, sizeof(buf_data));
+	buf_data.size = BTINTEL_TEST_DEFAULT_BUFFER_SIZE;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			buf_data.size = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		case 'H':
+			buf_data.flags |= BTINTEL_TEST_BUF_HUGE;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_SET_BUFFER_SIZE...");
+	printf("  Requesting %zu bytes%s\n", buf_data.size,
+	       buf_data.flags & BTINTEL_TEST_BUF_HUGE ? " on huge pages" : "");
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_SET_BUFFER_SIZE, &buf_data) < 0) {
+		print_error("SET_BUFFER_SIZE ioctl failed");
+		return -1;
+	}
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_GET_INFO, &info) < 0) {
+		print_error("GET_INFO ioctl failed");
+		return -1;
+	}
+	printf("  Backing:         %s\n", backing_name(info.buffer_backing));
+
+	print_success("SET_BUFFER_SIZE completed");
+	return 0;
+}
+
+/**
+ * print_buf_bench - Print the results of one buffer backing
+ */
+static void print_buf_bench(const char *name,
+			    const struct btintel_test_buf_bench *req,
+			    const struct btintel_test_buf_bench_result *r)
+{
+	double bytes = (double)req->size * req->passes;
+
+	printf("  %s (%s):\n", name, backing_name(r->backing));
+	if (req->passes)
+		printf("    Sequential:    %.1f MB/s read, %.1f MB/s write\n",
+		       r->seq_read_ns ? bytes / r->seq_read_ns * 1e3 : 0,
+		       r->seq_write_ns ? bytes / r->seq_write_ns * 1e3 : 0);
+	if (req->random)
+		printf("    Random read:   %.1f ns\n",
+		       (double)r->rand_read_ns / req->random);
+}
+
+/**
+ * cmd_buf_bench - Compare base page and huge page buffer access
+ */
+static int cmd_buf_bench(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "size-mb", required_argument, NULL, 's' },
+		{ "passes",  required_argument, NULL, 'p' },
+		{ "random",  required_argument, NULL, 'r' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct btintel_test_buf_bench req;
+	int opt;
+
+	memset(&req, 0, sizeof(req));
+	req.size = 64 * 1024 * 1024;
+	req.passes = 4;
+	req.random = 4 * 1024 * 1024;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			req.size = strtoul(optarg, NULL, 0) * 1024 * 1024;
+			break;
+		case 'p':
+			req.passes = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			req.random = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_BUF_BENCH...");
+	printf("  %u MB, %u sequential passes, %u random reads\n",
+	       req.size >> 20, req.passes, req.random);
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_BUF_BENCH, &req) < 0) {
+		print_error("BUF_BENCH ioctl failed (size must be a multiple of the huge page size)");
+		return -1;
+	}
+
+	print_buf_bench("Base pages", &req, &req.base);
+	print_buf_bench("Huge pages", &req, &req.huge);
+	if (req.huge.backing != BTINTEL_TEST_BUF_BACKING_HUGE)
+		print_info("No free huge pages, the second run fell back");
+	else if (req.random && req.huge.rand_read_ns)
+		printf("  Random speedup:  %.2fx\n",
+		       (double)req.base.rand_read_ns / req.huge.rand_read_ns);
+
+	print_success("BUF_BENCH completed");
+	return 0;
+}
+
+/**
+ * cmd_ioctl_stats - Print how much time each ioctl command costs
+ */
+static int cmd_ioctl_stats(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "reset", no_argument, NULL, 'r' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct btintel_test_ioctl_stats *st;
+	uint32_t i;
+	int opt, ret = 0;
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return -1;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'r':
+			st->flags |= BTINTEL_TEST_IOCTL_STATS_RESET;
+			break;
+		default:
+			free(st);
+			return -1;
+		}
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_IOCTL_STATS...");
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_IOCTL_STATS, st) < 0) {
+		print_error("IOCTL_STATS ioctl failed");
+		ret = -1;
+		goto out;
+	}
+
+	printf("  %-18s %10s %8s %12s %12s %12s\n", "Command", "Calls",
+	       "Errors", "Mean us", "Max us", "Total ms");
+	for (i = 0; i < st->nr_cmds && i < BTINTEL_TEST_IOC_MAX_NR; i++) {
+		const struct btintel_test_ioctl_cost *c = &st->cmds[i];
+
+		if (!c->calls)
+			continue;
+		printf("  %-18.*s %10llu %8llu %12.3f %12.3f %12.3f\n",
+		       (int)sizeof(c->name), c->name,
+		       (unsigned long long)c->calls,
+		       (unsigned long long)c->errors,
+		       (double)c->total_ns / c->calls / 1e3,
+		       (double)c->max_ns / 1e3, (double)c->total_ns / 1e6);
+	}
+
+	print_success("IOCTL_STATS completed");
+out:
+	free(st);
+	return ret;
+}
+
+/**
+ * cmd_trace - Toggle, read and benchmark the instrumentation points
+ */
+static int cmd_trace(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "on",    no_argument,       NULL, '1' },
+		{ "off",   no_argument,       NULL, '0' },
+		{ "reset", no_argument,       NULL, 'r' },
+		{ "bench", required_argument, NULL, 'b' },
+		{ NULL, 0, NULL, 0 }
+	};
+	static const char * const names[BTINTEL_TEST_TRACE_POINTS] = {
+		[BTINTEL_TEST_TRACE_READ] = "read",
+		[BTINTEL_TEST_TRACE_WRITE] = "write",
+		[BTINTEL_TEST_TRACE_IOCTL] = "ioctl",
+		[BTINTEL_TEST_TRACE_HCI_CMD] = "HCI command",
+		[BTINTEL_TEST_TRACE_BENCH] = "benchmark point",
+	};
+	struct btintel_test_trace_bench bench;
+	struct btintel_test_trace tr;
+	unsigned int i;
+	int opt;
+
+	memset(&tr, 0, sizeof(tr));
+	memset(&bench, 0, sizeof(bench));
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case '1':
+			tr.flags |= BTINTEL_TEST_TRACE_ENABLE;
+			break;
+		case '0':
+			tr.flags |= BTINTEL_TEST_TRACE_DISABLE;
+			break;
+		case 'r':
+			tr.flags |= BTINTEL_TEST_TRACE_RESET;
+			break;
+		case 'b':
+			bench.loops = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (bench.loops) {
+		print_info("Testing BTINTEL_TEST_IOC_TRACE_BENCH...");
+		if (dev_ioctl(fd, BTINTEL_TEST_IOC_TRACE_BENCH, &bench) < 0) {
+			print_error("TRACE_BENCH ioctl failed");
+			return -1;
+		}
+		printf("  %u loops\n", bench.loops);
+		printf("  No point:        %.3f ns/loop\n",
+		       (double)bench.bare_ns / bench.loops);
+		printf("  Disabled point:  %.3f ns/loop (+%.3f)\n",
+		       (double)bench.off_ns / bench.loops,
+		       ((double)bench.off_ns - bench.bare_ns) / bench.loops);
+		printf("  Enabled point:   %.3f ns/loop (+%.3f)\n",
+		       (double)bench.on_ns / bench.loops,
+		       ((double)bench.on_ns - bench.bare_ns) / bench.loops);
+		print_success("TRACE_BENCH completed");
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_TRACE...");
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_TRACE, &tr) < 0) {
+		print_error("TRACE ioctl failed");
+		return -1;
+	}
+
+	printf("  Points were %s\n", tr.enabled ? "enabled" : "disabled");
+	for (i = 0; i < BTINTEL_TEST_TRACE_POINTS; i++)
+		if (tr.points[i].samples)
+			print_latency(names[i], &tr.points[i]);
+	if (tr.flags & (BTINTEL_TEST_TRACE_ENABLE | BTINTEL_TEST_TRACE_DISABLE))
+		printf("  Points now %s\n", tr.flags & BTINTEL_TEST_TRACE_ENABLE ?
+					    "enabled" : "disabled");
+
+	print_success("TRACE completed");
+	return 0;
+}
+
+/**
+ * cmd_sampler - Control the stats sampler and stream its history as CSV
+ */
+static int cmd_sampler(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "start",   required_argument, NULL, 's' },
+		{ "stop",    no_argument,       NULL, 'S' },
+		{ "reset",   no_argument,       NULL, 'r' },
+		{ "watch",   required_argument, NULL, 'w' },
+		{ "output",  required_argument, NULL, 'o' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct btintel_test_sample samples[256];
+	struct btintel_test_sampler_read rd;
+	struct btintel_test_sampler ctl;
+	unsigned int watch_s = 0, i;
+	const char *output = NULL;
+	struct timespec t0, now;
+	uint64_t lost = 0;
+	FILE *out = stdout;
+	int opt, ret = 0;
+
+	memset(&ctl, 0, sizeof(ctl));
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			ctl.flags |= BTINTEL_TEST_SAMPLER_START;
+			ctl.period_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			ctl.flags |= BTINTEL_TEST_SAMPLER_STOP;
+			break;
+		case 'r':
+			ctl.flags |= BTINTEL_TEST_SAMPLER_RESET;
+			break;
+		case 'w':
+			watch_s = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_SAMPLER...");
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_SAMPLER, &ctl) < 0) {
+		print_error("SAMPLER ioctl failed");
+		return -1;
+	}
+	printf("  Sampler %s, period %u us, %llu samples taken, %u kept\n",
+	       ctl.running ? "running" : "stopped", ctl.period_us,
+	       (unsigned long long)ctl.next_seq, ctl.capacity);
+
+	if (!watch_s && !output) {
+		print_success("SAMPLER completed");
+		return 0;
+	}
+
+	if (output) {
+		out = fopen(output, "w");
+		if (!out) {
+			print_error("Cannot create output file");
+			return -1;
+		}
+	}
+
+	fprintf(out, "seq,timestamp_ns,interval_ns,reads,writes,ioctls,errors,"
+		"read_bytes,write_bytes,hci_cmds,hci_mean_ns,hci_max_ns\n");
+
+	/* Everything still in the history, then whatever arrives while watching */
+	memset(&rd, 0, sizeof(rd));
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (;;) {
+		rd.samples = (uintptr_t)samples;
+		rd.count = sizeof(samples) / sizeof(samples[0]);
+		if (dev_ioctl(fd, BTINTEL_TEST_IOC_SAMPLER_READ, &rd) < 0) {
+			print_error("SAMPLER_READ ioctl failed");
+			ret = -1;
+			break;
+		}
+		lost += rd.lost;
+
+		for (i = 0; i < rd.count; i++) {
+			const struct btintel_test_sample *s = &samples[i];
+
+			fprintf(out, "%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,"
+				"%llu,%llu,%llu\n",
+				(unsigned long long)s->seq,
+				(unsigned long long)s->timestamp_ns,
+				(unsigned long long)s->interval_ns,
+				(unsigned long long)s->reads,
+				(unsigned long long)s->writes,
+				(unsigned long long)s->ioctls,
+				(unsigned long long)s->errors,
+				(unsigned long long)s->read_bytes,
+				(unsigned long long)s->write_bytes,
+				(unsigned long long)s->hci_cmds,
+				(unsigned long long)s->hci_mean_ns,
+				(unsigned long long)s->hci_max_ns);
+		}
+
+		if (rd.count == sizeof(samples) / sizeof(samples[0]))
+			continue;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - t0.tv_sec >= (time_t)watch_s)
+			break;
+
+		fflush(out);
+		usleep(100 * 1000);
+	}
+
+	if (out != stdout)
+		fclose(out);
+	if (lost)
+		printf("  %llu samples were overwritten before they were read\n",
+		       (unsigned long long)lost);
+
+	if (ret)
+		return ret;
+
+	print_success("SAMPLER completed");
+	return 0;
+}
+
+/**
+ * replay_append - Append one command to an HCI replay script in memory
+ */
+static int replay_append(uint8_t **script, size_t *len, uint16_t opcode,
+			 uint8_t status, uint32_t delay_us,
+			 const uint8_t *param, uint8_t plen)
+{
+	size_t rec = sizeof(struct btintel_test_replay_cmd);
+	uint8_t *p;
+
+	p = realloc(*script, *len + rec + plen);
+	if (!p)
+		return -1;
+	*script = p;
+	p += *len;
+
+	/* Little endian on every host */
+	p[0] = opcode;
+	p[1] = opcode >> 8;
+	p[2] = plen;
+	p[3] = status;
+	p[4] = delay_us;
+	p[5] = delay_us >> 8;
+	p[6] = delay_us >> 16;
+	p[7] = delay_us >> 24;
+	memcpy(p + rec, param, plen);
+
+	*len += rec + plen;
+	return 0;
+}
+
+/**
+ * replay_load - Read an HCI replay script, binary or text
+ *
+ * The text form has one command per line, "OPCODE DELAY_US STATUS [HEX]",
+ * with STATUS "-" when any status is acceptable and '#' starting a comment.
+ */
+static int replay_load(const char *path, int text, uint8_t **script,
+		       size_t *len)
+{
+	uint8_t param[255];
+	char line[1024], hex[sizeof(line)], st[8];
+	unsigned int opcode, delay_us, count = 0, n = 0;
+	FILE *f;
+	int plen, ret = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	*len = sizeof(struct btintel_test_replay_hdr);
+	*script = calloc(1, *len);
+	if (!*script) {
+		fclose(f);
+		return -1;
+	}
+
+	if (!text) {
+		size_t got;
+
+		*len = 0;
+		while ((got = fread(line, 1, sizeof(line), f)) > 0) {
+			uint8_t *p = realloc(*script, *len + got);
+
+			if (!p) {
+				ret = -1;
+				break;
+			}
+			*script = p;
+			memcpy(p + *len, line, got);
+			*len += got;
+		}
+		fclose(f);
+		return ret;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		n++;
+		if (line[strspn(line, " \t\n")] == '#' ||
+		    !line[strspn(line, " \t\n")])
+			continue;
+
+		hex[0] = '\0';
+		if (sscanf(line, "%x %u %7s %1023s", &opcode, &delay_us, st,
+			   hex) < 3 ||
+		    (plen = parse_hex(hex, param, sizeof(param))) < 0) {
+			fprintf(stderr, "%s:%u: malformed command\n", path, n);
+			ret = -1;
+			break;
+		}
+
+		if (replay_append(script, len, opcode,
+				  strcmp(st, "-") ? strtoul(st, NULL, 0) :
+				  BTINTEL_TEST_REPLAY_ANY_STATUS,
+				  delay_us, param, plen) < 0) {
+			ret = -1;
+			break;
+		}
+		count++;
+	}
+	fclose(f);
+
+	/* Header fields, little endian */
+	for (n = 0; n < 4; n++) {
+		(*script)[n] = BTINTEL_TEST_REPLAY_MAGIC >> (8 * n);
+		(*script)[4 + n] = count >> (8 * n);
+	}
+	return ret;
+}
+
+/**
+ * cmd_hci_replay - Replay a captured HCI command sequence
+ */
+static int cmd_hci_replay(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "backend",    required_argument, NULL, 'b' },
+		{ "index",      required_argument, NULL, 'i' },
+		{ "text",       no_argument,       NULL, 't' },
+		{ "save",       required_argument, NULL, 's' },
+		{ "fast",       no_argument,       NULL, 'f' },
+		{ "stop",       no_argument,       NULL, 'S' },
+		{ "latency-us", required_argument, NULL, 'L' },
+		{ "jitter-us",  required_argument, NULL, 'j' },
+		{ "verbose",    no_argument,       NULL, 'v' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct btintel_test_replay_result *res = NULL;
+	struct btintel_test_hci_replay req;
+	const char *save = NULL;
+	int text = 0, verbose = 0, opt, ret = -1;
+	uint8_t *script = NULL;
+	size_t len = 0;
+	uint32_t i;
+	FILE *f;
+
+	memset(&req, 0, sizeof(req));
+	req.backend = BTINTEL_TEST_BACKEND_EMUL;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			if (parse_backend(optarg, &req.backend) < 0) {
+				fprintf(stderr, "Unknown backend: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'i':
+			req.hci_index = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			text = 1;
+			break;
+		case 's':
+			save = optarg;
+			break;
+		case 'f':
+			req.flags |= BTINTEL_TEST_REPLAY_FAST;
+			break;
+		case 'S':
+			req.flags |= BTINTEL_TEST_REPLAY_STOP;
+			break;
+		case 'L':
+			req.emul_latency_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'j':
+			req.emul_jitter_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "No script given\n");
+		return -1;
+	}
+
+	if (replay_load(argv[optind], text, &script, &len) < 0) {
+		print_error("Cannot load the replay script");
+		goto out;
+	}
+
+	if (save) {
+		f = fopen(save, "wb");
+		if (!f || fwrite(script, 1, len, f) != len) {
+			print_error("Cannot save the replay script");
+			if (f)
+				fclose(f);
+			goto out;
+		}
+		fclose(f);
+	}
+
+	req.script = (uintptr_t)script;
+	req.script_len = len;
+	if (len >= sizeof(struct btintel_test_replay_hdr)) {
+		req.max_results = script[4] | script[5] << 8 |
+				  script[6] << 16 | (uint32_t)script[7] << 24;
+		res = calloc(req.max_results, sizeof(*res));
+		if (res)
+			req.results = (uintptr_t)res;
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_HCI_REPLAY...");
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_HCI_REPLAY, &req) < 0) {
+		print_error("HCI_REPLAY ioctl failed");
+		goto out;
+	}
+
+	printf("  Executed:        %u commands, %s pace\n", req.executed,
+	       req.flags & BTINTEL_TEST_REPLAY_FAST ? "fastest" : "original");
+	printf("  Duration:        %.3f ms (capture %.3f ms)\n",
+	       req.elapsed_ns / 1e6, req.script_ns / 1e6);
+	printf("  Divergences:     %u", req.divergences);
+	if (req.divergences)
+		printf(", first at command %u", req.first_divergence);
+	printf("\n");
+	print_latency("Command latency", &req.latency);
+	if (!(req.flags & BTINTEL_TEST_REPLAY_FAST))
+		print_latency("Schedule lag", &req.lag);
+
+	for (i = 0; res && i < req.executed && i < req.max_results; i++) {
+		const struct btintel_test_replay_result *r = &res[i];
+		int diverged = r->error ||
+			       (r->expected != BTINTEL_TEST_REPLAY_ANY_STATUS &&
+				r->status != r->expected);
+
+		if (!verbose && !diverged)
+			continue;
+		printf("  #%-6u 0x%04x at %10.3f ms +%8.3f us: status 0x%02x",
+		       i, r->opcode, r->due_ns / 1e6, r->lag_ns / 1e3, r->status);
+		if (r->expected != BTINTEL_TEST_REPLAY_ANY_STATUS)
+			printf(" (expected 0x%02x)", r->expected);
+		if (r->error)
+			printf(" error %d", r->error);
+		printf(", %.3f us%s\n", r->latency_ns / 1e3,
+		       diverged ? "  <-- diverged" : "");
+	}
+
+	ret = req.divergences ? -1 : 0;
+	if (!ret)
+		print_success("HCI_REPLAY completed");
+out:
+	free(res);
+	free(script);
+	return ret;
+}
+
+/* ============================================================================
+ * REGRESSION BENCHMARK
+ * ============================================================================ */
+
+#define BENCH_MAX_METRICS	16
+#define BENCH_IO_SIZE		65536	/* Device buffer size for the I/O runs */
+#define BENCH_IO_OPS		10000
+#define BENCH_IOCTL_OPS		10000
+#define BENCH_HCI_CMDS		2000
+#define BENCH_HCI_DEPTH		8
+
+/**
+ * struct bench_metric - One benchmark result or baseline entry
+ * @name: Stable metric name, the key in the JSON files
+ * @value: Median over the repetitions
+ * @tolerance_pct: Allowed change in the worse direction before the metric
+ *                 counts as a regression
+ * @higher_is_better: Throughput metric rather than a time
+ */
+struct bench_metric {
+	char name[48];
+	double value;
+	double tolerance_pct;
+	int higher_is_better;
+};
+
+/**
+ * struct bench_set - Metrics of one run or one baseline file
+ * @backend: HCI backend the metrics were measured on
+ * @host: Host name of the machine that recorded them
+ * @kernel: Kernel release it ran
+ */
+struct bench_set {
+	char backend[8];
+	char host[65];
+	char kernel[65];
+	struct bench_metric m[BENCH_MAX_METRICS];
+	int count;
+};
+
+/**
+ * bench_add - Append a metric with its default tolerance
+ */
+static void bench_add(struct bench_set *set, const char *name, double value,
+		      double tolerance_pct, int higher_is_better)
+{
+	struct bench_metric *m;
+
+	if (set->count >= BENCH_MAX_METRICS)
+		return;
+
+	m = &set->m[set->count++];
+	snprintf(m->name, sizeof(m->name), "%s", name);
+	m->value = value;
+	m->tolerance_pct = tolerance_pct;
+	m->higher_is_better = higher_is_better;
+}
+
+/**
+ * bench_find - Look up a metric by name
+ */
+static const struct bench_metric *bench_find(const struct bench_set *set,
+					     const char *name)
+{
+	int i;
+
+	for (i = 0; i < set->count; i++)
+		if (!strcmp(set->m[i].name, name))
+			return &set->m[i];
+	return NULL;
+}
+
+/**
+ * cmp_double - qsort() comparator for the repetition medians
+ */
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * bench_io - Mean time of one positioned read or write of @size bytes
+ */
+static double bench_io(int fd, void *buf, size_t size, int write_op)
+{
+	uint64_t start;
+	ssize_t ret;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < BENCH_IO_OPS; i++) {
+		ret = write_op ? pwrite(fd, buf, size, 0) : pread(fd, buf, size, 0);
+		if (ret != (ssize_t)size)
+			return -1;
+	}
+	return (double)(now_ns() - start) / BENCH_IO_OPS;
+}
+
+/**
+ * bench_ioctl - Mean round trip of a GET_INFO ioctl
+ *
+ * Calls ioctl() directly so that perf mode does not count its own output.
+ */
+static double bench_ioctl(int fd)
+{
+	struct btintel_test_dev_info info;
+	uint64_t start;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < BENCH_IOCTL_OPS; i++)
+		if (ioctl(fd, BTINTEL_TEST_IOC_GET_INFO, &info) < 0)
+			return -1;
+	return (double)(now_ns() - start) / BENCH_IOCTL_OPS;
+}
+
+/**
+ * bench_hci - Run one HCI_PIPELINE pass of Read Local Version Information
+ */
+static int bench_hci(int fd, uint32_t backend, uint32_t index, uint32_t depth,
+		     struct btintel_test_hci_pipeline *req)
+{
+	memset(req, 0, sizeof(*req));
+	req->backend = backend;
+	req->hci_index = index;
+	req->opcode = 0x1001;
+	req->depth = depth;
+	req->count = BENCH_HCI_CMDS;
+	req->emul_credits = depth;
+
+	if (ioctl(fd, BTINTEL_TEST_IOC_HCI_PIPELINE, req) < 0)
+		return -1;
+	return req->errors ? -1 : 0;
+}
+
+/**
+ * bench_run - Run the fixed benchmark matrix @repeat times
+ *
+ * Every metric is the median of its repetitions, which keeps a single
+ * preempted pass from failing the comparison.
+ */
+static int bench_run(int fd, uint32_t backend, uint32_t index, int repeat,
+		     struct bench_set *set)
+{
+	static const size_t sizes[] = { 64, 4096, BENCH_IO_SIZE };
+	enum { IO_METRICS = 2 * 3, NR_METRICS = IO_METRICS + 4 };
+	static const char * const names[NR_METRICS] = {
+		"buf_read_64_ns", "buf_write_64_ns",
+		"buf_read_4096_ns", "buf_write_4096_ns",
+		"buf_read_65536_mbps", "buf_write_65536_mbps",
+		"ioctl_get_info_ns",
+		"hci_latency_mean_ns", "hci_latency_p99_ns",
+		"hci_pipeline_cmds_per_sec",
+	};
+	struct btintel_test_buffer_data buf_data;
+	struct btintel_test_hci_pipeline req;
+	struct btintel_test_dev_info info;
+	double *samples[NR_METRICS] = { NULL }, v;
+	void *buf;
+	int i, r, ret = -1;
+
+	/* The I/O runs resize the device buffer; put it back afterwards */
+	if (ioctl(fd, BTINTEL_TEST_IOC_GET_INFO, &info) < 0) {
+		print_error("GET_INFO ioctl failed");
+		return -1;
+	}
+
+	memset(&buf_data, 0, sizeof(buf_data));
+	buf_data.size = BENCH_IO_SIZE;
+	if (ioctl(fd, BTINTEL_TEST_IOC_SET_BUFFER_SIZE, &buf_data) < 0) {
+		print_error("SET_BUFFER_SIZE ioctl failed");
+		return -1;
+	}
+
+	buf = calloc(1, BENCH_IO_SIZE);
+	samples[0] = calloc(NR_METRICS * repeat, sizeof(double));
+	if (!buf || !samples[0]) {
+		print_error("Out of memory");
+		goto out;
+	}
+	for (i = 1; i < NR_METRICS; i++)
+		samples[i] = samples[0] + i * repeat;
+
+	for (r = 0; r < repeat; r++) {
+		printf("  Pass %d/%d\n", r + 1, repeat);
+
+		for (i = 0; i < IO_METRICS; i++) {
+			v = bench_io(fd, buf, sizes[i / 2], i & 1);
+			if (v < 0) {
+				print_error("Buffer I/O failed");
+				goto out;
+			}
+			/* The largest size is reported as throughput */
+			if (sizes[i / 2] == BENCH_IO_SIZE)
+				v = BENCH_IO_SIZE / v * 1e3;
+			samples[i][r] = v;
+		}
+
+		v = bench_ioctl(fd);
+		if (v < 0) {
+			print_error("GET_INFO ioctl failed");
+			goto out;
+		}
+		samples[IO_METRICS][r] = v;
+
+		if (bench_hci(fd, backend, index, 1, &req) < 0) {
+			print_error("HCI_PIPELINE at depth 1 failed");
+			goto out;
+		}
+		samples[IO_METRICS + 1][r] = req.latency.mean_ns;
+		samples[IO_METRICS + 2][r] = req.latency.p99_ns;
+
+		if (bench_hci(fd, backend, index, BENCH_HCI_DEPTH, &req) < 0) {
+			print_error("HCI_PIPELINE at full depth failed");
+			goto out;
+		}
+		samples[IO_METRICS + 3][r] = req.cmds_per_sec;
+	}
+
+	for (i = 0; i < NR_METRICS; i++) {
+		/* Times end in _ns, everything else is a rate */
+		int higher = strstr(names[i], "_ns") == NULL;
+		/* Tail latency is the noisiest number in the matrix */
+		double tol = i == IO_METRICS + 2 ? 50 : higher ? 20 : 25;
+
+		qsort(samples[i], repeat, sizeof(double), cmp_double);
+		bench_add(set, names[i], samples[i][repeat / 2], tol, higher);
+	}
+	ret = 0;
+out:
+	memset(&buf_data, 0, sizeof(buf_data));
+	buf_data.size = info.buffer_size;
+	if (info.buffer_backing == BTINTEL_TEST_BUF_BACKING_HUGE)
+		buf_data.flags = BTINTEL_TEST_BUF_HUGE;
+	if (ioctl(fd, BTINTEL_TEST_IOC_SET_BUFFER_SIZE, &buf_data) < 0) {
+		fprintf(stderr, "ERROR: Cannot restore the %zu byte buffer: %s\n",
+			info.buffer_size, strerror(errno));
+		ret = -1;
+	}
+
+	free(samples[0]);
+	free(buf);
+	return ret;
+}
+
+/**
+ * bench_save - Write a result set as JSON, one metric per line
+ *
+ * The host and kernel that produced the numbers are recorded with them,
+ * so that a baseline says where it was measured.
+ */
+static int bench_save(const char *path, const char *backend,
+		      const struct bench_set *set)
+{
+	FILE *f = fopen(path, "w");
+	struct utsname uts;
+	int i;
+
+	if (!f) {
+		print_error("Cannot create output file");
+		return -1;
+	}
+
+	if (uname(&uts) < 0) {
+		strcpy(uts.nodename, "unknown");
+		strcpy(uts.release, "unknown");
+		strcpy(uts.machine, "unknown");
+	}
+
+	fprintf(f, "{\n  \"backend\": \"%s\",\n", backend);
+	fprintf(f, "  \"host\": \"%s\",\n", uts.nodename);
+	fprintf(f, "  \"kernel\": \"%s %s\",\n", uts.release, uts.machine);
+	fprintf(f, "  \"metrics\": {\n");
+	for (i = 0; i < set->count; i++)
+		fprintf(f, "    \"%s\": { \"value\": %.1f, \"tolerance_pct\": %.0f, \"better\": \"%s\" }%s\n",
+			set->m[i].name, set->m[i].value,
+			set->m[i].tolerance_pct,
+			set->m[i].higher_is_better ? "higher" : "lower",
+			i + 1 < set->count ? "," : "");
+	fprintf(f, "  }\n}\n");
+
+	if (fclose(f)) {
+		print_error("Cannot write output file");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * bench_load - Read a baseline in the format bench_save() writes
+ *
+ * Only the backend, host, kernel and metric lines are parsed, so the file
+ * may be hand-edited to adjust tolerances as long as each of them stays on
+ * its own line.
+ */
+static int bench_load(const char *path, struct bench_set *set)
+{
+	char line[256], name[48], better[8];
+	double value, tol;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		print_error("Cannot open baseline");
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, " \"backend\": \"%7[^\"]\"", set->backend) == 1 ||
+		    sscanf(line, " \"host\": \"%64[^\"]\"", set->host) == 1 ||
+		    sscanf(line, " \"kernel\": \"%64[^\"]\"", set->kernel) == 1)
+			continue;
+		if (sscanf(line, " \"%47[^\"]\": { \"value\": %lf, \"tolerance_pct\": %lf, \"better\": \"%7[^\"]\"",
+			   name, &value, &tol, better) != 4)
+			continue;
+		bench_add(set, name, value, tol, !strcmp(better, "higher"));
+	}
+	fclose(f);
+
+	if (!set->count) {
+		fprintf(stderr, "No metrics in baseline %s\n", path);
+		return -1;
+	}
+	if (!set->backend[0]) {
+		fprintf(stderr, "No backend in baseline %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * bench_compare - Check a run against its baseline
+ *
+ * Return: Number of regressed or missing metrics
+ */
+static int bench_compare(const struct bench_set *base,
+			 const struct bench_set *cur)
+{
+	const struct bench_metric *b, *c;
+	int i, failed = 0;
+	double delta;
+	const char *verdict;
+
+	printf("  %-28s %14s %14s %9s %6s\n", "Metric", "Baseline", "Current",
+	       "Change", "Tol");
+	for (i = 0; i < base->count; i++) {
+		b = &base->m[i];
+		c = bench_find(cur, b->name);
+		if (!c) {
+			printf("  %-28s %14.1f %14s %9s %5.0f%%  MISSING\n",
+			       b->name, b->value, "-", "-", b->tolerance_pct);
+			failed++;
+			continue;
+		}
+
+		delta = b->value ? (c->value - b->value) / b->value * 100 : 0;
+		/* Positive when the metric moved in its worse direction */
+		if ((b->higher_is_better ? -delta : delta) > b->tolerance_pct) {
+			verdict = "REGRESSED";
+			failed++;
+		} else if ((b->higher_is_better ? delta : -delta) >
+			   b->tolerance_pct) {
+			verdict = "improved";
+		} else {
+			verdict = "ok";
+		}
+
+		printf("  %-28s %14.1f %14.1f %+8.1f%% %5.0f%%  %s\n", b->name,
+		       b->value, c->value, delta, b->tolerance_pct, verdict);
+	}
+	return failed;
+}
+
+/**
+ * cmd_bench - Run the benchmark matrix and compare it with a baseline
+ *
+ * Covers buffer I/O at three sizes, the ioctl round trip and HCI command
+ * latency and throughput. Exits non-zero when any baseline metric moved
+ * past its tolerance in the worse direction or is missing from the run.
+ */
+static int cmd_bench(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "backend",  required_argument, NULL, 'b' },
+		{ "index",    required_argument, NULL, 'i' },
+		{ "repeat",   required_argument, NULL, 'r' },
+		{ "output",   required_argument, NULL, 'o' },
+		{ "baseline", required_argument, NULL, 'B' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const char *backend_name = "emul", *output = NULL, *baseline = NULL;
+	uint32_t backend = BTINTEL_TEST_BACKEND_EMUL, index = 0;
+	struct bench_set *cur, *base;
+	int i, opt, repeat = 5, failed, ret = -1;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			if (parse_backend(optarg, &backend) < 0) {
+				fprintf(stderr, "Unknown backend: %s\n", optarg);
+				return -1;
+			}
+			backend_name = optarg;
+			break;
+		case 'i':
+			index = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'B':
+			baseline = optarg;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (repeat < 1 || repeat > 100) {
+		fprintf(stderr, "Repeat count must be 1..100\n");
+		return -1;
+	}
+
+	cur = calloc(1, sizeof(*cur));
+	base = calloc(1, sizeof(*base));
+	if (!cur || !base) {
+		print_error("Out of memory");
+		goto out;
+	}
+
+	if (baseline && bench_load(baseline, base) < 0)
+		goto out;
+
+	/* Numbers from different backends measure different things */
+	if (baseline && strcmp(base->backend, backend_name)) {
+		fprintf(stderr, "Baseline %s was recorded on the %s backend, not %s\n",
+			baseline, base->backend, backend_name);
+		goto out;
+	}
+
+	print_info("Running the benchmark matrix...");
+	printf("  Backend %s, %d passes\n", backend_name, repeat);
+	if (bench_run(fd, backend, index, repeat, cur) < 0)
+		goto out;
+
+	if (output && bench_save(output, backend_name, cur) < 0)
+		goto out;
+	if (output)
+		printf("  Results written to %s\n", output);
+
+	if (!baseline) {
+		for (i = 0; i < cur->count; i++)
+			printf("  %-28s %14.1f\n", cur->m[i].name,
+			       cur->m[i].value);
+		print_success("Benchmark completed");
+		ret = 0;
+		goto out;
+	}
+
+	printf("  Compared with %s (%s, %s):\n", baseline,
+	       base->host[0] ? base->host : "unknown host",
+	       base->kernel[0] ? base->kernel : "unknown kernel");
+	failed = bench_compare(base, cur);
+	if (failed) {
+		fprintf(stderr, "ERROR: %d metric(s) regressed\n", failed);
+		goto out;
+	}
+
+	print_success("No regressions against the baseline");
+	ret = 0;
+out:
+	free(cur);
+	free(base);
+	return ret;
+}
+
+/* ============================================================================
+ * MULTI-DEVICE ORCHESTRATOR
+ * ============================================================================ */
+
+#define MULTI_MAX_DEVICES	65	/* Primary node plus emulated instances */
+
+/* Steps of a multi-device plan */
+#define MULTI_PLAN_BASIC	0x1
+#define MULTI_PLAN_IO		0x2
+#define MULTI_PLAN_IOCTL	0x4
+#define MULTI_PLAN_HCI		0x8
+
+/**
+ * struct multi_worker - One device and the results of its plan
+ * @path: Device node
+ * @cpu: CPU the worker is pinned to, -1 when unpinned
+ * @plan: MULTI_PLAN_* steps to run
+ * @backend: HCI backend for MULTI_PLAN_HCI
+ * @hci_index: HCI device index for the hci backend
+ * @hci_lock: Held around MULTI_PLAN_HCI when the workers share one
+ *            controller, NULL otherwise
+ * @failed: Name of the first failed step, NULL when all passed
+ * @err: errno of the failed step
+ * @elapsed_ns: Time the whole plan took
+ * @read_mbps: Sequential 4 KiB read throughput
+ * @write_mbps: Sequential 4 KiB write throughput
+ * @ioctl_ns: Mean GET_INFO round trip
+ * @hci: HCI pipeline results
+ */
+struct multi_worker {
+	pthread_t thread;
+	char path[64];
+	int cpu;
+	uint32_t plan;
+	uint32_t backend;
+	uint32_t hci_index;
+	pthread_mutex_t *hci_lock;
+	const char *failed;
+	int err;
+	uint64_t elapsed_ns;
+	double read_mbps;
+	double write_mbps;
+	double ioctl_ns;
+	struct btintel_test_hci_pipeline hci;
+};
+
+/**
+ * struct multi_saved - Device state a plan changes
+ * @info: GET_INFO taken before the plan
+ * @buf: Buffer contents, @info.buffer_size bytes
+ */
+struct multi_saved {
+	struct btintel_test_dev_info info;
+	char *buf;
+};
+
+/**
+ * multi_save - Record what multi_restore() needs to undo a plan
+ *
+ * Return: Name of the failed step, or NULL
+ */
+static const char *multi_save(int fd, struct multi_saved *saved)
+{
+	size_t size;
+	ssize_t ret;
+
+	saved->buf = NULL;
+	if (ioctl(fd, BTINTEL_TEST_IOC_GET_INFO, &saved->info) < 0)
+		return "GET_INFO";
+
+	size = saved->info.buffer_size;
+	saved->buf = malloc(size ? size : 1);
+	if (!saved->buf)
+		return "save buffer";
+	ret = pread(fd, saved->buf, size, 0);
+	if (ret != (ssize_t)size) {
+		if (ret >= 0)
+			errno = EIO;
+		free(saved->buf);
+		saved->buf = NULL;
+		return "save buffer";
+	}
+	return NULL;
+}
+
+/**
+ * multi_restore - Put back the buffer size, contents and enable state
+ *
+ * Statistics cannot be put back, which is why the plan never resets them.
+ *
+ * Return: Name of the failed step, or NULL
+ */
+static const char *multi_restore(int fd, struct multi_saved *saved)
+{
+	const struct btintel_test_dev_info *info = &saved->info;
+	struct btintel_test_buffer_data buf_data;
+	const char *failed = NULL;
+
+	memset(&buf_data, 0, sizeof(buf_data));
+	buf_data.size = info->buffer_size;
+	if (info->buffer_backing == BTINTEL_TEST_BUF_BACKING_HUGE)
+		buf_data.flags = BTINTEL_TEST_BUF_HUGE;
+	if (ioctl(fd, BTINTEL_TEST_IOC_SET_BUFFER_SIZE, &buf_data) < 0)
+		failed = "restore buffer size";
+	else if (info->buffer_size &&
+		 pwrite(fd, saved->buf, info->buffer_size, 0) !=
+		 (ssize_t)info->buffer_size)
+		failed = "restore buffer";
+	else if (ioctl(fd, info->active ? BTINTEL_TEST_IOC_ENABLE :
+					  BTINTEL_TEST_IOC_DISABLE, NULL) < 0)
+		failed = "restore enable state";
+
+	free(saved->buf);
+	saved->buf = NULL;
+	return failed;
+}
+
+/**
+ * multi_basic - Run the basic ioctl sequence without printing
+ *
+ * The statistics are compared across the I/O rather than reset, since
+ * multi_restore() could not give the old counts back.
+ *
+ * Return: Name of the failed step, or NULL
+ */
+static const char *multi_basic(int fd)
+{
+	static const char pattern[] = "multi-device qualification";
+	struct btintel_test_buffer_data buf_data;
+	struct btintel_test_stats before, after;
+	struct btintel_test_status status;
+	char buf[sizeof(pattern)];
+	ssize_t ret;
+
+	if (ioctl(fd, BTINTEL_TEST_IOC_GET_STATS, &before) < 0)
+		return "GET_STATS";
+
+	ret = pwrite(fd, pattern, sizeof(pattern), 0);
+	if (ret != sizeof(pattern)) {
+		if (ret >= 0)
+			errno = EIO;
+		return "write";
+	}
+	ret = pread(fd, buf, sizeof(buf), 0);
+	if (ret != sizeof(buf) || memcmp(buf, pattern, sizeof(buf))) {
+		if (ret >= 0)
+			errno = EIO;
+		return "read";
+	}
+	if (ioctl(fd, BTINTEL_TEST_IOC_GET_STATS, &after) < 0)
+		return "GET_STATS";
+	if (after.read_count <= before.read_count ||
+	    after.write_count <= before.write_count) {
+		errno = EIO;
+		return "GET_STATS";
+	}
+
+	memset(&buf_data, 0, sizeof(buf_data));
+	buf_data.size = 8192;
+	if (ioctl(fd, BTINTEL_TEST_IOC_SET_BUFFER_SIZE, &buf_data) < 0)
+		return "SET_BUFFER_SIZE";
+	if (ioctl(fd, BTINTEL_TEST_IOC_CLEAR_BUFFER, NULL) < 0)
+		return "CLEAR_BUFFER";
+	if (ioctl(fd, BTINTEL_TEST_IOC_GET_STATUS, &status) < 0)
+		return "GET_STATUS";
+	if (ioctl(fd, BTINTEL_TEST_IOC_DISABLE, NULL) < 0)
+		return "DISABLE";
+	if (ioctl(fd, BTINTEL_TEST_IOC_ENABLE, NULL) < 0)
+		return "ENABLE";
+	return NULL;
+}
+
+/**
+ * multi_run - Worker thread: pin, open the node and run the plan
+ *
+ * The device is restored once the plan is done, whether it passed or not.
+ */
+static void *multi_run(void *arg)
+{
+	struct multi_worker *w = arg;
+	uint64_t start = now_ns();
+	char buf[4096] = { 0 };
+	struct multi_saved saved;
+	const char *restore;
+	cpu_set_t set;
+	double v;
+	int fd, err;
+
+	if (w->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			w->failed = "pin";
+			goto out;
+		}
+	}
+
+	fd = open(w->path, O_RDWR);
+	if (fd < 0) {
+		w->failed = "open";
+		goto out;
+	}
+
+	w->failed = multi_save(fd, &saved);
+	if (w->failed)
+		goto close;
+
+	if ((w->plan & MULTI_PLAN_BASIC) && (w->failed = multi_basic(fd)))
+		goto restore;
+
+	if (w->plan & MULTI_PLAN_IO) {
+		v = bench_io(fd, buf, sizeof(buf), 1);
+		if (v < 0) {
+			w->failed = "write bench";
+			goto restore;
+		}
+		w->write_mbps = sizeof(buf) / v * 1e3;
+		v = bench_io(fd, buf, sizeof(buf), 0);
+		if (v < 0) {
+			w->failed = "read bench";
+			goto restore;
+		}
+		w->read_mbps = sizeof(buf) / v * 1e3;
+	}
+
+	if (w->plan & MULTI_PLAN_IOCTL) {
+		w->ioctl_ns = bench_ioctl(fd);
+		if (w->ioctl_ns < 0) {
+			w->failed = "ioctl bench";
+			goto restore;
+		}
+	}
+
+	if (w->plan & MULTI_PLAN_HCI) {
+		if (w->hci_lock)
+			pthread_mutex_lock(w->hci_lock);
+		if (bench_hci(fd, w->backend, w->hci_index, BENCH_HCI_DEPTH,
+			      &w->hci) < 0)
+			w->failed = "HCI_PIPELINE";
+		if (w->hci_lock)
+			pthread_mutex_unlock(w->hci_lock);
+	}
+
+restore:
+	err = errno;
+	restore = multi_restore(fd, &saved);
+	if (w->failed)
+		errno = err;
+	else
+		w->failed = restore;
+close:
+	close(fd);
+out:
+	if (w->failed)
+		w->err = errno;
+	w->elapsed_ns = now_ns() - start;
+	return NULL;
+}
+
+/**
+ * parse_plan - Parse a comma separated step list such as "basic,hci"
+ */
+static int parse_plan(char *arg, uint32_t *plan)
+{
+	char *step, *save;
+
+	*plan = 0;
+	for (step = strtok_r(arg, ",", &save); step;
+	     step = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(step, "basic"))
+			*plan |= MULTI_PLAN_BASIC;
+		else if (!strcmp(step, "io"))
+			*plan |= MULTI_PLAN_IO;
+		else if (!strcmp(step, "ioctl"))
+			*plan |= MULTI_PLAN_IOCTL;
+		else if (!strcmp(step, "hci"))
+			*plan |= MULTI_PLAN_HCI;
+		else if (!strcmp(step, "all"))
+			*plan |= MULTI_PLAN_BASIC | MULTI_PLAN_IO |
+				 MULTI_PLAN_IOCTL | MULTI_PLAN_HCI;
+		else
+			return -1;
+	}
+	return *plan ? 0 : -1;
+}
+
+/**
+ * cmd_multi - Run a test plan on every device node concurrently
+ *
+ * Discovers every node of the driver, including the emulated instances of
+ * the emul_instances module parameter, and runs the plan on all of them
+ * with one worker thread per device, each pinned to its own CPU.
+ */
+static int cmd_multi(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "plan",    required_argument, NULL, 'p' },
+		{ "cpus",    required_argument, NULL, 'C' },
+		{ "nopin",   no_argument,       NULL, 'n' },
+		{ "backend", required_argument, NULL, 'b' },
+		{ "index",   required_argument, NULL, 'i' },
+		{ NULL, 0, NULL, 0 }
+	};
+	uint64_t mask[BTINTEL_TEST_EXEC_CPU_WORDS] = { 0 };
+	uint32_t plan = MULTI_PLAN_BASIC | MULTI_PLAN_IO | MULTI_PLAN_IOCTL |
+			MULTI_PLAN_HCI;
+	uint32_t backend = BTINTEL_TEST_BACKEND_EMUL, hci_index = 0;
+	pthread_mutex_t hci_lock = PTHREAD_MUTEX_INITIALIZER;
+	struct multi_worker *w;
+	uint64_t start, wall_ns, serial_ns = 0;
+	double read_mbps = 0, write_mbps = 0, hci_cps = 0;
+	int cpus[BTINTEL_TEST_EXEC_CPU_WORDS * 64];
+	int opt, i, n, started, nr_cpus = 0, pin = 1, failed = 0;
+	cpu_set_t set;
+	glob_t g;
+
+	(void)fd;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'p':
+			if (parse_plan(optarg, &plan) < 0) {
+				fprintf(stderr, "Bad plan: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'C':
+			if (parse_cpus(optarg, mask) < 0) {
+				fprintf(stderr, "Bad CPU list: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'n':
+			pin = 0;
+			break;
+		case 'b':
+			if (parse_backend(optarg, &backend) < 0) {
+				fprintf(stderr, "Unknown backend: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'i':
+			hci_index = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	/* Without --cpus, use every CPU this process may run on */
+	if (!mask[0] && sched_getaffinity(0, sizeof(set), &set) == 0)
+		for (i = 0; i < CPU_SETSIZE &&
+			    i < BTINTEL_TEST_EXEC_CPU_WORDS * 64; i++)
+			if (CPU_ISSET(i, &set))
+				mask[i / 64] |= 1ULL << (i % 64);
+	for (i = 0; i < BTINTEL_TEST_EXEC_CPU_WORDS * 64; i++)
+		if (mask[i / 64] & (1ULL << (i % 64)))
+			cpus[nr_cpus++] = i;
+	if (!nr_cpus)
+		pin = 0;
+
+	if (glob(DEVICE_PATH "*", 0, NULL, &g) || !g.gl_pathc) {
+		fprintf(stderr, "ERROR: No %s* device nodes\n", DEVICE_PATH);
+		return -1;
+	}
+	n = g.gl_pathc < MULTI_MAX_DEVICES ? g.gl_pathc : MULTI_MAX_DEVICES;
+
+	w = calloc(n, sizeof(*w));
+	if (!w) {
+		print_error("Out of memory");
+		globfree(&g);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		snprintf(w[i].path, sizeof(w[i].path), "%s", g.gl_pathv[i]);
+		w[i].cpu = pin ? cpus[i % nr_cpus] : -1;
+		w[i].plan = plan;
+		w[i].backend = backend;
+		w[i].hci_index = hci_index;
+		/* Every node would drive the same hciN; take turns */
+		if (backend == BTINTEL_TEST_BACKEND_HCI_INDEX)
+			w[i].hci_lock = &hci_lock;
+	}
+	globfree(&g);
+
+	print_info("Running the plan on every device node...");
+	printf("  %d devices, %d CPUs%s\n", n, nr_cpus,
+	       pin ? "" : ", unpinned");
+	if (n > nr_cpus && pin)
+		print_info("More devices than CPUs, some workers share a CPU");
+	if (n > 1 && (plan & MULTI_PLAN_HCI) &&
+	    backend == BTINTEL_TEST_BACKEND_HCI_INDEX)
+		printf("  All workers share hci%u, HCI runs are serialized\n",
+		       hci_index);
+
+	start = now_ns();
+	for (started = 0; started < n; started++) {
+		errno = pthread_create(&w[started].thread, NULL, multi_run,
+				       &w[started]);
+		if (errno)
+			break;
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(w[i].thread, NULL);
+	wall_ns = now_ns() - start;
+
+	for (i = started; i < n; i++) {
+		w[i].failed = "thread";
+		w[i].err = errno;
+	}
+
+	printf("  %-38s %4s %-20s %9s %9s %9s %9s %10s %9s\n", "Device",
+	       "CPU", "Result", "Time ms", "Rd MB/s", "Wr MB/s", "ioctl ns",
+	       "HCI cmd/s", "HCI us");
+	for (i = 0; i < n; i++) {
+		char result[32];
+
+		if (w[i].failed) {
+			snprintf(result, sizeof(result), "FAIL %s",
+				 w[i].failed);
+			failed++;
+		} else {
+			snprintf(result, sizeof(result), "PASS");
+		}
+
+		printf("  %-38s %4d %-20s %9.1f %9.1f %9.1f %9.1f %10llu %9.1f\n",
+		       w[i].path, w[i].cpu, result, w[i].elapsed_ns / 1e6,
+		       w[i].read_mbps, w[i].write_mbps, w[i].ioctl_ns,
+		       (unsigned long long)w[i].hci.cmds_per_sec,
+		       w[i].hci.latency.mean_ns / 1e3);
+		if (w[i].failed)
+			printf("    %s: %s\n", w[i].failed, strerror(w[i].err));
+
+		serial_ns += w[i].elapsed_ns;
+		read_mbps += w[i].read_mbps;
+		write_mbps += w[i].write_mbps;
+		hci_cps += w[i].hci.cmds_per_sec;
+	}
+
+	printf("  Aggregate:       %.1f MB/s read, %.1f MB/s write, %.0f HCI commands/s\n",
+	       read_mbps, write_mbps, hci_cps);
+	printf("  Wall time:       %.3f ms\n", wall_ns / 1e6);
+	printf("  Serial time:     %.3f ms\n", serial_ns / 1e6);
+	if (wall_ns)
+		printf("  Speedup:         %.2fx\n", (double)serial_ns / wall_ns);
+	printf("  Devices passed:  %d of %d\n", n - failed, n);
+
+	free(w);
+	if (failed)
+		return -1;
+
+	print_success("Multi-device run completed");
+	return 0;
+}
+
+/* ============================================================================
+ * DMA DESCRIPTOR RING BENCHMARK
+ * ============================================================================ */
+
+/**
+ * dma_bench_run - Run one DMA ring pass and print its results
+ * @fd: Device file descriptor
+ * @req: Parameters, results are filled in
+ * @name: Mapping mode, for the report
+ */
+static int dma_bench_run(int fd, struct btintel_test_dma_bench *req,
+			 const char *name)
+{
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_DMA_BENCH, req) < 0)
+		return -1;
+
+	printf("  Mode %s:\n", name);
+	printf("    Completed:     %u (%u errors)\n", req->completed,
+	       req->errors);
+	printf("    Setup:         %.3f ms\n", req->setup_ns / 1e6);
+	printf("    Elapsed:       %.3f ms\n", req->elapsed_ns / 1e6);
+	printf("    Throughput:    %.1f MB/s\n", req->bytes_per_sec / 1e6);
+	printf("    Max in flight: %u, ring full %u times\n",
+	       req->max_inflight, req->ring_full);
+	if (req->map_calls)
+		printf("    Map/sync cost: %.1f ns per call (%llu calls)\n",
+		       (double)req->map_ns / req->map_calls,
+		       (unsigned long long)req->map_calls);
+	print_latency("Post to reap", &req->latency);
+
+	return req->errors ? -1 : 0;
+}
+
+/**
+ * cmd_dma_bench - Compare per-transfer mapping with premapped DMA buffers
+ */
+static int cmd_dma_bench(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "direction",  required_argument, NULL, 'd' },
+		{ "ring",       required_argument, NULL, 'r' },
+		{ "batch",      required_argument, NULL, 'b' },
+		{ "buf-size",   required_argument, NULL, 's' },
+		{ "count",      required_argument, NULL, 'c' },
+		{ "latency-us", required_argument, NULL, 'l' },
+		{ "jitter-us",  required_argument, NULL, 'j' },
+		{ "mode",       required_argument, NULL, 'm' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct btintel_test_dma_bench req = {
+		.direction = BTINTEL_TEST_DMA_TX,
+		.ring_size = 256,
+		.batch = 32,
+		.buf_size = 1024,
+		.count = 100000,
+	};
+	struct btintel_test_dma_bench pre, each;
+	const char *mode = "both";
+	int opt, ret = 0;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			if (!strcmp(optarg, "tx")) {
+				req.direction = BTINTEL_TEST_DMA_TX;
+			} else if (!strcmp(optarg, "rx")) {
+				req.direction = BTINTEL_TEST_DMA_RX;
+			} else {
+				fprintf(stderr, "Unknown direction: %s\n",
+					optarg);
+				return -1;
+			}
+			break;
+		case 'r':
+			req.ring_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			req.batch = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			req.buf_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			req.count = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			req.emul_latency_ns = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'j':
+			req.emul_jitter_ns = strtoul(optarg, NULL, 0) * 1000;
+			break;
+		case 'm':
+			mode = optarg;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (strcmp(mode, "premapped") && strcmp(mode, "map") &&
+	    strcmp(mode, "both")) {
+		fprintf(stderr, "Unknown mode: %s\n", mode);
+		return -1;
+	}
+
+	print_info("Running the DMA descriptor ring benchmark...");
+	printf("  %s, ring %u, batch %u, %u-byte buffers, %u transfers\n",
+	       req.direction == BTINTEL_TEST_DMA_TX ? "TX" : "RX",
+	       req.ring_size, req.batch, req.buf_size, req.count);
+	printf("  Engine latency %llu us, jitter %u us\n",
+	       (unsigned long long)req.emul_latency_ns / 1000,
+	       req.emul_jitter_ns / 1000);
+
+	pre = req;
+	if (strcmp(mode, "map") && dma_bench_run(fd, &pre, "premapped") < 0)
+		ret = -1;
+
+	each = req;
+	each.flags |= BTINTEL_TEST_DMA_MAP_EACH;
+	if (strcmp(mode, "premapped") && dma_bench_run(fd, &each, "map") < 0)
+		ret = -1;
+
+	if (ret)
+		return ret;
+
+	if (!strcmp(mode, "both") && each.bytes_per_sec && pre.map_calls &&
+	    each.map_calls) {
+		printf("  Premapped vs per-transfer mapping:\n");
+		printf("    Throughput:    %.2fx\n",
+		       (double)pre.bytes_per_sec / each.bytes_per_sec);
+		printf("    Map/sync cost: %.1f vs %.1f ns per call\n",
+		       (double)pre.map_ns / pre.map_calls,
+		       (double)each.map_ns / each.map_calls);
+	}
+
+	print_success("DMA benchmark completed");
+	return 0;
+}
+
+/* ============================================================================
+ * HCI RESPONSE CACHE
+ * ============================================================================ */
+
+#define RSP_CACHE_HCI_RESET	0x0c03
+
+/**
+ * rsp_cache_parse - Parse an opcode list such as "0xfc05,0x1001"
+ */
+static int rsp_cache_parse(const char *arg, struct btintel_test_rsp_cache *rc)
+{
+	unsigned long op;
+	char *end;
+
+	rc->nr_opcodes = 0;
+	while (*arg) {
+		if (rc->nr_opcodes == BTINTEL_TEST_RSP_CACHE_MAX_OPCODES)
+			return -1;
+		op = strtoul(arg, &end, 0);
+		if (end == arg || op > 0xffff || (*end && *end != ','))
+			return -1;
+		rc->opcodes[rc->nr_opcodes++] = op;
+		arg = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+/**
+ * rsp_cache_print - Print the opcode set and counters of the cache
+ */
+static void rsp_cache_print(const struct btintel_test_rsp_cache *rc)
+{
+	uint32_t i;
+
+	printf("  Opcodes:       ");
+	if (!rc->nr_opcodes)
+		printf("none, cache off");
+	for (i = 0; i < rc->nr_opcodes; i++)
+		printf("%s0x%04x", i ? "," : "", rc->opcodes[i]);
+	printf("\n");
+	printf("  Hits:          %llu\n", (unsigned long long)rc->hits);
+	printf("  Misses:        %llu\n", (unsigned long long)rc->misses);
+	printf("  Invalidations: %llu\n",
+	       (unsigned long long)rc->invalidations);
+	printf("  Evictions:     %llu\n", (unsigned long long)rc->evictions);
+	printf("  Entries:       %u\n", rc->entries);
+	print_latency("Hit latency", &rc->hit_latency);
+	print_latency("Miss latency", &rc->miss_latency);
+}
+
+/**
+ * rsp_cache_send - Send one command @count times through the executor
+ */
+static int rsp_cache_send(int fd, uint32_t backend, uint32_t index,
+			  uint16_t opcode, const uint8_t *param, uint8_t plen,
+			  uint32_t count)
+{
+	struct btintel_test_exec_submit sub;
+	struct btintel_test_exec_collect col;
+	struct btintel_test_job_result res;
+	struct btintel_test_job job;
+
+	memset(&job, 0, sizeof(job));
+	job.type = BTINTEL_TEST_JOB_HCI_BATCH;
+	job.backend = backend;
+	job.hci_index = index;
+	job.hci.opcode = opcode;
+	job.hci.plen = plen;
+	job.hci.count = count;
+	if (plen)
+		memcpy(job.hci.param, param, plen);
+
+	memset(&sub, 0, sizeof(sub));
+	sub.jobs = (uintptr_t)&job;
+	sub.count = 1;
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_EXEC_SUBMIT, &sub) < 0)
+		return -1;
+
+	memset(&col, 0, sizeof(col));
+	col.results = (uintptr_t)&res;
+	col.max = 1;
+	col.flags = BTINTEL_TEST_EXEC_WAIT;
+	do {
+		if (dev_ioctl(fd, BTINTEL_TEST_IOC_EXEC_COLLECT, &col) < 0)
+			return -1;
+	} while (!col.count && col.pending);
+
+	if (!col.count || res.status || res.value) {
+		fprintf(stderr, "  Opcode 0x%04x: %llu of %u commands failed\n",
+			opcode, col.count ? (unsigned long long)res.value : 0ULL,
+			count);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * rsp_cache_verify - Check hit, miss and invalidation accounting end to end
+ *
+ * Sends every selected opcode @count times, invalidates the cache and
+ * sends them again. Each round must miss once per opcode and hit on
+ * every other command. The invalidation is an HCI_Reset, except on the
+ * real controller where the flush ioctl stands in for it.
+ */
+static int rsp_cache_verify(int fd, struct btintel_test_rsp_cache *rc,
+			    uint32_t backend, uint32_t index,
+			    const uint8_t *param, uint8_t plen, uint32_t count)
+{
+	uint64_t nr = rc->nr_opcodes, want_hits, want_misses;
+	uint64_t round_ns[2];
+	uint32_t i;
+	int round;
+
+	rc->flags = BTINTEL_TEST_RSP_CACHE_SET | BTINTEL_TEST_RSP_CACHE_RESET;
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_RSP_CACHE, rc) < 0) {
+		print_error("RSP_CACHE ioctl failed");
+		return -1;
+	}
+
+	for (round = 0; round < 2; round++) {
+		if (round && backend == BTINTEL_TEST_BACKEND_HW) {
+			if (dev_ioctl(fd, BTINTEL_TEST_IOC_RSP_CACHE_FLUSH,
+				      NULL) < 0) {
+				print_error("RSP_CACHE_FLUSH ioctl failed");
+				return -1;
+			}
+		} else if (round &&
+			   rsp_cache_send(fd, backend, index,
+					  RSP_CACHE_HCI_RESET, NULL, 0, 1) < 0) {
+			return -1;
+		}
+
+		round_ns[round] = now_ns();
+		for (i = 0; i < nr; i++)
+			if (rsp_cache_send(fd, backend, index, rc->opcodes[i],
+					   param, plen, count) < 0)
+				return -1;
+		round_ns[round] = now_ns() - round_ns[round];
+	}
+
+	rc->flags = 0;
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_RSP_CACHE, rc) < 0) {
+		print_error("RSP_CACHE ioctl failed");
+		return -1;
+	}
+
+	rsp_cache_print(rc);
+	printf("  Round times:   %.3f ms, %.3f ms after invalidation\n",
+	       round_ns[0] / 1e6, round_ns[1] / 1e6);
+
+	want_misses = 2 * nr;
+	want_hits = want_misses * (count - 1);
+	if (rc->hits != want_hits || rc->misses != want_misses ||
+	    rc->invalidations != 1) {
+		fprintf(stderr,
+			"ERROR: expected %llu hits, %llu misses and 1 invalidation\n",
+			(unsigned long long)want_hits,
+			(unsigned long long)want_misses);
+		return -1;
+	}
+
+	print_success("Response cache verified");
+	return 0;
+}
+
+/**
+ * cmd_rsp_cache - Configure, flush, inspect or verify the HCI response cache
+ */
+static int cmd_rsp_cache(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "opcodes", required_argument, NULL, 'o' },
+		{ "off",     no_argument,       NULL, 'O' },
+		{ "flush",   no_argument,       NULL, 'f' },
+		{ "reset",   no_argument,       NULL, 'r' },
+		{ "verify",  no_argument,       NULL, 'v' },
+		{ "backend", required_argument, NULL, 'b' },
+		{ "index",   required_argument, NULL, 'i' },
+		{ "count",   required_argument, NULL, 'c' },
+		{ "param",   required_argument, NULL, 'p' },
+		{ NULL, 0, NULL, 0 }
+	};
+	uint8_t param[BTINTEL_TEST_RSP_CACHE_MAX_PARAM];
+	struct btintel_test_rsp_cache rc;
+	uint32_t backend = BTINTEL_TEST_BACKEND_EMUL, index = 0, count = 16;
+	int opt, flush = 0, verify = 0, plen = 0;
+
+	memset(&rc, 0, sizeof(rc));
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'o':
+			if (rsp_cache_parse(optarg, &rc) < 0) {
+				fprintf(stderr, "Bad opcode list: %s\n", optarg);
+				return -1;
+			}
+			rc.flags |= BTINTEL_TEST_RSP_CACHE_SET;
+			break;
+		case 'O':
+			rc.nr_opcodes = 0;
+			rc.flags |= BTINTEL_TEST_RSP_CACHE_SET;
+			break;
+		case 'f':
+			flush = 1;
+			break;
+		case 'r':
+			rc.flags |= BTINTEL_TEST_RSP_CACHE_RESET;
+			break;
+		case 'v':
+			verify = 1;
+			break;
+		case 'b':
+			if (parse_backend(optarg, &backend) < 0) {
+				fprintf(stderr, "Unknown backend: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'i':
+			index = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			plen = parse_hex(optarg, param, sizeof(param));
+			if (plen < 0) {
+				fprintf(stderr, "Bad parameters: %s\n", optarg);
+				return -1;
+			}
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (flush) {
+		print_info("Testing BTINTEL_TEST_IOC_RSP_CACHE_FLUSH...");
+		if (dev_ioctl(fd, BTINTEL_TEST_IOC_RSP_CACHE_FLUSH, NULL) < 0) {
+			print_error("RSP_CACHE_FLUSH ioctl failed");
+			return -1;
+		}
+	}
+
+	if (verify) {
+		if (count < 2) {
+			fprintf(stderr, "Verification needs --count 2 or more\n");
+			return -1;
+		}
+		if (!(rc.flags & BTINTEL_TEST_RSP_CACHE_SET) &&
+		    dev_ioctl(fd, BTINTEL_TEST_IOC_RSP_CACHE, &rc) < 0) {
+			print_error("RSP_CACHE ioctl failed");
+			return -1;
+		}
+		if (!rc.nr_opcodes) {
+			fprintf(stderr, "No opcodes to verify, use --opcodes\n");
+			return -1;
+		}
+		print_info("Verifying the HCI response cache...");
+		return rsp_cache_verify(fd, &rc, backend, index, param, plen,
+					count);
+	}
+
+	print_info("Testing BTINTEL_TEST_IOC_RSP_CACHE...");
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_RSP_CACHE, &rc) < 0) {
+		print_error("RSP_CACHE ioctl failed");
+		return -1;
+	}
+
+	rsp_cache_print(&rc);
+	return 0;
+}
+
+/* ============================================================================
+ * FIRMWARE DOWNLOAD SWEEP
+ * ============================================================================ */
+
+/**
+ * parse_u32_list - Parse a list such as "64,128,252" into @out
+ *
+ * Return: Number of values, or -1 if malformed or longer than @max
+ */
+static int parse_u32_list(const char *arg, uint32_t *out, int max)
+{
+	unsigned long val;
+	char *end;
+	int n = 0;
+
+	while (*arg) {
+		if (n == max)
+			return -1;
+		val = strtoul(arg, &end, 0);
+		if (end == arg || val > UINT32_MAX || (*end && *end != ','))
+			return -1;
+		out[n++] = val;
+		arg = *end ? end + 1 : end;
+	}
+	return n;
+}
+
+/**
+ * cmd_fw_sweep - Find the fastest firmware download chunk size and depth
+ */
+static int cmd_fw_sweep(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "chunks",     required_argument, NULL, 'c' },
+		{ "depths",     required_argument, NULL, 'd' },
+		{ "repeat",     required_argument, NULL, 'r' },
+		{ "backend",    required_argument, NULL, 'b' },
+		{ "index",      required_argument, NULL, 'i' },
+		{ "nocache",    no_argument,       NULL, 'n' },
+		{ "latency-us", required_argument, NULL, 'L' },
+		{ "jitter-us",  required_argument, NULL, 'j' },
+		{ "bandwidth",  required_argument, NULL, 'B' },
+		{ "credits",    required_argument, NULL, 'C' },
+		{ NULL, 0, NULL, 0 }
+	};
+	static const char * const stages[BTINTEL_TEST_FW_STAGES] = {
+		"load", "header", "pkey", "sig", "payload"
+	};
+	static const char * const formats[] = { "raw", "RSA", "ECDSA" };
+	struct btintel_test_fw_sweep_result *res, *r;
+	struct btintel_test_fw_sweep req;
+	int opt, n, i, s, ret = -1;
+
+	memset(&req, 0, sizeof(req));
+	req.backend = BTINTEL_TEST_BACKEND_EMUL;
+	req.repeat = 3;
+	req.nr_chunks = parse_u32_list("32,64,128,252", req.chunks,
+				       BTINTEL_TEST_FW_SWEEP_MAX_CHUNKS);
+	req.nr_depths = parse_u32_list("1,2,4,8", req.depths,
+				       BTINTEL_TEST_FW_SWEEP_MAX_DEPTHS);
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			n = parse_u32_list(optarg, req.chunks,
+					   BTINTEL_TEST_FW_SWEEP_MAX_CHUNKS);
+			if (n <= 0) {
+				fprintf(stderr, "Bad chunk list: %s\n", optarg);
+				return -1;
+			}
+			req.nr_chunks = n;
+			break;
+		case 'd':
+			n = parse_u32_list(optarg, req.depths,
+					   BTINTEL_TEST_FW_SWEEP_MAX_DEPTHS);
+			if (n <= 0) {
+				fprintf(stderr, "Bad depth list: %s\n", optarg);
+				return -1;
+			}
+			req.nr_depths = n;
+			break;
+		case 'r':
+			req.repeat = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			if (parse_backend(optarg, &req.backend) < 0) {
+				fprintf(stderr, "Unknown backend: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'i':
+			req.hci_index = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			req.flags |= BTINTEL_TEST_FW_NOCACHE;
+			break;
+		case 'L':
+			req.emul_latency_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'j':
+			req.emul_jitter_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'B':
+			req.emul_bytes_per_sec = strtoull(optarg, NULL, 0) * 1000;
+			break;
+		case 'C':
+			req.emul_credits = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf(stderr, "Expected one firmware file name\n");
+		return -1;
+	}
+	snprintf(req.name, sizeof(req.name), "%s", argv[optind]);
+
+	/* A real bootloader only takes the first image after boot */
+	if (req.backend == BTINTEL_TEST_BACKEND_HCI_INDEX &&
+	    (req.repeat != 1 || req.nr_chunks != 1 || req.nr_depths != 1)) {
+		fprintf(stderr, "The hci backend takes one chunk size, one depth "
+			"and --repeat 1\n");
+		return -1;
+	}
+
+	res = calloc(req.nr_chunks * req.nr_depths, sizeof(*res));
+	if (!res) {
+		print_error("Out of memory");
+		return -1;
+	}
+	req.results = (uintptr_t)res;
+
+	print_info("Running the firmware download sweep...");
+	printf("  %s, %u chunk sizes x %u depths, %u downloads each\n",
+	       req.name, req.nr_chunks, req.nr_depths, req.repeat);
+
+	if (dev_ioctl(fd, BTINTEL_TEST_IOC_FW_SWEEP, &req) < 0) {
+		fprintf(stderr, "ERROR: FW_SWEEP: %s\n", strerror(errno));
+		goto out;
+	}
+
+	printf("  Image: %u bytes, %s\n", req.size,
+	       req.format < 3 ? formats[req.format] : "?");
+	printf("  %5s %5s %6s %5s %10s %10s", "chunk", "depth", "cmds",
+	       "errs", "total ms", "KB/s");
+	for (s = 0; s < BTINTEL_TEST_FW_STAGES; s++)
+		printf(" %8s", stages[s]);
+	printf("\n");
+
+	for (i = 0; i < (int)(req.nr_chunks * req.nr_depths); i++) {
+		r = &res[i];
+		printf("%s %5u %5u %6u %5u %10.3f %10.1f",
+		       i == req.best ? " *" : "  ", r->chunk, r->depth,
+		       r->commands, r->errors, r->total_ns / 1e6,
+		       r->bytes_per_sec / 1e3);
+		for (s = 0; s < BTINTEL_TEST_FW_STAGES; s++)
+			printf(" %8.3f", r->stage_ns[s] / 1e6);
+		printf("\n");
+	}
+	printf("  Stage times are in ms per download\n");
+
+	if (req.best < 0) {
+		print_error("No configuration completed without errors");
+		goto out;
+	}
+
+	r = &res[req.best];
+	printf("  Best: chunk %u, depth %u, %.1f KB/s (max %u in flight)\n",
+	       r->chunk, r->depth, r->bytes_per_sec / 1e3, r->max_outstanding);
+	print_success("Firmware sweep completed");
+	ret = 0;
+out:
+	free(res);
+	return ret;
+}
+
+/* ============================================================================
+ * VIRTUAL CONTROLLER (hci_vhci)
+ * ============================================================================ */
+
+#define VHCI_MAX_PENDING	256
+#define VHCI_RSP_PAD		248	/* Largest return parameters we emulate */
+
+static volatile sig_atomic_t vhci_stop;
+
+/**
+ * vhci_sigint - Stop the responder loop
+ */
+static void vhci_sigint(int sig)
+{
+	(void)sig;
+	vhci_stop = 1;
+}
+
+/**
+ * vhci_up_thread - Power on the vhci controller while the responder runs
+ */
+static void *vhci_up_thread(void *arg)
+{
+	int index = (int)(intptr_t)arg;
+	int sk;
+
+	sk = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+	if (sk < 0) {
+		print_error("Failed to open HCI socket");
+		return NULL;
+	}
+
+	if (ioctl(sk, HCIDEVUP, index) < 0 && errno != EALREADY)
+		print_error("Failed to power on vhci controller");
+	else
+		printf("[INFO] hci%d is up\n", index);
+
+	close(sk);
+	return NULL;
+}
+
+/**
+ * vhci_rsp_params - Return parameters the virtual controller answers with
+ *
+ * The HCI core needs sane values for a handful of init commands; every
+ * other command gets success and zeroed parameters.
+ */
+static size_t vhci_rsp_params(uint16_t opcode, uint8_t *rp)
+{
+	memset(rp, 0, VHCI_RSP_PAD);
+
+	switch (opcode) {
+	case 0x1001:	/* Read Local Version Information */
+		rp[1] = 0x0c;			/* HCI 5.3 */
+		rp[4] = 0x0c;			/* LMP 5.3 */
+		rp[5] = 0x02;			/* Intel */
+		return 9;
+	case 0x1003:	/* Read Local Supported Features */
+		rp[5] = 0x60;			/* LE, no BR/EDR */
+		return 9;
+	case 0x1009:	/* Read BD_ADDR */
+		rp[1] = 0x01;
+		rp[6] = 0xc0;			/* Static random */
+		return 7;
+	case 0x2002:	/* LE Read Buffer Size */
+		rp[1] = 27;
+		rp[3] = 8;
+		return 4;
+	default:
+		return VHCI_RSP_PAD;
+	}
+}
+
+/**
+ * cmd_vhci - Run a virtual controller with configurable response delay
+ *
+ * Creates an hci_vhci controller and answers every HCI command with a
+ * Command Complete after the configured delay, advertising the configured
+ * number of command credits. Runs until interrupted.
+ */
+static int cmd_vhci(int fd, int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "delay-us", required_argument, NULL, 'd' },
+		{ "credits",  required_argument, NULL, 'C' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct {
+		uint64_t due_ns;
+		uint16_t opcode;
+	} pending[VHCI_MAX_PENDING];
+	unsigned int head = 0, tail = 0, credits = 1;
+	uint64_t delay_ns = 0, answered = 0;
+	uint8_t buf[1 + 3 + 255], rsp[1 + 2 + 3 + VHCI_RSP_PAD];
+	struct pollfd pfd;
+	pthread_t up;
+	int vfd, opt, index, timeout;
+	ssize_t len;
+
+	(void)fd;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			delay_ns = strtod(optarg, NULL) * 1000;
+			break;
+		case 'C':
+			credits = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	vfd = open(VHCI_PATH, O_RDWR);
+	if (vfd < 0) {
+		print_error("Failed to open " VHCI_PATH);
+		return -1;
+	}
+
+	/* Create a primary controller and learn its index */
+	buf[0] = HCI_VENDOR_PKT;
+	buf[1] = 0x00;
+	if (write(vfd, buf, 2) != 2 || read(vfd, buf, 4) != 4 ||
+	    buf[0] != HCI_VENDOR_PKT) {
+		print_error("Failed to create vhci controller");
+		close(vfd);
+		return -1;
+	}
+	index = buf[2] | buf[3] << 8;
+	printf("[INFO] Created hci%d: delay %.1f us, %u credits\n", index,
+	       delay_ns / 1e3, credits);
+
+	signal(SIGINT, vhci_sigint);
+	signal(SIGTERM, vhci_sigint);
+
+	if (pthread_create(&up, NULL, vhci_up_thread, (void *)(intptr_t)index)) {
+		print_error("Failed to start power-on thread");
+		close(vfd);
+		return -1;
+	}
+	pthread_detach(up);
+
+	pfd.fd = vfd;
+	pfd.events = POLLIN;
+
+	while (!vhci_stop) {
+		uint64_t now = now_ns();
+
+		/* Answer every command whose delay has elapsed */
+		while (head != tail && pending[tail % VHCI_MAX_PENDING].due_ns <= now) {
+			uint16_t opcode = pending[tail++ % VHCI_MAX_PENDING].opcode;
+			unsigned int queued = head - tail;
+			size_t rlen = vhci_rsp_params(opcode, rsp + 6);
+
+			rsp[0] = HCI_EVENT_PKT;
+			rsp[1] = HCI_EV_CMD_COMPLETE;
+			rsp[2] = 3 + rlen;
+			rsp[3] = credits > queued ? credits - queued : 0;
+			rsp[4] = opcode & 0xff;
+			rsp[5] = opcode >> 8;
+			if (write(vfd, rsp, 6 + rlen) < 0) {
+				print_error("vhci write failed");
+				vhci_stop = 1;
+			}
+			answered++;
+		}
+
+		timeout = -1;
+		if (head != tail) {
+			uint64_t due = pending[tail % VHCI_MAX_PENDING].due_ns;
+
+			timeout = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+		}
+
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+
+		len = read(vfd, buf, sizeof(buf));
+		if (len < 4 || buf[0] != HCI_COMMAND_PKT)
+			continue;
+
+		if (head - tail == VHCI_MAX_PENDING) {
+			fprintf(stderr, "ERROR: more than %u commands in flight\n",
+				VHCI_MAX_PENDING);
+			continue;
+		}
+
+		pending[head % VHCI_MAX_PENDING].opcode = buf[1] | buf[2] << 8;
+		pending[head % VHCI_MAX_PENDING].due_ns = now_ns() + delay_ns;
+		head++;
+	}
+
+	printf("[INFO] Answered %llu commands\n", (unsigned long long)answered);
+	close(vfd);
+	return 0;
+}
+
+/**
+ * struct command - Named subcommand of the test application
+ * @name: Name given on the command line
+ * @run: Handler, called with the device open unless @no_device
+ * @usage: Option summary
+ * @no_device: Handler does not use the driver device node
+ */
+struct command {
+	const char *name;
+	int (*run)(int fd, int argc, char *argv[]);
+	const char *usage;
+	int no_device;
+};
+
+static const struct command commands[] = {
+	{ "iso-jitter", cmd_iso_jitter,
+	  "[--backend hw|hci|emul] [--index N] [--iso] [--handle H] [--len N]\n"
+	  "\t\t[--count N] [--interval-us US] [--deadline-us US]\n"
+	  "\t\t[--latency-us US] [--jitter-us US]", 0 },
+	{ "exec", cmd_exec,
+	  "[--workers N] [--cpus LIST] [--type buf|reg|hci] [--jobs N]\n"
+	  "\t\t[--backend hw|hci|emul] [--index N] [--size B] [--iterations N]\n"
+	  "\t\t[--offset O] [--count N] [--opcode OP] [--poll]", 0 },
+	{ "hci-pipeline", cmd_hci_pipeline,
+	  "[--backend hw|hci|emul] [--index N] [--opcode OP] [--param HEX]\n"
+	  "\t\t[--depth N] [--count N] [--latency-us US] [--jitter-us US]\n"
+	  "\t\t[--credits N] [--poll]", 0 },
+	{ "mem-dump", cmd_mem_dump,
+	  "[--source emul|bar] [--address A] [--length N] [--chunk N]\n"
+	  "\t\t[--chunk-delay-us US] [--lz4] [--output FILE]", 0 },
+	{ "reset-cycle", cmd_reset_cycle,
+	  "[--backend hw|emul] [--cycles N] [--poll-us US] [--timeout-ms MS]\n"
+	  "\t\t[--settle-ms MS] [--stage-us US,US,...] [--jitter-us US]", 0 },
+	{ "fw-load", cmd_fw_load,
+	  "[--download] [--backend hci|emul] [--index N] [--latency-us US]\n"
+	  "\t\t[--nocache] [--repeat N] [--flush] FILE...", 0 },
+	{ "pm-cycle", cmd_pm_cycle,
+	  "[--backend hw|emul] [--d3hot] [--cycles N] [--dwell-us US]\n"
+	  "\t\t[--suspend-us US] [--resume-us US] [--jitter-us US]\n"
+	  "\t\t[--fail-pct N]", 0 },
+	{ "irq", cmd_irq,
+	  "[--hw] [--vector N] [--inject N] [--interval-us US] [--cpu N]\n"
+	  "\t\t[--sample-ms MS] [--keep] [--attach]", 0 },
+	{ "hci-poll", cmd_hci_poll,
+	  "[--backend hw|hci|emul] [--index N] [--opcode OP] [--param HEX]\n"
+	  "\t\t[--count N] [--budget-us US] [--latency-us US] [--jitter-us US]", 0 },
+	{ "numa", cmd_numa,
+	  "[--node N|dev] [--size-kb KB] [--passes N] [--cpu N]", 0 },
+	{ "buffer", cmd_buffer, "[--size-kb KB] [--huge]", 0 },
+	{ "buf-bench", cmd_buf_bench,
+	  "[--size-mb MB] [--passes N] [--random N]", 0 },
+	{ "ioctl-stats", cmd_ioctl_stats, "[--reset]", 0 },
+	{ "trace", cmd_trace, "[--on|--off] [--reset] [--bench LOOPS]", 0 },
+	{ "sampler", cmd_sampler,
+	  "[--start PERIOD_US] [--stop] [--reset] [--watch SECONDS]\n"
+	  "\t\t[--output FILE]", 0 },
+	{ "hci-replay", cmd_hci_replay,
+	  "[--backend hw|hci|emul] [--index N] [--text] [--save FILE]\n"
+	  "\t\t[--fast] [--stop] [--latency-us US] [--jitter-us US] [--verbose]\n"
+	  "\t\tSCRIPT", 0 },
+	{ "bench", cmd_bench,
+	  "[--backend hw|hci|emul] [--index N] [--repeat N] [--output FILE]\n"
+	  "\t\t[--baseline FILE]", 0 },
+	{ "multi", cmd_multi,
+	  "[--plan basic,io,ioctl,hci|all] [--cpus LIST] [--nopin]\n"
+	  "\t\t[--backend hw|hci|emul] [--index N]", 1 },
+	{ "dma-bench", cmd_dma_bench,
+	  "[--direction tx|rx] [--ring N] [--batch N] [--buf-size B]\n"
+	  "\t\t[--count N] [--latency-us US] [--jitter-us US]\n"
+	  "\t\t[--mode premapped|map|both]", 0 },
+	{ "rsp-cache", cmd_rsp_cache,
+	  "[--opcodes LIST|--off] [--flush] [--reset] [--verify]\n"
+	  "\t\t[--backend hw|hci|emul] [--index N] [--count N] [--param HEX]", 0 },
+	{ "fw-sweep", cmd_fw_sweep,
+	  "[--chunks LIST] [--depths LIST] [--repeat N] [--backend hci|emul]\n"
+	  "\t\t[--index N] [--nocache] [--latency-us US] [--jitter-us US]\n"
+	  "\t\t[--bandwidth KBPS] [--credits N] FILE", 0 },
+	{ "vhci", cmd_vhci, "[--delay-us US] [--credits N]", 1 },
+};
+
+/**
+ * usage - Print the command summary
+ */
+static void usage(const char *prog)
+{
+	size_t i;
+
+	printf("Usage: %s                 Run the basic ioctl test sequence\n",
+	       prog);
+	for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+		printf("       %s %s %s\n", prog, commands[i].name,
+		       commands[i].usage);
+	printf("       %s perf COMMAND [options]  Count CPU events of each driver ioctl\n",
+	       prog);
+}
+
+/**
+ * run_command - Open the device and run one named subcommand
+ */
+static int run_command(int argc, char *argv[])
+{
+	size_t i;
+	int fd, ret;
+
+	if (argc > 2 && !strcmp(argv[1], "perf")) {
+		perf_mode = 1;
+		argc--;
+		argv++;
+	}
+
+	for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		if (strcmp(argv[1], commands[i].name))
+			continue;
+
+		if (commands[i].no_device) {
+			ret = commands[i].run(-1, argc - 1, argv + 1);
+			return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+		}
+
+		fd = open_device();
+		if (fd < 0)
+			return EXIT_FAILURE;
+
+		ret = commands[i].run(fd, argc - 1, argv + 1);
+		close_device(fd);
+		return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	usage(argv[0]);
+	return EXIT_FAILURE;
+}
+
+/* ============================================================================
+ * MAIN PROGRAM
+ * ============================================================================ */
+
+int main(int argc, char *argv[])
+{
+	int fd;
+	int ret = 0;
+
+	if (argc > 1)
+		return run_command(argc, argv);
 
 	printf("========================================\n");
 	printf("Intel Bluetooth Test Driver - Userspace Test\n");